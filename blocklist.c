@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "net.h"
+#include "blocklist.h"
+
+/** 每块的域名数量, 块首域名完整存放, 其余域名只存放与前一个域名不同的后缀 */
+#define BLOCK_KEYS 16
+/** 布隆过滤器每个域名占用的位数, 10位配合7个哈希函数的误判率约为1% */
+#define BLOOM_BITS 10
+/** 布隆过滤器的哈希函数数量 */
+#define BLOOM_HASHES 7
+/** 反转域名的标签分隔符, 小于域名中的任何字符, 使子域名排在父域名之后且紧邻父域名 */
+#define LABEL_SEP '\1'
+
+static uint8_t *_data = NULL;			// 前缀压缩编码的域名
+static uint32_t *_blocks = NULL;		// 每块在_data中的偏移地址
+static uint32_t _nblocks = 0, _count = 0;
+static uint64_t *_bloom = NULL;			// 布隆过滤器位图
+static uint32_t _bloom_bits = 0;
+static dns_block_t _mode = DNS_BLOCK_NULL;
+
+// 加载时使用的临时存储, 全部反转域名依次存放, 以'\0'结尾
+static char *_arena = NULL;
+
+/** 计算数据的哈希值, FNV-1a算法, h为上一段数据的哈希值 */
+static inline uint64_t blocklist_hash(uint64_t h, const char* s, size_t len) {
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t) s[i]) * 1099511628211u;
+	return h;
+}
+
+/** 计算布隆过滤器第i个哈希函数的位置, 由64位哈希值的高低两半组合生成 */
+static inline uint32_t bloom_pos(uint64_t h, unsigned i) {
+	uint32_t g = (uint32_t) h + i * ((uint32_t) (h >> 32) | 1);
+	return (uint32_t) (((uint64_t) g * _bloom_bits) >> 32);
+}
+
+static inline void bloom_add(uint64_t h) {
+	for (unsigned i = 0; i < BLOOM_HASHES; ++i) {
+		uint32_t p = bloom_pos(h, i);
+		_bloom[p >> 6] |= (uint64_t) 1 << (p & 63);
+	}
+}
+
+static inline bool bloom_test(uint64_t h) {
+	for (unsigned i = 0; i < BLOOM_HASHES; ++i) {
+		uint32_t p = bloom_pos(h, i);
+		if (!(_bloom[p >> 6] & ((uint64_t) 1 << (p & 63))))
+			return false;
+	}
+	return true;
+}
+
+/** 把域名转换为小写的反转格式, 标签之间使用LABEL_SEP分隔, 例如 www.a.com -> com\1a\1www
+ * @param host 域名, 允许以'.'结尾
+ * @param len 域名长度
+ * @param dst 回写反转格式的域名, 以'\0'结尾
+ * @return 反转格式的长度, 0: 域名格式错误
+ */
+static size_t blocklist_reverse(const char* host, size_t len, char dst[HOST_MAX]) {
+	if (len && host[len - 1] == '.') --len;
+	if (!len || len >= HOST_MAX) return 0;
+
+	size_t pos = 0, end = len;
+	while (end) {
+		size_t start = end;
+		while (start && host[start - 1] != '.') --start;
+		if (start == end || end - start > 63) return 0;
+		if (pos) dst[pos++] = LABEL_SEP;
+		for (size_t i = start; i < end; ++i) {
+			char c = (char) tolower((unsigned char) host[i]);
+			if (!isalnum((unsigned char) c) && c != '-' && c != '_') return 0;
+			dst[pos++] = c;
+		}
+		end = start ? start - 1 : 0;
+		if (start && !end) return 0;
+	}
+	dst[pos] = '\0';
+	return pos;
+}
+
+/** 比较两个反转格式的域名, 按无符号字节顺序 */
+static inline int blocklist_cmp(const uint8_t* a, size_t alen, const uint8_t* b, size_t blen) {
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+	return r ? r : (alen > blen) - (alen < blen);
+}
+
+/** 排序使用的比较函数, 参数是域名在_arena中的偏移地址 */
+static int blocklist_sort_cmp(const void* a, const void* b) {
+	return strcmp(_arena + *(const uint32_t*) a, _arena + *(const uint32_t*) b);
+}
+
+/** 从一行文本中取出域名, 兼容hosts文件格式, 第一列是ip地址时使用第二列
+ * @return 域名起始地址, NULL: 空行或注释
+ */
+static const char* blocklist_parse_line(char* line, size_t* len) {
+	char *tok[2];
+	int n = 0;
+	for (char *p = line; *p && *p != '#' && n < 2; ) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ++p;
+		if (!*p || *p == '#') break;
+		tok[n++] = p;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#') ++p;
+		if (*p && *p != '#') *p++ = '\0';
+		else *p = '\0';
+	}
+	if (!n) return NULL;
+
+	const char *host = tok[0];
+	if (n > 1 && (strchr(tok[0], ':') || net_ip_fromstring(tok[0]) != INADDR_NONE))
+		host = tok[1];
+	*len = strlen(host);
+	return host;
+}
+
+bool blocklist_load(const char* filename, bool nxdomain) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		log_error("can't open blocklist file %s", filename);
+		return false;
+	}
+
+	uint64_t start = net_mstime();
+	size_t arena_size = 0, arena_cap = 1024 * 1024;
+	uint32_t *keys = NULL, nkeys = 0, keys_cap = 0, lines = 0, invalid = 0;
+	char line[512], rev[HOST_MAX];
+	_arena = malloc(arena_cap);
+
+	// 读取全部域名, 转换为反转格式存入临时存储, 不含'.'的名称(例如hosts文件中的localhost)忽略
+	while (fgets(line, sizeof(line), f)) {
+		++lines;
+		size_t len;
+		const char *host = blocklist_parse_line(line, &len);
+		if (!host) continue;
+		size_t rlen = strchr(host, '.') ? blocklist_reverse(host, len, rev) : 0;
+		if (!rlen || !strchr(rev, LABEL_SEP)) {
+			++invalid;
+			continue;
+		}
+		if (arena_size + rlen + 1 > arena_cap)
+			_arena = realloc(_arena, arena_cap *= 2);
+		if (nkeys == keys_cap)
+			keys = realloc(keys, (keys_cap = keys_cap ? keys_cap * 2 : 4096) * sizeof(uint32_t));
+		memcpy(_arena + arena_size, rev, rlen + 1);
+		keys[nkeys++] = (uint32_t) arena_size;
+		arena_size += rlen + 1;
+	}
+	fclose(f);
+
+	// 排序后子域名紧跟在父域名之后, 父域名已拦截时子域名是多余的, 与重复的域名一起去掉
+	qsort(keys, nkeys, sizeof(uint32_t), blocklist_sort_cmp);
+	uint32_t kept = 0;
+	const char *parent = NULL;
+	size_t plen = 0;
+	for (uint32_t i = 0; i < nkeys; ++i) {
+		const char *k = _arena + keys[i];
+		if (parent && !strncmp(k, parent, plen) && (k[plen] == '\0' || k[plen] == LABEL_SEP))
+			continue;
+		keys[kept++] = keys[i];
+		parent = k;
+		plen = strlen(k);
+	}
+
+	blocklist_free();
+	_mode = nxdomain ? DNS_BLOCK_NXDOMAIN : DNS_BLOCK_NULL;
+	_count = kept;
+	_nblocks = (kept + BLOCK_KEYS - 1) / BLOCK_KEYS;
+	_blocks = malloc((_nblocks ? _nblocks : 1) * sizeof(uint32_t));
+	_bloom_bits = (kept ? kept : 1) * BLOOM_BITS;
+	_bloom = calloc((_bloom_bits + 63) / 64, sizeof(uint64_t));
+
+	// 编码后的长度不会超过临时存储的长度加上每个域名2个字节的前缀长度与后缀长度
+	size_t pos = 0;
+	_data = malloc(arena_size + (size_t) kept * 2 + 1);
+	const uint8_t *prev = NULL;
+	size_t prev_len = 0;
+	for (uint32_t i = 0; i < kept; ++i) {
+		const uint8_t *k = (const uint8_t*) _arena + keys[i];
+		size_t klen = strlen((const char*) k), shared = 0;
+		if (i % BLOCK_KEYS == 0) {
+			_blocks[i / BLOCK_KEYS] = (uint32_t) pos;
+		} else {
+			while (shared < prev_len && shared < klen && k[shared] == prev[shared]) ++shared;
+			_data[pos++] = (uint8_t) shared;
+		}
+		_data[pos++] = (uint8_t) (klen - shared);
+		memcpy(_data + pos, k + shared, klen - shared);
+		pos += klen - shared;
+		prev = k;
+		prev_len = klen;
+		bloom_add(blocklist_hash(14695981039346656037u, (const char*) k, klen));
+	}
+	_data = realloc(_data, pos ? pos : 1);
+
+	free(keys);
+	free(_arena);
+	_arena = NULL;
+
+	size_t mem = pos + _nblocks * sizeof(uint32_t) + (_bloom_bits + 63) / 64 * sizeof(uint64_t);
+	log_info("load blocklist %s: lines=%u, domains=%u, skipped=%u, memory=%zu bytes (%.1f bytes/domain), time=%" PRIu64 "ms",
+			filename, lines, kept, invalid, mem, kept ? (double) mem / kept : 0.0, net_mstime() - start);
+	return true;
+}
+
+dns_block_t blocklist_check(const char* host) {
+	if (!_count) return DNS_BLOCK_NONE;
+	char q[HOST_MAX];
+	size_t qlen = blocklist_reverse(host, strlen(host), q);
+	if (!qlen) return DNS_BLOCK_NONE;
+
+	// 依次检查顶级域名、二级域名直到完整域名是否可能在列表中, 都不在时无需查找
+	uint64_t h = 14695981039346656037u;
+	bool maybe = false;
+	for (size_t i = 0; i < qlen && !maybe; ++i) {
+		h = (h ^ (uint8_t) q[i]) * 1099511628211u;
+		if (q[i + 1] == LABEL_SEP || q[i + 1] == '\0')
+			maybe = bloom_test(h);
+	}
+	if (!maybe) return DNS_BLOCK_NONE;
+
+	// 二分查找块首域名不大于查询域名的最后一块
+	const uint8_t *uq = (const uint8_t*) q;
+	uint32_t lo = 0, hi = _nblocks;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		const uint8_t *b = _data + _blocks[mid];
+		if (blocklist_cmp(b + 1, b[0], uq, qlen) <= 0) lo = mid + 1;
+		else hi = mid;
+	}
+	if (!lo) return DNS_BLOCK_NONE;
+
+	// 在块内解码出不大于查询域名的最大域名, 列表中没有互为父子的域名,
+	// 所以只有该域名可能是查询域名本身或其父域名
+	uint32_t blk = lo - 1, n = blk + 1 < _nblocks ? BLOCK_KEYS : _count - blk * BLOCK_KEYS;
+	const uint8_t *p = _data + _blocks[blk];
+	uint8_t key[HOST_MAX], best[HOST_MAX];
+	size_t klen = 0, best_len = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		size_t shared = i ? *p++ : 0, slen = *p++;
+		memcpy(key + shared, p, slen);
+		p += slen;
+		klen = shared + slen;
+		if (blocklist_cmp(key, klen, uq, qlen) > 0) break;
+		memcpy(best, key, klen);
+		best_len = klen;
+	}
+
+	if (best_len && best_len <= qlen && !memcmp(best, q, best_len)
+			&& (best_len == qlen || q[best_len] == LABEL_SEP)) {
+		log_debug("blocklist match: %s", host);
+		return _mode;
+	}
+	return DNS_BLOCK_NONE;
+}
+
+void blocklist_free() {
+	free(_data);
+	free(_blocks);
+	free(_bloom);
+	_data = NULL;
+	_blocks = NULL;
+	_bloom = NULL;
+	_nblocks = _count = _bloom_bits = 0;
+}
+
+// #define BLOCKLIST_TEST
+#ifdef BLOCKLIST_TEST
+#include <assert.h>
+
+int main() {
+	const char *text = "# comment\n"
+		"ads.example.com\n"
+		"0.0.0.0 tracker.net # hosts format\n"
+		"127.0.0.1 localhost\n"
+		"x.ads.example.com\n"
+		"Ads.Example.COM.\n"
+		"bad..name\n"
+		"example-ads.com\n";
+	FILE *f = fopen("blocklist.test", "w");
+	fputs(text, f);
+	// 超过一块的域名, 检查块间的二分查找
+	for (int i = 0; i < 1000; ++i)
+		fprintf(f, "h%d.block.org\n", i * 2);
+	fclose(f);
+
+	log_set_level(LOG_INFO);
+	assert(blocklist_load("blocklist.test", false));
+	assert(_count == 1003);
+	assert(blocklist_check("ads.example.com") == DNS_BLOCK_NULL);
+	assert(blocklist_check("a.b.ADS.example.com") == DNS_BLOCK_NULL);
+	assert(blocklist_check("example.com") == DNS_BLOCK_NONE);
+	assert(blocklist_check("xads.example.com") == DNS_BLOCK_NONE);
+	assert(blocklist_check("example-ads.com") == DNS_BLOCK_NULL);
+	assert(blocklist_check("tracker.net") == DNS_BLOCK_NULL);
+	assert(blocklist_check("localhost") == DNS_BLOCK_NONE);
+	assert(blocklist_check("net") == DNS_BLOCK_NONE);
+	for (int i = 0; i < 2000; ++i) {
+		char host[HOST_MAX];
+		sprintf(host, "www.h%d.block.org", i);
+		assert(blocklist_check(host) == (i % 2 ? DNS_BLOCK_NONE : DNS_BLOCK_NULL));
+	}
+
+	assert(blocklist_load("blocklist.test", true));
+	assert(blocklist_check("tracker.net") == DNS_BLOCK_NXDOMAIN);
+	blocklist_free();
+	assert(blocklist_check("tracker.net") == DNS_BLOCK_NONE);
+	remove("blocklist.test");
+	printf("test success\n");
+	return 0;
+}
+#endif // BLOCKLIST_TEST
@@ -0,0 +1,28 @@
+/** 域名拦截列表, 列表中的域名及其全部子域名应答0.0.0.0(::)或域名不存在
+ *  域名按标签反转(www.a.com -> com.a.www)后排序, 使用前缀压缩编码存放, 相当于序列化的压缩后缀树,
+ *  每16个域名一块, 块首域名完整存放用于二分查找, 前面加一个布隆过滤器快速排除不在列表中的域名
+ */
+#pragma once
+#ifndef __BLOCKLIST_H__
+#define __BLOCKLIST_H__
+
+#include <stdbool.h>
+#include "dnsproto.h"
+
+/** 加载拦截列表文件, 每行一个域名, 兼容hosts文件格式(ip 域名), #开头为注释
+ * @param filename 拦截列表文件名
+ * @param nxdomain true: 拦截的域名应答域名不存在, false: 应答0.0.0.0(::)
+ * @return true: 成功, false: 文件无法读取
+ */
+extern bool blocklist_load(const char* filename, bool nxdomain);
+
+/** 判断域名是否被拦截, 符合dns_block_func接口
+ * @param host 域名, 不区分大小写
+ * @return 拦截的应答方式, DNS_BLOCK_NONE表示未拦截
+ */
+extern dns_block_t blocklist_check(const char* host);
+
+/** 释放拦截列表 */
+extern void blocklist_free();
+
+#endif // __BLOCKLIST_H__
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "log.h"
+#include "dnsproto.h"
+#include "cache.h"
+
+/** 缓存分片数量, 必须是2的幂 */
+#define CACHE_SHARDS 16
+/** 每个分片哈希桶的初始数量, 必须是2的幂 */
+#define CACHE_BUCKETS_INIT 64
+/** 缓存转储文件的标识及版本 */
+#define CACHE_DUMP_MAGIC "MDC\1"
+/** 转储文件头的长度, 标识(4) 转储时的系统时间(8) */
+#define CACHE_DUMP_HEAD 12
+/** 转储条目头的长度, 域名长度(1) 类型(2) 类(2) 生存时间(4) 已缓存时间(4) 命中次数(4) 报文长度(2) */
+#define CACHE_DUMP_ENTRY 19
+
+// 缓存条目
+typedef struct cache_entry_t {
+	struct cache_entry_t *next;	// 哈希桶链表的下一项
+	uint32_t hash;				// 键的哈希值
+	uint32_t ring_idx;			// 在CLOCK环中的位置
+	uint32_t stored;			// 写入时间
+	uint32_t ttl;				// 生存时间
+	uint32_t hits;				// 命中次数
+	uint32_t failed;			// 最近一次刷新失败的时间
+	uint16_t type;				// 查询类型
+	uint16_t class;				// 查询类
+	uint16_t len;				// 应答报文长度
+	uint8_t referenced;			// CLOCK访问标志, 命中时置位, 淘汰扫描时清除
+	char host[HOST_MAX];		// 小写的域名
+	uint8_t msg[];				// 应答报文
+} cache_entry_t;
+
+// 缓存分片
+typedef struct cache_shard_t {
+	cache_entry_t **buckets;	// 哈希桶
+	uint32_t bucket_mask;		// 哈希桶数量减1
+	uint32_t count;				// 条目数量
+	size_t mem;					// 已使用的内存
+	cache_entry_t **ring;		// CLOCK环, 存放全部条目
+	uint32_t ring_cap;			// CLOCK环的容量
+	uint32_t hand;				// CLOCK指针
+} cache_shard_t;
+
+static cache_shard_t _shards[CACHE_SHARDS];
+static size_t _shard_mem_max = 0;
+
+/** 计算键的哈希值, FNV-1a算法, 域名不区分大小写 */
+static uint32_t cache_hash(const char* host, uint16_t type, uint16_t class) {
+	uint32_t h = 2166136261u;
+	for (; *host; ++host)
+		h = (h ^ (uint8_t) tolower((unsigned char) *host)) * 16777619u;
+	h = (h ^ type) * 16777619u;
+	h = (h ^ class) * 16777619u;
+	return h;
+}
+
+/** 条目占用的内存 */
+static inline size_t cache_entry_mem(const cache_entry_t* e) {
+	return sizeof(cache_entry_t) + e->len + sizeof(cache_entry_t*) * 2;
+}
+
+void cache_init(size_t mem_max) {
+	_shard_mem_max = mem_max / CACHE_SHARDS;
+	for (int i = 0; i < CACHE_SHARDS; ++i) {
+		cache_shard_t *s = _shards + i;
+		s->buckets = calloc(CACHE_BUCKETS_INIT, sizeof(cache_entry_t*));
+		s->bucket_mask = CACHE_BUCKETS_INIT - 1;
+		s->count = 0;
+		s->mem = 0;
+		s->ring = NULL;
+		s->ring_cap = 0;
+		s->hand = 0;
+	}
+}
+
+void cache_free() {
+	for (int i = 0; i < CACHE_SHARDS; ++i) {
+		cache_shard_t *s = _shards + i;
+		for (uint32_t j = 0; j < s->count; ++j)
+			free(s->ring[j]);
+		free(s->ring);
+		free(s->buckets);
+		memset(s, 0, sizeof(*s));
+	}
+}
+
+/** 在分片中查找条目 */
+static cache_entry_t* cache_find(cache_shard_t* s, uint32_t hash, const char* host,
+		uint16_t type, uint16_t class) {
+	for (cache_entry_t *e = s->buckets[hash & s->bucket_mask]; e; e = e->next)
+		if (e->hash == hash && e->type == type && e->class == class && !strcasecmp(e->host, host))
+			return e;
+	return NULL;
+}
+
+/** 从分片中删除条目并释放内存 */
+static void cache_remove(cache_shard_t* s, cache_entry_t* e) {
+	cache_entry_t **pp = s->buckets + (e->hash & s->bucket_mask);
+	while (*pp != e) pp = &(*pp)->next;
+	*pp = e->next;
+
+	// 用环中最后一项填补被删除条目的位置
+	cache_entry_t *last = s->ring[--s->count];
+	s->ring[e->ring_idx] = last;
+	last->ring_idx = e->ring_idx;
+	if (s->hand >= s->count) s->hand = 0;
+
+	s->mem -= cache_entry_mem(e);
+	free(e);
+}
+
+/** 哈希桶数量翻倍 */
+static void cache_rehash(cache_shard_t* s) {
+	uint32_t n = (s->bucket_mask + 1) << 1;
+	cache_entry_t **buckets = calloc(n, sizeof(cache_entry_t*));
+	for (uint32_t i = 0; i < s->count; ++i) {
+		cache_entry_t *e = s->ring[i];
+		e->next = buckets[e->hash & (n - 1)];
+		buckets[e->hash & (n - 1)] = e;
+	}
+	free(s->buckets);
+	s->buckets = buckets;
+	s->bucket_mask = n - 1;
+}
+
+/** 使用CLOCK算法淘汰条目, 直到有足够的内存写入新条目, 过期条目直接淘汰 */
+static void cache_evict(cache_shard_t* s, size_t need, uint32_t now) {
+	while (s->count && s->mem + need > _shard_mem_max) {
+		cache_entry_t *e = s->ring[s->hand];
+		if (e->referenced && now - e->stored < e->ttl) {
+			e->referenced = 0;
+			if (++s->hand >= s->count) s->hand = 0;
+		} else {
+			log_trace("cache evict %s [type=%u]", e->host, e->type);
+			cache_remove(s, e);
+		}
+	}
+}
+
+bool cache_get(const char* host, uint16_t type, uint16_t class, uint32_t now, uint32_t stale,
+		cache_view_t* dst) {
+	uint32_t hash = cache_hash(host, type, class);
+	cache_shard_t *s = _shards + (hash & (CACHE_SHARDS - 1));
+	cache_entry_t *e = cache_find(s, hash, host, type, class);
+	if (!e || (uint64_t) (now - e->stored) >= (uint64_t) e->ttl + stale)
+		return false;
+
+	e->referenced = 1;
+	if (e->hits != UINT32_MAX) ++e->hits;
+	dst->msg = e->msg;
+	dst->len = e->len;
+	dst->age = now - e->stored;
+	dst->ttl = e->ttl;
+	dst->hits = e->hits;
+	dst->failed = e->failed;
+	return true;
+}
+
+void cache_set_failed(const char* host, uint16_t type, uint16_t class, uint32_t now) {
+	uint32_t hash = cache_hash(host, type, class);
+	cache_entry_t *e = cache_find(_shards + (hash & (CACHE_SHARDS - 1)), hash, host, type, class);
+	if (e) e->failed = now ? now : 1;
+}
+
+void cache_put(const char* host, uint16_t type, uint16_t class,
+		const uint8_t* msg, uint16_t len, uint32_t ttl, uint32_t now) {
+	size_t hl = strlen(host);
+	if (hl >= HOST_MAX || !ttl) return;
+
+	uint32_t hash = cache_hash(host, type, class);
+	cache_shard_t *s = _shards + (hash & (CACHE_SHARDS - 1));
+	cache_entry_t *e = cache_find(s, hash, host, type, class);
+	if (e) cache_remove(s, e);
+
+	e = malloc(sizeof(cache_entry_t) + len);
+	e->hash = hash;
+	e->stored = now;
+	e->ttl = ttl;
+	e->hits = 0;
+	e->failed = 0;
+	e->type = type;
+	e->class = class;
+	e->len = len;
+	e->referenced = 0;
+	for (size_t i = 0; i <= hl; ++i)
+		e->host[i] = (char) tolower((unsigned char) host[i]);
+	memcpy(e->msg, msg, len);
+
+	size_t need = cache_entry_mem(e);
+	if (need > _shard_mem_max) {
+		free(e);
+		return;
+	}
+	cache_evict(s, need, now);
+
+	if (s->count >= s->ring_cap) {
+		s->ring_cap = s->ring_cap ? s->ring_cap << 1 : CACHE_BUCKETS_INIT;
+		s->ring = realloc(s->ring, s->ring_cap * sizeof(cache_entry_t*));
+	}
+	e->ring_idx = s->count;
+	s->ring[s->count++] = e;
+	e->next = s->buckets[hash & s->bucket_mask];
+	s->buckets[hash & s->bucket_mask] = e;
+	s->mem += need;
+	if (s->count > (s->bucket_mask + 1) << 1)
+		cache_rehash(s);
+}
+
+void cache_usage(size_t* count, size_t* mem) {
+	*count = *mem = 0;
+	for (int i = 0; i < CACHE_SHARDS; ++i) {
+		*count += _shards[i].count;
+		*mem += _shards[i].mem;
+	}
+}
+
+static inline void cache_enc16(uint8_t* p, uint16_t v) { p[0] = (uint8_t) (v >> 8); p[1] = (uint8_t) v; }
+
+static inline void cache_enc32(uint8_t* p, uint32_t v) {
+	cache_enc16(p, (uint16_t) (v >> 16));
+	cache_enc16(p + 2, (uint16_t) v);
+}
+
+static inline uint16_t cache_dec16(const uint8_t* p) { return (uint16_t) (p[0] << 8 | p[1]); }
+
+static inline uint32_t cache_dec32(const uint8_t* p) {
+	return (uint32_t) cache_dec16(p) << 16 | cache_dec16(p + 2);
+}
+
+int cache_save(const char* filename, uint32_t now) {
+	char tmp[FILENAME_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int) sizeof(tmp))
+		return -1;
+	FILE *fp = fopen(tmp, "wb");
+	if (!fp) {
+		log_error("%s error: can't open file %s", __func__, tmp);
+		return -1;
+	}
+
+	// 数据先写入临时文件, 完成后改名, 避免中途退出时留下不完整的转储文件
+	uint8_t head[CACHE_DUMP_HEAD];
+	uint64_t wall = (uint64_t) time(NULL);
+	memcpy(head, CACHE_DUMP_MAGIC, 4);
+	cache_enc32(head + 4, (uint32_t) (wall >> 32));
+	cache_enc32(head + 8, (uint32_t) wall);
+	bool ok = fwrite(head, sizeof(head), 1, fp) == 1;
+
+	int count = 0;
+	for (int i = 0; i < CACHE_SHARDS && ok; ++i) {
+		const cache_shard_t *s = _shards + i;
+		for (uint32_t j = 0; j < s->count && ok; ++j) {
+			const cache_entry_t *e = s->ring[j];
+			uint32_t age = now - e->stored;
+			if (age >= e->ttl) continue;
+			uint8_t eh[CACHE_DUMP_ENTRY];
+			size_t hl = strlen(e->host);
+			eh[0] = (uint8_t) hl;
+			cache_enc16(eh + 1, e->type);
+			cache_enc16(eh + 3, e->class);
+			cache_enc32(eh + 5, e->ttl);
+			cache_enc32(eh + 9, age);
+			cache_enc32(eh + 13, e->hits);
+			cache_enc16(eh + 17, e->len);
+			ok = fwrite(eh, sizeof(eh), 1, fp) == 1 && fwrite(e->host, 1, hl, fp) == hl
+					&& fwrite(e->msg, 1, e->len, fp) == e->len;
+			++count;
+		}
+	}
+
+	if (fclose(fp) != 0) ok = false;
+#ifdef _WIN32
+	if (ok) remove(filename);
+#endif
+	if (!ok || rename(tmp, filename) != 0) {
+		log_error("%s error: can't write file %s", __func__, filename);
+		remove(tmp);
+		return -1;
+	}
+	return count;
+}
+
+int cache_load(const char* filename, uint32_t now) {
+	FILE *fp = fopen(filename, "rb");
+	if (!fp) return -1;
+
+	uint8_t head[CACHE_DUMP_HEAD];
+	if (fread(head, sizeof(head), 1, fp) != 1 || memcmp(head, CACHE_DUMP_MAGIC, 4)) {
+		log_warn("%s error: %s is not a cache dump file", __func__, filename);
+		fclose(fp);
+		return -1;
+	}
+
+	// 按转储后经过的系统时间调整已缓存时间, 系统时间回拨时视为没有经过时间
+	uint64_t wall = (uint64_t) time(NULL), dumped = (uint64_t) cache_dec32(head + 4) << 32 | cache_dec32(head + 8);
+	uint64_t elapsed = wall > dumped ? wall - dumped : 0;
+
+	int count = 0;
+	static uint8_t msg[UINT16_MAX];
+	uint8_t eh[CACHE_DUMP_ENTRY];
+	char host[HOST_MAX];
+	while (fread(eh, sizeof(eh), 1, fp) == 1) {
+		size_t hl = eh[0];
+		uint16_t len = cache_dec16(eh + 17);
+		if (hl >= HOST_MAX || fread(host, 1, hl, fp) != hl || fread(msg, 1, len, fp) != len) {
+			log_warn("%s error: %s is truncated", __func__, filename);
+			break;
+		}
+		host[hl] = '\0';
+		uint32_t ttl = cache_dec32(eh + 5);
+		uint64_t age = cache_dec32(eh + 9) + elapsed;
+		if (age >= ttl) continue;
+
+		// 写入时间回推已缓存的时间, 应答时报文中的生存时间按剩余时间计算
+		uint16_t type = cache_dec16(eh + 1), class = cache_dec16(eh + 3);
+		cache_put(host, type, class, msg, len, ttl, now - (uint32_t) age);
+		uint32_t hash = cache_hash(host, type, class);
+		cache_entry_t *e = cache_find(_shards + (hash & (CACHE_SHARDS - 1)), hash, host, type, class);
+		if (e) e->hits = cache_dec32(eh + 13);
+		++count;
+	}
+
+	fclose(fp);
+	return count;
+}
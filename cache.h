@@ -0,0 +1,79 @@
+/** dns应答缓存, 按域名、类型、类缓存上游服务器的应答报文, 按生存时间过期,
+ *  缓存分片存放, 每个分片独立使用CLOCK算法在内存超出上限时淘汰条目
+ */
+#pragma once
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** 缓存查找结果, 指向缓存内部的只读内存, 下一次写入缓存前有效 */
+typedef struct cache_view_t {
+	const uint8_t	*msg;			// 缓存的应答报文
+	uint16_t		len;			// 应答报文长度
+	uint32_t		age;			// 已缓存的时间, 秒为单位
+	uint32_t		ttl;			// 写入缓存时的生存时间, 秒为单位, age不小于ttl时为过期条目
+	uint32_t		hits;			// 写入后的命中次数
+	uint32_t		failed;			// 最近一次刷新失败的时间, 0表示没有失败
+} cache_view_t;
+
+/** 初始化缓存
+ * @param mem_max 缓存允许使用的最大内存, 字节为单位
+ */
+extern void cache_init(size_t mem_max);
+
+/** 释放缓存的全部内存 */
+extern void cache_free();
+
+/** 查找缓存
+ * @param host 域名, 不区分大小写
+ * @param type 查询类型
+ * @param class 查询类
+ * @param now 当前时间, 秒为单位的单调时钟
+ * @param stale 过期后仍允许返回的时间, 秒为单位, 0表示只返回未过期的条目
+ * @param dst 回写查找结果
+ * @return true: 命中, false: 未命中或过期超过stale
+ */
+extern bool cache_get(const char* host, uint16_t type, uint16_t class, uint32_t now, uint32_t stale,
+		cache_view_t* dst);
+
+/** 写入缓存, 已存在相同的条目时替换
+ * @param host 域名, 不区分大小写
+ * @param type 查询类型
+ * @param class 查询类
+ * @param msg 应答报文
+ * @param len 应答报文长度
+ * @param ttl 生存时间, 秒为单位
+ * @param now 当前时间, 秒为单位的单调时钟
+ */
+extern void cache_put(const char* host, uint16_t type, uint16_t class,
+		const uint8_t* msg, uint16_t len, uint32_t ttl, uint32_t now);
+
+/** 记录条目刷新失败的时间, 用于过期应答期间控制重新查询上游的频率
+ * @param host 域名, 不区分大小写
+ * @param type 查询类型
+ * @param class 查询类
+ * @param now 当前时间, 秒为单位的单调时钟
+ */
+extern void cache_set_failed(const char* host, uint16_t type, uint16_t class, uint32_t now);
+
+/** 把未过期的缓存条目转储到文件, 先写入临时文件再改名替换
+ * @param filename 转储文件名
+ * @param now 当前时间, 秒为单位的单调时钟
+ * @return 写入的条目数量, -1: 写入失败
+ */
+extern int cache_save(const char* filename, uint32_t now);
+
+/** 从转储文件加载缓存条目, 已缓存时间加上转储后经过的系统时间, 跳过已过期的条目
+ * @param filename 转储文件名
+ * @param now 当前时间, 秒为单位的单调时钟
+ * @return 加载的条目数量, -1: 文件不存在或格式错误
+ */
+extern int cache_load(const char* filename, uint32_t now);
+
+/** 获取缓存的条目数量及已使用的内存 */
+extern void cache_usage(size_t* count, size_t* mem);
+
+#endif // __CACHE_H__
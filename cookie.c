@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "cookie.h"
+
+/** 服务器cookie的版本号 */
+#define COOKIE_VERSION 1
+/** 服务器cookie的长度: 版本(1) 保留(3) 时间戳(4) 哈希(8) */
+#define COOKIE_SERVER_LEN 16
+/** 服务器cookie的有效期, 秒为单位 */
+#define COOKIE_LIFETIME 3600
+/** 允许客户端与服务器的时钟偏差, 时间戳超前当前时间不超过该值时仍然有效 */
+#define COOKIE_CLOCK_SKEW 300
+/** 统计信息的输出间隔, 秒为单位 */
+#define COOKIE_STATS_INTERVAL 300
+
+static uint8_t _secret[16], _prev_secret[16];
+static bool _has_prev = false;
+static uint32_t _rotate = COOKIE_ROTATE_DEFAULT;
+static time_t _rotate_next = 0, _stats_next = 0;
+// 请求计数, 统计信息输出后清零
+static uint64_t _queries = 0, _cookies = 0, _valid = 0;
+
+static inline uint64_t cookie_get64le(const uint8_t* p) {
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; --i)
+		v = v << 8 | p[i];
+	return v;
+}
+
+#define ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+/** SipHash-2-4, 128位密钥的64位带密钥哈希, 短输入时很快, 适合逐个请求计算 */
+static uint64_t cookie_siphash(const uint8_t key[16], const uint8_t* in, size_t len) {
+	uint64_t k0 = cookie_get64le(key), k1 = cookie_get64le(key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0, v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0, v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t b = (uint64_t) len << 56, m;
+	const uint8_t *end = in + (len & ~(size_t) 7);
+
+	for (; in != end; in += 8) {
+		m = cookie_get64le(in);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+	for (int i = (int) (len & 7) - 1; i >= 0; --i)
+		b |= (uint64_t) in[i] << (i * 8);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/** 生成随机密钥, 优先使用系统的随机数源 */
+static void cookie_random(uint8_t key[16]) {
+#ifndef _WIN32
+	FILE *fp = fopen("/dev/urandom", "rb");
+	if (fp) {
+		size_t n = fread(key, 1, 16, fp);
+		fclose(fp);
+		if (n == 16) return;
+	}
+#endif
+	// 没有系统随机数源时, 使用时间及地址混合生成, splitmix64算法
+	static uint64_t state = 0;
+	state ^= net_mstime() ^ ((uint64_t) time(NULL) << 20) ^ (uint64_t) (uintptr_t) key;
+	for (int i = 0; i < 16; i += 8) {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		z ^= z >> 31;
+		memcpy(key + i, &z, 8);
+	}
+}
+
+void cookie_init(uint32_t rotate) {
+	_rotate = rotate ? rotate : COOKIE_ROTATE_DEFAULT;
+	cookie_random(_secret);
+	_has_prev = false;
+	_rotate_next = time(NULL) + _rotate;
+	log_info("dns cookie enabled: secret rotate every %u seconds", _rotate);
+}
+
+/** 生成服务器cookie
+ * @param secret 密钥
+ * @param client 客户端cookie
+ * @param ip 客户端地址, 网络字节序
+ * @param ts 时间戳
+ * @param dst 回写服务器cookie
+ */
+static void cookie_make(const uint8_t secret[16], const uint8_t client[DNS_COOKIE_CLIENT_LEN], uint32_t ip,
+		uint32_t ts, uint8_t dst[COOKIE_SERVER_LEN]) {
+	uint8_t in[DNS_COOKIE_CLIENT_LEN + 8 + 4];
+	memcpy(in, client, DNS_COOKIE_CLIENT_LEN);
+	in[8] = COOKIE_VERSION;
+	in[9] = in[10] = in[11] = 0;
+	in[12] = (uint8_t) (ts >> 24);
+	in[13] = (uint8_t) (ts >> 16);
+	in[14] = (uint8_t) (ts >> 8);
+	in[15] = (uint8_t) ts;
+	memcpy(in + 16, &ip, 4);
+
+	uint64_t h = cookie_siphash(secret, in, sizeof(in));
+	memcpy(dst, in + DNS_COOKIE_CLIENT_LEN, 8);
+	for (int i = 0; i < 8; ++i)
+		dst[8 + i] = (uint8_t) (h >> (i * 8));
+}
+
+/** 校验请求中的服务器cookie, 时间戳在有效期内且使用当前或上一个密钥生成时有效 */
+static bool cookie_valid(const uint8_t* cookie, uint16_t len, uint32_t ip, uint32_t now) {
+	const uint8_t *server = cookie + DNS_COOKIE_CLIENT_LEN;
+	if (len != DNS_COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN || server[0] != COOKIE_VERSION)
+		return false;
+	uint32_t ts = (uint32_t) server[4] << 24 | (uint32_t) server[5] << 16 | (uint32_t) server[6] << 8 | server[7];
+	// 时间戳按序列号比较, 允许回绕
+	if ((int32_t) (now - ts) > COOKIE_LIFETIME || (int32_t) (ts - now) > COOKIE_CLOCK_SKEW)
+		return false;
+
+	uint8_t expect[COOKIE_SERVER_LEN];
+	cookie_make(_secret, cookie, ip, ts, expect);
+	if (!memcmp(expect, server, COOKIE_SERVER_LEN)) return true;
+	if (!_has_prev) return false;
+	cookie_make(_prev_secret, cookie, ip, ts, expect);
+	return !memcmp(expect, server, COOKIE_SERVER_LEN);
+}
+
+/** 定时输出带cookie请求的比例 */
+static void cookie_log_stats(time_t now) {
+	if (now < _stats_next) return;
+	_stats_next = now + COOKIE_STATS_INTERVAL;
+	if (_queries)
+		log_info("cookie stats: queries=%" PRIu64 ", cookie=%" PRIu64 " (%.1f%%), valid=%" PRIu64 " (%.1f%%)",
+				_queries, _cookies, _cookies * 100.0 / _queries, _valid, _valid * 100.0 / _queries);
+	_queries = _cookies = _valid = 0;
+}
+
+uint16_t cookie_check(const sockaddr_in_t* addr, const uint8_t* cookie, uint16_t len,
+		uint8_t server[DNS_COOKIE_SERVER_MAX], bool* valid) {
+	time_t now = time(NULL);
+	cookie_log_stats(now);
+	++_queries;
+	*valid = false;
+	if (!len) return 0;
+	++_cookies;
+
+	// 定时更换密钥, 上一个密钥生成的cookie在有效期内仍然有效
+	if (now >= _rotate_next) {
+		memcpy(_prev_secret, _secret, sizeof(_secret));
+		_has_prev = true;
+		cookie_random(_secret);
+		_rotate_next = now + _rotate;
+		log_debug("dns cookie secret rotated");
+	}
+
+	if ((*valid = cookie_valid(cookie, len, addr->sin_addr.s_addr, (uint32_t) now))) ++_valid;
+	cookie_make(_secret, cookie, addr->sin_addr.s_addr, (uint32_t) now, server);
+	return COOKIE_SERVER_LEN;
+}
+
+// #define COOKIE_TEST
+#ifdef COOKIE_TEST
+#include <assert.h>
+
+static void hex(const char* text, uint8_t* dst) {
+	for (; *text; text += 2)
+		*dst++ = (uint8_t) strtoul((char[]) { text[0], text[1], 0 }, NULL, 16);
+}
+
+int main() {
+	// SipHash-2-4论文中的测试向量, 密钥为00..0f, 输入为00..0e
+	uint8_t key[16], in[15];
+	for (int i = 0; i < 16; ++i) key[i] = (uint8_t) i;
+	for (int i = 0; i < 15; ++i) in[i] = (uint8_t) i;
+	assert(cookie_siphash(key, in, 15) == 0xa129ca6149be45e5ULL);
+	assert(cookie_siphash(key, in, 0) == 0x726fdb47dd0e0e31ULL);
+
+	// RFC 9018附录A.1的测试向量
+	uint8_t secret[16], client[8], server[COOKIE_SERVER_LEN], expect[COOKIE_SERVER_LEN];
+	hex("e5e973e5a6b2a43f48e7dc849e37bfcf", secret);
+	hex("2464c4abcf10c957", client);
+	hex("010000005cf79f111f8130c3eee29480", expect);
+	cookie_make(secret, client, net_ip_fromstring("198.51.100.100"), 1559731985, server);
+	assert(!memcmp(server, expect, COOKIE_SERVER_LEN));
+
+	// 首次请求只有客户端cookie, 再次请求带上服务器cookie后有效, 地址不同或密钥更换两次后无效
+	sockaddr_in_t addr = { .sin_family = AF_INET }, other = addr;
+	addr.sin_addr.s_addr = net_ip_fromstring("10.0.0.1");
+	other.sin_addr.s_addr = net_ip_fromstring("10.0.0.2");
+	uint8_t cookie[DNS_COOKIE_CLIENT_LEN + DNS_COOKIE_SERVER_MAX];
+	uint8_t out[DNS_COOKIE_SERVER_MAX];
+	bool valid;
+	cookie_init(COOKIE_ROTATE_DEFAULT);
+	memcpy(cookie, client, 8);
+	uint16_t n = cookie_check(&addr, cookie, 8, cookie + 8, &valid);
+	assert(n == COOKIE_SERVER_LEN && !valid);
+	cookie_check(&addr, cookie, 8 + n, out, &valid);
+	assert(valid);
+	cookie_check(&other, cookie, 8 + n, out, &valid);
+	assert(!valid);
+	cookie[20] ^= 1;
+	cookie_check(&addr, cookie, 8 + n, out, &valid);
+	assert(!valid);
+	cookie[20] ^= 1;
+	_rotate_next = 0;
+	cookie_check(&addr, cookie, 8 + n, out, &valid);
+	assert(valid);
+	_rotate_next = 0;
+	cookie_check(&addr, cookie, 8 + n, out, &valid);
+	assert(!valid);
+	assert(cookie_check(&addr, cookie, 0, out, &valid) == 0 && !valid);
+
+	uint64_t start = net_mstime(), sum = 0;
+	for (uint32_t i = 0; i < 10000000; ++i) {
+		cookie_make(secret, client, i, 1559731985, server);
+		sum += server[15];
+	}
+	printf("10M cookies: %llums, sum=%llu\n", (unsigned long long) (net_mstime() - start), (unsigned long long) sum);
+	printf("test success\n");
+	return 0;
+}
+#endif // COOKIE_TEST
@@ -0,0 +1,33 @@
+/** DNS Cookies(RFC 7873), 用于低成本地区分真实客户端与伪造源地址的请求
+ *  服务器cookie按RFC 9018的格式生成: 版本(1) 保留(3) 时间戳(4) 哈希(8), 哈希使用SipHash-2-4计算,
+ *  输入为客户端cookie、版本、保留、时间戳及客户端地址, 密钥定时更换, 更换后上一个密钥仍然有效
+ */
+#pragma once
+#ifndef __COOKIE_H__
+#define __COOKIE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "net.h"
+#include "dnsproto.h"
+
+/** 默认的密钥更换间隔, 秒为单位 */
+#define COOKIE_ROTATE_DEFAULT 3600
+
+/** 初始化服务器cookie, 生成随机密钥
+ * @param rotate 密钥更换间隔, 秒为单位
+ */
+extern void cookie_init(uint32_t rotate);
+
+/** 校验请求中的cookie并生成应答使用的服务器cookie, 符合dns_cookie_func接口, 同时统计带cookie请求的比例
+ * @param addr 客户端地址
+ * @param cookie 请求中cookie选项的数据, 客户端cookie及可选的服务器cookie
+ * @param len cookie选项的数据长度, 0表示请求没有cookie选项
+ * @param server 回写新的服务器cookie
+ * @param valid 回写请求中的服务器cookie是否有效
+ * @return 服务器cookie的长度, 0: 不需要应答cookie
+ */
+extern uint16_t cookie_check(const sockaddr_in_t* addr, const uint8_t* cookie, uint16_t len,
+		uint8_t server[DNS_COOKIE_SERVER_MAX], bool* valid);
+
+#endif // __COOKIE_H__
@@ -1,42 +1,622 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux
+#include <sys/inotify.h>
+#endif
 
 #include "list.h"
 #include "log.h"
 #include "net.h"
 #include "dnsdb.h"
+#include "lpm.h"
 
-#define _I2S_TMP(x) #x
-#define _I2S(x) _I2S_TMP(x)
+/** 文本格式数据库中一行记录的最大长度 */
+#define LINE_MAX_LEN 1024
+/** 单条记录rdata的最大长度 */
+#define RDATA_MAX 512
+/** 加权轮转时单条记录允许的最大权重 */
+#define WEIGHT_MAX 100
+/** 区域默认的否定应答缓存时间, 秒为单位 */
+#define NEG_TTL_DEFAULT 60
+/** 记录生存时间允许的最大值, 取RFC 2181规定的最大值 */
+#define TTL_MAX 0x7FFFFFFF
+/** 转发域名默认的预取阈值, 剩余生存时间的百分比 */
+#define PREFETCH_DEFAULT 10
+/** 域名索引哈希桶的初始数量, 必须是2的幂 */
+#define INDEX_INIT 1024
+/** 并行加载的最大线程数 */
+#define LOAD_THREADS_MAX 16
+/** 并行加载时每个线程至少处理的字节数, 文件较小时减少线程数 */
+#define LOAD_CHUNK_MIN (256 * 1024)
+/** 允许定义的最大视图数量 */
+#define VIEW_MAX 16
+/** 非linux平台检查数据库文件改动的间隔, 秒为单位 */
+#define WATCH_INTERVAL 2
+/** 预编码SOA记录的最大长度, 两个域名加上5个4字节整数 */
+#define SOA_MAX (DNS_RR_HEAD_LEN + (HOST_MAX + 1) * 2 + 20)
 
-#define SCAN_FMT ("%" _I2S(HOST_MAX) "s %" _I2S(HOST_MAX) "s")
+// 资源记录集, 同一域名同一类型的所有记录, 以应答报文格式预编码存放
+typedef struct dnsdb_rrset_t {
+	struct dnsdb_rrset_t *next;	// 同一域名的下一个记录集
+	uint16_t type;				// 记录类型
+	uint16_t count;				// 记录数量
+	uint16_t len;				// 预编码数据长度
+	uint16_t sched_len;			// 加权轮转调度表长度, 0表示按顺序轮转
+	atomic_uint rotate;			// 轮转计数器, 每次查询加1, 无锁更新
+	uint8_t *data;				// 预编码数据, 每条记录格式: type(2) class(2) ttl(4) rdlength(2) rdata
+	uint8_t *weights;			// 每条记录的权重, NULL表示权重全部为1
+	uint16_t *sched;			// 加权轮转调度表, 内容为每次查询第一条输出的记录序号
+} dnsdb_rrset_t;
 
-// 存放域名ip信息的结构
+// 存放域名记录信息的结构
 typedef struct dnsdb_rec_t {
 	LIST_FIELDS;
+	struct dnsdb_rec_t *hnext;	// 索引中同一哈希桶的下一项
+	uint32_t hash;				// 域名的哈希值
 	char host[HOST_MAX];
-	uint32_t ip;
+	dnsdb_rrset_t *rrsets;
+	struct dnsdb_node_t *node;	// 域名在标签树中的节点, 只有快照的记录有, 并行加载的分块中为NULL
 } dnsdb_rec_t;
 
-// 域名ip存放链表
-static LIST_HEAD(_dns_recs);
+// 标签树的节点, 按反转的标签组织, 例如 www.a.com 的路径为 根 -> com -> a -> www,
+// 子节点不单独存放, 以(父节点, 标签)为键存放在快照的节点哈希表中, 每一级查找都是常数时间
+typedef struct dnsdb_node_t {
+	struct dnsdb_node_t *parent;	// 父节点
+	struct dnsdb_node_t *hnext;		// 节点哈希表中同一哈希桶的下一项
+	dnsdb_rec_t *rec;				// 节点对应域名的记录, NULL表示只有子域名记录的空非终结节点
+	uint32_t hash;					// 父节点与标签的哈希值
+	uint32_t children;				// 子节点数量, 为0且没有记录时删除节点
+	uint8_t len;					// 标签长度
+	char label[];					// 标签, 不以'\0'结尾
+} dnsdb_node_t;
+
+// 域名记录集合, 链表保持文件中的顺序, 哈希索引用于按域名查找, 快照及并行加载的分块各有一个
+typedef struct dnsdb_recs_t {
+	list_head_t list;			// 域名记录链表
+	dnsdb_rec_t **buckets;		// 哈希索引
+	uint32_t mask;				// 哈希桶数量减1
+	uint32_t count;				// 域名数量
+} dnsdb_recs_t;
+
+// 区域配置, 由数据库文件中的$ZONE指令定义, 决定区域内记录的默认生存时间、生存时间上下限及否定应答的SOA记录
+typedef struct dnsdb_zone_t {
+	LIST_FIELDS;
+	char name[HOST_MAX];		// 区域名
+	char mname[HOST_MAX];		// SOA记录的主域名服务器, 为空时使用区域名
+	char rname[HOST_MAX];		// SOA记录的管理员邮箱, 为空时使用hostmaster.区域名
+	uint32_t ttl;				// 区域内记录的默认生存时间
+	uint32_t ttl_min;			// 记录生存时间下限
+	uint32_t ttl_max;			// 记录生存时间上限
+	uint32_t neg_ttl;			// 否定应答的缓存时间, 即SOA记录的minimum字段
+	uint32_t serial;			// SOA记录的序列号, 数据库改动时更新
+	uint16_t soa_len;			// 预编码SOA记录长度
+	uint8_t soa[SOA_MAX];		// 预编码SOA记录
+} dnsdb_zone_t;
+
+// 转发策略, 由数据库文件中的$FORWARD指令定义, 决定转发域名缓存的预取阈值及过期应答窗口
+typedef struct dnsdb_fwdzone_t {
+	LIST_FIELDS;
+	char name[HOST_MAX];		// 域名后缀, 为空时匹配全部域名
+	uint8_t prefetch;			// 预取阈值, 剩余生存时间的百分比, 0表示不预取
+	uint32_t stale;				// 过期应答窗口, 秒为单位, 0表示不使用过期应答
+} dnsdb_fwdzone_t;
+
+// 视图, 由数据库文件中的$VIEW指令定义, 客户端地址属于视图的网段时, 视图中的记录覆盖同名的共享记录
+typedef struct dnsdb_view_t {
+	char name[HOST_MAX];		// 视图名
+	uint32_t prefix_count;		// 网段数量
+	lpm_prefix_t *prefixes;		// 网段
+	dnsdb_recs_t recs;			// 视图的域名记录, 即文件中以"@视图名"开头的记录行
+} dnsdb_view_t;
+
+// 文本格式中记录类型名称与类型值的对应关系
+static const struct { const char *name; uint16_t type; } _dns_types[] = {
+	{"A", DNS_QT_A}, {"NS", DNS_QT_NS}, {"CNAME", DNS_QT_CNAME},
+	{"MX", DNS_QT_MX}, {"TXT", DNS_QT_TXT}, {"SRV", DNS_QT_SRV}
+};
+
+// 数据库快照的摘要项, 每个域名及指令一项, 用于重新加载时统计改动
+typedef struct dnsdb_digest_t {
+	uint64_t key;				// 域名或指令名称的哈希值
+	uint64_t value;				// 内容的哈希值
+} dnsdb_digest_t;
+
+// 数据库快照, 一次加载的全部记录及指令, 重新加载时在后台线程生成新快照, 由服务线程整体替换
+typedef struct dnsdb_t {
+	dnsdb_recs_t recs;			// 域名记录
+	dnsdb_node_t **nodes;		// 标签树的节点哈希表, 根节点不存放, 顶级域名节点的父节点为NULL
+	uint32_t node_mask;			// 节点哈希桶数量减1
+	uint32_t node_count;		// 节点数量, 不含根节点
+	list_head_t zones;			// 区域配置链表
+	list_head_t fwdzones;		// 转发策略链表
+	uint32_t view_count;		// 视图数量
+	dnsdb_view_t views[VIEW_MAX];	// 视图
+	lpm_t *lpm;					// 客户端地址到视图序号加1的最长前缀匹配表, 没有定义网段时为NULL
+	uint32_t digest_count;		// 摘要项数量
+	dnsdb_digest_t *digests;	// 按key排序的摘要, 加载时生成, 之后不再改动
+} dnsdb_t;
+
+// 当前使用的数据库快照, 只由服务线程读取及替换
+static dnsdb_t *_db = NULL;
+// 后台线程加载完成、等待服务线程发布的快照, 加载失败时为NULL
+static dnsdb_t *_db_next = NULL;
+// 新快照相对当前快照新增、改动、删除的项数
+static uint32_t _diff[3];
+static pthread_t _reload_tid;
+static bool _reloading = false, _reload_again = false;
+static atomic_bool _reload_done;
+// 最近一次加载或保存时数据库文件的状态, 用于忽略自身保存引起的文件变化
+static struct stat _db_stat;
+// 后台线程开始解析时数据库文件的状态, 发布新快照时作为加载的文件状态
+static struct stat _next_stat;
+// 不属于任何已定义区域的域名使用的默认区域, 每次使用时按域名生成
+static dnsdb_zone_t _default_zone = { .ttl = DNS_TTL_DEFAULT, .ttl_min = 0,
+	.ttl_max = TTL_MAX, .neg_ttl = NEG_TTL_DEFAULT };
+// 当前请求的客户端所属视图的序号加1, 0表示只使用共享记录
+static uint32_t _view = 0;
 static bool _db_modified = false; // 数据库改动标志
 static char* _db_filename = NULL; // 数据库文件名
+static dnsdb_change_func _change_func = NULL; // 记录改动的回调接口
+
+// 动态修改的操作类型
+enum { DNSDB_OP_UPDATE, DNSDB_OP_DELETE, DNSDB_OP_RR_ADD, DNSDB_OP_RRSET_DELETE, DNSDB_OP_RR_DELETE };
+
+// 还没保存到文件的动态修改, 重新加载手工修改的文件后在新快照上重做, 保存成功后清空
+typedef struct dnsdb_journal_t {
+	LIST_FIELDS;
+	uint8_t op;					// 操作类型
+	uint16_t type;				// 记录类型
+	uint16_t rdlen;				// rdata长度
+	uint32_t val;				// 更新的ip或添加记录的生存时间
+	char host[HOST_MAX];		// 域名
+	uint8_t rdata[];			// rdata
+} dnsdb_journal_t;
+static LIST_HEAD(_journal);
+
+/** 根据类型名称获取类型值, 返回0表示不支持的类型 */
+static uint16_t dnsdb_type_parse(const char* name) {
+	for (size_t i = 0; i < sizeof(_dns_types) / sizeof(_dns_types[0]); ++i)
+		if (!strcasecmp(name, _dns_types[i].name))
+			return _dns_types[i].type;
+	return 0;
+}
+
+/** 根据类型值获取类型名称 */
+static const char* dnsdb_type_name(uint16_t type) {
+	for (size_t i = 0; i < sizeof(_dns_types) / sizeof(_dns_types[0]); ++i)
+		if (type == _dns_types[i].type)
+			return _dns_types[i].name;
+	return "UNKNOWN";
+}
+
+/** 读取一个以空白字符分隔的单词, 返回单词起始地址, 并将*text移动到单词之后 */
+static char* dnsdb_next_token(char** text) {
+	char *p = *text;
+	while (isspace((unsigned char) *p)) ++p;
+	if (!*p) return NULL;
+	char *start = p;
+	while (*p && !isspace((unsigned char) *p)) ++p;
+	if (*p) *p++ = '\0';
+	*text = p;
+	return start;
+}
+
+/** 将文本格式的rdata转换为报文格式
+ * @param type 记录类型
+ * @param text 文本格式的rdata内容
+ * @param dst 回写地址
+ * @return 写入长度, 0: 格式错误
+ */
+static uint16_t dnsdb_rdata_parse(uint16_t type, char* text, uint8_t dst[RDATA_MAX]) {
+	char *t1, *t2, *t3, *t4;
+	uint16_t len;
+	switch (type) {
+		case DNS_QT_A: {
+			uint32_t ip;
+			if (!(t1 = dnsdb_next_token(&text)) || (ip = inet_addr(t1)) == INADDR_NONE)
+				return 0;
+			memcpy(dst, &ip, 4);
+			return 4;
+		}
+		case DNS_QT_NS:
+		case DNS_QT_CNAME:
+			if (!(t1 = dnsdb_next_token(&text)) || strlen(t1) >= HOST_MAX)
+				return 0;
+			return dns_name_to_wire(t1, dst, RDATA_MAX);
+		case DNS_QT_MX:
+			if (!(t1 = dnsdb_next_token(&text)) || !(t2 = dnsdb_next_token(&text))
+					|| strlen(t2) >= HOST_MAX)
+				return 0;
+			*(uint16_t*)dst = htons((uint16_t) atoi(t1));
+			len = dns_name_to_wire(t2, dst + 2, RDATA_MAX - 2);
+			return len ? len + 2 : 0;
+		case DNS_QT_SRV:
+			if (!(t1 = dnsdb_next_token(&text)) || !(t2 = dnsdb_next_token(&text))
+					|| !(t3 = dnsdb_next_token(&text)) || !(t4 = dnsdb_next_token(&text))
+					|| strlen(t4) >= HOST_MAX)
+				return 0;
+			*(uint16_t*)dst = htons((uint16_t) atoi(t1));
+			*(uint16_t*)(dst + 2) = htons((uint16_t) atoi(t2));
+			*(uint16_t*)(dst + 4) = htons((uint16_t) atoi(t3));
+			len = dns_name_to_wire(t4, dst + 6, RDATA_MAX - 6);
+			return len ? len + 6 : 0;
+		case DNS_QT_TXT:
+			// 一个或多个字符串, 带空格的字符串需要使用双引号括起来
+			len = 0;
+			while (*text) {
+				while (isspace((unsigned char) *text)) ++text;
+				if (!*text) break;
+				char *s = text, *e;
+				if (*s == '"') {
+					e = strchr(++s, '"');
+					if (!e) return 0;
+					text = e + 1;
+				} else {
+					e = s;
+					while (*e && !isspace((unsigned char) *e)) ++e;
+					text = e;
+				}
+				size_t sl = e - s;
+				if (sl > 255 || len + sl + 1 > RDATA_MAX) return 0;
+				dst[len++] = (uint8_t) sl;
+				memcpy(dst + len, s, sl);
+				len += sl;
+			}
+			return len;
+	}
+	return 0;
+}
 
-static inline void dnsdb_append_rec(const char* host, size_t hlen, uint32_t ip) {
+/** 将报文格式的rdata转换为文本格式, 用于保存数据库
+ * @param type 记录类型
+ * @param rdata 报文格式的rdata
+ * @param rdlen rdata长度
+ * @param dst 回写地址
+ * @param dst_size 回写地址可写长度
+ */
+static void dnsdb_rdata_format(uint16_t type, const uint8_t* rdata, uint16_t rdlen,
+		char* dst, size_t dst_size) {
+	char name[HOST_MAX];
+	*dst = '\0';
+	switch (type) {
+		case DNS_QT_A:
+			snprintf(dst, dst_size, "%s", net_ip_tostring(*(const uint32_t*) rdata));
+			break;
+		case DNS_QT_NS:
+		case DNS_QT_CNAME:
+			if (dns_name_from_wire(rdata, rdlen, name))
+				snprintf(dst, dst_size, "%s", name);
+			break;
+		case DNS_QT_MX:
+			if (dns_name_from_wire(rdata + 2, rdlen - 2, name))
+				snprintf(dst, dst_size, "%u %s", ntohs(*(const uint16_t*) rdata), name);
+			break;
+		case DNS_QT_SRV:
+			if (dns_name_from_wire(rdata + 6, rdlen - 6, name))
+				snprintf(dst, dst_size, "%u %u %u %s", ntohs(*(const uint16_t*) rdata),
+						ntohs(*(const uint16_t*)(rdata + 2)), ntohs(*(const uint16_t*)(rdata + 4)), name);
+			break;
+		case DNS_QT_TXT: {
+			size_t pos = 0;
+			for (uint16_t i = 0; i < rdlen && pos + rdata[i] + 4 < dst_size; i += rdata[i] + 1)
+				pos += snprintf(dst + pos, dst_size - pos, "%s\"%.*s\"", pos ? " " : "",
+						(int) rdata[i], (const char*)(rdata + i + 1));
+			break;
+		}
+	}
+}
+
+bool dnsdb_txt_valid(const uint8_t* rdata, uint16_t rdlen) {
+	// 保存时每个字符串加双引号并以空格分隔, 整行要能放入行缓冲区, 留出视图名、域名及生存时间的长度
+	size_t text_len = 0;
+	if (!rdlen || rdlen > RDATA_MAX) return false;
+	for (uint16_t i = 0; i < rdlen; i += rdata[i] + 1) {
+		if (i + rdata[i] + 1 > rdlen) return false;
+		for (uint16_t j = i + 1; j <= i + rdata[i]; ++j)
+			if (rdata[j] < 0x20 || rdata[j] == 0x7F || rdata[j] == '"' || rdata[j] == '\\')
+				return false;
+		text_len += rdata[i] + 3;
+	}
+	return text_len <= LINE_MAX_LEN - HOST_MAX * 2 - 32;
+}
+
+/** 判断域名host是否等于zone或是zone的子域名 */
+static bool dnsdb_in_zone(const char* host, size_t hlen, const char* zone, size_t zlen) {
+	if (!zlen) return true;
+	if (hlen < zlen || strcasecmp(host + hlen - zlen, zone)) return false;
+	return hlen == zlen || host[hlen - zlen - 1] == '.';
+}
+
+/** 查找域名所属的区域, 有多个匹配时取最长的区域, 找不到时返回NULL */
+static dnsdb_zone_t* dnsdb_zone_find(dnsdb_t* db, const char* host) {
+	dnsdb_zone_t *pos, *best = NULL;
+	size_t hl = strlen(host), bl = 0;
+	list_foreach(pos, &db->zones) {
+		size_t zl = strlen(pos->name);
+		if ((!best || zl > bl) && dnsdb_in_zone(host, hl, pos->name, zl))
+			best = pos, bl = zl;
+	}
+	return best;
+}
+
+/** 按区域的上下限修正生存时间 */
+static inline uint32_t dnsdb_zone_clamp(const dnsdb_zone_t* zone, uint32_t ttl) {
+	return ttl < zone->ttl_min ? zone->ttl_min : ttl > zone->ttl_max ? zone->ttl_max : ttl;
+}
+
+/** 生成区域的预编码SOA记录, 记录的生存时间与minimum字段都使用否定应答缓存时间 */
+static void dnsdb_zone_build_soa(dnsdb_zone_t* zone) {
+	char mname[HOST_MAX + 16], rname[HOST_MAX + 16];
+	const char *dot = *zone->name ? "." : "";
+	if (*zone->mname) strcpy(mname, zone->mname);
+	else strcpy(mname, zone->name);
+	if (*zone->rname) strcpy(rname, zone->rname);
+	else sprintf(rname, "hostmaster%s%s", dot, zone->name);
+
+	uint8_t *p = zone->soa, *rd = p + DNS_RR_HEAD_LEN;
+	uint16_t n1 = dns_name_to_wire(mname, rd, HOST_MAX + 1);
+	uint16_t n2 = n1 ? dns_name_to_wire(rname, rd + n1, HOST_MAX + 1) : 0;
+	if (!n2) {
+		log_warn("%s fail: zone[%s] soa name too long", __func__, zone->name);
+		zone->soa_len = 0;
+		return;
+	}
+	uint32_t *v = (uint32_t*)(rd + n1 + n2);
+	v[0] = htonl(zone->serial);
+	v[1] = htonl(3600);			// refresh
+	v[2] = htonl(600);			// retry
+	v[3] = htonl(86400);		// expire
+	v[4] = htonl(zone->neg_ttl);	// minimum
+	*(uint16_t*) p = htons(DNS_QT_SOA);
+	*(uint16_t*)(p + 2) = htons(1);
+	*(uint32_t*)(p + 4) = htonl(zone->neg_ttl);
+	*(uint16_t*)(p + 8) = htons(n1 + n2 + 20);
+	zone->soa_len = DNS_RR_HEAD_LEN + n1 + n2 + 20;
+}
+
+/** 数据库改动后更新域名所属区域的SOA序列号 */
+static void dnsdb_zone_touch(const char* host) {
+	dnsdb_zone_t *zone = dnsdb_zone_find(_db, host);
+	if (zone) {
+		uint32_t now = (uint32_t) time(NULL);
+		zone->serial = now > zone->serial ? now : zone->serial + 1;
+		dnsdb_zone_build_soa(zone);
+	}
+}
+
+/** 解析$ZONE指令, 格式: $ZONE 区域名 [ttl=默认生存时间] [min=下限] [max=上限] [neg=否定应答缓存时间]
+ *      [mname=主域名服务器] [rname=管理员邮箱]
+ */
+static void dnsdb_parse_zone(dnsdb_t* db, char* text) {
+	char *name = dnsdb_next_token(&text), *opt;
+	if (!name || strlen(name) >= HOST_MAX) {
+		log_warn("$ZONE directive is invalid.");
+		return;
+	}
+	if (!strcmp(name, ".")) name = "";
+
+	dnsdb_zone_t *zone = calloc(1, sizeof(dnsdb_zone_t));
+	strcpy(zone->name, name);
+	zone->ttl = DNS_TTL_DEFAULT;
+	zone->ttl_max = TTL_MAX;
+	zone->neg_ttl = NEG_TTL_DEFAULT;
+	zone->serial = (uint32_t) time(NULL);
+
+	while ((opt = dnsdb_next_token(&text))) {
+		char *val = strchr(opt, '=');
+		if (!val || strlen(val + 1) >= HOST_MAX) {
+			log_warn("zone[%s] option[%s] is invalid.", name, opt);
+			continue;
+		}
+		*val++ = '\0';
+		if (!strcmp(opt, "ttl")) zone->ttl = (uint32_t) strtoul(val, NULL, 10);
+		else if (!strcmp(opt, "min")) zone->ttl_min = (uint32_t) strtoul(val, NULL, 10);
+		else if (!strcmp(opt, "max")) zone->ttl_max = (uint32_t) strtoul(val, NULL, 10);
+		else if (!strcmp(opt, "neg")) zone->neg_ttl = (uint32_t) strtoul(val, NULL, 10);
+		else if (!strcmp(opt, "mname")) strcpy(zone->mname, val);
+		else if (!strcmp(opt, "rname")) strcpy(zone->rname, val);
+		else log_warn("zone[%s] option[%s] unsupport.", name, opt);
+	}
+	if (zone->ttl_max > TTL_MAX) zone->ttl_max = TTL_MAX;
+	if (zone->ttl_min > zone->ttl_max) zone->ttl_min = zone->ttl_max;
+	zone->neg_ttl = dnsdb_zone_clamp(zone, zone->neg_ttl);
+
+	dnsdb_zone_build_soa(zone);
+	list_add_tail((list_head_t*) zone, &db->zones);
+	log_trace("read zone %s ttl=%u, min=%u, max=%u, neg=%u", zone->name, zone->ttl,
+			zone->ttl_min, zone->ttl_max, zone->neg_ttl);
+}
+
+/** 把区域配置写入文件, 只写入与默认值不同的选项 */
+static void dnsdb_save_zone(FILE* fp, const dnsdb_zone_t* zone) {
+	fprintf(fp, "$ZONE %s", *zone->name ? zone->name : ".");
+	if (zone->ttl != DNS_TTL_DEFAULT) fprintf(fp, " ttl=%u", zone->ttl);
+	if (zone->ttl_min) fprintf(fp, " min=%u", zone->ttl_min);
+	if (zone->ttl_max != TTL_MAX) fprintf(fp, " max=%u", zone->ttl_max);
+	if (zone->neg_ttl != NEG_TTL_DEFAULT) fprintf(fp, " neg=%u", zone->neg_ttl);
+	if (*zone->mname) fprintf(fp, " mname=%s", zone->mname);
+	if (*zone->rname) fprintf(fp, " rname=%s", zone->rname);
+	fputc('\n', fp);
+}
+
+/** 解析$FORWARD指令, 格式: $FORWARD 域名后缀 [prefetch=预取阈值百分比] [stale=过期应答窗口秒数] */
+static void dnsdb_parse_fwdzone(dnsdb_t* db, char* text) {
+	char *name = dnsdb_next_token(&text), *opt;
+	if (!name || strlen(name) >= HOST_MAX) {
+		log_warn("$FORWARD directive is invalid.");
+		return;
+	}
+	if (!strcmp(name, ".")) name = "";
+
+	dnsdb_fwdzone_t *fz = calloc(1, sizeof(dnsdb_fwdzone_t));
+	strcpy(fz->name, name);
+	fz->prefetch = PREFETCH_DEFAULT;
+
+	while ((opt = dnsdb_next_token(&text))) {
+		char *val = strchr(opt, '=');
+		if (!val) {
+			log_warn("forward[%s] option[%s] is invalid.", name, opt);
+			continue;
+		}
+		*val++ = '\0';
+		unsigned long v = strtoul(val, NULL, 10);
+		if (!strcmp(opt, "prefetch")) fz->prefetch = (uint8_t) (v > 99 ? 99 : v);
+		else if (!strcmp(opt, "stale")) fz->stale = (uint32_t) (v > TTL_MAX ? TTL_MAX : v);
+		else log_warn("forward[%s] option[%s] unsupport.", name, opt);
+	}
+
+	list_add_tail((list_head_t*) fz, &db->fwdzones);
+	log_trace("read forward %s prefetch=%u, stale=%u", fz->name, fz->prefetch, fz->stale);
+}
+
+/** 把转发策略写入文件, 只写入与默认值不同的选项 */
+static void dnsdb_save_fwdzone(FILE* fp, const dnsdb_fwdzone_t* fz) {
+	fprintf(fp, "$FORWARD %s", *fz->name ? fz->name : ".");
+	if (fz->prefetch != PREFETCH_DEFAULT) fprintf(fp, " prefetch=%u", fz->prefetch);
+	if (fz->stale) fprintf(fp, " stale=%u", fz->stale);
+	fputc('\n', fp);
+}
+
+/** 按名称查找视图, 找不到时返回NULL */
+static dnsdb_view_t* dnsdb_view_find(dnsdb_t* db, const char* name) {
+	for (uint32_t i = 0; i < db->view_count; ++i)
+		if (!strcmp(db->views[i].name, name))
+			return db->views + i;
+	return NULL;
+}
+
+/** 解析$VIEW指令, 格式: $VIEW 视图名 网段..., 网段格式为a.b.c.d/len, 同名视图的网段合并,
+ *  同一网段属于多个视图时, 以后定义的为准
+ */
+static void dnsdb_parse_view(dnsdb_t* db, char* text) {
+	char *name = dnsdb_next_token(&text), *tok;
+	if (!name || strlen(name) >= HOST_MAX) {
+		log_warn("$VIEW directive is invalid.");
+		return;
+	}
+	dnsdb_view_t *v = dnsdb_view_find(db, name);
+	if (!v) {
+		if (db->view_count >= VIEW_MAX) {
+			log_warn("view[%s] is ignored, max %d views.", name, VIEW_MAX);
+			return;
+		}
+		v = db->views + db->view_count++;
+		strcpy(v->name, name);
+	}
+
+	while ((tok = dnsdb_next_token(&text))) {
+		lpm_prefix_t p;
+		if (!lpm_parse(tok, &p)) {
+			log_warn("view[%s] subnet[%s] is invalid.", name, tok);
+			continue;
+		}
+		p.value = (uint16_t) (v - db->views + 1);
+		v->prefixes = realloc(v->prefixes, (v->prefix_count + 1) * sizeof(lpm_prefix_t));
+		v->prefixes[v->prefix_count++] = p;
+	}
+	log_trace("read view %s subnets=%u", v->name, v->prefix_count);
+}
+
+/** 把视图配置写入文件 */
+static void dnsdb_save_view(FILE* fp, const dnsdb_view_t* v) {
+	fprintf(fp, "$VIEW %s", v->name);
+	for (uint32_t i = 0; i < v->prefix_count; ++i)
+		fprintf(fp, " %s/%u", net_ip_tostring(htonl(v->prefixes[i].ip)), v->prefixes[i].len);
+	fputc('\n', fp);
+}
+
+/** 使用全部视图的网段生成客户端地址的最长前缀匹配表 */
+static void dnsdb_view_build(dnsdb_t* db) {
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < db->view_count; ++i)
+		n += db->views[i].prefix_count;
+	if (!n) return;
+	lpm_prefix_t *all = malloc(n * sizeof(lpm_prefix_t)), *p = all;
+	for (uint32_t i = 0; i < db->view_count; ++i) {
+		memcpy(p, db->views[i].prefixes, db->views[i].prefix_count * sizeof(lpm_prefix_t));
+		p += db->views[i].prefix_count;
+	}
+	db->lpm = lpm_build(all, n);
+	free(all);
+}
+
+/** 计算数据的哈希值, FNV-1a算法, h为上一段数据的哈希值 */
+static uint64_t dnsdb_hash(uint64_t h, const void* data, size_t len) {
+	for (const uint8_t *p = data, *pe = p + len; p < pe; ++p)
+		h = (h ^ *p) * 1099511628211ULL;
+	return h;
+}
+
+#define DNSDB_HASH_INIT 14695981039346656037ULL
+
+/** 初始化域名记录集合, 索引的哈希桶数量为不小于n的2的幂 */
+static void dnsdb_recs_init(dnsdb_recs_t* recs, uint32_t n) {
+	uint32_t size = INDEX_INIT;
+	while (size < n) size <<= 1;
+	list_head_init(&recs->list);
+	recs->buckets = calloc(size, sizeof(dnsdb_rec_t*));
+	recs->mask = size - 1;
+	recs->count = 0;
+}
+
+/** 把域名记录加入索引, 数量超过哈希桶的2倍时桶数量翻倍 */
+static void dnsdb_index_add(dnsdb_recs_t* recs, dnsdb_rec_t* rec) {
+	if (recs->count >= (recs->mask + 1) << 1) {
+		uint32_t size = (recs->mask + 1) << 1;
+		dnsdb_rec_t **buckets = calloc(size, sizeof(dnsdb_rec_t*));
+		for (uint32_t i = 0; i <= recs->mask; ++i) {
+			for (dnsdb_rec_t *r = recs->buckets[i], *next; r; r = next) {
+				next = r->hnext;
+				r->hnext = buckets[r->hash & (size - 1)];
+				buckets[r->hash & (size - 1)] = r;
+			}
+		}
+		free(recs->buckets);
+		recs->buckets = buckets;
+		recs->mask = size - 1;
+	}
+	dnsdb_rec_t **b = recs->buckets + (rec->hash & recs->mask);
+	rec->hnext = *b;
+	*b = rec;
+	++recs->count;
+}
+
+/** 从索引及链表中删除域名记录 */
+static void dnsdb_index_del(dnsdb_recs_t* recs, dnsdb_rec_t* rec) {
+	dnsdb_rec_t **pp = recs->buckets + (rec->hash & recs->mask);
+	while (*pp != rec) pp = &(*pp)->hnext;
+	*pp = rec->hnext;
+	list_del((list_head_t*) rec);
+	--recs->count;
+}
+
+static inline dnsdb_rec_t* dnsdb_append_rec(dnsdb_recs_t* recs, const char* host, size_t hlen) {
 	dnsdb_rec_t *r = malloc(sizeof(dnsdb_rec_t));
 	memcpy(r->host, host, hlen + 1);
-	r->ip = ip;
-	list_add_tail((list_head_t*) r, &_dns_recs);
+	r->hash = (uint32_t) dnsdb_hash(DNSDB_HASH_INIT, host, hlen);
+	r->rrsets = NULL;
+	r->node = NULL;
+	list_add_tail((list_head_t*) r, &recs->list);
+	dnsdb_index_add(recs, r);
+	return r;
 }
 
-static inline dnsdb_rec_t* dnsdb_get(const char* host, size_t hlen) {
-	if (++hlen <= HOST_MAX) {
-		dnsdb_rec_t *pos;
-		list_foreach(pos, &_dns_recs) {
-			if (!memcmp(pos->host, host, hlen))
-				return pos;
+static inline dnsdb_rec_t* dnsdb_get(dnsdb_recs_t* recs, const char* host, size_t hlen) {
+	if (hlen < HOST_MAX) {
+		uint32_t hash = (uint32_t) dnsdb_hash(DNSDB_HASH_INIT, host, hlen);
+		for (dnsdb_rec_t *r = recs->buckets[hash & recs->mask]; r; r = r->hnext) {
+			if (r->hash == hash && !memcmp(r->host, host, hlen + 1))
+				return r;
 		}
 	} else {
 		log_warn("%s fail: host[%s] too long", __func__, host);
@@ -44,47 +624,864 @@ static inline dnsdb_rec_t* dnsdb_get(const char* host, size_t hlen) {
 	return NULL;
 }
 
-bool dnsdb_load(const char* filename) {
-	if (_db_filename) {
-		log_error("%s error: %s already load!", __func__, filename);
+/** 计算标签树节点的哈希值 */
+static inline uint32_t dnsdb_node_hash(const dnsdb_node_t* parent, const char* label, size_t len) {
+	return (uint32_t) dnsdb_hash(dnsdb_hash(DNSDB_HASH_INIT, &parent, sizeof(parent)), label, len);
+}
+
+/** 初始化标签树, 节点哈希桶数量为不小于n的2的幂 */
+static void dnsdb_trie_init(dnsdb_t* db, uint32_t n) {
+	uint32_t size = INDEX_INIT;
+	while (size < n) size <<= 1;
+	db->nodes = calloc(size, sizeof(dnsdb_node_t*));
+	db->node_mask = size - 1;
+	db->node_count = 0;
+}
+
+/** 查找标签树的子节点, parent为NULL时查找顶级域名节点 */
+static dnsdb_node_t* dnsdb_node_child(const dnsdb_t* db, const dnsdb_node_t* parent, const char* label, size_t len) {
+	uint32_t hash = dnsdb_node_hash(parent, label, len);
+	for (dnsdb_node_t *n = db->nodes[hash & db->node_mask]; n; n = n->hnext)
+		if (n->hash == hash && n->parent == parent && n->len == len && !memcmp(n->label, label, len))
+			return n;
+	return NULL;
+}
+
+/** 查找或创建标签树的子节点, 数量超过哈希桶的2倍时桶数量翻倍 */
+static dnsdb_node_t* dnsdb_node_add(dnsdb_t* db, dnsdb_node_t* parent, const char* label, size_t len) {
+	dnsdb_node_t *n = dnsdb_node_child(db, parent, label, len);
+	if (n) return n;
+
+	if (db->node_count >= (db->node_mask + 1) << 1) {
+		uint32_t size = (db->node_mask + 1) << 1;
+		dnsdb_node_t **nodes = calloc(size, sizeof(dnsdb_node_t*));
+		for (uint32_t i = 0; i <= db->node_mask; ++i) {
+			for (dnsdb_node_t *x = db->nodes[i], *next; x; x = next) {
+				next = x->hnext;
+				x->hnext = nodes[x->hash & (size - 1)];
+				nodes[x->hash & (size - 1)] = x;
+			}
+		}
+		free(db->nodes);
+		db->nodes = nodes;
+		db->node_mask = size - 1;
 	}
-	FILE* fp = fopen(filename, "r");
-	if (!fp) {
-		fp = fopen(filename, "w");
-		if (!fp) {
-			log_error("%s error: can't open file %s!", __func__, filename);
-			return false;
+
+	n = malloc(sizeof(dnsdb_node_t) + len);
+	n->parent = parent;
+	n->rec = NULL;
+	n->hash = dnsdb_node_hash(parent, label, len);
+	n->children = 0;
+	n->len = (uint8_t) len;
+	memcpy(n->label, label, len);
+	dnsdb_node_t **b = db->nodes + (n->hash & db->node_mask);
+	n->hnext = *b;
+	*b = n;
+	++db->node_count;
+	if (parent) ++parent->children;
+	return n;
+}
+
+/** 从右向左取出域名的下一级标签, 返回标签起始位置, end回写为下一次调用的结束位置, 没有标签时返回NULL */
+static inline const char* dnsdb_prev_label(const char* host, const char** end) {
+	if (*end <= host) return NULL;
+	const char *p = *end;
+	while (p > host && p[-1] != '.') --p;
+	const char *label = p;
+	*end = p > host ? p - 1 : host;
+	return label;
+}
+
+/** 把记录加入标签树, 创建路径上缺少的节点 */
+static void dnsdb_trie_add(dnsdb_t* db, dnsdb_rec_t* rec) {
+	dnsdb_node_t *n = NULL;
+	const char *end = rec->host + strlen(rec->host), *le = end, *label;
+	while ((label = dnsdb_prev_label(rec->host, &end))) {
+		n = dnsdb_node_add(db, n, label, le - label);
+		le = end;
+	}
+	if (n) {
+		n->rec = rec;
+		rec->node = n;
+	}
+}
+
+/** 从标签树中删除记录, 同时删除不再有记录及子节点的路径 */
+static void dnsdb_trie_del(dnsdb_t* db, dnsdb_rec_t* rec) {
+	dnsdb_node_t *n = rec->node;
+	if (!n) return;
+	n->rec = NULL;
+	rec->node = NULL;
+	while (n && !n->rec && !n->children) {
+		dnsdb_node_t *parent = n->parent, **pp = db->nodes + (n->hash & db->node_mask);
+		while (*pp != n) pp = &(*pp)->hnext;
+		*pp = n->hnext;
+		--db->node_count;
+		if (parent) --parent->children;
+		free(n);
+		n = parent;
+	}
+}
+
+/** 在标签树中查找域名的最近祖先, 即存在的最长后缀节点(RFC 4592的closest encloser), 查找次数与标签数量成正比
+ * @param exact 回写域名本身是否存在节点
+ * @return 最近祖先节点, NULL表示顶级域名也不存在
+ */
+static const dnsdb_node_t* dnsdb_trie_encloser(const dnsdb_t* db, const char* host, size_t hlen, bool* exact) {
+	const dnsdb_node_t *n = NULL;
+	const char *end = host + hlen, *le = end, *label;
+	*exact = false;
+	while ((label = dnsdb_prev_label(host, &end))) {
+		const dnsdb_node_t *c = dnsdb_node_child(db, n, label, le - label);
+		if (!c) return n;
+		n = c;
+		le = end;
+	}
+	*exact = n != NULL;
+	return n;
+}
+
+/** 获取域名指定类型的记录集 */
+static inline dnsdb_rrset_t* dnsdb_rrset_get(const dnsdb_rec_t* rec, uint16_t type) {
+	for (dnsdb_rrset_t *rs = rec->rrsets; rs; rs = rs->next)
+		if (rs->type == type)
+			return rs;
+	return NULL;
+}
+
+/** 获取域名指定类型的记录集, 不存在则创建 */
+static dnsdb_rrset_t* dnsdb_rrset_add(dnsdb_rec_t* rec, uint16_t type) {
+	dnsdb_rrset_t *rs = dnsdb_rrset_get(rec, type);
+	if (!rs) {
+		rs = calloc(1, sizeof(dnsdb_rrset_t));
+		rs->type = type;
+		rs->next = rec->rrsets;
+		rec->rrsets = rs;
+	}
+	return rs;
+}
+
+/** 生成平滑加权轮转的调度表, 权重高的记录按比例更多地排在第一位, 且分布均匀 */
+static void dnsdb_rrset_build_sched(dnsdb_rrset_t* rs) {
+	free(rs->sched);
+	rs->sched = NULL;
+	rs->sched_len = 0;
+	if (!rs->weights) return;
+
+	int total = 0, cur[rs->count];
+	for (uint16_t i = 0; i < rs->count; ++i) {
+		total += rs->weights[i];
+		cur[i] = 0;
+	}
+	rs->sched = malloc(total * sizeof(uint16_t));
+	for (int n = 0; n < total; ++n) {
+		uint16_t best = 0;
+		for (uint16_t i = 0; i < rs->count; ++i) {
+			cur[i] += rs->weights[i];
+			if (cur[i] > cur[best]) best = i;
 		}
+		cur[best] -= total;
+		rs->sched[n] = best;
 	}
+	rs->sched_len = (uint16_t) total;
+}
+
+/** 往记录集中追加一条记录, 按应答报文格式预编码
+ * @param rs 记录集
+ * @param rdata 报文格式的rdata
+ * @param rdlen rdata长度
+ * @param ttl 记录的生存时间
+ * @param weight 加权轮转的权重, 1为默认权重
+ */
+static bool dnsdb_rrset_append(dnsdb_rrset_t* rs, const uint8_t* rdata, uint16_t rdlen,
+		uint32_t ttl, uint8_t weight) {
+	uint32_t nlen = rs->len + DNS_RR_HEAD_LEN + rdlen;
+	if (nlen > DNS_EDNS_MAX) {
+		log_warn("%s fail: rrset type[%u] too large", __func__, rs->type);
+		return false;
+	}
+	rs->data = realloc(rs->data, nlen);
+	uint8_t *p = rs->data + rs->len;
+	*(uint16_t*) p = htons(rs->type);
+	*(uint16_t*)(p + 2) = htons(1);
+	*(uint32_t*)(p + 4) = htonl(ttl);
+	*(uint16_t*)(p + 8) = htons(rdlen);
+	memcpy(p + DNS_RR_HEAD_LEN, rdata, rdlen);
+	rs->len = (uint16_t) nlen;
+	rs->count++;
+
+	// 有非默认权重时才需要权重表及调度表
+	if (weight != 1 && !rs->weights) {
+		rs->weights = malloc(rs->count);
+		memset(rs->weights, 1, rs->count);
+	}
+	if (rs->weights) {
+		rs->weights = realloc(rs->weights, rs->count);
+		rs->weights[rs->count - 1] = weight;
+		dnsdb_rrset_build_sched(rs);
+	}
+	return true;
+}
 
-	char host[HOST_MAX], ip[HOST_MAX];
-	uint32_t ip_num;
+/** 清空记录集的所有记录 */
+static void dnsdb_rrset_clear(dnsdb_rrset_t* rs) {
+	free(rs->weights);
+	free(rs->sched);
+	rs->weights = NULL;
+	rs->sched = NULL;
+	rs->len = rs->count = rs->sched_len = 0;
+}
 
-	while (fscanf(fp, SCAN_FMT, host, ip) == 2) {
-		log_trace("read record host=%s, ip=%s", host, ip);
+/** 释放记录集 */
+static void dnsdb_rrset_free(dnsdb_rrset_t* rs) {
+	dnsdb_rrset_clear(rs);
+	free(rs->data);
+	free(rs);
+}
+
+/** 释放域名记录及其所有记录集 */
+static void dnsdb_rec_free(dnsdb_rec_t* rec) {
+	for (dnsdb_rrset_t *rs = rec->rrsets, *next; rs; rs = next) {
+		next = rs->next;
+		dnsdb_rrset_free(rs);
+	}
+	free(rec);
+}
 
-		ip_num = inet_addr(ip);
-		if (ip_num == INADDR_NONE) {
-			log_warn("host[%s], ip[%s] is invalid.", host, ip);
+/** 解析文本格式数据库的一行记录并加入数据库
+ *  格式: [@视图名] 域名 [生存时间] [类型] 记录内容, 省略类型时为A记录, 兼容旧的"域名 ip"格式,
+ *  省略生存时间时使用所属区域的默认值, 以$开头的行为指令, recs为NULL时只解析指令, 否则只解析记录,
+ *  recs[0]存放共享记录, recs[1 + i]存放第i个视图的记录, 例如:
+ *      $ZONE a.com ttl=300 min=30 max=86400 neg=60
+ *      $FORWARD . prefetch=10 stale=86400
+ *      $VIEW lan 192.168.0.0/16 10.0.0.0/8
+ *      www.a.com 1.2.3.4
+ *      @lan www.a.com 192.168.1.4
+ *      www.a.com 600 A 1.2.3.5 3  (A记录可在末尾指定加权轮转的权重, 默认为1)
+ *      a.com MX 10 mail.a.com
+ *      a.com TXT "v=spf1 -all"
+ *      _sip._tcp.a.com SRV 10 60 5060 sip.a.com
+ */
+static void dnsdb_parse_line(dnsdb_t* db, dnsdb_recs_t* recs, char* line) {
+	char *text = line, *host, *tok;
+	if (!(host = dnsdb_next_token(&text)) || *host == '#' || *host == ';')
+		return;
+	// 指令在预扫描时解析, 解析记录时跳过
+	if (*host == '$') {
+		if (recs) return;
+		if (!strcasecmp(host, "$ZONE")) dnsdb_parse_zone(db, text);
+		else if (!strcasecmp(host, "$FORWARD")) dnsdb_parse_fwdzone(db, text);
+		else if (!strcasecmp(host, "$VIEW")) dnsdb_parse_view(db, text);
+		else log_warn("directive[%s] unsupport.", host);
+		return;
+	}
+	if (!recs) return;
+	// 以@视图名开头的记录属于视图
+	if (*host == '@') {
+		const dnsdb_view_t *v = dnsdb_view_find(db, host + 1);
+		if (!v) {
+			log_warn("view[%s] is undefined.", host + 1);
+			return;
+		}
+		recs += 1 + (v - db->views);
+		if (!(host = dnsdb_next_token(&text))) {
+			log_warn("view[%s] record is invalid.", v->name);
+			return;
+		}
+	}
+	if (!(tok = dnsdb_next_token(&text))) {
+		log_warn("host[%s] record is invalid.", host);
+		return;
+	}
+
+	// 第二项是纯数字时为生存时间
+	const dnsdb_zone_t *zone = dnsdb_zone_find(db, host);
+	uint32_t ttl = zone ? zone->ttl : DNS_TTL_DEFAULT;
+	if (strspn(tok, "0123456789") == strlen(tok)) {
+		ttl = (uint32_t) strtoul(tok, NULL, 10);
+		if (!(tok = dnsdb_next_token(&text))) {
+			log_warn("host[%s] record is invalid.", host);
+			return;
+		}
+	}
+	if (zone) ttl = dnsdb_zone_clamp(zone, ttl);
+	log_trace("read record host=%s, ttl=%u, type=%s, data=%s", host, ttl, tok, text);
+
+	// 第二项不是类型名称时, 是旧格式的A记录
+	uint16_t type = dnsdb_type_parse(tok);
+	if (!type) {
+		type = DNS_QT_A;
+		text = tok;
+	}
+
+	size_t hl = strlen(host);
+	if (!dnsdb_host_valid(host, true)) {
+		log_warn("host[%s] is invalid.", host);
+		return;
+	}
+
+	// A记录ip之后的可选数字为权重
+	int weight = 1;
+	if (type == DNS_QT_A) {
+		char *ip = dnsdb_next_token(&text), *w = ip ? dnsdb_next_token(&text) : NULL;
+		if (w && ((weight = atoi(w)) < 1 || weight > WEIGHT_MAX)) {
+			log_warn("host[%s], weight[%s] is invalid, must be 1-%d.", host, w, WEIGHT_MAX);
+			weight = 1;
+		}
+		text = ip ? ip : text;
+	}
+
+	uint8_t rdata[RDATA_MAX];
+	uint16_t rdlen = dnsdb_rdata_parse(type, text, rdata);
+	if (!rdlen) {
+		log_warn("host[%s], type[%s], data[%s] is invalid.", host, dnsdb_type_name(type), text);
+		return;
+	}
+
+	dnsdb_rec_t *rec = dnsdb_get(recs, host, hl);
+	if (!rec) rec = dnsdb_append_rec(recs, host, hl);
+	dnsdb_rrset_append(dnsdb_rrset_add(rec, type), rdata, rdlen, ttl, (uint8_t) weight);
+}
+
+static int dnsdb_digest_cmp(const void* a, const void* b) {
+	uint64_t x = ((const dnsdb_digest_t*) a)->key, y = ((const dnsdb_digest_t*) b)->key;
+	return x < y ? -1 : x > y;
+}
+
+/** 生成域名记录的摘要项, 视图的记录以视图名作为哈希的初始值, 与同名的共享记录区分
+ * @return 下一个摘要项的地址
+ */
+static dnsdb_digest_t* dnsdb_digest_recs(dnsdb_digest_t* d, const dnsdb_recs_t* recs, uint64_t seed) {
+	dnsdb_rec_t *rec;
+	list_foreach(rec, &recs->list) {
+		d->key = dnsdb_hash(seed, rec->host, strlen(rec->host));
+		d->value = 0;
+		for (const dnsdb_rrset_t *rs = rec->rrsets; rs; rs = rs->next) {
+			uint64_t h = dnsdb_hash(DNSDB_HASH_INIT, &rs->type, sizeof(rs->type));
+			h = dnsdb_hash(h, rs->data, rs->len);
+			if (rs->weights) h = dnsdb_hash(h, rs->weights, rs->count);
+			d->value += h;
+		}
+		++d;
+	}
+	return d;
+}
+
+/** 生成快照的摘要, 域名不区分记录集的先后顺序, 区域不包含随时间变化的SOA序列号 */
+static void dnsdb_digest_build(dnsdb_t* db) {
+	uint32_t n = db->recs.count + db->view_count;
+	list_head_t *it;
+	list_foreach(it, &db->zones) ++n;
+	list_foreach(it, &db->fwdzones) ++n;
+	for (uint32_t i = 0; i < db->view_count; ++i)
+		n += db->views[i].recs.count;
+	dnsdb_digest_t *d = db->digests = malloc((n ? n : 1) * sizeof(dnsdb_digest_t));
+	db->digest_count = n;
+
+	d = dnsdb_digest_recs(d, &db->recs, DNSDB_HASH_INIT);
+	for (uint32_t i = 0; i < db->view_count; ++i) {
+		const dnsdb_view_t *v = db->views + i;
+		d = dnsdb_digest_recs(d, &v->recs, dnsdb_hash(dnsdb_hash(DNSDB_HASH_INIT, "@", 1), v->name, strlen(v->name)));
+		d->key = dnsdb_hash(dnsdb_hash(DNSDB_HASH_INIT, "$VIEW", 5), v->name, strlen(v->name));
+		d->value = DNSDB_HASH_INIT;
+		for (uint32_t j = 0; j < v->prefix_count; ++j) {
+			d->value = dnsdb_hash(d->value, &v->prefixes[j].ip, sizeof(v->prefixes[j].ip));
+			d->value = dnsdb_hash(d->value, &v->prefixes[j].len, sizeof(v->prefixes[j].len));
+		}
+		++d;
+	}
+	dnsdb_zone_t *zone;
+	list_foreach(zone, &db->zones) {
+		uint32_t v[] = { zone->ttl, zone->ttl_min, zone->ttl_max, zone->neg_ttl };
+		d->key = dnsdb_hash(dnsdb_hash(DNSDB_HASH_INIT, "$ZONE", 5), zone->name, strlen(zone->name));
+		d->value = dnsdb_hash(DNSDB_HASH_INIT, v, sizeof(v));
+		d->value = dnsdb_hash(d->value, zone->mname, strlen(zone->mname) + 1);
+		d->value = dnsdb_hash(d->value, zone->rname, strlen(zone->rname) + 1);
+		++d;
+	}
+	dnsdb_fwdzone_t *fz;
+	list_foreach(fz, &db->fwdzones) {
+		d->key = dnsdb_hash(dnsdb_hash(DNSDB_HASH_INIT, "$FORWARD", 8), fz->name, strlen(fz->name));
+		d->value = dnsdb_hash(dnsdb_hash(DNSDB_HASH_INIT, &fz->prefetch, 1), &fz->stale, sizeof(fz->stale));
+		++d;
+	}
+	qsort(db->digests, n, sizeof(dnsdb_digest_t), dnsdb_digest_cmp);
+}
+
+/** 比较两个快照的摘要, 统计新增、改动、删除的项数 */
+static void dnsdb_diff(const dnsdb_t* old, const dnsdb_t* db, uint32_t dst[3]) {
+	uint32_t i = 0, j = 0;
+	dst[0] = dst[1] = dst[2] = 0;
+	while (i < old->digest_count || j < db->digest_count) {
+		if (j >= db->digest_count || (i < old->digest_count && old->digests[i].key < db->digests[j].key)) {
+			++dst[2], ++i;
+		} else if (i >= old->digest_count || db->digests[j].key < old->digests[i].key) {
+			++dst[0], ++j;
 		} else {
-			size_t hl = strlen(host) + 1;
-			if (hl > HOST_MAX) {
-				hl = HOST_MAX;
-				host[HOST_MAX - 1] = '\0';
-			}
-			dnsdb_append_rec(host, hl, ip_num);
+			if (old->digests[i].value != db->digests[j].value) ++dst[1];
+			++i, ++j;
+		}
+	}
+}
+
+/** 释放域名记录集合的全部记录及索引 */
+static void dnsdb_recs_free(dnsdb_recs_t* recs) {
+	list_head_t *pos, *tmp;
+	list_foreach_reverse_safe(pos, tmp, &recs->list) {
+		dnsdb_rec_free((dnsdb_rec_t*) pos);
+	}
+	free(recs->buckets);
+}
+
+/** 释放快照的全部内存 */
+static void dnsdb_db_free(dnsdb_t* db) {
+	list_head_t *pos, *tmp;
+	dnsdb_recs_free(&db->recs);
+	for (uint32_t i = 0; i < db->view_count; ++i) {
+		if (db->views[i].recs.buckets) dnsdb_recs_free(&db->views[i].recs);
+		free(db->views[i].prefixes);
+	}
+	lpm_free(db->lpm);
+	for (uint32_t i = 0; i <= db->node_mask; ++i) {
+		for (dnsdb_node_t *n = db->nodes[i], *next; n; n = next) {
+			next = n->hnext;
+			free(n);
 		}
 	}
+	free(db->nodes);
+	list_foreach_reverse_safe(pos, tmp, &db->zones) {
+		free(pos);
+	}
+	list_foreach_reverse_safe(pos, tmp, &db->fwdzones) {
+		free(pos);
+	}
+	free(db->digests);
+	free(db);
+}
+
+// 并行加载的分块, 每个线程解析一块, 完成后按文件中的顺序合并
+typedef struct dnsdb_chunk_t {
+	dnsdb_t *db;				// 已解析全部指令的快照, 解析记录时只读
+	const char *begin, *end;	// 分块的文件内容, 以换行结束
+	dnsdb_recs_t recs[1 + VIEW_MAX];	// 解析出的共享记录及各视图的记录
+} dnsdb_chunk_t;
 
+/** 把文件内容映射到内存, linux下使用mmap, 其它平台读入内存, 空文件返回长度为0的空串 */
+static const char* dnsdb_map(const char* filename, size_t* size) {
+#ifdef _WIN32
+	FILE *fp = fopen(filename, "rb");
+	if (!fp) return NULL;
+	fseek(fp, 0, SEEK_END);
+	long n = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	char *data = malloc(n > 0 ? n : 1);
+	*size = n > 0 ? fread(data, 1, n, fp) : 0;
 	fclose(fp);
+	return data;
+#else
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd == -1) return NULL;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : (void*) "";
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+	if (st.st_size) madvise(data, st.st_size, MADV_SEQUENTIAL);
+	return data;
+#endif
+}
+
+/** 释放dnsdb_map映射的内存 */
+static void dnsdb_unmap(const char* data, size_t size) {
+#ifdef _WIN32
+	free((void*) data);
+#else
+	if (size) munmap((void*) data, size);
+#endif
+}
+
+/** 复制一行到缓冲区, 超长的行截断, 返回下一行的起始位置 */
+static const char* dnsdb_next_line(const char* p, const char* end, char line[LINE_MAX_LEN]) {
+	const char *nl = memchr(p, '\n', end - p), *le = nl ? nl : end;
+	size_t n = le - p < LINE_MAX_LEN ? (size_t) (le - p) : LINE_MAX_LEN - 1;
+	memcpy(line, p, n);
+	line[n] = '\0';
+	return nl ? nl + 1 : end;
+}
+
+/** 解析分块中的记录, 并行加载的线程入口 */
+static void* dnsdb_parse_chunk(void* arg) {
+	dnsdb_chunk_t *c = arg;
+	char line[LINE_MAX_LEN];
+	for (uint32_t i = 0; i <= c->db->view_count; ++i)
+		dnsdb_recs_init(c->recs + i, 0);
+	for (const char *p = c->begin; p < c->end;) {
+		p = dnsdb_next_line(p, c->end, line);
+		dnsdb_parse_line(c->db, c->recs, line);
+	}
+	return NULL;
+}
+
+/** 把分块的域名记录按顺序合并到快照, 共享记录同时加入标签树, 同一域名出现在多个分块时, 后面分块的记录追加到已有的记录集 */
+static void dnsdb_merge(dnsdb_t* db, dnsdb_recs_t* dst, dnsdb_recs_t* src) {
+	list_head_t *pos, *tmp;
+	list_foreach_safe(pos, tmp, &src->list) {
+		dnsdb_rec_t *rec = (dnsdb_rec_t*) pos, *old = dnsdb_get(dst, rec->host, strlen(rec->host));
+		if (!old) {
+			list_add_tail(pos, &dst->list);
+			dnsdb_index_add(dst, rec);
+			if (dst == &db->recs) dnsdb_trie_add(db, rec);
+			continue;
+		}
+		for (dnsdb_rrset_t *rs = rec->rrsets, *next; rs; rs = next) {
+			next = rs->next;
+			dnsdb_rrset_t *ors = dnsdb_rrset_get(old, rs->type);
+			if (!ors) {
+				rs->next = old->rrsets;
+				old->rrsets = rs;
+				continue;
+			}
+			uint16_t i = 0;
+			for (const uint8_t *p = rs->data, *pe = rs->data + rs->len; p < pe; ++i) {
+				uint16_t rdlen = ntohs(*(const uint16_t*)(p + 8));
+				dnsdb_rrset_append(ors, p + DNS_RR_HEAD_LEN, rdlen, ntohl(*(const uint32_t*)(p + 4)),
+						rs->weights ? rs->weights[i] : 1);
+				p += DNS_RR_HEAD_LEN + rdlen;
+			}
+			dnsdb_rrset_free(rs);
+		}
+		free(rec);
+	}
+	free(src->buckets);
+}
+
+/** 获取可用的cpu数量 */
+static int dnsdb_cpus() {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (int) si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+#endif
+}
+
+/** 读取文本格式的数据库文件, 生成新的快照及其摘要
+ *  文件映射到内存, 先顺序解析全部指令, 再按换行切分为多块由多个线程并行解析记录, 最后一次性建立索引并合并
+ * @param threads 最多使用的线程数, 文件较小时减少
+ * @return 新的快照, NULL: 文件无法打开
+ */
+static dnsdb_t* dnsdb_read(const char* filename, int threads) {
+	size_t size;
+	const char *data = dnsdb_map(filename, &size), *end = data + size;
+	if (!data) return NULL;
+	uint64_t start = net_mstime();
+
+	dnsdb_t *db = calloc(1, sizeof(dnsdb_t));
+	list_head_init(&db->zones);
+	list_head_init(&db->fwdzones);
+
+	// 指令决定区域内记录的默认生存时间, 不论在文件中的位置, 都先于记录解析
+	char line[LINE_MAX_LEN];
+	uint32_t lines = 0;
+	for (const char *p = data; p < end; ++lines) {
+		const char *q = p;
+		while (q < end && (*q == ' ' || *q == '\t')) ++q;
+		if (q < end && *q == '$') {
+			p = dnsdb_next_line(p, end, line);
+			dnsdb_parse_line(db, NULL, line);
+		} else {
+			const char *nl = memchr(q, '\n', end - q);
+			p = nl ? nl + 1 : end;
+		}
+	}
+
+	// 按换行切分分块, 文件较小时减少线程数
+	int n = threads;
+	if (n > LOAD_THREADS_MAX) n = LOAD_THREADS_MAX;
+	if ((size_t) n > size / LOAD_CHUNK_MIN) n = size / LOAD_CHUNK_MIN ? (int) (size / LOAD_CHUNK_MIN) : 1;
+	dnsdb_chunk_t chunks[LOAD_THREADS_MAX];
+	pthread_t tids[LOAD_THREADS_MAX];
+	bool started[LOAD_THREADS_MAX];
+	for (int i = 0, off = 0; i < n; ++i) {
+		const char *b = data + off, *e = i == n - 1 ? end : data + size / n * (i + 1);
+		if (e < b) e = b;
+		if (e < end && e > data && e[-1] != '\n') {
+			const char *nl = memchr(e, '\n', end - e);
+			e = nl ? nl + 1 : end;
+		}
+		chunks[i] = (dnsdb_chunk_t) { .db = db, .begin = b, .end = e };
+		off = e - data;
+	}
+	for (int i = 1; i < n; ++i)
+		started[i] = pthread_create(tids + i, NULL, dnsdb_parse_chunk, chunks + i) == 0;
+	dnsdb_parse_chunk(chunks);
+	for (int i = 1; i < n; ++i) {
+		if (started[i]) pthread_join(tids[i], NULL);
+		else dnsdb_parse_chunk(chunks + i);
+	}
+
+	// 按全部分块的域名数量一次性分配索引, 合并时不再扩容
+	uint32_t total = 0;
+	for (int i = 0; i < n; ++i)
+		total += chunks[i].recs[0].count;
+	dnsdb_recs_init(&db->recs, total);
+	dnsdb_trie_init(db, total);
+	for (int i = 0; i < n; ++i)
+		dnsdb_merge(db, &db->recs, chunks[i].recs);
+	for (uint32_t v = 0; v < db->view_count; ++v) {
+		dnsdb_recs_init(&db->views[v].recs, 0);
+		for (int i = 0; i < n; ++i)
+			dnsdb_merge(db, &db->views[v].recs, chunks[i].recs + 1 + v);
+	}
+	dnsdb_unmap(data, size);
+	dnsdb_view_build(db);
+	dnsdb_digest_build(db);
+
+	uint64_t ms = net_mstime() - start;
+	log_info("parse dnsdb %s: lines=%u, hosts=%u, threads=%d, time=%" PRIu64 "ms, %" PRIu64 " lines/s",
+			filename, lines, db->recs.count, n, ms, (uint64_t) lines * 1000 / (ms ? ms : 1));
+	return db;
+}
+
+/** 记录数据库文件当前的状态 */
+static void dnsdb_stat_save() {
+	if (stat(_db_filename, &_db_stat) != 0)
+		memset(&_db_stat, 0, sizeof(_db_stat));
+}
+
+/** 判断数据库文件是否与最近一次加载或保存时不同 */
+static bool dnsdb_stat_changed() {
+	struct stat st;
+	if (stat(_db_filename, &st) != 0) return false;
+	return st.st_mtime != _db_stat.st_mtime || st.st_size != _db_stat.st_size || st.st_ino != _db_stat.st_ino;
+}
+
+/** 清空未保存的修改 */
+static void dnsdb_journal_clear() {
+	dnsdb_journal_t *pos, *tmp;
+	list_foreach_safe(pos, tmp, &_journal) {
+		free(pos);
+	}
+	list_head_init(&_journal);
+}
+
+/** 在当前快照上按顺序重做未保存的修改, 重做时重新记入, 直到保存成功 */
+static void dnsdb_journal_redo() {
+	if (list_empty(&_journal)) return;
+	LIST_HEAD(redo);
+	list_replace(&_journal, &redo);
+	list_head_init(&_journal);
+	dnsdb_journal_t *pos, *tmp;
+	list_foreach_safe(pos, tmp, &redo) {
+		switch (pos->op) {
+			case DNSDB_OP_UPDATE: dnsdb_update(pos->host, pos->val); break;
+			case DNSDB_OP_DELETE: dnsdb_delete(pos->host); break;
+			case DNSDB_OP_RR_ADD: dnsdb_rr_add(pos->host, pos->type, pos->val, pos->rdata, pos->rdlen); break;
+			case DNSDB_OP_RRSET_DELETE: dnsdb_rrset_delete(pos->host, pos->type); break;
+			case DNSDB_OP_RR_DELETE: dnsdb_rr_delete(pos->host, pos->type, pos->rdata, pos->rdlen); break;
+		}
+		free(pos);
+	}
+}
+
+bool dnsdb_load(const char* filename) {
+	if (_db_filename) {
+		log_error("%s error: %s already load!", __func__, filename);
+	}
+	// 文件不存在时创建空文件
+	FILE* fp = fopen(filename, "r");
+	if (!fp) fp = fopen(filename, "w");
+	if (fp) fclose(fp);
+	dnsdb_t *db = fp ? dnsdb_read(filename, dnsdb_cpus()) : NULL;
+	if (!db) {
+		log_error("%s error: can't open file %s!", __func__, filename);
+		return false;
+	}
+
+	if (_db) dnsdb_db_free(_db);
+	_db = db;
 	_db_modified = false;
+	dnsdb_journal_clear();
 	size_t dfs = strlen(filename) + 1;
 	_db_filename = malloc(dfs);
 	memcpy(_db_filename, filename, dfs);
+	dnsdb_stat_save();
 	log_info("load dnsdb records success: %s", filename);
 	return true;
 }
 
+/** 后台加载线程, 解析及生成摘要都在该线程完成, 服务线程只需替换快照指针 */
+static void* dnsdb_reload_thread(void* arg) {
+	(void) arg;
+	// 先记下文件状态再解析, 解析期间文件又被修改时, 发布后仍能发现文件有变化
+	if (stat(_db_filename, &_next_stat) != 0)
+		memset(&_next_stat, 0, sizeof(_next_stat));
+	dnsdb_t *db = dnsdb_read(_db_filename, dnsdb_cpus());
+	if (db) {
+		// 当前快照的摘要生成后不再改动, 加载期间服务线程不会替换当前快照, 可以在本线程比较
+		dnsdb_diff(_db, db, _diff);
+	} else {
+		log_error("%s error: can't open file %s", __func__, _db_filename);
+	}
+	_db_next = db;
+	atomic_store_explicit(&_reload_done, true, memory_order_release);
+	return NULL;
+}
+
+void dnsdb_reload() {
+	if (!_db_filename) return;
+	if (_reloading) {
+		_reload_again = true;
+		return;
+	}
+	atomic_store(&_reload_done, false);
+	if (pthread_create(&_reload_tid, NULL, dnsdb_reload_thread, NULL) != 0) {
+		log_error("%s error: can't create reload thread", __func__);
+		return;
+	}
+	_reloading = true;
+	log_debug("reload dnsdb records: %s", _db_filename);
+}
+
+bool dnsdb_publish() {
+	if (!_reloading || !atomic_load_explicit(&_reload_done, memory_order_acquire))
+		return false;
+	pthread_join(_reload_tid, NULL);
+	_reloading = false;
+
+	dnsdb_t *db = _db_next;
+	_db_next = NULL;
+	if (db) {
+		// 服务线程在两次请求之间发布, 此时没有指向旧快照的记录集视图, 旧快照可以立即释放
+		dnsdb_t *old = _db;
+		_db = db;
+		_view = 0;
+		dnsdb_db_free(old);
+		_db_modified = false;
+		_db_stat = _next_stat;
+		log_info("reload dnsdb records success: %s, added=%u, changed=%u, removed=%u",
+				_db_filename, _diff[0], _diff[1], _diff[2]);
+		// 新快照是按文件解析的, 不含还没保存的动态修改, 重做到新快照上再保存, 手工修改与动态修改都保留
+		if (!list_empty(&_journal)) {
+			log_info("dnsdb redo unsaved dynamic changes on reloaded records: %s", _db_filename);
+			dnsdb_journal_redo();
+			dnsdb_save();
+		}
+		if (_change_func) _change_func(NULL);
+	}
+	if (_reload_again) {
+		_reload_again = false;
+		dnsdb_reload();
+	}
+	return db != NULL;
+}
+
+#ifdef __linux
+static int _watch_fd = -1;
+static char _watch_name[256];
+
+bool dnsdb_watch() {
+	char dir[1024] = "";
+	if (!_db_filename || get_basename(_watch_name, sizeof(_watch_name), _db_filename) == (size_t) -1
+			|| get_fielpath(dir, sizeof(dir), _db_filename) == (size_t) -1)
+		return false;
+	if (!*dir) strcpy(dir, *_db_filename == PATH_SEP ? "/" : ".");
+
+	// 监视文件所在目录, 编辑器保存时常用改名替换原文件, 直接监视文件会丢失后续的改动
+	_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_watch_fd == -1 || inotify_add_watch(_watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		log_warn("%s error: can't watch %s", __func__, dir);
+		if (_watch_fd != -1) close(_watch_fd);
+		_watch_fd = -1;
+		return false;
+	}
+	log_debug("watch dnsdb file %s", _db_filename);
+	return true;
+}
+
+int dnsdb_watch_fdset(fd_set* rfds, int maxfd) {
+	if (_watch_fd == -1) return maxfd;
+	FD_SET(_watch_fd, rfds);
+	return _watch_fd > maxfd ? _watch_fd : maxfd;
+}
+
+void dnsdb_watch_io(const fd_set* rfds) {
+	if (_watch_fd == -1 || !FD_ISSET(_watch_fd, rfds)) return;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool hit = false;
+	ssize_t n;
+	while ((n = read(_watch_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+			const struct inotify_event *ev = (const struct inotify_event*) p;
+			if (ev->len && !strcmp(ev->name, _watch_name)) hit = true;
+		}
+	}
+	if (hit && dnsdb_stat_changed())
+		dnsdb_reload();
+}
+
+#else // __linux
+static bool _watching = false;
+static time_t _watch_next = 0;
+
+bool dnsdb_watch() {
+	_watching = _db_filename != NULL;
+	return _watching;
+}
+
+int dnsdb_watch_fdset(fd_set* rfds, int maxfd) {
+	return maxfd;
+}
+
+// 没有inotify的平台定时检查文件的修改时间及大小
+void dnsdb_watch_io(const fd_set* rfds) {
+	time_t now = time(NULL);
+	if (!_watching || now < _watch_next) return;
+	_watch_next = now + WATCH_INTERVAL;
+	if (dnsdb_stat_changed())
+		dnsdb_reload();
+}
+#endif // __linux
+
+/** 把域名记录写入文件, 视图的记录以"@视图名"开头
+ * @param view 视图名, 共享记录为NULL
+ */
+static void dnsdb_save_recs(FILE* fp, const dnsdb_recs_t* recs, const char* view) {
+	char text[LINE_MAX_LEN], ttl_text[16], prefix[HOST_MAX + 2] = "";
+	if (view) snprintf(prefix, sizeof(prefix), "@%s ", view);
+	dnsdb_rec_t *pos;
+	list_foreach(pos, &recs->list) {
+		const dnsdb_zone_t *zone = dnsdb_zone_find(_db, pos->host);
+		uint32_t def_ttl = zone ? zone->ttl : DNS_TTL_DEFAULT;
+		for (dnsdb_rrset_t *rs = pos->rrsets; rs; rs = rs->next) {
+			uint16_t i = 0;
+			for (const uint8_t *p = rs->data, *pe = rs->data + rs->len; p < pe; ++i) {
+				uint16_t rdlen = ntohs(*(const uint16_t*)(p + 8));
+				uint32_t ttl = ntohl(*(const uint32_t*)(p + 4));
+				dnsdb_rdata_format(rs->type, p + DNS_RR_HEAD_LEN, rdlen, text, sizeof(text));
+				log_trace("write record host[%s], type[%s], data[%s]", pos->host, dnsdb_type_name(rs->type), text);
+				// 生存时间与区域默认值相同时省略
+				if (ttl != def_ttl) sprintf(ttl_text, " %u", ttl);
+				else *ttl_text = '\0';
+				// A记录使用旧格式保存, 保持与旧版本的兼容
+				if (rs->type == DNS_QT_A && rs->weights && rs->weights[i] != 1)
+					fprintf(fp, "%s%s%s %s %u\n", prefix, pos->host, ttl_text, text, rs->weights[i]);
+				else if (rs->type == DNS_QT_A)
+					fprintf(fp, "%s%s%s %s\n", prefix, pos->host, ttl_text, text);
+				else
+					fprintf(fp, "%s%s%s %s %s\n", prefix, pos->host, ttl_text, dnsdb_type_name(rs->type), text);
+				p += DNS_RR_HEAD_LEN + rdlen;
+			}
+		}
+	}
+}
+
 bool dnsdb_save() {
 	if (!_db_modified) return true;
 
@@ -93,72 +1490,253 @@ bool dnsdb_save() {
 		return false;
 	}
 
-	FILE* fp = fopen(_db_filename, "w");
+	// 文件被手工修改且还没加载时不能覆盖, 改为重新加载, 发布时把未保存的修改重做到新快照上再保存
+	if (dnsdb_stat_changed()) {
+		log_info("dnsdb file changed outside, save after reload: %s", _db_filename);
+		dnsdb_reload();
+		return true;
+	}
+
+	// 先写入临时文件再改名替换, 后台重新加载时不会读到写了一半的文件
+	char tmp[FILENAME_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", _db_filename);
+	FILE* fp = fopen(tmp, "w");
 	if (!fp) {
-		log_error("%s error: can't open file %s", __func__, _db_filename);
+		log_error("%s error: can't open file %s", __func__, tmp);
 		return false;
 	}
 
-	struct in_addr addr;
-	dnsdb_rec_t *pos;
-	list_foreach(pos, &_dns_recs) {
-		addr.s_addr = pos->ip;
-		char* ip = inet_ntoa(addr);
-		log_trace("write record host[%s], ip[%s]", pos->host, ip);
-		fprintf(fp, "%s %s\n", pos->host, ip);
+	// 区域指令需要写在记录之前, 加载时记录才能使用区域的配置
+	dnsdb_zone_t *zone;
+	list_foreach(zone, &_db->zones) {
+		dnsdb_save_zone(fp, zone);
+	}
+	dnsdb_fwdzone_t *fz;
+	list_foreach(fz, &_db->fwdzones) {
+		dnsdb_save_fwdzone(fp, fz);
 	}
 
+	for (uint32_t i = 0; i < _db->view_count; ++i)
+		dnsdb_save_view(fp, _db->views + i);
+
+	dnsdb_save_recs(fp, &_db->recs, NULL);
+	for (uint32_t i = 0; i < _db->view_count; ++i)
+		dnsdb_save_recs(fp, &_db->views[i].recs, _db->views[i].name);
+
 	fclose(fp);
+#ifdef _WIN32
+	remove(_db_filename);
+#endif
+	if (rename(tmp, _db_filename) != 0) {
+		log_error("%s error: can't write file %s", __func__, _db_filename);
+		remove(tmp);
+		return false;
+	}
 	_db_modified = false;
+	dnsdb_stat_save();
+	dnsdb_journal_clear();
 	log_debug("save record success: %s", _db_filename);
 	return true;
 }
 
 void dnsdb_free() {
+	if (_reloading) {
+		pthread_join(_reload_tid, NULL);
+		if (_db_next) dnsdb_db_free(_db_next);
+		_db_next = NULL;
+		_reloading = _reload_again = false;
+	}
+	dnsdb_journal_clear();
 	if (_db_filename)
 		free(_db_filename);
+	if (_db)
+		dnsdb_db_free(_db);
 
-	list_head_t *pos, *tmp;
-	list_foreach_reverse_safe(pos, tmp, &_dns_recs) {
-		free(pos);
+	_db_filename = NULL;
+	_db = NULL;
+}
+
+/** 精确查找失败时在标签树中匹配通配符记录(RFC 4592)
+ *  域名本身是空的非终结节点时返回无数据, 否则使用最近祖先下的 * 节点的记录, 没有时域名不存在
+ * @param rec 回写匹配的通配符记录
+ */
+static dns_lookup_t dnsdb_wildcard(const dnsdb_t* db, const char* host, size_t hlen, dnsdb_rec_t** rec) {
+	bool exact;
+	const dnsdb_node_t *n = dnsdb_trie_encloser(db, host, hlen, &exact);
+	if (exact) return DNS_LOOKUP_NODATA;
+	const dnsdb_node_t *w = dnsdb_node_child(db, n, "*", 1);
+	if (!w || !w->rec) return DNS_LOOKUP_NXDOMAIN;
+	log_debug("dnsdb wildcard match: %s -> %s", host, w->rec->host);
+	*rec = w->rec;
+	return DNS_LOOKUP_FOUND;
+}
+
+dns_lookup_t dnsdb_lookup(const char* host, uint16_t type, dns_rrset_view_t* dst) {
+	if (!host) return DNS_LOOKUP_NXDOMAIN;
+	size_t hl = strlen(host);
+	// 精确匹配直接使用哈希索引, 找不到时才在标签树中查找通配符
+	dnsdb_rec_t *p = NULL;
+	// 客户端属于视图时, 视图中的同名记录覆盖共享记录
+	if (_view && _view <= _db->view_count)
+		p = dnsdb_get(&_db->views[_view - 1].recs, host, hl);
+	if (!p) p = dnsdb_get(&_db->recs, host, hl);
+	if (!p && hl < HOST_MAX) {
+		dns_lookup_t ret = dnsdb_wildcard(_db, host, hl, &p);
+		if (ret != DNS_LOOKUP_FOUND) return ret;
 	}
+	if (!p) return DNS_LOOKUP_NXDOMAIN;
 
-	_db_filename = NULL;
-	list_head_init(&_dns_recs);
+	// 找不到指定类型时, 如果域名是别名, 返回别名记录集
+	dnsdb_rrset_t *rs = dnsdb_rrset_get(p, type);
+	if (!rs && !(rs = dnsdb_rrset_get(p, DNS_QT_CNAME)))
+		return DNS_LOOKUP_NODATA;
+	if (!rs->count)
+		return DNS_LOOKUP_NODATA;
+
+	dst->data = rs->data;
+	dst->len = rs->len;
+	dst->count = rs->count;
+	dst->type = rs->type;
+
+	// 多条记录时按轮转计数器或加权调度表决定第一条输出的记录
+	if (rs->count > 1) {
+		unsigned n = atomic_fetch_add_explicit(&rs->rotate, 1, memory_order_relaxed);
+		dst->first = rs->sched_len ? rs->sched[n % rs->sched_len] : n % rs->count;
+	} else {
+		dst->first = 0;
+	}
+	return DNS_LOOKUP_FOUND;
+}
+
+void dnsdb_select_view(uint32_t ip) {
+	_view = _db->lpm ? lpm_lookup(_db->lpm, ntohl(ip)) : 0;
+}
+
+bool dnsdb_soa(const char* host, dns_rrset_view_t* dst, const char** zone_name) {
+	dnsdb_zone_t *zone = dnsdb_zone_find(_db, host);
+
+	// 不属于任何已定义区域时, 使用域名的最后两级作为区域名生成默认区域
+	if (!zone) {
+		const char *p = host + strlen(host);
+		int dots = 0;
+		while (p > host && (p[-1] != '.' || ++dots < 2)) --p;
+		zone = &_default_zone;
+		if (strcmp(zone->name, p)) {
+			strcpy(zone->name, p);
+			zone->serial = (uint32_t) time(NULL);
+			dnsdb_zone_build_soa(zone);
+		}
+	}
+	if (!zone->soa_len) return false;
+
+	dst->data = zone->soa;
+	dst->len = zone->soa_len;
+	dst->count = 1;
+	dst->type = DNS_QT_SOA;
+	dst->first = 0;
+	*zone_name = zone->name;
+	return true;
+}
+
+bool dnsdb_zone_exists(const char* host) {
+	return dnsdb_zone_find(_db, host) != NULL;
+}
+
+void dnsdb_forward_policy(const char* host, uint8_t* prefetch, uint32_t* stale) {
+	dnsdb_fwdzone_t *pos, *best = NULL;
+	size_t hl = strlen(host), bl = 0;
+	list_foreach(pos, &_db->fwdzones) {
+		size_t zl = strlen(pos->name);
+		if ((!best || zl > bl) && dnsdb_in_zone(host, hl, pos->name, zl))
+			best = pos, bl = zl;
+	}
+	*prefetch = best ? best->prefetch : PREFETCH_DEFAULT;
+	*stale = best ? best->stale : 0;
 }
 
 uint32_t dnsdb_find(const char* host) {
 	if (host) {
 		size_t hl = strlen(host);
-		dnsdb_rec_t *p = dnsdb_get(host, hl);
-		return p ? p->ip : INADDR_NONE;
+		dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, hl);
+		dnsdb_rrset_t *rs = p ? dnsdb_rrset_get(p, DNS_QT_A) : NULL;
+		return rs ? *(uint32_t*)(rs->data + DNS_RR_HEAD_LEN) : INADDR_NONE;
 	}
 	return INADDR_NONE;
 }
 
+bool dnsdb_find_single(const char* host, uint32_t* ip, uint32_t* ttl) {
+	size_t hl = strlen(host);
+	dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, hl);
+	dnsdb_rrset_t *rs = p ? dnsdb_rrset_get(p, DNS_QT_A) : NULL;
+	if (!rs || rs->count != 1) return false;
+	for (uint32_t i = 0; i < _db->view_count; ++i)
+		if (dnsdb_get(&_db->views[i].recs, host, hl)) return false;
+	*ip = *(const uint32_t*)(rs->data + DNS_RR_HEAD_LEN);
+	*ttl = ntohl(*(const uint32_t*)(rs->data + 4));
+	return true;
+}
+
 bool dnsdb_findby_ip(uint32_t ip, char dst[HOST_MAX]) {
 	if (ip != INADDR_NONE) {
 		dnsdb_rec_t *pos;
-		list_foreach(pos, &_dns_recs) {
-			if (ip == pos->ip) {
-				strcpy(dst, pos->host);
-				return true;
+		list_foreach(pos, &_db->recs.list) {
+			dnsdb_rrset_t *rs = dnsdb_rrset_get(pos, DNS_QT_A);
+			if (!rs) continue;
+			for (uint16_t i = 0; i < rs->count; ++i) {
+				if (ip == *(uint32_t*)(rs->data + i * (DNS_RR_HEAD_LEN + 4) + DNS_RR_HEAD_LEN)) {
+					strcpy(dst, pos->host);
+					return true;
+				}
 			}
 		}
 	}
 	return false;
 }
 
+/** 记录改动后更新区域序列号、设置改动标志、记入未保存的修改并通知回调接口
+ * @param op 操作类型
+ * @param val 更新的ip或添加记录的生存时间
+ */
+static void dnsdb_changed(uint8_t op, const char* host, uint16_t type, uint32_t val,
+		const uint8_t* rdata, uint16_t rdlen) {
+	dnsdb_zone_touch(host);
+	_db_modified = true;
+	dnsdb_journal_t *j = malloc(sizeof(dnsdb_journal_t) + rdlen);
+	if (j) {
+		j->op = op;
+		j->type = type;
+		j->rdlen = rdlen;
+		j->val = val;
+		strcpy(j->host, host);
+		if (rdlen) memcpy(j->rdata, rdata, rdlen);
+		list_add_tail((list_head_t*) j, &_journal);
+	} else {
+		log_error("%s error: out of memory, host[%s] change may lost on reload", __func__, host);
+	}
+	if (_change_func) _change_func(host);
+}
+
 bool dnsdb_update(const char* host, uint32_t ip) {
 	size_t hl = strlen(host);
-	dnsdb_rec_t *p = dnsdb_get(host, hl);
-	if (p) {
-		if (p->ip == ip) return true;
-		p->ip = ip;
-	} else {
-		dnsdb_append_rec(host, hl, ip);
+	if (!dnsdb_host_valid(host, false)) {
+		log_warn("%s fail: host[%s] is invalid", __func__, host);
+		return false;
 	}
-	_db_modified = true;
+	dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, hl);
+	if (!p) {
+		p = dnsdb_append_rec(&_db->recs, host, hl);
+		dnsdb_trie_add(_db, p);
+	}
+
+	// 动态更新时, 用新ip替换整个A记录集, 生存时间沿用原记录, 新记录使用区域默认值
+	dnsdb_rrset_t *rs = dnsdb_rrset_add(p, DNS_QT_A);
+	if (rs->count == 1 && *(uint32_t*)(rs->data + DNS_RR_HEAD_LEN) == ip)
+		return true;
+	const dnsdb_zone_t *zone = dnsdb_zone_find(_db, host);
+	uint32_t ttl = rs->count ? ntohl(*(uint32_t*)(rs->data + 4)) : zone ? zone->ttl : DNS_TTL_DEFAULT;
+	dnsdb_rrset_clear(rs);
+	dnsdb_rrset_append(rs, (const uint8_t*) &ip, 4, ttl, 1);
+	dnsdb_changed(DNSDB_OP_UPDATE, host, DNS_QT_A, ip, NULL, 0);
 
 	if (log_is_trace_enabled())
 		log_trace("%s update success: host[%s], ip[%s]", __func__, host, net_ip_tostring(ip));
@@ -168,23 +1746,190 @@ bool dnsdb_update(const char* host, uint32_t ip) {
 
 bool dnsdb_delete(const char* host) {
 	size_t hl = strlen(host);
-	dnsdb_rec_t *p = dnsdb_get(host, hl);
+	dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, hl);
 
 	if (!p) {
 		log_debug("%s fail: host[%s] can't find!", __func__, host);
 		return false;
 	}
 
-	list_del((list_head_t*) p);
-	_db_modified = 1;
+	dnsdb_index_del(&_db->recs, p);
+	dnsdb_trie_del(_db, p);
+	dnsdb_rec_free(p);
+	dnsdb_changed(DNSDB_OP_DELETE, host, 0, 0, NULL, 0);
 
 	return true;
 }
 
+/** 在记录集中查找rdata完全相同的记录
+ * @param off 回写记录在预编码数据中的偏移地址
+ * @return 记录序号, -1表示找不到
+ */
+static int dnsdb_rrset_find(const dnsdb_rrset_t* rs, const uint8_t* rdata, uint16_t rdlen, uint16_t* off) {
+	uint16_t pos = 0;
+	for (int i = 0; i < rs->count; ++i) {
+		uint16_t len = ntohs(*(const uint16_t*)(rs->data + pos + 8));
+		if (len == rdlen && !memcmp(rs->data + pos + DNS_RR_HEAD_LEN, rdata, rdlen)) {
+			*off = pos;
+			return i;
+		}
+		pos += DNS_RR_HEAD_LEN + len;
+	}
+	return -1;
+}
+
+/** 从域名中移除并释放记录集 */
+static void dnsdb_rrset_remove(dnsdb_rec_t* rec, dnsdb_rrset_t* rs) {
+	dnsdb_rrset_t **pp = &rec->rrsets;
+	while (*pp != rs) pp = &(*pp)->next;
+	*pp = rs->next;
+	dnsdb_rrset_free(rs);
+}
+
+/** 域名已没有记录集时, 从共享记录的索引及标签树中删除并释放 */
+static void dnsdb_rec_prune(dnsdb_rec_t* rec) {
+	if (rec->rrsets) return;
+	dnsdb_index_del(&_db->recs, rec);
+	dnsdb_trie_del(_db, rec);
+	dnsdb_rec_free(rec);
+}
+
+bool dnsdb_host_valid(const char* host, bool wildcard) {
+	size_t hl = strlen(host);
+	if (!hl || hl >= HOST_MAX) return false;
+	// 通配符只能作为完整的首个标签
+	if (wildcard && host[0] == '*' && host[1] == '.') host += 2;
+	size_t n = 0;
+	for (; *host; ++host) {
+		if (*host == '.') {
+			if (!n) return false;
+			n = 0;
+		} else if (isalnum((unsigned char) *host) || *host == '-' || *host == '_') {
+			if (++n > 63) return false;
+		} else return false;
+	}
+	return n > 0;
+}
+
+bool dnsdb_type_supported(uint16_t type) {
+	return dnsdb_type_parse(dnsdb_type_name(type)) == type;
+}
+
+const char* dnsdb_zone_name(const char* host) {
+	const dnsdb_zone_t *zone = dnsdb_zone_find(_db, host);
+	return zone ? zone->name : NULL;
+}
+
+bool dnsdb_name_exists(const char* host) {
+	const dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, strlen(host));
+	if (p) {
+		for (const dnsdb_rrset_t *rs = p->rrsets; rs; rs = rs->next)
+			if (rs->count) return true;
+	}
+	return false;
+}
+
+uint16_t dnsdb_rrset_count(const char* host, uint16_t type, uint16_t* len) {
+	const dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, strlen(host));
+	const dnsdb_rrset_t *rs = p ? dnsdb_rrset_get(p, type) : NULL;
+	if (len) *len = rs ? rs->len : 0;
+	return rs ? rs->count : 0;
+}
+
+bool dnsdb_rr_exists(const char* host, uint16_t type, const uint8_t* rdata, uint16_t rdlen) {
+	const dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, strlen(host));
+	const dnsdb_rrset_t *rs = p ? dnsdb_rrset_get(p, type) : NULL;
+	uint16_t off;
+	return rs && dnsdb_rrset_find(rs, rdata, rdlen, &off) >= 0;
+}
+
+bool dnsdb_rr_add(const char* host, uint16_t type, uint32_t ttl, const uint8_t* rdata, uint16_t rdlen) {
+	size_t hl = strlen(host);
+	if (hl >= HOST_MAX) {
+		log_warn("%s fail: host[%s] too long", __func__, host);
+		return false;
+	}
+	const dnsdb_zone_t *zone = dnsdb_zone_find(_db, host);
+	if (zone) ttl = dnsdb_zone_clamp(zone, ttl);
+
+	dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, hl);
+	if (!p) {
+		p = dnsdb_append_rec(&_db->recs, host, hl);
+		dnsdb_trie_add(_db, p);
+	}
+	dnsdb_rrset_t *rs = dnsdb_rrset_add(p, type);
+	uint16_t off;
+	bool exists = dnsdb_rrset_find(rs, rdata, rdlen, &off) >= 0;
+	if (!exists && !dnsdb_rrset_append(rs, rdata, rdlen, ttl, 1)) {
+		if (!rs->count) dnsdb_rrset_remove(p, rs);
+		dnsdb_rec_prune(p);
+		return false;
+	}
+
+	// 同一记录集的生存时间保持一致(RFC 2181 5.2), 记录已存在且生存时间相同时没有改动
+	bool changed = !exists;
+	for (uint16_t pos = 0; pos < rs->len; pos += DNS_RR_HEAD_LEN + ntohs(*(uint16_t*)(rs->data + pos + 8))) {
+		if (ntohl(*(uint32_t*)(rs->data + pos + 4)) != ttl) {
+			*(uint32_t*)(rs->data + pos + 4) = htonl(ttl);
+			changed = true;
+		}
+	}
+	if (changed) dnsdb_changed(DNSDB_OP_RR_ADD, host, type, ttl, rdata, rdlen);
+	log_trace("%s success: host[%s], type[%s], ttl[%u]%s", __func__, host, dnsdb_type_name(type), ttl,
+			exists ? " exists" : "");
+	return true;
+}
+
+bool dnsdb_rrset_delete(const char* host, uint16_t type) {
+	dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, strlen(host));
+	if (!p) return false;
+
+	// 删除全部类型时保留区域顶点的NS记录, 区域的授权信息不能通过动态更新删除
+	const char *zone = type == DNS_QT_ANY ? dnsdb_zone_name(host) : NULL;
+	bool apex = zone && !strcasecmp(zone, host), deleted = false;
+	for (dnsdb_rrset_t *rs = p->rrsets, *next; rs; rs = next) {
+		next = rs->next;
+		if (type == DNS_QT_ANY ? !(apex && rs->type == DNS_QT_NS) : rs->type == type) {
+			dnsdb_rrset_remove(p, rs);
+			deleted = true;
+		}
+	}
+	dnsdb_rec_prune(p);
+	if (deleted) dnsdb_changed(DNSDB_OP_RRSET_DELETE, host, type, 0, NULL, 0);
+	return deleted;
+}
+
+bool dnsdb_rr_delete(const char* host, uint16_t type, const uint8_t* rdata, uint16_t rdlen) {
+	dnsdb_rec_t *p = dnsdb_get(&_db->recs, host, strlen(host));
+	dnsdb_rrset_t *rs = p ? dnsdb_rrset_get(p, type) : NULL;
+	uint16_t off;
+	int i = rs ? dnsdb_rrset_find(rs, rdata, rdlen, &off) : -1;
+	if (i < 0) return false;
+
+	// 移除预编码数据中的记录, 有权重表时同步移除权重并重建调度表
+	uint16_t n = DNS_RR_HEAD_LEN + rdlen;
+	memmove(rs->data + off, rs->data + off + n, rs->len - off - n);
+	rs->len -= n;
+	rs->count--;
+	if (rs->weights) {
+		memmove(rs->weights + i, rs->weights + i + 1, rs->count - i);
+		dnsdb_rrset_build_sched(rs);
+	}
+	if (!rs->count) dnsdb_rrset_remove(p, rs);
+	dnsdb_rec_prune(p);
+	dnsdb_changed(DNSDB_OP_RR_DELETE, host, type, 0, rdata, rdlen);
+	return true;
+}
+
+void dnsdb_set_change(dnsdb_change_func change_func) {
+	_change_func = change_func;
+}
+
 void dnsdb_foreach(bool (*callback) (const char* host, uint32_t ip)) {
 	dnsdb_rec_t *pos;
-	list_foreach(pos, &_dns_recs) {
-		if (!callback(pos->host, pos->ip))
+	list_foreach(pos, &_db->recs.list) {
+		dnsdb_rrset_t *rs = dnsdb_rrset_get(pos, DNS_QT_A);
+		if (rs && !callback(pos->host, *(uint32_t*)(rs->data + DNS_RR_HEAD_LEN)))
 			break;
 	}
 }
@@ -192,20 +1937,177 @@ void dnsdb_foreach(bool (*callback) (const char* host, uint32_t ip)) {
 //----------------------------------------
 // #define DNSDB_TEST
 #ifdef DNSDB_TEST
+#include <assert.h>
+#include <unistd.h>
+
+/** 测试使用的临时数据库文件, 不改动示例配置 */
+#define TEST_FILE "dnsdb_test.conf"
+
+/** 写入测试用的数据库文件 */
+static void write_file(const char* filename, const char* text) {
+	FILE *fp = fopen(filename, "w");
+	fputs(text, fp);
+	fclose(fp);
+}
+
+/** 查找域名的第一条A记录, 找不到时返回INADDR_NONE */
+static uint32_t test_lookup_a(const char* host) {
+	dns_rrset_view_t view;
+	if (dnsdb_lookup(host, DNS_QT_A, &view) != DNS_LOOKUP_FOUND || view.type != DNS_QT_A)
+		return INADDR_NONE;
+	return *(const uint32_t*)(view.data + DNS_RR_HEAD_LEN);
+}
+
+/** 等待后台加载完成, 不发布 */
+static void wait_reload() {
+	while (!atomic_load(&_reload_done)) usleep(1000);
+}
+
 int main() {
 	// log_set_level(LOG_TRACE);
 	const char *h1 = "home.kivensoft.cn", *h2 = "xx.home.kivensoft.cn";
-	dnsdb_load("minidns.conf");
-	dnsdb_update(h1, 0x01020304);
-	dnsdb_update(h2, 0x05060708);
-	dnsdb_save();
+	uint32_t ip1 = net_ip_fromstring("1.2.3.4"), ip2 = net_ip_fromstring("5.6.7.8");
+	assert(dnsdb_host_valid("_sip._tcp.a-1.com", false) && dnsdb_host_valid("*.a.com", true));
+	assert(!dnsdb_host_valid("*.a.com", false) && !dnsdb_host_valid("a*.com", true));
+	assert(!dnsdb_host_valid("a..com", false) && !dnsdb_host_valid(".a.com", false));
+	assert(!dnsdb_host_valid("a.com.", false) && !dnsdb_host_valid("a com", false) && !dnsdb_host_valid("", false));
+
+	write_file(TEST_FILE, "");
+	dnsdb_load(TEST_FILE);
+	assert(!dnsdb_update("*.a.com", ip1) && dnsdb_find("*.a.com") == INADDR_NONE);
+	dnsdb_update(h1, ip1);
+	dnsdb_update(h2, ip2);
+	assert(_db_modified && dnsdb_save() && !_db_modified);
+	dnsdb_free();
+
+	dnsdb_load(TEST_FILE);
+	assert(dnsdb_find(h1) == ip1 && dnsdb_find(h2) == ip2);
+
+	// 后台重新加载, 发布前仍使用旧数据
+	write_file(TEST_FILE, "home.kivensoft.cn 9.9.9.9\nnew.kivensoft.cn 8.8.8.8\n");
+	dnsdb_reload();
+	assert(dnsdb_find(h1) == ip1);
+	while (!dnsdb_publish());
+	assert(dnsdb_find(h1) == net_ip_fromstring("9.9.9.9"));
+	assert(dnsdb_find(h2) == INADDR_NONE);
+	assert(dnsdb_find("new.kivensoft.cn") == net_ip_fromstring("8.8.8.8"));
+
+	// 手工修改文件后加载期间有动态更新: 发布手工修改的新快照并重做动态更新, 保存后两者都在
+	write_file(TEST_FILE, "home.kivensoft.cn 9.9.9.9\n");
+	dnsdb_reload();
+	wait_reload();
+	dnsdb_update(h2, ip2);
+	assert(_db_modified && dnsdb_publish() && !_reloading);
+	assert(dnsdb_find(h2) == ip2 && dnsdb_find(h1) == net_ip_fromstring("9.9.9.9"));
+	assert(!_db_modified && list_empty(&_journal) && !dnsdb_stat_changed());
+	dnsdb_free();
+	dnsdb_load(TEST_FILE);
+	assert(dnsdb_find(h2) == ip2 && dnsdb_find(h1) == net_ip_fromstring("9.9.9.9"));
+
+	// 手工修改文件后还没加载时保存动态删除: 不覆盖文件, 改为重新加载, 发布时重做删除后保存
+	write_file(TEST_FILE, "home.kivensoft.cn 7.7.7.7\nxx.home.kivensoft.cn 5.6.7.8\nnew.kivensoft.cn 8.8.8.8\n");
+	dnsdb_delete(h2);
+	assert(dnsdb_save() && _db_modified && _reloading && dnsdb_stat_changed());
+	wait_reload();
+	dnsdb_update("new.kivensoft.cn", ip1);
+	assert(dnsdb_publish() && !_db_modified && !dnsdb_stat_changed());
+	assert(dnsdb_find(h2) == INADDR_NONE && dnsdb_find(h1) == net_ip_fromstring("7.7.7.7"));
+	assert(dnsdb_find("new.kivensoft.cn") == ip1);
 	dnsdb_free();
+	dnsdb_load(TEST_FILE);
+	assert(dnsdb_find(h2) == INADDR_NONE && dnsdb_find(h1) == net_ip_fromstring("7.7.7.7"));
+	assert(dnsdb_find("new.kivensoft.cn") == ip1);
 
-	dnsdb_load("minidns.conf");
-	log_debug("host[%s] -> ip[%s]", h1, ip_string(dnsdb_find(h1)));
-	log_debug("host[%s] -> ip[%s]", h1, ip_string(dnsdb_find(h2)));
+	// 加载期间没有修改时直接发布
+	dnsdb_reload();
+	wait_reload();
+	assert(dnsdb_publish() && !_reloading);
+	dnsdb_free();
+
+	// 通配符匹配, 最近祖先下没有通配符或域名是空的非终结节点时不匹配
+	write_file(TEST_FILE, "*.kivensoft.cn 7.7.7.7\na.b.kivensoft.cn 6.6.6.6\n");
+	dnsdb_load(TEST_FILE);
+	dns_rrset_view_t view;
+	assert(test_lookup_a("x.kivensoft.cn") == net_ip_fromstring("7.7.7.7"));
+	assert(test_lookup_a("x.y.kivensoft.cn") == net_ip_fromstring("7.7.7.7"));
+	assert(dnsdb_lookup("b.kivensoft.cn", DNS_QT_A, &view) == DNS_LOOKUP_NODATA);
+	assert(dnsdb_lookup("z.b.kivensoft.cn", DNS_QT_A, &view) == DNS_LOOKUP_NXDOMAIN);
+	assert(dnsdb_lookup("kivensoft.cn", DNS_QT_A, &view) == DNS_LOOKUP_NODATA);
+	assert(dnsdb_lookup("x.kivensoft.cn", DNS_QT_MX, &view) == DNS_LOOKUP_NODATA);
+	assert(test_lookup_a("a.b.kivensoft.cn") == net_ip_fromstring("6.6.6.6"));
+
+	// 删除后标签树中没有记录的节点被剪除, b.kivensoft.cn不再是空的非终结节点, 改为匹配通配符
+	dnsdb_update("z.b.kivensoft.cn", net_ip_fromstring("1.1.1.1"));
+	dnsdb_delete("a.b.kivensoft.cn");
+	assert(test_lookup_a("z.b.kivensoft.cn") == net_ip_fromstring("1.1.1.1"));
+	assert(dnsdb_lookup("a.b.kivensoft.cn", DNS_QT_A, &view) == DNS_LOOKUP_NXDOMAIN);
+	dnsdb_delete("z.b.kivensoft.cn");
+	assert(test_lookup_a("b.kivensoft.cn") == net_ip_fromstring("7.7.7.7"));
+	uint32_t nodes = _db->node_count;
+	dnsdb_delete("*.kivensoft.cn");
+	assert(_db->node_count == nodes - 3 && !_db->node_count);
+	assert(dnsdb_lookup("x.kivensoft.cn", DNS_QT_A, &view) == DNS_LOOKUP_NXDOMAIN);
+	dnsdb_free();
+
+	// 视图: 视图中的记录覆盖共享记录, 其它域名及通配符使用共享记录, 不属于视图的客户端只使用共享记录
+	write_file(TEST_FILE, "$VIEW lan 10.0.0.0/8\nwww.v.test 2.2.2.2\n@lan www.v.test 1.1.1.1\n"
+		"other.v.test 3.3.3.3\n*.v.test 4.4.4.4\n@lan only.v.test 5.5.5.5\n");
+	dnsdb_load(TEST_FILE);
+	dnsdb_select_view(net_ip_fromstring("10.1.2.3"));
+	assert(test_lookup_a("www.v.test") == net_ip_fromstring("1.1.1.1"));
+	assert(test_lookup_a("other.v.test") == net_ip_fromstring("3.3.3.3"));
+	assert(test_lookup_a("x.v.test") == net_ip_fromstring("4.4.4.4"));
+	assert(test_lookup_a("only.v.test") == net_ip_fromstring("5.5.5.5"));
+	dnsdb_select_view(net_ip_fromstring("192.168.1.1"));
+	assert(test_lookup_a("www.v.test") == net_ip_fromstring("2.2.2.2"));
+	assert(test_lookup_a("only.v.test") == net_ip_fromstring("4.4.4.4"));
+	dnsdb_free();
+
+	// 并行加载: 文件切分为多块, 块边界落在行中间, 同一域名的记录分布在多个块中,
+	// 结果与单线程解析完全相同, 记录数量与写入的行数相同
+	FILE *fp = fopen(TEST_FILE, "w");
+	uint32_t records = 0, multi = 0;
+	fprintf(fp, "$ZONE big.test ttl=300\n$VIEW lan 10.0.0.0/8\n");
+	for (uint32_t i = 0; i < 80000; ++i, ++records) {
+		if (i % 5000 == 0) {
+			fprintf(fp, "multi.big.test 10.9.%u.%u\n", i >> 16, i / 5000);
+			++multi, ++records;
+		}
+		if (i % 7 == 0) fprintf(fp, "# comment line %u\r\n", i);
+		if (i % 1000 == 0) fprintf(fp, "@lan h%u.big.test 192.168.%u.%u\n", i, i >> 8 & 0xFF, i & 0xFF);
+		if (i % 3 == 0) fprintf(fp, "h%u.big.test TXT \"%*u\"\n", i, (int) (i % 40), i);
+		else fprintf(fp, "h%u.big.test %u 10.%u.%u.%u\r\n", i, 60 + i % 5, i >> 16, i >> 8 & 0xFF, i & 0xFF);
+	}
+	long size = ftell(fp);
+	fclose(fp);
+	assert(size > LOAD_THREADS_MAX / 2 * LOAD_CHUNK_MIN);
+	dnsdb_t *seq = dnsdb_read(TEST_FILE, 1), *par = dnsdb_read(TEST_FILE, LOAD_THREADS_MAX / 2);
+	assert(seq->recs.count == 80001 && par->recs.count == seq->recs.count);
+	assert(seq->node_count == par->node_count);
+	assert(seq->view_count == 1 && par->views[0].recs.count == 80 && seq->views[0].recs.count == 80);
+	uint32_t total = 0;
+	dnsdb_rec_t *pos;
+	list_foreach(pos, &seq->recs.list) {
+		dnsdb_rec_t *other = dnsdb_get(&par->recs, pos->host, strlen(pos->host));
+		assert(other && other->node && other->node->rec == other);
+		for (dnsdb_rrset_t *rs = pos->rrsets; rs; rs = rs->next) {
+			dnsdb_rrset_t *ors = dnsdb_rrset_get(other, rs->type);
+			assert(ors && ors->count == rs->count && ors->len == rs->len && !memcmp(ors->data, rs->data, rs->len));
+			total += rs->count;
+		}
+	}
+	assert(total == records);
+	dnsdb_rec_t *m = dnsdb_get(&par->recs, "multi.big.test", 14);
+	assert(m && m->rrsets->count == multi && m->rrsets->data[DNS_RR_HEAD_LEN + 3] == 0);
+	uint32_t diff[3];
+	dnsdb_diff(seq, par, diff);
+	assert(!diff[0] && !diff[1] && !diff[2]);
+	dnsdb_db_free(seq);
+	dnsdb_db_free(par);
 
-    return 0;
+	remove(TEST_FILE);
+	printf("test success\n");
+	return 0;
 }
 
-#endif // DNSDB_TEST
\ No newline at end of file
+#endif // DNSDB_TEST
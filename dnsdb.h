@@ -4,6 +4,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "net.h"
 #include "dnsproto.h"
 
 /** 加载域名记录
@@ -12,20 +13,84 @@
  */
 extern bool dnsdb_load(const char* filename);
 
-/** 保存域名记录
- * @return true: 保存成功, false: 保存失败
+/** 保存域名记录, 文件被手工修改且还没加载时不覆盖, 改为重新加载, 发布时重做未保存的修改后再保存
+ * @return true: 保存成功或已推迟到重新加载之后, false: 保存失败
  */
 extern bool dnsdb_save();
 
+/** 在后台线程重新加载数据库文件, 解析完成后由dnsdb_publish替换当前数据, 加载期间再次调用时, 完成后重新加载一次 */
+extern void dnsdb_reload();
+
+/** 在服务循环的两次请求之间调用, 后台加载已完成时用新数据替换当前数据并释放旧数据, 日志输出新增、改动、删除的数量
+ *  有还没保存的动态修改时, 在新数据上重做这些修改后保存
+ * @return true: 已替换, false: 没有完成的加载或加载失败
+ */
+extern bool dnsdb_publish();
+
+/** 监视数据库文件的改动, linux下使用inotify, 其它平台定时检查文件的修改时间, 文件改动后自动重新加载
+ * @return true: 成功, false: 失败
+ */
+extern bool dnsdb_watch();
+
+/** 把监视文件改动的描述符加入select的等待集合
+ * @return 已加入集合及maxfd中的最大值
+ */
+extern int dnsdb_watch_fdset(fd_set* rfds, int maxfd);
+
+/** select返回后调用, 数据库文件被其它程序改动时重新加载 */
+extern void dnsdb_watch_io(const fd_set* rfds);
+
 /** 释放dnsdb所分配的内存 */
 extern void dnsdb_free();
 
-/** 查找域名记录
+/** 查找域名指定类型的记录集, 返回的视图指向数据库内部预编码的内存, 只读, 数据库改动前有效
+ * @param host 域名
+ * @param type 记录类型, 域名是别名且查找的不是别名类型时, 返回别名记录集
+ * @param dst 回写记录集视图
+ * @return DNS_LOOKUP_FOUND: 成功, DNS_LOOKUP_NODATA: 域名存在但没有该类型记录, DNS_LOOKUP_NXDOMAIN: 域名不存在
+ */
+extern dns_lookup_t dnsdb_lookup(const char* host, uint16_t type, dns_rrset_view_t* dst);
+
+/** 按客户端地址选择视图, 在dns_process之前调用, 之后的查找中视图的记录覆盖同名的共享记录
+ * @param ip 客户端地址, 网络字节序
+ */
+extern void dnsdb_select_view(uint32_t ip);
+
+/** 获取域名所属区域的SOA记录, 用于否定应答, 不属于任何$ZONE定义的区域时, 以域名最后两级为区域合成默认SOA
+ * @param host 域名
+ * @param dst 回写SOA记录集视图
+ * @param zone 回写区域名
+ * @return true: 成功, false: 失败
+ */
+extern bool dnsdb_soa(const char* host, dns_rrset_view_t* dst, const char** zone);
+
+/** 判断域名是否属于$ZONE定义的区域, 属于已定义区域的域名由本地权威应答, 不转发
+ * @param host 域名
+ * @return true: 属于已定义区域, false: 不属于
+ */
+extern bool dnsdb_zone_exists(const char* host);
+
+/** 获取转发域名的缓存策略, 取$FORWARD指令中匹配的最长后缀, 没有匹配时预取阈值为10%, 不使用过期应答
  * @param host 域名
- * @return 成功返回ip, 失败返回 INADDR_NONE
+ * @param prefetch 回写预取阈值, 剩余生存时间的百分比, 0表示不预取
+ * @param stale 回写过期应答窗口, 秒为单位, 0表示不使用过期应答
+ */
+extern void dnsdb_forward_policy(const char* host, uint8_t* prefetch, uint32_t* stale);
+
+/** 查找域名的A记录
+ * @param host 域名
+ * @return 成功返回ip, 有多个ip时返回第一个, 失败返回 INADDR_NONE
  */
 extern uint32_t dnsdb_find(const char* host);
 
+/** 查找对所有客户端应答都相同的单条A记录: 共享记录中只有一条A记录, 且没有视图中的同名记录覆盖, 可以预先编码在数据平面直接应答
+ * @param host 域名
+ * @param ip 回写ip地址, 网络字节序
+ * @param ttl 回写生存时间
+ * @return true: 成功, false: 域名不存在或不满足条件
+ */
+extern bool dnsdb_find_single(const char* host, uint32_t* ip, uint32_t* ttl);
+
 /** 查找ip对应的域名
  * @param ip 查抄的ip地址
  * @param dst 找到ip后回写域名的地址
@@ -33,7 +98,7 @@ extern uint32_t dnsdb_find(const char* host);
  */
 extern bool dnsdb_findby_ip(uint32_t ip, char dst[HOST_MAX]);
 
-/** 更新或添加记录, 只在内存中更新, 需要用户自己调用records_save来保存
+/** 更新或添加A记录, 替换域名原有的全部A记录, 只在内存中更新, 需要用户自己调用dnsdb_save来保存
  * @param domain_name 域名
  * @param ip ip地址
  * @return true: 成功, false: 失败
@@ -46,6 +111,91 @@ extern bool dnsdb_update(const char* host, uint32_t ip);
  */
 extern bool dnsdb_delete(const char* host);
 
+/** 检查域名格式: 标签1-63个字母、数字、'-'或'_', 以单个'.'分隔, 总长度小于HOST_MAX
+ * @param host 域名
+ * @param wildcard 是否允许首个标签为通配符'*'
+ * @return true: 有效, false: 无效
+ */
+extern bool dnsdb_host_valid(const char* host, bool wildcard);
+
+/** 判断记录类型是否支持存放在数据库中
+ * @param type 记录类型
+ * @return true: 支持, false: 不支持
+ */
+extern bool dnsdb_type_supported(uint16_t type);
+
+/** 判断TXT记录的rdata能否保存为记录文件的文本并原样读回, 字符串不能包含控制字符、双引号及反斜杠
+ * @param rdata 报文格式的rdata
+ * @param rdlen rdata长度
+ * @return true: 可以保存, false: 不能保存
+ */
+extern bool dnsdb_txt_valid(const uint8_t* rdata, uint16_t rdlen);
+
+/** 获取域名所属的$ZONE区域名, 有多个匹配时取最长的区域
+ * @param host 域名
+ * @return 区域名, NULL表示不属于任何已定义区域
+ */
+extern const char* dnsdb_zone_name(const char* host);
+
+/** 判断共享记录中域名是否有记录
+ * @param host 域名
+ * @return true: 有记录, false: 没有
+ */
+extern bool dnsdb_name_exists(const char* host);
+
+/** 获取共享记录中域名指定类型的记录数量
+ * @param host 域名
+ * @param type 记录类型
+ * @param len 回写预编码数据的总长度, 可以为NULL
+ * @return 记录数量
+ */
+extern uint16_t dnsdb_rrset_count(const char* host, uint16_t type, uint16_t* len);
+
+/** 判断共享记录中是否存在rdata完全相同的记录
+ * @param host 域名
+ * @param type 记录类型
+ * @param rdata 报文格式的rdata, 不能包含压缩指针
+ * @param rdlen rdata长度
+ * @return true: 存在, false: 不存在
+ */
+extern bool dnsdb_rr_exists(const char* host, uint16_t type, const uint8_t* rdata, uint16_t rdlen);
+
+/** 往共享记录中添加一条记录, 记录已存在时只更新生存时间, 记录集内所有记录使用相同的生存时间, 只在内存中添加
+ * @param host 域名
+ * @param type 记录类型
+ * @param ttl 生存时间, 按所属区域的上下限修正
+ * @param rdata 报文格式的rdata, 不能包含压缩指针
+ * @param rdlen rdata长度
+ * @return true: 成功, false: 域名超长或记录集超过最大长度
+ */
+extern bool dnsdb_rr_add(const char* host, uint16_t type, uint32_t ttl, const uint8_t* rdata, uint16_t rdlen);
+
+/** 删除共享记录中域名指定类型的记录集, 只在内存中删除
+ * @param host 域名
+ * @param type 记录类型, DNS_QT_ANY表示全部类型, 此时区域顶点的NS记录保留
+ * @return true: 有记录被删除, false: 没有匹配的记录
+ */
+extern bool dnsdb_rrset_delete(const char* host, uint16_t type);
+
+/** 删除共享记录中rdata完全相同的一条记录, 只在内存中删除
+ * @param host 域名
+ * @param type 记录类型
+ * @param rdata 报文格式的rdata, 不能包含压缩指针
+ * @param rdlen rdata长度
+ * @return true: 有记录被删除, false: 没有匹配的记录
+ */
+extern bool dnsdb_rr_delete(const char* host, uint16_t type, const uint8_t* rdata, uint16_t rdlen);
+
+/** 记录改动的回调接口
+ * @param host 改动的域名, NULL表示重新加载后全部记录都可能改动
+ */
+typedef void (*dnsdb_change_func) (const char* host);
+
+/** 设置记录改动的回调接口, dnsdb_update、dnsdb_delete、dnsdb_rr_add等修改记录及dnsdb_publish替换数据后调用, 用于同步记录的副本
+ * @param change_func 回调函数, NULL表示取消
+ */
+extern void dnsdb_set_change(dnsdb_change_func change_func);
+
 /** 对记录进行循环，循环中回调处理，回调函数返回true则继续循环，返回false取消循环
  * @param callback 回调函数
  */
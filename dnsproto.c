@@ -5,42 +5,139 @@
 #include "log.h"
 #include "dnsproto.h"
 
-#define DNS_HEAD_LEN 12
-#define TTL 60
+/** 跟随别名链的最大深度, 避免别名循环引用 */
+#define DNS_CNAME_DEPTH 8
+/** 单个请求报文允许的最大问题数量 */
+#define DNS_QUESTION_MAX 8
+/** 名称压缩字典的最大条目数 */
+#define DNS_COMPRESS_MAX 64
+/** 解析压缩指针时允许的最大跳转次数, 避免指针循环 */
+#define DNS_POINTER_HOPS 16
+/** 不带选项的OPT伪记录长度 */
+#define DNS_OPT_LEN 11
+/** OPT伪记录的类型值 */
+#define DNS_QT_OPT 41
+/** EDNS cookie选项的代码 */
+#define DNS_OPT_COOKIE 10
 
 typedef const uint8_t* pcuint8_t;
 
-// dns查询类型定义
-enum dns_qt_t {
-	DNS_QT_A = 1,
-	DNS_QT_NS = 2,
-	DNS_QT_CNAME = 5,
-	DNS_QT_PTR = 12,
-	DNS_QT_MX = 15,
-	DNS_QT_AAAA = 28
-};
-
 // dns返回码定义
 enum dns_rcode_t {
 	DNS_RCODE_OK = 0,
 	DNS_RCODE_QUERY_ERROR = 1,
 	DNS_RCODE_SVR_FAILURE = 2,
-	DNS_RCODE_NAME_ERROR = 3
+	DNS_RCODE_NAME_ERROR = 3,
+	DNS_RCODE_BADVERS = 16			// 扩展返回码, 高8位写入OPT伪记录中
 };
 
 /** dns查询问题结构 */
 typedef struct dns_query_t {
-	uint32_t	ip;					// 查询结果，记录到此
 	uint16_t	offset;				// 查询在请求报文中的偏移地址，用于创建应答报文时的地址引用
 	uint16_t	type;              	// 查询类型
 	uint16_t	class;             	// 查询类, 通常为1, 固定为internet类
 	char 		host[HOST_MAX];   	// 域名
 } dns_query_t;
 
-static uint32_t (*g_dns_find_func) (const char* host) = NULL;
+/** dns请求报文的解析结果 */
+typedef struct dns_request_t {
+	uint16_t	qdcount;			// 问题数量
+	uint16_t	qend;				// 问题区域的结束偏移地址
+	bool		edns;				// 请求是否带有OPT伪记录
+	uint8_t		edns_version;		// 客户端的EDNS版本
+	uint16_t	udp_size;			// 客户端声明可接收的udp报文大小
+	uint16_t	cookie_off;			// cookie选项数据在请求报文中的偏移地址
+	uint16_t	cookie_len;			// cookie选项数据的长度, 0表示没有cookie选项
+	dns_query_t	quers[DNS_QUESTION_MAX];
+} dns_request_t;
+
+/** 响应报文写入器, 写入时检查协商的报文大小, 并维护已写入域名的压缩字典 */
+typedef struct dns_writer_t {
+	uint8_t		*buf;				// 响应报文起始地址
+	uint16_t	pos;				// 当前写入位置
+	uint16_t	max;				// 允许写入的最大长度
+	uint16_t	ncount;				// 压缩字典条目数量
+	uint16_t	names[DNS_COMPRESS_MAX];	// 已写入域名每个后缀的偏移地址
+} dns_writer_t;
+
+static dns_lookup_func g_dns_lookup_func = NULL;
+static dns_soa_func g_dns_soa_func = NULL;
+static dns_forward_func g_dns_forward_func = NULL;
+static dns_block_func g_dns_block_func = NULL;
+static dns_cookie_func g_dns_cookie_func = NULL;
+static dns_guard_func g_dns_guard_func = NULL;
+static dns_miss_func g_dns_miss_func = NULL;
+static dns_observe_func g_dns_observe_func = NULL;
+static dns_update_func g_dns_update_func = NULL;
+
+/** 拦截域名应答的预编码记录, 生存时间为DNS_TTL_DEFAULT, 地址全为0 */
+static const uint8_t _block_a[DNS_RR_HEAD_LEN + 4] = { 0, DNS_QT_A, 0, 1, 0, 0, 0, DNS_TTL_DEFAULT, 0, 4 };
+static const uint8_t _block_aaaa[DNS_RR_HEAD_LEN + 16] = { 0, DNS_QT_AAAA, 0, 1, 0, 0, 0, DNS_TTL_DEFAULT, 0, 16 };
+
+void dns_init(dns_lookup_func lookup_func, dns_soa_func soa_func) {
+	g_dns_lookup_func = lookup_func;
+	g_dns_soa_func = soa_func;
+}
+
+void dns_set_forward(dns_forward_func forward_func) {
+	g_dns_forward_func = forward_func;
+}
+
+void dns_set_block(dns_block_func block_func) {
+	g_dns_block_func = block_func;
+}
 
-void dns_init(uint32_t (*find_func) (const char* host)) {
-	g_dns_find_func = find_func;
+void dns_set_guard(dns_guard_func guard_func, dns_miss_func miss_func) {
+	g_dns_guard_func = guard_func;
+	g_dns_miss_func = miss_func;
+}
+
+void dns_set_observe(dns_observe_func observe_func) {
+	g_dns_observe_func = observe_func;
+}
+
+void dns_set_update(dns_update_func update_func) {
+	g_dns_update_func = update_func;
+}
+
+void dns_set_cookie(dns_cookie_func cookie_func) {
+	g_dns_cookie_func = cookie_func;
+}
+
+uint16_t dns_name_to_wire(const char* host, uint8_t* dst, size_t dst_size) {
+	size_t pos = 0;
+	while (*host) {
+		const char *dot = strchr(host, '.');
+		size_t len = dot ? (size_t)(dot - host) : strlen(host);
+		// 空标签或标签超长, 格式错误
+		if (!len || len > 63 || pos + len + 2 > dst_size)
+			return 0;
+		dst[pos++] = (uint8_t) len;
+		memcpy(dst + pos, host, len);
+		pos += len;
+		host += dot ? len + 1 : len;
+	}
+	if (pos + 1 > dst_size) return 0;
+	dst[pos++] = 0;
+	return (uint16_t) pos;
+}
+
+uint16_t dns_name_from_wire(const uint8_t* src, size_t src_size, char dst[HOST_MAX]) {
+	size_t pos = 0, rpos = 0;
+	while (rpos < src_size) {
+		size_t len = src[rpos++];
+		if (!len) {
+			dst[pos ? pos - 1 : 0] = '\0';
+			return (uint16_t) rpos;
+		}
+		// 不支持压缩指针, 标签超出范围也视为格式错误
+		if (len > 63 || rpos + len > src_size || pos + len + 1 > HOST_MAX)
+			return 0;
+		memcpy(dst + pos, src + rpos, len);
+		pos += len, rpos += len;
+		dst[pos++] = '.';
+	}
+	return 0;
 }
 
 /** 校验报文长度是否有效, 最小需要12个字节以上 */
@@ -55,116 +152,457 @@ inline static unsigned dns_get_opcode(pcuint8_t req) { return (req[2] >> 3) & 0x
 /** 获取报文要查询的域名数量 */
 inline static unsigned dns_get_questions(pcuint8_t req) { return ntohs(*(uint16_t*)(req + 4)); }
 
-/** 读取dns请求的queries查询区域
- * @param data 要读取起始地址(非报文起始地址, 第一次读取, 应该是queries区域的起始地址)
- * @param data_end 结尾地址，即允许读取的最大地址加1
- * @param dst 回写域名查询请求结构地址
- * @return 返回data的下一次读取地址, 返回NULL表示读取失败, 可能是格式有误或其它错误
+/** 获取报文指定偏移位置的两字节计数值 */
+inline static unsigned dns_get_count(pcuint8_t req, unsigned off) { return ntohs(*(uint16_t*)(req + off)); }
+
+size_t dns_read_name(pcuint8_t msg, size_t msg_len, size_t off, char host[HOST_MAX]) {
+	size_t pos = 0, next = 0;
+	int hops = 0;
+
+	while (off < msg_len) {
+		size_t len = msg[off++];
+		// 压缩指针, 高2位为11, 剩余14位为偏移地址
+		if ((len & 0xC0) == 0xC0) {
+			if (off >= msg_len || ++hops > DNS_POINTER_HOPS) break;
+			if (!next) next = off + 1;
+			off = ((len & 0x3F) << 8) | msg[off];
+			continue;
+		}
+		// 读取到长度为0，表明域名读取结束
+		if (!len) {
+			host[pos ? pos - 1 : 0] = '\0';
+			return next ? next : off;
+		}
+		// 域名长度超出报文长度或超出允许的最大长度，读取失败
+		if (len > 63 || off + len > msg_len || pos + len + 1 > HOST_MAX)
+			break;
+		memcpy(host + pos, msg + off, len);
+		pos += len, off += len;
+		host[pos++] = '.';
+	}
+
+	log_warn("%s error: read domain name error at offset[%u]!", __func__, (unsigned) off);
+	return 0;
+}
+
+size_t dns_skip_rr(pcuint8_t msg, size_t msg_len, size_t off) {
+	char host[HOST_MAX];
+	if (!(off = dns_read_name(msg, msg_len, off, host)) || off + DNS_RR_HEAD_LEN > msg_len)
+		return 0;
+	off += DNS_RR_HEAD_LEN + ntohs(*(uint16_t*)(msg + off + 8));
+	return off <= msg_len ? off : 0;
+}
+
+/** 解析OPT伪记录中的选项, 目前只处理cookie选项
+ * @param req 请求报文
+ * @param req_size 请求报文长度
+ * @param off 选项数据的起始偏移地址
+ * @param dst 回写cookie选项的位置
+ * @return false: 选项格式错误
  */
-static const uint8_t* dns_get_queries(pcuint8_t data, pcuint8_t data_end, dns_query_t *dst) {
-	// 传入参数错误
-	if (data >= data_end) {
-		log_warn("%s error: data[%" PRIxPTR "] >= data_end[%" PRIxPTR "]!", __func__, data, data_end);
-		return NULL; 
+static bool dns_parse_options(pcuint8_t req, size_t req_size, size_t off, dns_request_t *dst) {
+	size_t end = off + ntohs(*(uint16_t*)(req + off - 2));
+	if (end > req_size) return false;
+	while (off + 4 <= end) {
+		unsigned code = ntohs(*(uint16_t*)(req + off)), len = ntohs(*(uint16_t*)(req + off + 2));
+		off += 4;
+		if (off + len > end) return false;
+		if (code == DNS_OPT_COOKIE) {
+			// 只有客户端cookie, 或带有8到32字节的服务器cookie
+			if (len != DNS_COOKIE_CLIENT_LEN && (len < DNS_COOKIE_CLIENT_LEN + 8
+					|| len > DNS_COOKIE_CLIENT_LEN + DNS_COOKIE_SERVER_MAX)) {
+				log_warn("dns request cookie length[%u] error!", len);
+				return false;
+			}
+			dst->cookie_off = (uint16_t) off;
+			dst->cookie_len = (uint16_t) len;
+		}
+		off += len;
 	}
+	return off == end;
+}
 
-	size_t pos = 0, len;
-	char *host = dst->host;
+/** 解析请求报文的问题区域及附加区域中的OPT伪记录
+ * @param req 请求报文
+ * @param req_size 请求报文长度
+ * @param dst 回写解析结果
+ * @return 返回码, DNS_RCODE_OK: 成功, 其它值表示应答时使用的错误码
+ */
+static int dns_parse_request(pcuint8_t req, size_t req_size, dns_request_t *dst) {
+	unsigned qdcount = dns_get_questions(req);
+	size_t off = DNS_HEAD_LEN;
 
-	while (data < data_end && pos < HOST_MAX - 1) {
-		// 读取域名分段长度
-		len = (size_t)(*data++);
-		
-		// 读取到长度为0，表明域名读取结束
-		if (!len) {
-			// 最后一个字符是'.'，改成0
-			host[pos - 1] = '\0';
-			break;
+	memset(dst, 0, sizeof(*dst));
+	dst->qend = DNS_HEAD_LEN;
+	dst->udp_size = DNS_PACKET_MAX;
+
+	if (qdcount > DNS_QUESTION_MAX) {
+		log_warn("dns request questions[%u] unsupport!", qdcount);
+		return DNS_RCODE_QUERY_ERROR;
+	}
+
+	// 读取问题区域
+	for (unsigned i = 0; i < qdcount; ++i) {
+		dns_query_t *q = dst->quers + i;
+		q->offset = (uint16_t) off;
+		if (!(off = dns_read_name(req, req_size, off, q->host)) || off + 4 > req_size) {
+			log_warn("dns request queries format error!");
+			return DNS_RCODE_QUERY_ERROR;
 		}
-		
-		// 域名长度超出报文长度，读取失败
-		if (data + len > data_end) {
-			log_warn("%s error: read domain name error, prefix len[%u] invalid!", __func__, (uint32_t)len);
-			return NULL;
+		q->type = ntohs(*(uint16_t*)(req + off));
+		q->class = ntohs(*(uint16_t*)(req + off + 2));
+		off += 4;
+	}
+	dst->qdcount = (uint16_t) qdcount;
+	dst->qend = (uint16_t) off;
+
+	// 跳过回答区域和授权区域, 在附加区域中查找OPT伪记录
+	unsigned skip = dns_get_count(req, 6) + dns_get_count(req, 8), arcount = dns_get_count(req, 10);
+	while (skip--)
+		if (!(off = dns_skip_rr(req, req_size, off)))
+			return DNS_RCODE_QUERY_ERROR;
+	while (arcount--) {
+		// OPT伪记录的域名固定为根域名, 即一个0字节
+		if (off + DNS_OPT_LEN <= req_size && !req[off]
+				&& ntohs(*(uint16_t*)(req + off + 1)) == DNS_QT_OPT) {
+			if (dst->edns) return DNS_RCODE_QUERY_ERROR;
+			dst->edns = true;
+			dst->udp_size = ntohs(*(uint16_t*)(req + off + 3));
+			dst->edns_version = req[off + 6];
+			if (!dns_parse_options(req, req_size, off + DNS_OPT_LEN, dst))
+				return DNS_RCODE_QUERY_ERROR;
 		}
+		if (!(off = dns_skip_rr(req, req_size, off)))
+			return DNS_RCODE_QUERY_ERROR;
+	}
 
-		// 将分段域名写入host
-		while (len--) host[pos++] = *data++;
-		host[pos++] = '.';
+	// 没有问题的请求只允许用于获取服务器cookie(RFC 7873 5.4)
+	if (!qdcount && !dst->cookie_len) {
+		log_warn("dns request questions[%u] unsupport!", qdcount);
+		return DNS_RCODE_QUERY_ERROR;
+	}
+	if (dst->edns && dst->edns_version) {
+		log_warn("dns request edns version[%u] unsupport!", dst->edns_version);
+		return DNS_RCODE_BADVERS;
+	}
+	return DNS_RCODE_OK;
+}
+
+/** 计算协商后的响应报文最大长度, 客户端未使用EDNS时为512字节 */
+inline static uint16_t dns_payload_size(const dns_request_t *rq, size_t res_size) {
+	size_t size = DNS_PACKET_MAX;
+	if (rq->edns && rq->udp_size > DNS_PACKET_MAX)
+		size = rq->udp_size < DNS_EDNS_MAX ? rq->udp_size : DNS_EDNS_MAX;
+	return (uint16_t)(size < res_size ? size : res_size);
+}
+
+/** 初始化响应报文写入器 */
+inline static void dns_writer_init(dns_writer_t *w, uint8_t *buf, uint16_t max) {
+	w->buf = buf;
+	w->pos = DNS_HEAD_LEN;
+	w->max = max;
+	w->ncount = 0;
+}
+
+/** 把报文中offset位置开始的域名的每个后缀加入压缩字典, 遇到压缩指针时结束 */
+static void dns_writer_add_names(dns_writer_t *w, uint16_t off) {
+	while (off < w->pos && w->buf[off] && (w->buf[off] & 0xC0) != 0xC0
+			&& off < 0x4000 && w->ncount < DNS_COMPRESS_MAX) {
+		w->names[w->ncount++] = off;
+		off += w->buf[off] + 1;
+	}
+}
+
+/** 比较报文中off位置的域名与报文格式的域名wire是否相同, 不区分大小写 */
+static bool dns_writer_name_equal(const dns_writer_t *w, uint16_t off, pcuint8_t wire) {
+	int hops = 0;
+	while (off < w->pos) {
+		uint8_t len = w->buf[off];
+		if ((len & 0xC0) == 0xC0) {
+			if (++hops > DNS_POINTER_HOPS) return false;
+			off = ((len & 0x3F) << 8) | w->buf[off + 1];
+			continue;
+		}
+		if (len != *wire) return false;
+		if (!len) return true;
+		if (strncasecmp((const char*)(w->buf + off + 1), (const char*)(wire + 1), len))
+			return false;
+		off += len + 1, wire += len + 1;
+	}
+	return false;
+}
+
+/** 写入报文格式的域名, 已写入过的后缀使用压缩指针代替
+ * @param w 写入器
+ * @param wire 报文格式的域名(不含压缩指针)
+ * @param name_off 回写域名的有效偏移地址, 整个域名都已写入过时为之前写入的位置, 可以为NULL
+ * @return true: 成功, false: 空间不足
+ */
+static bool dns_writer_put_name(dns_writer_t *w, pcuint8_t wire, uint16_t *name_off) {
+	uint16_t prefix = 0, ptr = 0;
+	pcuint8_t p = wire;
+
+	// 从最长的后缀开始在压缩字典中查找
+	for (; *p; prefix += *p + 1, p += *p + 1) {
+		for (uint16_t i = 0; i < w->ncount && !ptr; ++i)
+			if (dns_writer_name_equal(w, w->names[i], p))
+				ptr = w->names[i];
+		if (ptr) break;
 	}
 
-	// 读取查询类型type和查询类class
-	dst->type = ntohs(*(uint16_t*)data);
-	dst->class = ntohs(*(uint16_t*)(data + 2));
+	uint16_t need = prefix + (ptr ? 2 : 1);
+	if (w->pos + need > w->max) return false;
+
+	uint16_t start = w->pos;
+	memcpy(w->buf + w->pos, wire, prefix);
+	w->pos += prefix;
+	if (ptr) {
+		*(uint16_t*)(w->buf + w->pos) = htons(ptr | 0xC000);
+		w->pos += 2;
+	} else {
+		w->buf[w->pos++] = 0;
+	}
+	if (prefix) dns_writer_add_names(w, start);
+	if (name_off) *name_off = prefix ? start : (ptr ? ptr : start);
+	return true;
+}
 
-	return data + 4;
+/** rdata中可压缩域名的起始位置, 只有早期定义的类型允许压缩, 不允许压缩的类型返回0xFFFF */
+inline static unsigned dns_rdata_name_pos(uint16_t type) {
+	switch (type) {
+		case DNS_QT_NS: case DNS_QT_CNAME: case DNS_QT_PTR: case DNS_QT_SOA: return 0;
+		case DNS_QT_MX: return 2;
+	}
+	return 0xFFFF;
+}
+
+/** 获取报文格式(不含压缩指针)的域名长度 */
+inline static uint16_t dns_wire_len(pcuint8_t wire) {
+	pcuint8_t p = wire;
+	while (*p) p += *p + 1;
+	return (uint16_t)(p - wire + 1);
+}
+
+/** 将记录集写入响应报文, 从view->first指定的记录开始轮转输出,
+ *  记录的域名部分使用指向owner的压缩指针, rdata中的域名也尽可能压缩
+ * @param w 写入器
+ * @param owner 记录所属域名在响应报文中的偏移地址
+ * @param owner_wire 不为NULL时, 第一条记录的域名按该报文格式域名压缩写入, 忽略owner参数
+ * @param view 记录集视图
+ * @param rdata_off 回写最后一条记录rdata中域名的偏移地址, 用于跟随别名, 可以为NULL
+ * @return 写入的记录数量, 少于记录集数量时表示空间不足
+ */
+static uint16_t dns_writer_put_rrset(dns_writer_t *w, uint16_t owner, pcuint8_t owner_wire,
+		const dns_rrset_view_t *view, uint16_t *rdata_off) {
+	pcuint8_t rr = view->data, rr_end = view->data + view->len;
+	uint16_t ptr = htons(owner | 0xC000), written = 0; // 1100_0000_0000_0000
+	unsigned npos = dns_rdata_name_pos(view->type);
+
+	// 定位轮转输出的第一条记录
+	for (uint16_t i = 0; i < view->first && rr < rr_end; ++i)
+		rr += DNS_RR_HEAD_LEN + ntohs(*(const uint16_t*)(rr + 8));
+
+	for (; written < view->count; ++written) {
+		if (rr >= rr_end) rr = view->data;
+		uint16_t rdlen = ntohs(*(const uint16_t*)(rr + 8)), start = w->pos, ncount = w->ncount;
+		if (owner_wire) {
+			// 写入第一条记录的域名, 后续记录引用该域名
+			if (!dns_writer_put_name(w, owner_wire, &owner)) break;
+			ptr = htons(owner | 0xC000);
+			owner_wire = NULL;
+		} else {
+			if (w->pos + 2 > w->max) break;
+			*(uint16_t*)(w->buf + w->pos) = ptr;
+			w->pos += 2;
+		}
+		if (w->pos + DNS_RR_HEAD_LEN > w->max) goto rollback;
+		memcpy(w->buf + w->pos, rr, DNS_RR_HEAD_LEN);
+		w->pos += DNS_RR_HEAD_LEN;
+
+		if (npos <= rdlen) {
+			// rdata中包含可压缩的域名, 先写入域名前面的固定部分, 再压缩写入域名,
+			// SOA记录有两个域名, 然后复制剩余部分, 最后修正rdlength
+			uint16_t rd_start = w->pos, noff;
+			pcuint8_t rd = rr + DNS_RR_HEAD_LEN + npos, rd_end = rr + DNS_RR_HEAD_LEN + rdlen;
+			if (w->pos + npos > w->max) goto rollback;
+			memcpy(w->buf + w->pos, rr + DNS_RR_HEAD_LEN, npos);
+			w->pos += npos;
+			if (!dns_writer_put_name(w, rd, &noff)) goto rollback;
+			rd += dns_wire_len(rd);
+			if (view->type == DNS_QT_SOA) {
+				if (!dns_writer_put_name(w, rd, NULL)) goto rollback;
+				rd += dns_wire_len(rd);
+			}
+			if (w->pos + (rd_end - rd) > w->max) goto rollback;
+			memcpy(w->buf + w->pos, rd, rd_end - rd);
+			w->pos += rd_end - rd;
+			*(uint16_t*)(w->buf + rd_start - 2) = htons(w->pos - rd_start);
+			if (rdata_off) *rdata_off = noff;
+		} else {
+			if (w->pos + rdlen > w->max) goto rollback;
+			memcpy(w->buf + w->pos, rr + DNS_RR_HEAD_LEN, rdlen);
+			w->pos += rdlen;
+		}
+		rr += DNS_RR_HEAD_LEN + rdlen;
+		continue;
+
+rollback:
+		w->pos = start;
+		w->ncount = ncount;
+		break;
+	}
+	return written;
+}
+
+/** 写入OPT伪记录
+ * @param w 写入器
+ * @param rcode 返回码, 扩展返回码的高8位写入OPT记录中
+ * @param opt 已编码的选项数据
+ * @param opt_len 选项数据长度
+ */
+static bool dns_writer_put_opt(dns_writer_t *w, int rcode, pcuint8_t opt, uint16_t opt_len) {
+	if (w->pos + DNS_OPT_LEN + opt_len > w->max) return false;
+	uint8_t *p = w->buf + w->pos;
+	p[0] = 0;
+	*(uint16_t*)(p + 1) = htons(DNS_QT_OPT);
+	*(uint16_t*)(p + 3) = htons(DNS_EDNS_MAX);
+	*(uint32_t*)(p + 5) = htonl((uint32_t)(rcode >> 4) << 24);
+	*(uint16_t*)(p + 9) = htons(opt_len);
+	memcpy(p + DNS_OPT_LEN, opt, opt_len);
+	w->pos += DNS_OPT_LEN + opt_len;
+	return true;
+}
+
+/** 校验请求中的cookie, 生成应答OPT伪记录中的cookie选项
+ * @param addr 客户端地址
+ * @param req 请求报文
+ * @param rq 请求的解析结果
+ * @param opt 回写cookie选项
+ * @param valid 回写请求中的服务器cookie是否有效
+ * @return cookie选项的长度, 0: 不需要应答cookie
+ */
+static uint16_t dns_build_cookie(const sockaddr_in_t* addr, pcuint8_t req, const dns_request_t *rq,
+		uint8_t opt[DNS_OPT_DATA_MAX], bool *valid) {
+	*valid = false;
+	if (!g_dns_cookie_func) return 0;
+	uint16_t n = g_dns_cookie_func(addr, req + rq->cookie_off, rq->cookie_len,
+			opt + 4 + DNS_COOKIE_CLIENT_LEN, valid);
+	if (!rq->cookie_len || !n || n > DNS_COOKIE_SERVER_MAX) return 0;
+	*(uint16_t*)opt = htons(DNS_OPT_COOKIE);
+	*(uint16_t*)(opt + 2) = htons(DNS_COOKIE_CLIENT_LEN + n);
+	memcpy(opt + 4, req + rq->cookie_off, DNS_COOKIE_CLIENT_LEN);
+	return 4 + DNS_COOKIE_CLIENT_LEN + n;
 }
 
 /** 创建dns响应报文的头部, 共12个字节
  * @param res 响应报文地址
  * @param req 请求报文地址
- * @param rcode 响应报文的返回码值
+ * @param rcode 响应报文的返回码值, 只写入低4位
+ * @param qdcount 响应报文的问题数量
  * @param ancount 响应报文的回答区域数量
+ * @param nscount 响应报文的授权区域数量
+ * @param arcount 响应报文的附加区域数量
 */
-static void dns_build_header(pcuint8_t req, uint8_t *res, uint16_t rcode, uint16_t ancount) {
-	// 头部12字节清零
-	*(uint64_t*)res = 0, *(uint32_t*)(res + 8) = 0;
-
+static void dns_build_header(pcuint8_t req, uint8_t *res, uint16_t rcode,
+		uint16_t qdcount, uint16_t ancount, uint16_t nscount, uint16_t arcount) {
 	// 0,1 两字节为id，从请求中获取
 	*(uint16_t*)res = *(const uint16_t*)req;
 
 	// 2,3 两字节为标志位，设置为(高位到低位) QR(1)_0000_AA(1)_00_0000_RCODE(4)
 	// QR: 0: 查询, 1: 应答, AA 1: 授权回答, 0: 非授权回答,  RCODE 响应码
 	*(res + 2) = 0x84; // 0x84 = 10000100, 应答报文，且是授权应答
-	*(res + 3) = (uint8_t) rcode;
+	*(res + 3) = (uint8_t)(rcode & 0xF);
 
 	// 4,5,6,7,8,9,10,11为4个两字节长度的（请求、回答、授权、附加）数量
-	*(uint16_t*)(res + 4) = *(const uint16_t*)(req + 4);
+	*(uint16_t*)(res + 4) = htons(qdcount);
 	*(uint16_t*)(res + 6) = htons(ancount);
+	*(uint16_t*)(res + 8) = htons(nscount);
+	*(uint16_t*)(res + 10) = htons(arcount);
 }
 
-/** 把查询内容写入到响应报文中, 返回写入查询内容后的总报文长度 */
-static uint16_t dns_copy_queries(pcuint8_t req, uint8_t *res) {
-	uint16_t count = (uint16_t) dns_get_questions(req), pos = DNS_HEAD_LEN;
-	while (count--) {
-		while ((res[pos] = req[pos]))
-			for (uint16_t len = req[pos++], max = pos + len; pos < max; ++pos)
-				res[pos] = req[pos];
-		pos++;
-		*(uint32_t*)(res + pos) = *(uint32_t*)(req + pos);
-		pos += 4;
+/** 回答一个问题, 把记录集写入回答区域, 别名记录的目标域名在本地有记录时, 继续跟随
+ * @param w 写入器
+ * @param q 问题
+ * @param ancount 累加写入的回答记录数量
+ * @param truncated 空间不足时回写true
+ * @param last 回写最终查找的域名, 否定应答时用于查找SOA记录
+ * @param quiet 找不到记录时不输出日志, 受到攻击的区域使用
+ * @return 最终域名的查找结果
+ */
+static dns_lookup_t dns_answer_query(dns_writer_t *w, const dns_query_t *q, uint16_t *ancount,
+		bool *truncated, char last[HOST_MAX], bool quiet) {
+	// 查找域名对应类型的记录集, 域名是别名时返回的是别名记录集
+	dns_rrset_view_t view;
+	dns_lookup_t ret = g_dns_lookup_func(q->host, q->type, &view);
+	strcpy(last, q->host);
+	if (ret != DNS_LOOKUP_FOUND) {
+		if (!quiet) log_warn("dns query result: %s %s [type=%u]", ret == DNS_LOOKUP_NODATA ? "no data" : "can't find",
+				q->host, q->type);
+		return ret;
 	}
-	return pos;
-}
 
-/** 创建一个域名错误的回答, 返回生成的报文长度 */
-inline static uint16_t dns_build_fail(pcuint8_t req, uint8_t* res, uint16_t rcode) {
-	dns_build_header(req, res, rcode, 0);
-	return dns_copy_queries(req, res);
+	uint16_t owner = q->offset, written;
+	for (int depth = 0; ; ) {
+		*ancount += written = dns_writer_put_rrset(w, owner, NULL, &view, &owner);
+		if (written < view.count) {
+			log_warn("dns answer write res memory no enough, truncated.");
+			*truncated = true;
+			break;
+		}
+		if (view.type != DNS_QT_CNAME || q->type == DNS_QT_CNAME || ++depth >= DNS_CNAME_DEPTH)
+			break;
+		// 别名的目标域名就在刚写入的记录的rdata中, 后续记录的域名直接引用该位置
+		if (!dns_read_name(w->buf, w->pos, owner, last))
+			break;
+		log_debug("dns anwser: %s follow cname %s", q->host, last);
+		// 目标域名在本地找不到时, 只返回别名记录, 由客户端继续解析目标域名
+		if (g_dns_lookup_func(last, q->type, &view) != DNS_LOOKUP_FOUND)
+			break;
+	}
+	log_debug("dns anwser: %s [type=%u] -> %u records", q->host, q->type, *ancount);
+	return ret;
 }
 
-/** 构建一个查询响应内容
- * @param reply 写入响应内容的起始地址
- * @param reply_end 最大可写入的结束地址
- * @param query 查询问题结构
- * @param ip 写入的响应ip地址
- * @return 写入长度
+/** 回答被拦截的问题, A及AAAA查询写入全0地址的记录, 其它类型没有记录
+ * @param block 拦截的应答方式
+ * @return 查找结果, 与dns_answer_query相同
  */
-static uint16_t dns_build_answer(uint8_t *data, uint8_t *data_end, const dns_query_t *query) {
-	if (data_end - data < 16) return 0;
-	uint16_t off = query->offset | 0xC000; // 1100_0000_0000_0000
-	*(uint16_t*)(data) = htons(off);
-	*(uint16_t*)(data + 2) = htons(query->type);
-	*(uint16_t*)(data + 4) = htons(query->class);
-	*(uint32_t*)(data + 6) = htonl(TTL);
+static dns_lookup_t dns_answer_blocked(dns_writer_t *w, const dns_query_t *q, dns_block_t block,
+		uint16_t *ancount, bool *truncated, char last[HOST_MAX]) {
+	strcpy(last, q->host);
+	if (block == DNS_BLOCK_NXDOMAIN) return DNS_LOOKUP_NXDOMAIN;
+	if (q->type != DNS_QT_A && q->type != DNS_QT_AAAA) return DNS_LOOKUP_NODATA;
+
+	dns_rrset_view_t view = { .count = 1, .type = q->type, .first = 0 };
+	view.data = q->type == DNS_QT_A ? _block_a : _block_aaaa;
+	view.len = q->type == DNS_QT_A ? sizeof(_block_a) : sizeof(_block_aaaa);
+	if (dns_writer_put_rrset(w, q->offset, NULL, &view, NULL) != 1) {
+		*truncated = true;
+		return DNS_LOOKUP_NODATA;
+	}
+	++*ancount;
+	log_debug("dns anwser: %s [type=%u] blocked", q->host, q->type);
+	return DNS_LOOKUP_FOUND;
+}
 
-	*(data + 10) = 0;
-	*(data + 11) = 4;
-	*(uint32_t*)(data + 12) = query->ip;
-	return 16;
+/** 在授权区域中写入域名所属区域的SOA记录, 生存时间为否定应答的缓存时间 */
+static bool dns_put_soa(dns_writer_t *w, const char *host) {
+	dns_rrset_view_t view;
+	const char *zone;
+	uint8_t wire[HOST_MAX + 1];
+
+	if (!g_dns_soa_func || !g_dns_soa_func(host, &view, &zone)
+			|| !dns_name_to_wire(zone, wire, sizeof(wire)))
+		return false;
+	return dns_writer_put_rrset(w, 0, wire, &view, NULL) == 1;
 }
 
-uint16_t dns_process(const void *req, size_t req_size, uint8_t res[DNS_PACKET_MAX]) {
+uint16_t dns_process(const sockaddr_in_t* addr, const void *req, size_t req_size,
+		uint8_t *res, size_t res_size, bool *cookie_valid) {
+	bool valid;
+	if (!cookie_valid) cookie_valid = &valid;
+	*cookie_valid = false;
+
 	// 判断报文长度
 	if (!dns_check_len(req_size)) {
 		log_warn("dns request length[%" PRIu64 "] too small!", (uint64_t)req_size);
@@ -179,50 +617,268 @@ uint16_t dns_process(const void *req, size_t req_size, uint8_t res[DNS_PACKET_MA
 
 	// 获取操作码, 0: 标准查询, 1: 反向查询, 2: 服务器状态请求
 	unsigned opcode = dns_get_opcode(req);
-	if (opcode > 1) {
+	if (opcode == DNS_OPCODE_UPDATE && g_dns_update_func)
+		return g_dns_update_func(addr, req, req_size, res, res_size);
+	if (opcode > DNS_OPCODE_MAX) {
 		log_warn("dns request opcode[%d] unsupport!", opcode);
 		return 0;
 	}
 
-	// 获取查询数量, 当前暂时只支持1个域名的查询, 一次性查多个域名暂不支持
-	int questions = dns_get_questions(req);
-	if (questions != 1) {
-		log_warn("dns request multiple questions[%u] unsupport!", questions);
-		return dns_build_fail(req, res, DNS_RCODE_NAME_ERROR);
+	// 解析查询请求, 格式错误时应答中不包含问题区域
+	dns_request_t rq;
+	int rcode = dns_parse_request(req, req_size, &rq);
+	if (rcode == DNS_RCODE_QUERY_ERROR)
+		rq.qdcount = 0, rq.qend = DNS_HEAD_LEN, rq.cookie_len = 0;
+	uint8_t opt[DNS_OPT_DATA_MAX];
+	uint16_t opt_len = dns_build_cookie(addr, req, &rq, opt, cookie_valid);
+
+	// 应答大小受协商的报文大小限制, 并为OPT伪记录预留空间
+	dns_writer_t w;
+	uint16_t max = dns_payload_size(&rq, res_size);
+	dns_writer_init(&w, res, rq.edns ? max - DNS_OPT_LEN - opt_len : max);
+	if (rq.qend > w.max) {
+		log_warn("dns request questions too large!");
+		return 0;
 	}
 
-	// 解析查询请求
-	const uint8_t *rp;
-	dns_query_t quer = {.offset = DNS_HEAD_LEN, .ip = INADDR_NONE};
-	rp = dns_get_queries(req + DNS_HEAD_LEN, req + req_size, &quer);
-	if (rp == NULL) {
-		log_warn("dns request queries format error!");
-		return dns_build_fail(req, res, DNS_RCODE_NAME_ERROR);
+	// 问题区域原样复制到应答中, 偏移地址与请求一致, 问题中的域名加入压缩字典
+	memcpy(res + DNS_HEAD_LEN, (pcuint8_t) req + DNS_HEAD_LEN, rq.qend - DNS_HEAD_LEN);
+	w.pos = rq.qend;
+	for (uint16_t i = 0; i < rq.qdcount; ++i) {
+		log_debug("dns request query: %s [type=%u, class=%u]", rq.quers[i].host,
+				rq.quers[i].type, rq.quers[i].class);
+		dns_writer_add_names(&w, rq.quers[i].offset);
 	}
-	// 解析查询请求中的域名信息错误或者请求的查询类型不是ipv4地址解析类型
-	if (quer.type != DNS_QT_A) {
-		log_warn("dns request query type unsupport: %s [type=%u,class=%u]",
-				quer.host, quer.type, quer.class);
-		return dns_build_fail(req, res, DNS_RCODE_NAME_ERROR);
+
+	// 逐个回答问题, 全部问题的域名都不存在时返回域名不存在, 否则返回成功
+	uint16_t ancount = 0, nscount = 0, negs = 0;
+	bool truncated = false, exists = false;
+	char neg_hosts[DNS_QUESTION_MAX][HOST_MAX];
+	if (rcode == DNS_RCODE_OK) {
+		for (uint16_t i = 0; i < rq.qdcount && !truncated; ++i) {
+			if (g_dns_observe_func) g_dns_observe_func(rq.quers[i].host);
+			// 先检查拦截列表, 被拦截的域名不查找本地记录, 也不转发, 受到攻击的区域不转发、不输出日志
+			dns_block_t block = g_dns_block_func ? g_dns_block_func(rq.quers[i].host) : DNS_BLOCK_NONE;
+			bool guarded = block == DNS_BLOCK_NONE && g_dns_guard_func && g_dns_guard_func(rq.quers[i].host);
+			dns_lookup_t ret = block != DNS_BLOCK_NONE
+				? dns_answer_blocked(&w, rq.quers + i, block, &ancount, &truncated, neg_hosts[negs])
+				: dns_answer_query(&w, rq.quers + i, &ancount, &truncated, neg_hosts[negs], guarded);
+			// 单个问题的域名在本地不存在时, 交给转发模块处理, 转发到上游的查询也算未命中
+			if (ret == DNS_LOOKUP_NXDOMAIN && block == DNS_BLOCK_NONE && !ancount && rq.qdcount == 1
+					&& g_dns_forward_func) {
+				dns_fwd_query_t fq = { .req = req, .req_size = (uint16_t) req_size, .qend = rq.qend,
+					.type = rq.quers[0].type, .class = rq.quers[0].class, .max = max,
+					.edns = rq.edns, .cookie = *cookie_valid, .opt_len = opt_len, .opt = opt,
+					.cache_only = guarded, .host = rq.quers[0].host };
+				int n = g_dns_forward_func(addr, &fq, res, max);
+				if (n == 0 && g_dns_miss_func) g_dns_miss_func(rq.quers[0].host);
+				if (n >= 0) return (uint16_t) n;
+			}
+			if (ret == DNS_LOOKUP_NXDOMAIN && block == DNS_BLOCK_NONE && g_dns_miss_func)
+				g_dns_miss_func(rq.quers[i].host);
+			if (ret != DNS_LOOKUP_NXDOMAIN) exists = true;
+			if (ret != DNS_LOOKUP_FOUND) ++negs;
+		}
+		if (!exists && rq.qdcount) rcode = DNS_RCODE_NAME_ERROR;
+
+		// 否定应答在授权区域附带SOA记录, 客户端据此缓存否定结果
+		for (uint16_t i = 0; i < negs && !truncated; ++i)
+			if (dns_put_soa(&w, neg_hosts[i])) ++nscount;
 	}
-	log_debug("dns request query: %s [type=%u, class=%u]", quer.host, quer.type, quer.class);
 
-	// 对成功解析的请求进行响应
-	quer.ip = g_dns_find_func(quer.host);
-	if (quer.ip == INADDR_NONE) {
-		log_warn("dns query result: can't find %s", quer.host);
-		return dns_build_fail(req, res, DNS_RCODE_NAME_ERROR);
+	w.max = max;
+	if (rq.edns) dns_writer_put_opt(&w, rcode, opt, opt_len);
+	dns_build_header(req, res, rcode, rq.qdcount, ancount, nscount, rq.edns ? 1 : 0);
+	if (truncated) res[2] |= 0x02; // TC标志位, 报文被截断
+
+	return w.pos;
+}
+
+// #define DNSPROTO_TEST
+#ifdef DNSPROTO_TEST
+#include <assert.h>
+#include <stdio.h>
+
+/** 测试用的记录, 预编码为记录集视图 */
+typedef struct test_rrset_t {
+	const char	*host;
+	uint16_t	type;
+	uint16_t	count;
+	uint16_t	len;
+	uint8_t		data[512];
+} test_rrset_t;
+
+static test_rrset_t _rrsets[8];
+static int _rrset_count = 0;
+static uint8_t _soa[128];
+static uint16_t _soa_len = 0;
+
+/** 在预编码数据末尾追加一条记录 */
+static uint16_t test_put_rr(uint8_t* dst, uint16_t type, uint32_t ttl, const uint8_t* rdata, uint16_t rdlen) {
+	*(uint16_t*) dst = htons(type);
+	*(uint16_t*)(dst + 2) = htons(1);
+	*(uint32_t*)(dst + 4) = htonl(ttl);
+	*(uint16_t*)(dst + 8) = htons(rdlen);
+	memcpy(dst + DNS_RR_HEAD_LEN, rdata, rdlen);
+	return DNS_RR_HEAD_LEN + rdlen;
+}
+
+/** 添加一条记录, 同一域名同一类型的记录追加到同一记录集 */
+static void test_add(const char* host, uint16_t type, const uint8_t* rdata, uint16_t rdlen) {
+	test_rrset_t *rs = NULL;
+	for (int i = 0; i < _rrset_count && !rs; ++i)
+		if (!strcmp(_rrsets[i].host, host) && _rrsets[i].type == type) rs = _rrsets + i;
+	if (!rs) {
+		rs = _rrsets + _rrset_count++;
+		rs->host = host, rs->type = type;
 	}
+	rs->len += test_put_rr(rs->data + rs->len, type, 300, rdata, rdlen);
+	rs->count++;
+}
+
+static dns_lookup_t test_lookup(const char* host, uint16_t type, dns_rrset_view_t* dst) {
+	bool exists = false;
+	for (int i = 0; i < _rrset_count; ++i) {
+		const test_rrset_t *rs = _rrsets + i;
+		if (strcmp(rs->host, host)) continue;
+		exists = true;
+		if (rs->type == type || (rs->type == DNS_QT_CNAME && type != DNS_QT_CNAME)) {
+			*dst = (dns_rrset_view_t) { .data = rs->data, .len = rs->len, .count = rs->count, .type = rs->type };
+			return DNS_LOOKUP_FOUND;
+		}
+	}
+	return exists ? DNS_LOOKUP_NODATA : DNS_LOOKUP_NXDOMAIN;
+}
 
-	// 生成应答包
-	dns_build_header(req, res, 0, 1);
-	uint16_t hlen = dns_copy_queries(req, res);
-	uint16_t alen = dns_build_answer(res + hlen, res + DNS_PACKET_MAX - hlen, &quer);
-	if (!alen) {
-		log_warn("dns answer write res memory no enough.");
-		return dns_build_fail(req, res, DNS_RCODE_SVR_FAILURE);
+static bool test_soa(const char* host, dns_rrset_view_t* dst, const char** zone) {
+	size_t n = strlen(host);
+	if (n < 5 || strcmp(host + n - 5, "a.com")) return false;
+	*dst = (dns_rrset_view_t) { .data = _soa, .len = _soa_len, .count = 1, .type = DNS_QT_SOA };
+	*zone = "a.com";
+	return true;
+}
+
+/** 生成查询请求, 问题中的域名不压缩 */
+static uint16_t test_query(uint8_t* buf, int n, const char* const hosts[], const uint16_t types[]) {
+	static const uint8_t head[DNS_HEAD_LEN] = { 0x12, 0x34, 0x01, 0x00 };
+	memcpy(buf, head, DNS_HEAD_LEN);
+	buf[5] = (uint8_t) n;
+	uint16_t pos = DNS_HEAD_LEN;
+	for (int i = 0; i < n; ++i) {
+		pos += dns_name_to_wire(hosts[i], buf + pos, 256);
+		*(uint16_t*)(buf + pos) = htons(types[i]);
+		*(uint16_t*)(buf + pos + 2) = htons(1);
+		pos += 4;
 	}
-	log_debug("dns anwser: %s -> %s", quer.host, net_ip_tostring(quer.ip));
+	return pos;
+}
+
+/** 发送单个问题的查询, 返回应答长度 */
+static uint16_t test_ask(const char* host, uint16_t type, uint8_t* res, size_t res_size) {
+	uint8_t req[512];
+	uint16_t n = test_query(req, 1, &host, &type);
+	return dns_process(NULL, req, n, res, res_size, NULL);
+}
 
-	return hlen + alen;
+#define RCODE(res) ((res)[3] & 0xF)
+#define COUNT(res, off) ntohs(*(const uint16_t*)((res) + (off)))
+#define TC(res) ((res)[2] & 0x02)
+
+int main() {
+	const uint8_t ip1[] = { 1, 2, 3, 4 }, ip2[] = { 5, 6, 7, 8 };
+	uint8_t wire[HOST_MAX + 8], res[DNS_EDNS_MAX];
+	test_add("www.a.com", DNS_QT_A, ip1, 4);
+	test_add("www.a.com", DNS_QT_A, ip2, 4);
+	test_add("alias.a.com", DNS_QT_CNAME, wire, dns_name_to_wire("www.a.com", wire, sizeof(wire)));
+	wire[0] = 0, wire[1] = 10;
+	test_add("a.com", DNS_QT_MX, wire, 2 + dns_name_to_wire("mx.a.com", wire + 2, sizeof(wire) - 2));
+	for (uint8_t i = 0; i < 20; ++i)
+		test_add("big.a.com", DNS_QT_A, (const uint8_t[]) { 10, 0, 0, i }, 4);
+	uint8_t rdata[128], *p = rdata;
+	p += dns_name_to_wire("ns.a.com", p, 64);
+	p += dns_name_to_wire("admin.a.com", p, 64);
+	memset(p, 0, 20);
+	p[3] = 1, p[19] = 60;
+	_soa_len = test_put_rr(_soa, DNS_QT_SOA, 60, rdata, (uint16_t)(p + 20 - rdata));
+	dns_init(test_lookup, test_soa);
+
+	// A记录: 回答的域名都是指向问题的压缩指针
+	static const uint8_t a_res[] = {
+		0x12, 0x34, 0x84, 0x00, 0, 1, 0, 2, 0, 0, 0, 0,
+		3, 'w', 'w', 'w', 1, 'a', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+		0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0x01, 0x2C, 0, 4, 1, 2, 3, 4,
+		0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0x01, 0x2C, 0, 4, 5, 6, 7, 8 };
+	assert(test_ask("www.a.com", DNS_QT_A, res, sizeof(res)) == sizeof(a_res));
+	assert(!memcmp(res, a_res, sizeof(a_res)));
+
+	// 跟随别名: 别名rdata中的a.com压缩为指向问题的指针(0x12), 目标记录的域名指向别名rdata(0x29)
+	static const uint8_t cname_res[] = {
+		0x12, 0x34, 0x84, 0x00, 0, 1, 0, 3, 0, 0, 0, 0,
+		5, 'a', 'l', 'i', 'a', 's', 1, 'a', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+		0xC0, 0x0C, 0, 5, 0, 1, 0, 0, 0x01, 0x2C, 0, 6, 3, 'w', 'w', 'w', 0xC0, 0x12,
+		0xC0, 0x29, 0, 1, 0, 1, 0, 0, 0x01, 0x2C, 0, 4, 1, 2, 3, 4,
+		0xC0, 0x29, 0, 1, 0, 1, 0, 0, 0x01, 0x2C, 0, 4, 5, 6, 7, 8 };
+	assert(test_ask("alias.a.com", DNS_QT_A, res, sizeof(res)) == sizeof(cname_res));
+	assert(!memcmp(res, cname_res, sizeof(cname_res)));
+
+	// MX记录rdata中的域名压缩, rdlength按压缩后的长度修正
+	static const uint8_t mx_res[] = {
+		0x12, 0x34, 0x84, 0x00, 0, 1, 0, 1, 0, 0, 0, 0,
+		1, 'a', 3, 'c', 'o', 'm', 0, 0, 15, 0, 1,
+		0xC0, 0x0C, 0, 15, 0, 1, 0, 0, 0x01, 0x2C, 0, 7, 0, 10, 2, 'm', 'x', 0xC0, 0x0C };
+	assert(test_ask("a.com", DNS_QT_MX, res, sizeof(res)) == sizeof(mx_res));
+	assert(!memcmp(res, mx_res, sizeof(mx_res)));
+
+	// 域名存在但没有该类型的记录: 返回码为0, 授权区域带SOA记录, 区域名及rdata中的域名都压缩
+	static const uint8_t soa_auth[] = {
+		0xC0, 0x10, 0, 6, 0, 1, 0, 0, 0, 60, 0, 33,
+		2, 'n', 's', 0xC0, 0x10, 5, 'a', 'd', 'm', 'i', 'n', 0xC0, 0x10,
+		0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 60 };
+	uint16_t n = test_ask("www.a.com", DNS_QT_TXT, res, sizeof(res));
+	assert(n == 27 + sizeof(soa_auth) && !memcmp(res + 27, soa_auth, sizeof(soa_auth)));
+	assert(RCODE(res) == 0 && COUNT(res, 6) == 0 && COUNT(res, 8) == 1 && !TC(res));
+
+	// 域名不存在: 返回码为3, 授权区域带SOA记录, 区域名指向问题中的a.com(0x0F)
+	n = test_ask("nx.a.com", DNS_QT_A, res, sizeof(res));
+	assert(RCODE(res) == 3 && COUNT(res, 6) == 0 && COUNT(res, 8) == 1);
+	assert(n == 26 + sizeof(soa_auth) && res[26] == 0xC0 && res[27] == 0x0F);
+
+	// 多个问题: 问题原样复制, 第二个问题的记录域名指向第二个问题(0x1B), 只要有一个域名存在返回码就为0
+	const char *hosts[] = { "www.a.com", "a.com", "nx.a.com" };
+	const uint16_t types[] = { DNS_QT_A, DNS_QT_MX, DNS_QT_A };
+	uint8_t req[512];
+	uint16_t len = test_query(req, 3, hosts, types);
+	n = dns_process(NULL, req, len, res, sizeof(res), NULL);
+	assert(RCODE(res) == 0 && COUNT(res, 4) == 3 && COUNT(res, 6) == 3 && COUNT(res, 8) == 1);
+	assert(!memcmp(res + DNS_HEAD_LEN, req + DNS_HEAD_LEN, len - DNS_HEAD_LEN));
+	assert(res[len + 32] == 0xC0 && res[len + 33] == 0x1B);
+	// MX的rdata中mx.a.com的后缀压缩为第一个问题中的a.com(0x10)
+	assert(res[len + 46] == 2 && res[len + 49] == 0xC0 && res[len + 50] == 0x10);
+	// 第三个问题不存在, 授权区域带SOA记录, 与单个问题时相同
+	assert(n == len + 51 + sizeof(soa_auth) && !memcmp(res + len + 51, soa_auth, sizeof(soa_auth)));
+
+	// 超过问题数量上限时应答格式错误, 不带问题区域
+	memset(req + 4, 0, 2);
+	req[5] = DNS_QUESTION_MAX + 1;
+	assert(dns_process(NULL, req, len, res, sizeof(res), NULL) == DNS_HEAD_LEN);
+	assert(RCODE(res) == 1 && COUNT(res, 4) == 0);
+
+	// 可写长度不足: 只写入完整的记录, 设置TC标志, 不写授权区域
+	n = test_ask("big.a.com", DNS_QT_A, res, 100);
+	assert(n == 27 + 4 * 16 && COUNT(res, 6) == 4 && TC(res));
+	n = test_ask("big.a.com", DNS_QT_A, res, sizeof(res));
+	assert(n == 27 + 20 * 16 && COUNT(res, 6) == 20 && !TC(res));
+
+	// rdata中的域名写不下时回滚整条记录, 包括已写入的域名部分及压缩字典
+	n = test_ask("a.com", DNS_QT_MX, res, sizeof(mx_res) - 1);
+	assert(n == 23 && COUNT(res, 6) == 0 && TC(res));
+
+	// 应答报文不接收, 报文过短不应答
+	memcpy(req, a_res, sizeof(a_res));
+	assert(dns_process(NULL, req, sizeof(a_res), res, sizeof(res), NULL) == 0);
+	assert(dns_process(NULL, req, DNS_HEAD_LEN, res, sizeof(res), NULL) == 0);
+
+	printf("test success\n");
+	return 0;
 }
+#endif // DNSPROTO_TEST
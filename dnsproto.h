@@ -3,11 +3,78 @@
 #define __DNSPROTO_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "net.h"
 
 /** 域名最大允许长度 */
 #define HOST_MAX 64
+/** dns报文头部长度 */
+#define DNS_HEAD_LEN 12
+/** 支持的最大操作码, 0: 标准查询, 1: 反向查询 */
+#define DNS_OPCODE_MAX 1
+/** 动态更新的操作码(RFC 2136), 由更新回调接口处理 */
+#define DNS_OPCODE_UPDATE 5
 #define DNS_PACKET_MAX 512
+/** 使用EDNS时允许的最大udp报文长度 */
+#define DNS_EDNS_MAX 1232
+/** 资源记录默认的生存时间, 秒为单位 */
+#define DNS_TTL_DEFAULT 60
+/** 预编码资源记录的固定头部长度, type(2) class(2) ttl(4) rdlength(2) */
+#define DNS_RR_HEAD_LEN 10
+/** 客户端cookie的长度 */
+#define DNS_COOKIE_CLIENT_LEN 8
+/** 服务器cookie的最大长度 */
+#define DNS_COOKIE_SERVER_MAX 32
+/** 应答OPT伪记录中选项数据的最大长度, 目前只有cookie选项: code(2) length(2) 客户端cookie 服务器cookie */
+#define DNS_OPT_DATA_MAX (4 + DNS_COOKIE_CLIENT_LEN + DNS_COOKIE_SERVER_MAX)
+
+// dns资源记录类型定义
+enum dns_qt_t {
+	DNS_QT_A = 1,
+	DNS_QT_NS = 2,
+	DNS_QT_CNAME = 5,
+	DNS_QT_SOA = 6,
+	DNS_QT_PTR = 12,
+	DNS_QT_MX = 15,
+	DNS_QT_TXT = 16,
+	DNS_QT_AAAA = 28,
+	DNS_QT_SRV = 33,
+	DNS_QT_ANY = 255
+};
+
+/** 资源记录集的只读视图, 指向数据库中已按应答报文格式预编码好的内存, 可直接复制到应答报文中
+ *  每条记录的格式为: type(2) class(2) ttl(4) rdlength(2) rdata, 不包含记录的域名部分
+ */
+typedef struct dns_rrset_view_t {
+	const uint8_t	*data;			// 预编码的资源记录起始地址
+	uint16_t		len;			// 预编码的资源记录总长度
+	uint16_t		count;			// 资源记录数量
+	uint16_t		type;			// 记录集类型, 查询的域名是别名时, 返回的是DNS_QT_CNAME
+	uint16_t		first;			// 轮转输出时第一条记录的序号, 从该记录开始输出, 到末尾后再从头输出
+} dns_rrset_view_t;
+
+/** 记录集查找结果 */
+typedef enum {
+	DNS_LOOKUP_NXDOMAIN,			// 域名不存在
+	DNS_LOOKUP_NODATA,				// 域名存在, 但没有查找类型的记录
+	DNS_LOOKUP_FOUND				// 找到记录
+} dns_lookup_t;
+
+/** 记录集查找回调接口
+ * @param host 域名
+ * @param type 查询类型
+ * @param dst 查找成功时回写的记录集视图
+ * @return 查找结果
+ */
+typedef dns_lookup_t (*dns_lookup_func) (const char* host, uint16_t type, dns_rrset_view_t* dst);
+
+/** 区域SOA记录查找回调接口, 用于在否定应答的授权区域中附带SOA记录, 供客户端缓存否定结果
+ * @param host 域名
+ * @param dst 回写SOA记录集视图, 记录的生存时间为否定应答的缓存时间
+ * @param zone 回写SOA记录所属的区域名
+ * @return true: 成功, false: 没有对应的区域
+ */
+typedef bool (*dns_soa_func) (const char* host, dns_rrset_view_t* dst, const char** zone);
 
 typedef struct dns_head_t {
     uint16_t id;                // dns事务id，应答报文原样返回，客户通过标识字段来确定DNS响应是否与查询请求匹配
@@ -33,18 +100,145 @@ typedef struct dns_head_t {
     uint16_t arcount;           // 报文附加段中的附加记录数
 } dns_head_t;
 
+/** 转发给上游服务器的查询信息 */
+typedef struct dns_fwd_query_t {
+	const uint8_t	*req;			// 客户端的请求报文
+	uint16_t		req_size;		// 请求报文长度
+	uint16_t		qend;			// 请求报文问题区域的结束偏移地址
+	uint16_t		type;			// 查询类型
+	uint16_t		class;			// 查询类
+	uint16_t		max;			// 与客户端协商的应答报文最大长度
+	bool			edns;			// 客户端是否使用EDNS
+	bool			cookie;			// 客户端是否带有有效的服务器cookie
+	uint16_t		opt_len;		// 应答OPT伪记录的选项数据长度
+	const uint8_t	*opt;			// 应答OPT伪记录的选项数据, 已编码好的cookie选项
+	bool			cache_only;		// 只使用缓存应答, 缓存中没有时不发送上游查询, 返回-1
+	const char		*host;			// 查询的域名
+} dns_fwd_query_t;
+
+/** 本地找不到域名时的转发回调接口, 只对单个问题的请求调用
+ * @param addr 客户端地址
+ * @param query 查询信息
+ * @param res 写入应答报文的地址, 能立即应答时(例如缓存命中)写入此处
+ * @param res_size 应答报文地址的可写长度
+ * @return 大于0: 已写入res的应答长度, 0: 已接管请求, 稍后异步应答, 小于0: 不转发, 按本地结果应答
+ */
+typedef int (*dns_forward_func) (const sockaddr_in_t* addr, const dns_fwd_query_t* query,
+		uint8_t* res, size_t res_size);
+
+/** 拦截域名的应答方式 */
+typedef enum {
+	DNS_BLOCK_NONE,					// 不拦截
+	DNS_BLOCK_NULL,					// A记录应答0.0.0.0, AAAA记录应答::, 其它类型应答没有记录
+	DNS_BLOCK_NXDOMAIN				// 应答域名不存在
+} dns_block_t;
+
+/** 域名拦截回调接口, 在本地记录查找之前调用
+ * @param host 域名
+ * @return 拦截的应答方式
+ */
+typedef dns_block_t (*dns_block_func) (const char* host);
+
+/** DNS Cookie回调接口, 对每个请求调用, 校验请求中的服务器cookie并生成应答使用的服务器cookie
+ * @param addr 客户端地址
+ * @param cookie 请求中cookie选项的数据, 客户端cookie及可选的服务器cookie
+ * @param len cookie选项的数据长度, 0表示请求没有cookie选项
+ * @param server 回写新的服务器cookie
+ * @param valid 回写请求中的服务器cookie是否有效
+ * @return 服务器cookie的长度, 0: 不需要应答cookie
+ */
+typedef uint16_t (*dns_cookie_func) (const sockaddr_in_t* addr, const uint8_t* cookie, uint16_t len,
+		uint8_t server[DNS_COOKIE_SERVER_MAX], bool* valid);
+
+/** 攻击检测回调接口, 在本地记录查找之前对每个问题调用, 例如随机子域名攻击检测
+ * @param host 域名
+ * @return true: 域名所属区域正受到攻击, 本地找不到时只使用转发缓存, 否则直接否定应答, 不输出日志
+ */
+typedef bool (*dns_guard_func) (const char* host);
+
+/** 查询未命中回调接口, 本地记录及转发缓存中都找不到域名时调用, 包括转发到上游的查询
+ * @param host 域名
+ */
+typedef void (*dns_miss_func) (const char* host);
+
+/** 查询观察回调接口, 对每个问题调用, 例如热点域名统计
+ * @param host 域名
+ */
+typedef void (*dns_observe_func) (const char* host);
+
+/** 动态更新回调接口, 处理操作码为DNS_OPCODE_UPDATE的请求
+ * @param addr 客户端地址
+ * @param req 请求报文
+ * @param req_size 请求报文长度
+ * @param res 写入应答报文的地址
+ * @param res_size 应答报文地址的可写长度
+ * @return 写入长度, 0: 忽略消息, 无需回复
+ */
+typedef uint16_t (*dns_update_func) (const sockaddr_in_t* addr, const uint8_t* req, size_t req_size,
+		uint8_t* res, size_t res_size);
+
 /** dns协议解析服务初始化函数
- * @param func 域名查找回调接口地址
+ * @param lookup_func 记录集查找回调接口地址
+ * @param soa_func 区域SOA记录查找回调接口地址, 为NULL时否定应答不附带SOA记录
  */
-extern void dns_init(uint32_t (*find_func) (const char* host));
+extern void dns_init(dns_lookup_func lookup_func, dns_soa_func soa_func);
+
+/** 设置本地找不到域名时的转发回调接口, 为NULL时不转发 */
+extern void dns_set_forward(dns_forward_func forward_func);
+
+/** 设置域名拦截回调接口, 为NULL时不拦截 */
+extern void dns_set_block(dns_block_func block_func);
+
+/** 设置攻击检测及查询未命中回调接口, 为NULL时不检测 */
+extern void dns_set_guard(dns_guard_func guard_func, dns_miss_func miss_func);
+
+/** 设置查询观察回调接口, 为NULL时不观察 */
+extern void dns_set_observe(dns_observe_func observe_func);
+
+/** 设置动态更新回调接口, 为NULL时不支持动态更新请求 */
+extern void dns_set_update(dns_update_func update_func);
+
+/** 设置DNS Cookie回调接口, 为NULL时忽略请求中的cookie选项 */
+extern void dns_set_cookie(dns_cookie_func cookie_func);
+
+/** 将文本格式的域名转换为dns报文格式, 例如 www.a.com -> 3www1a3com0
+ * @param host 文本格式的域名
+ * @param dst 回写地址
+ * @param dst_size 回写地址的可写长度
+ * @return 写入长度, 0: 域名格式错误或可写长度不足
+ */
+extern uint16_t dns_name_to_wire(const char* host, uint8_t* dst, size_t dst_size);
+
+/** 将dns报文格式(不支持压缩指针)的域名转换为文本格式
+ * @param src 报文格式的域名地址
+ * @param src_size 允许读取的最大长度
+ * @param dst 回写文本格式域名的地址
+ * @return 读取的报文长度, 0: 格式错误
+ */
+extern uint16_t dns_name_from_wire(const uint8_t* src, size_t src_size, char dst[HOST_MAX]);
+
+/** 读取报文中的域名, 支持压缩指针
+ * @param msg 报文起始地址
+ * @param msg_len 报文长度
+ * @param off 域名在报文中的偏移地址
+ * @param host 回写文本格式的域名
+ * @return 域名之后的偏移地址, 0: 格式错误或域名超长
+ */
+extern size_t dns_read_name(const uint8_t* msg, size_t msg_len, size_t off, char host[HOST_MAX]);
+
+/** 跳过报文中的一条资源记录, 返回下一条记录的偏移地址, 0: 格式错误 */
+extern size_t dns_skip_rr(const uint8_t* msg, size_t msg_len, size_t off);
 
 /** dns解析处理函数, 解析dns报文, 查找域名, 填充返回内容
+ * @param addr 客户端地址
  * @param req dns报文地址
  * @param req_size 报文长度
  * @param res 写入回复消息的地址
- * @param res_size 写入回复消息地址的可写长度
+ * @param res_size 写入回复消息地址的可写长度, 实际写入长度不超过与客户端协商的报文大小
+ * @param cookie_valid 回写请求是否带有有效的服务器cookie, 带有效cookie的客户端地址不是伪造的, 不受限速, 可以为NULL
  * @return 写入长度, 0: 忽略消息, 无需回复
  */
-extern uint16_t dns_process(const void *req, size_t req_size, uint8_t res[DNS_PACKET_MAX]);
+extern uint16_t dns_process(const sockaddr_in_t* addr, const void *req, size_t req_size,
+		uint8_t *res, size_t res_size, bool *cookie_valid);
 
 #endif //__DNSPROTO_H__
\ No newline at end of file
@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "dnsproto.h"
+#include "dnsdb.h"
+#include "tsig.h"
+#include "dnsupdate.h"
+
+/** 规范化后的rdata缓冲区大小, 请求中被压缩的域名展开后可能变长 */
+#define DNSUPDATE_RDATA_POOL (DNS_EDNS_MAX + DNSUPDATE_RR_MAX * HOST_MAX)
+/** 区域传送等只能用于查询的类型 */
+#define DNS_QT_AXFR 252
+#define DNS_QT_MAILA 254
+/** 区域的类, 只支持internet类 */
+#define DNS_CLASS_IN 1
+/** 先决条件及删除操作使用的类 */
+#define DNS_CLASS_NONE 254
+#define DNS_CLASS_ANY 255
+
+// 动态更新的返回码(RFC 2136 2.2)
+enum dnsupdate_rcode_t {
+	UPDATE_NOERROR = 0,
+	UPDATE_FORMERR = 1,
+	UPDATE_SERVFAIL = 2,
+	UPDATE_NXDOMAIN = 3,
+	UPDATE_NOTIMP = 4,
+	UPDATE_REFUSED = 5,
+	UPDATE_YXDOMAIN = 6,
+	UPDATE_YXRRSET = 7,
+	UPDATE_NXRRSET = 8,
+	UPDATE_NOTAUTH = 9,
+	UPDATE_NOTZONE = 10
+};
+
+/** 先决条件或更新区域的一条记录, rdata中的域名已展开为无压缩格式 */
+typedef struct dnsupdate_rr_t {
+	char			host[HOST_MAX];	// 域名
+	uint16_t		type;			// 记录类型
+	uint16_t		class;			// 类, 决定先决条件或更新操作的含义
+	uint32_t		ttl;			// 生存时间
+	uint16_t		rdlen;			// rdata长度
+	const uint8_t	*rdata;			// 规范化的rdata, 指向_rdata缓冲区
+} dnsupdate_rr_t;
+
+static dnsupdate_rr_t _rrs[DNSUPDATE_RR_MAX];
+static uint8_t _rdata[DNSUPDATE_RDATA_POOL];
+
+/** 类型是否只能用于查询, 不能出现在更新记录中 */
+static inline bool dnsupdate_meta_type(uint16_t type) {
+	return type >= DNS_QT_AXFR && type <= DNS_QT_ANY;
+}
+
+/** 把请求中的rdata转换为数据库使用的格式, 域名展开压缩指针, 其它类型原样复制
+ * @param msg 请求报文, 调用者已检查rdata在报文长度内
+ * @param off rdata的偏移地址
+ * @param type 记录类型
+ * @param rdlen rdata长度
+ * @param dst 回写地址
+ * @param dst_size 回写地址可写长度
+ * @return 写入长度, 0: 格式错误
+ */
+static uint16_t dnsupdate_rdata(const uint8_t* msg, size_t off, uint16_t type, uint16_t rdlen,
+		uint8_t* dst, size_t dst_size) {
+	char host[HOST_MAX];
+	size_t prefix = 0, end = off + rdlen;
+	switch (type) {
+		case DNS_QT_A:
+			if (rdlen != 4) return 0;
+			break;
+		case DNS_QT_TXT:
+			// 一个或多个字符串, 每个字符串以长度字节开头, 刚好占满rdata, 且能原样保存到记录文件
+			if (!dnsdb_txt_valid(msg + off, rdlen)) return 0;
+			break;
+		case DNS_QT_SRV: prefix += 4; // fall through
+		case DNS_QT_MX: prefix += 2; // fall through
+		case DNS_QT_NS:
+		case DNS_QT_CNAME: {
+			if (rdlen <= prefix || prefix + HOST_MAX + 1 > dst_size
+					|| dns_read_name(msg, end, off + prefix, host) != end)
+				return 0;
+			memcpy(dst, msg + off, prefix);
+			uint16_t n = dns_name_to_wire(host, dst + prefix, dst_size - prefix);
+			return n ? (uint16_t)(prefix + n) : 0;
+		}
+	}
+	if (rdlen > dst_size) return 0;
+	memcpy(dst, msg + off, rdlen);
+	return rdlen;
+}
+
+/** 读取先决条件或更新区域的记录, 只有需要比较rdata时才规范化
+ * @param off 记录的偏移地址, 回写下一条记录的偏移地址
+ * @param pool 已使用的rdata缓冲区长度, 回写新的长度
+ * @return true: 成功, false: 格式错误
+ */
+static bool dnsupdate_read_rr(const uint8_t* msg, size_t len, size_t* off, dnsupdate_rr_t* rr, size_t* pool) {
+	size_t p = dns_read_name(msg, len, *off, rr->host);
+	if (!p || p + DNS_RR_HEAD_LEN > len) return false;
+	rr->type = ntohs(*(const uint16_t*)(msg + p));
+	rr->class = ntohs(*(const uint16_t*)(msg + p + 2));
+	rr->ttl = ntohl(*(const uint32_t*)(msg + p + 4));
+	uint16_t rdlen = ntohs(*(const uint16_t*)(msg + p + 8));
+	p += DNS_RR_HEAD_LEN;
+	if (p + rdlen > len) return false;
+	*off = p + rdlen;
+
+	rr->rdata = _rdata + *pool;
+	rr->rdlen = 0;
+	if (!rdlen) return true;
+	// rdata长度不为0的ANY类记录是格式错误, 由调用者检查
+	if (rr->class == DNS_CLASS_ANY) {
+		rr->rdlen = rdlen;
+		return true;
+	}
+	if (!(rr->rdlen = dnsupdate_rdata(msg, p, rr->type, rdlen, _rdata + *pool, sizeof(_rdata) - *pool)))
+		return false;
+	*pool += rr->rdlen;
+	return true;
+}
+
+/** 判断域名是否属于更新的区域, 属于更深的$ZONE区域的域名不算 */
+static inline bool dnsupdate_in_zone(const char* host, const char* zone) {
+	const char *z = dnsdb_zone_name(host);
+	return z && !strcasecmp(z, zone);
+}
+
+/** 判断两条记录的域名、类型及rdata是否相同 */
+static inline bool dnsupdate_rr_equal(const dnsupdate_rr_t* a, const dnsupdate_rr_t* b) {
+	return a->type == b->type && a->rdlen == b->rdlen && !strcmp(a->host, b->host)
+		&& !memcmp(a->rdata, b->rdata, a->rdlen);
+}
+
+/** 检查先决条件(RFC 2136 3.2)
+ * @param rrs 先决条件
+ * @param count 先决条件数量
+ * @param zone 区域名
+ * @return 返回码, UPDATE_NOERROR表示全部满足
+ */
+static int dnsupdate_prereq(const dnsupdate_rr_t* rrs, unsigned count, const char* zone) {
+	for (unsigned i = 0; i < count; ++i) {
+		const dnsupdate_rr_t *rr = rrs + i;
+		if (rr->ttl) return UPDATE_FORMERR;
+		if (!dnsupdate_in_zone(rr->host, zone)) return UPDATE_NOTZONE;
+		switch (rr->class) {
+			case DNS_CLASS_ANY:
+				if (rr->rdlen) return UPDATE_FORMERR;
+				if (rr->type == DNS_QT_ANY ? !dnsdb_name_exists(rr->host) : !dnsdb_rrset_count(rr->host, rr->type, NULL))
+					return rr->type == DNS_QT_ANY ? UPDATE_NXDOMAIN : UPDATE_NXRRSET;
+				break;
+			case DNS_CLASS_NONE:
+				if (rr->rdlen) return UPDATE_FORMERR;
+				if (rr->type == DNS_QT_ANY ? dnsdb_name_exists(rr->host) : dnsdb_rrset_count(rr->host, rr->type, NULL) > 0)
+					return rr->type == DNS_QT_ANY ? UPDATE_YXDOMAIN : UPDATE_YXRRSET;
+				break;
+			case DNS_CLASS_IN: {
+				if (rr->type == DNS_QT_ANY) return UPDATE_FORMERR;
+				// 同一域名同一类型的先决条件只在第一次出现时检查, 去重后的记录必须与现有记录集完全相同
+				bool first = true;
+				for (unsigned j = 0; j < i && first; ++j)
+					first = rrs[j].class != DNS_CLASS_IN || rrs[j].type != rr->type || strcmp(rrs[j].host, rr->host);
+				if (!first) break;
+				uint16_t distinct = 0;
+				for (unsigned j = i; j < count; ++j) {
+					if (rrs[j].class != DNS_CLASS_IN || rrs[j].type != rr->type || strcmp(rrs[j].host, rr->host))
+						continue;
+					bool dup = false;
+					for (unsigned k = i; k < j && !dup; ++k)
+						dup = rrs[k].class == DNS_CLASS_IN && dnsupdate_rr_equal(rrs + k, rrs + j);
+					if (dup) continue;
+					if (!dnsdb_rr_exists(rr->host, rr->type, rrs[j].rdata, rrs[j].rdlen))
+						return UPDATE_NXRRSET;
+					++distinct;
+				}
+				if (distinct != dnsdb_rrset_count(rr->host, rr->type, NULL))
+					return UPDATE_NXRRSET;
+				break;
+			}
+			default:
+				return UPDATE_FORMERR;
+		}
+	}
+	return UPDATE_NOERROR;
+}
+
+/** 预检查更新记录(RFC 2136 3.4.1), 全部合法才开始修改, 保证更新整体生效或整体不生效
+ * @param rrs 更新记录
+ * @param count 更新记录数量
+ * @param zone 区域名
+ * @return 返回码, UPDATE_NOERROR表示全部合法
+ */
+static int dnsupdate_prescan(const dnsupdate_rr_t* rrs, unsigned count, const char* zone) {
+	for (unsigned i = 0; i < count; ++i) {
+		const dnsupdate_rr_t *rr = rrs + i;
+		if (!dnsupdate_in_zone(rr->host, zone)) return UPDATE_NOTZONE;
+		switch (rr->class) {
+			case DNS_CLASS_IN: {
+				if (dnsupdate_meta_type(rr->type) || !rr->rdlen) return UPDATE_FORMERR;
+				if (!dnsdb_type_supported(rr->type)) {
+					log_warn("dns update %s [type=%u] unsupport!", rr->host, rr->type);
+					return UPDATE_NOTIMP;
+				}
+				// 记录集预编码后不能超过最大长度, 按全部新增记录估算, 已存在的记录不增加长度
+				uint16_t cur;
+				dnsdb_rrset_count(rr->host, rr->type, &cur);
+				size_t total = cur;
+				for (unsigned j = 0; j <= i; ++j)
+					if (rrs[j].class == DNS_CLASS_IN && rrs[j].type == rr->type && !strcmp(rrs[j].host, rr->host)
+							&& !dnsdb_rr_exists(rr->host, rr->type, rrs[j].rdata, rrs[j].rdlen))
+						total += DNS_RR_HEAD_LEN + rrs[j].rdlen;
+				if (total > DNS_EDNS_MAX) {
+					log_warn("dns update %s [type=%u] rrset too large!", rr->host, rr->type);
+					return UPDATE_REFUSED;
+				}
+				break;
+			}
+			case DNS_CLASS_ANY:
+				if (rr->ttl || rr->rdlen || (dnsupdate_meta_type(rr->type) && rr->type != DNS_QT_ANY))
+					return UPDATE_FORMERR;
+				break;
+			case DNS_CLASS_NONE:
+				if (rr->ttl || !rr->rdlen || dnsupdate_meta_type(rr->type)) return UPDATE_FORMERR;
+				break;
+			default:
+				return UPDATE_FORMERR;
+		}
+	}
+	return UPDATE_NOERROR;
+}
+
+/** 执行更新记录(RFC 2136 3.4.2), 区域顶点的NS记录不能全部删除
+ * @param rrs 更新记录
+ * @param count 更新记录数量
+ * @param zone 区域名
+ * @return 返回码, UPDATE_NOERROR表示成功
+ */
+static int dnsupdate_apply(const dnsupdate_rr_t* rrs, unsigned count, const char* zone) {
+	for (unsigned i = 0; i < count; ++i) {
+		const dnsupdate_rr_t *rr = rrs + i;
+		bool apex = !strcasecmp(rr->host, zone);
+		switch (rr->class) {
+			case DNS_CLASS_IN:
+				// 别名不能与其它类型的记录共存, 冲突时忽略新增的记录, 别名记录只能有一条, 新增时替换
+				if (rr->type == DNS_QT_CNAME) {
+					if (dnsdb_name_exists(rr->host) && !dnsdb_rrset_count(rr->host, DNS_QT_CNAME, NULL))
+						break;
+					dnsdb_rrset_delete(rr->host, DNS_QT_CNAME);
+				} else if (dnsdb_rrset_count(rr->host, DNS_QT_CNAME, NULL)) {
+					break;
+				}
+				if (!dnsdb_rr_add(rr->host, rr->type, rr->ttl, rr->rdata, rr->rdlen)) {
+					log_error("dns update add %s [type=%u] fail!", rr->host, rr->type);
+					return UPDATE_SERVFAIL;
+				}
+				break;
+			case DNS_CLASS_ANY:
+				if (!(apex && rr->type == DNS_QT_NS))
+					dnsdb_rrset_delete(rr->host, rr->type);
+				break;
+			case DNS_CLASS_NONE:
+				if (!(apex && rr->type == DNS_QT_NS && dnsdb_rrset_count(rr->host, DNS_QT_NS, NULL) <= 1))
+					dnsdb_rr_delete(rr->host, rr->type, rr->rdata, rr->rdlen);
+				break;
+		}
+	}
+	return UPDATE_NOERROR;
+}
+
+/** 读取区域部分, 区域部分只能有一条
+ * @param req 请求报文
+ * @param len 请求报文长度
+ * @param zone 回写区域名
+ * @return 区域部分的结束偏移地址, 应答时原样复制, 0: 格式错误
+ */
+static size_t dnsupdate_zone(const uint8_t* req, size_t len, char zone[HOST_MAX]) {
+	size_t off;
+	if (ntohs(*(const uint16_t*)(req + 4)) != 1 || !(off = dns_read_name(req, len, DNS_HEAD_LEN, zone))
+			|| off + 4 > len)
+		return 0;
+	return off + 4;
+}
+
+/** 解析并执行已通过签名校验的更新请求
+ * @param req 请求报文
+ * @param len 不含TSIG记录的请求报文长度
+ * @param off 区域部分的结束偏移地址
+ * @param zone 区域名
+ * @return 返回码
+ */
+static int dnsupdate_run(const uint8_t* req, size_t len, size_t off, const char* zone) {
+	unsigned prcount = ntohs(*(const uint16_t*)(req + 6)), upcount = ntohs(*(const uint16_t*)(req + 8));
+	size_t pool = 0;
+
+	// 区域的类型为SOA, 且必须是数据库中定义的区域本身
+	if (ntohs(*(const uint16_t*)(req + off - 4)) != DNS_QT_SOA)
+		return UPDATE_FORMERR;
+	const char *defined = dnsdb_zone_name(zone);
+	if (ntohs(*(const uint16_t*)(req + off - 2)) != DNS_CLASS_IN || !defined || strcasecmp(defined, zone)) {
+		log_warn("dns update zone[%s] is not a local zone!", zone);
+		return UPDATE_NOTAUTH;
+	}
+
+	if (prcount + upcount > DNSUPDATE_RR_MAX) {
+		log_warn("dns update zone[%s] records[%u] exceed %d!", zone, prcount + upcount, DNSUPDATE_RR_MAX);
+		return UPDATE_REFUSED;
+	}
+	for (unsigned i = 0; i < prcount + upcount; ++i)
+		if (!dnsupdate_read_rr(req, len, &off, _rrs + i, &pool))
+			return UPDATE_FORMERR;
+
+	// 先决条件及预检查都通过后才修改, 单线程执行, 修改期间不会有查询看到一半的结果
+	int rcode = dnsupdate_prereq(_rrs, prcount, zone);
+	if (rcode == UPDATE_NOERROR) rcode = dnsupdate_prescan(_rrs + prcount, upcount, zone);
+	if (rcode == UPDATE_NOERROR) rcode = dnsupdate_apply(_rrs + prcount, upcount, zone);
+	log_info("dns update zone[%s]: %u prerequisites, %u updates, rcode %d", zone, prcount, upcount, rcode);
+	return rcode;
+}
+
+uint16_t dnsupdate_process(const sockaddr_in_t* addr, const uint8_t* req, size_t req_size,
+		uint8_t* res, size_t res_size) {
+	if (req_size <= DNS_HEAD_LEN || res_size < DNS_HEAD_LEN) return 0;
+
+	// 先校验签名再解析记录, 没有签名或签名错误的请求不会触及数据库
+	tsig_t tsig;
+	size_t end = req_size;
+	char zone[HOST_MAX];
+	int rcode;
+	tsig_result_t tr = tsig_verify(req, req_size, &end, &tsig);
+	size_t zone_end = tr == TSIG_MALFORMED ? 0 : dnsupdate_zone(req, end, zone);
+	if (!zone_end && tr == TSIG_VALID) tr = TSIG_MALFORMED;
+	switch (tr) {
+		case TSIG_VALID:
+			rcode = dnsupdate_run(req, end, zone_end, zone);
+			// 一个请求的全部修改只保存一次数据库文件
+			if (!dnsdb_save()) rcode = UPDATE_SERVFAIL;
+			break;
+		case TSIG_UNSIGNED:
+			log_warn("dns update from %s without tsig refused!", net_ip_tostring(addr->sin_addr.s_addr));
+			rcode = UPDATE_REFUSED;
+			break;
+		case TSIG_FAILED:
+			log_warn("dns update from %s tsig error %u", net_ip_tostring(addr->sin_addr.s_addr), tsig.error);
+			rcode = UPDATE_NOTAUTH;
+			break;
+		default:
+			rcode = UPDATE_FORMERR;
+			break;
+	}
+
+	// 应答只包含头部及请求的区域部分, 签名有效或签名时间错误时带签名的TSIG记录
+	if (!zone_end || zone_end > res_size) zone_end = DNS_HEAD_LEN;
+	memcpy(res, req, zone_end);
+	res[2] = 0x80 | (req[2] & 0x78);	// QR置位, 保留操作码
+	res[3] = (uint8_t) rcode;
+	*(uint16_t*)(res + 4) = htons(zone_end > DNS_HEAD_LEN ? 1 : 0);
+	*(uint16_t*)(res + 6) = *(uint16_t*)(res + 8) = *(uint16_t*)(res + 10) = 0;
+	if (tr == TSIG_VALID || tr == TSIG_FAILED) {
+		size_t n = tsig_sign(res, zone_end, res_size, &tsig);
+		if (n) return (uint16_t) n;
+	}
+	return (uint16_t) zone_end;
+}
+
+// #define DNSUPDATE_TEST
+#ifdef DNSUPDATE_TEST
+#include <assert.h>
+
+#define TEST_FILE "dnsupdate_test.conf"
+/** 请求的头部及区域部分长度, 区域为a.com */
+#define TEST_ZONE_END 23
+
+static uint8_t _msg[DNS_EDNS_MAX];
+static size_t _len;
+
+/** dnspython生成的签名更新请求, 添加www.a.com 300 A 1.2.3.4, 密钥k1, 签名时间1700000000, 早已超出误差 */
+static const uint8_t _signed[] = {
+	0x12, 0x34, 0x28, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x01, 0x61, 0x03, 0x63,
+	0x6f, 0x6d, 0x00, 0x00, 0x06, 0x00, 0x01, 0x03, 0x77, 0x77, 0x77, 0xc0, 0x0c, 0x00, 0x01, 0x00,
+	0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0x01, 0x02, 0x03, 0x04, 0x02, 0x6b, 0x31, 0x00, 0x00,
+	0xfa, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3d, 0x0b, 0x68, 0x6d, 0x61, 0x63, 0x2d, 0x73,
+	0x68, 0x61, 0x32, 0x35, 0x36, 0x00, 0x00, 0x00, 0x65, 0x53, 0xf1, 0x00, 0x01, 0x2c, 0x00, 0x20,
+	0xc5, 0x21, 0xbe, 0xf7, 0x0a, 0x30, 0x30, 0x7b, 0x32, 0xf2, 0x8e, 0xb5, 0x0d, 0x84, 0xd3, 0x95,
+	0xbe, 0xb3, 0xf6, 0x15, 0x68, 0x20, 0x8f, 0x25, 0x48, 0xc9, 0x41, 0xff, 0xab, 0xa0, 0xf0, 0xbd,
+	0x12, 0x34, 0x00, 0x00, 0x00, 0x00 };
+
+/** 开始一个更新请求, 写入头部及区域部分 */
+static void test_begin(uint16_t prcount, uint16_t upcount) {
+	static const uint8_t head[TEST_ZONE_END] = { 0x12, 0x34, 0x28, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+		1, 'a', 3, 'c', 'o', 'm', 0, 0, DNS_QT_SOA, 0, DNS_CLASS_IN };
+	memcpy(_msg, head, TEST_ZONE_END);
+	*(uint16_t*)(_msg + 6) = htons(prcount);
+	*(uint16_t*)(_msg + 8) = htons(upcount);
+	_len = TEST_ZONE_END;
+}
+
+/** 追加一条先决条件或更新记录 */
+static void test_rr(const char* host, uint16_t type, uint16_t class, uint32_t ttl, const void* rdata, uint16_t rdlen) {
+	uint8_t *p = _msg + _len;
+	p += dns_name_to_wire(host, p, HOST_MAX + 1);
+	*(uint16_t*) p = htons(type);
+	*(uint16_t*)(p + 2) = htons(class);
+	*(uint32_t*)(p + 4) = htonl(ttl);
+	*(uint16_t*)(p + 8) = htons(rdlen);
+	memcpy(p + DNS_RR_HEAD_LEN, rdata, rdlen);
+	_len = p + DNS_RR_HEAD_LEN + rdlen - _msg;
+}
+
+/** 执行已通过签名校验的请求, 返回返回码 */
+static int test_run() {
+	return dnsupdate_run(_msg, _len, TEST_ZONE_END, "a.com");
+}
+
+int main() {
+	static const uint8_t ip1[] = { 1, 2, 3, 4 }, ip2[] = { 5, 6, 7, 8 }, ip9[] = { 9, 9, 9, 9 };
+	uint32_t www = *(const uint32_t*) ip1;
+	FILE *fp = fopen(TEST_FILE, "w");
+	fputs("$ZONE a.com\na.com NS ns.a.com\nwww.a.com 1.2.3.4\nmail.a.com TXT \"v=spf1 -all\"\n", fp);
+	fclose(fp);
+	assert(dnsdb_load(TEST_FILE));
+
+	// 先决条件不满足时返回对应的返回码
+	test_begin(1, 0);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_NONE, 0, NULL, 0);
+	assert(test_run() == UPDATE_YXRRSET);
+	test_begin(1, 0);
+	test_rr("www.a.com", DNS_QT_MX, DNS_CLASS_ANY, 0, NULL, 0);
+	assert(test_run() == UPDATE_NXRRSET);
+	test_begin(1, 0);
+	test_rr("nx.a.com", DNS_QT_ANY, DNS_CLASS_ANY, 0, NULL, 0);
+	assert(test_run() == UPDATE_NXDOMAIN);
+	test_begin(1, 0);
+	test_rr("www.a.com", DNS_QT_ANY, DNS_CLASS_NONE, 0, NULL, 0);
+	assert(test_run() == UPDATE_YXDOMAIN);
+	test_begin(1, 0);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_IN, 0, ip9, 4);
+	assert(test_run() == UPDATE_NXRRSET);
+	test_begin(1, 0);
+	test_rr("www.b.com", DNS_QT_A, DNS_CLASS_ANY, 0, NULL, 0);
+	assert(test_run() == UPDATE_NOTZONE);
+
+	// 先决条件不满足时更新记录不执行
+	test_begin(1, 1);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_IN, 0, ip9, 4);
+	test_rr("new.a.com", DNS_QT_A, DNS_CLASS_IN, 300, ip2, 4);
+	assert(test_run() == UPDATE_NXRRSET && !dnsdb_name_exists("new.a.com"));
+
+	// 预检查失败时, 之前合法的删除及添加都不执行, 数据库不变
+	test_begin(0, 3);
+	test_rr("www.a.com", DNS_QT_ANY, DNS_CLASS_ANY, 0, NULL, 0);
+	test_rr("new.a.com", DNS_QT_A, DNS_CLASS_IN, 300, ip2, 4);
+	test_rr("www.b.com", DNS_QT_A, DNS_CLASS_IN, 300, ip2, 4);
+	assert(test_run() == UPDATE_NOTZONE);
+	test_begin(0, 2);
+	test_rr("mail.a.com", DNS_QT_TXT, DNS_CLASS_NONE, 0, "\x0bv=spf1 -all", 12);
+	test_rr("new.a.com", DNS_QT_AXFR, DNS_CLASS_IN, 300, ip2, 4);
+	assert(test_run() == UPDATE_FORMERR);
+	assert(dnsdb_find("www.a.com") == www && dnsdb_rrset_count("www.a.com", DNS_QT_A, NULL) == 1);
+	assert(!dnsdb_name_exists("new.a.com") && dnsdb_rrset_count("mail.a.com", DNS_QT_TXT, NULL) == 1);
+
+	// 先决条件满足后整体执行: 替换www的A记录, 删除mail的TXT记录, 添加new
+	test_begin(2, 4);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_IN, 0, ip1, 4);
+	test_rr("new.a.com", DNS_QT_ANY, DNS_CLASS_NONE, 0, NULL, 0);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_ANY, 0, NULL, 0);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_IN, 300, ip9, 4);
+	test_rr("mail.a.com", DNS_QT_TXT, DNS_CLASS_NONE, 0, "\x0bv=spf1 -all", 12);
+	test_rr("new.a.com", DNS_QT_A, DNS_CLASS_IN, 300, ip2, 4);
+	assert(test_run() == UPDATE_NOERROR);
+	assert(dnsdb_find("www.a.com") == *(const uint32_t*) ip9 && dnsdb_find("new.a.com") == *(const uint32_t*) ip2);
+	assert(!dnsdb_rrset_count("mail.a.com", DNS_QT_TXT, NULL));
+
+	// TXT记录保存到文件后重新加载, rdata不变; 保存后会改变含义或丢失数据的TXT记录是格式错误
+	static const uint8_t txt[] = "\x0bv=spf1 -all\x00\x05" "a b=c\x03\xe4\xb8\xad";
+	test_begin(0, 1);
+	test_rr("txt.a.com", DNS_QT_TXT, DNS_CLASS_IN, 300, txt, sizeof(txt) - 1);
+	assert(test_run() == UPDATE_NOERROR && dnsdb_save());
+	dnsdb_free();
+	assert(dnsdb_load(TEST_FILE) && dnsdb_rr_exists("txt.a.com", DNS_QT_TXT, txt, sizeof(txt) - 1));
+	assert(dnsdb_rrset_count("txt.a.com", DNS_QT_TXT, NULL) == 1 && dnsdb_find("new.a.com") == *(const uint32_t*) ip2);
+	static const char* const bad[] = { "\x03" "a\"b", "\x03" "a\nb", "\x03" "a\\b", "\x03" "a\0b", "\x04" "a b" };
+	for (int i = 0; i < 5; ++i) {
+		test_begin(0, 1);
+		test_rr("bad.a.com", DNS_QT_TXT, DNS_CLASS_IN, 300, bad[i], 4);
+		assert(test_run() == UPDATE_FORMERR);
+	}
+	uint8_t big[600];
+	memset(big, 0, sizeof(big));
+	test_begin(0, 1);
+	test_rr("bad.a.com", DNS_QT_TXT, DNS_CLASS_IN, 300, big, 513);
+	assert(test_run() == UPDATE_FORMERR);
+	test_begin(0, 1);
+	test_rr("bad.a.com", DNS_QT_TXT, DNS_CLASS_IN, 300, big, 400);
+	assert(test_run() == UPDATE_FORMERR && !dnsdb_name_exists("bad.a.com"));
+
+	// 区域顶点的最后一条NS记录不能删除
+	test_begin(0, 1);
+	test_rr("a.com", DNS_QT_NS, DNS_CLASS_ANY, 0, NULL, 0);
+	assert(test_run() == UPDATE_NOERROR && dnsdb_rrset_count("a.com", DNS_QT_NS, NULL) == 1);
+
+	// 完整流程: 没有签名的请求被拒绝, 签名时间错误时应答NOTAUTH并带签名, 都不修改数据库
+	sockaddr_in_t addr = { .sin_family = AF_INET };
+	uint8_t res[512];
+	test_begin(0, 1);
+	test_rr("www.a.com", DNS_QT_A, DNS_CLASS_ANY, 0, NULL, 0);
+	assert(dnsupdate_process(&addr, _msg, _len, res, sizeof(res)) == TEST_ZONE_END);
+	assert(res[2] == 0xA8 && res[3] == UPDATE_REFUSED && !res[11]);
+	assert(tsig_add_key("k1:c2VjcmV0c2VjcmV0c2VjcmV0c2VjcmV0"));
+	size_t n = dnsupdate_process(&addr, _signed, sizeof(_signed), res, sizeof(res));
+	assert(n == TEST_ZONE_END + 14 + 13 + 10 + SHA256_LEN + 6 + 6 && res[TEST_ZONE_END + 14 + 13 + 9] == SHA256_LEN);
+	assert(res[3] == UPDATE_NOTAUTH && res[11] == 1 && dnsdb_find("www.a.com") == *(const uint32_t*) ip9);
+
+	dnsdb_free();
+	remove(TEST_FILE);
+	printf("test success\n");
+	return 0;
+}
+#endif // DNSUPDATE_TEST
@@ -0,0 +1,28 @@
+/** 标准动态更新(RFC 2136), 处理操作码为UPDATE的请求, 请求必须使用TSIG(HMAC-SHA256)签名,
+ *  一个请求中的先决条件全部满足且更新记录全部合法时, 才作为一个整体修改共享记录, 之后只保存一次数据库文件,
+ *  区域必须是数据库中$ZONE定义的区域, 只支持数据库能存放的记录类型
+ */
+#pragma once
+#ifndef __DNSUPDATE_H__
+#define __DNSUPDATE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "net.h"
+
+/** 每个请求允许的最大先决条件及更新记录数量 */
+#define DNSUPDATE_RR_MAX 128
+
+/** 处理动态更新请求, 与dns_update_func接口一致
+ * @param addr 客户端地址
+ * @param req 请求报文
+ * @param req_size 请求报文长度
+ * @param res 写入应答报文的地址
+ * @param res_size 应答报文地址的可写长度
+ * @return 写入长度, 0: 忽略消息, 无需回复
+ */
+extern uint16_t dnsupdate_process(const sockaddr_in_t* addr, const uint8_t* req, size_t req_size,
+		uint8_t* res, size_t res_size);
+
+#endif // __DNSUPDATE_H__
@@ -12,6 +12,10 @@
 #define DN_MAX 64
 #define KEY_MAX 128
 #define IP_MAX 16
+/** 批量更新每个报文最多的条目数量, 与服务端一致 */
+#define BATCH_MAX 32
+/** 报文的最大长度, 与服务端接收缓冲区一致 */
+#define PACKET_MAX 1232
 #ifndef _MAX_FNAME
 #	define _MAX_FNAME 256
 #endif
@@ -26,10 +30,12 @@ typedef struct {
 	char key[KEY_MAX];	          // 动态更新DNS的密钥
 	char logfile[_MAX_FNAME];     // 日志文件名
 	char ip[IP_MAX];              // 指定更新的IP
+	char batch[_MAX_FNAME];       // 批量更新的条目文件名, -表示标准输入
 } config_t;
 
 const char APP[] = "dyndns-cli";
 const char MAGIC[] = "ddyn";
+const char BATCH_VER[] = "/2";
 static char HEX[] = "0123456789abcdef";
 
 config_t g_conf = { .port = 53,
@@ -40,7 +46,10 @@ config_t g_conf = { .port = 53,
 #endif
 };
 
-char g_buf[512];
+char g_buf[PACKET_MAX + 1];
+/** 批量更新的域名, 按请求中的顺序, 用于显示每个条目的应答 */
+char g_hosts[BATCH_MAX][DN_MAX];
+int g_host_count = 0;
 
 inline static const char* b2s(bool b) {
 	return b ? "true" : "false";
@@ -69,8 +78,10 @@ inline static void _uint64_to_hex(char dst[16], uint64_t val) {
 /** 使用帮助 */
 static void usage() {
 	printf("Usage: %s [OPTION]... -k <key> -h <host> -s <server>\n", APP);
+	printf("       %s [OPTION]... -k <key> -b <file> -s <server>\n", APP);
 	printf("dynamic dns update client, version 1.3, copyleft by kivensoft 2017-2020.\n\n");
 	printf("Options:\n");
+	printf("  -b <file>             batch update, one \"host [ip]\" per line, max %d, - for stdin\n", BATCH_MAX);
 	printf("  -d                    enabled logger mode, default %s\n", b2s(g_conf.debug));
 	printf("  -g <log filename>     log file name, default %s\n", g_conf.logfile);
 	printf("  -h <host>             dynamic update domain name, example: user.myip.com\n");
@@ -83,8 +94,15 @@ static void usage() {
 /** 解析命令行参数 */
 static bool parse_cmd_line(int argc, char **argv, config_t *dst) {
 	int c;
-	while ((c = getopt(argc, argv, "dg:h:i:k:p:s:?")) != -1) {
+	while ((c = getopt(argc, argv, "b:dg:h:i:k:p:s:?")) != -1) {
 		switch (c) {
+			case 'b':
+				if (strlen(optarg) >= _MAX_FNAME) {
+					printf("batch file name too long!\n");
+					return false;
+				}
+				strcpy(dst->batch, optarg);
+				break;
 			case 'd':
 				dst->debug = 1; break;
 			case 'g':
@@ -175,6 +193,66 @@ static size_t mk_dyndns_req() {
 	return nb - g_buf;
 }
 
+/** 生成批量更新请求, 条目从文件中读取, 每行: 域名 [ip], 没有ip时服务端取客户端地址 */
+static size_t mk_batch_req() {
+	FILE *f = strcmp(g_conf.batch, "-") ? fopen(g_conf.batch, "r") : stdin;
+	if (!f) {
+		printf("can't open batch file %s\n", g_conf.batch);
+		return 0;
+	}
+
+	char body[PACKET_MAX], line[256], host[DN_MAX], ip[IP_MAX];
+	size_t body_len = 0, head_len = sizeof(MAGIC) - 1 + sizeof(BATCH_VER) - 1;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), f)) {
+		host[0] = ip[0] = '\0';
+		if (sscanf(line, "%63s %15s", host, ip) < 1)
+			continue;
+		int n = snprintf(body + body_len, sizeof(body) - body_len, ip[0] ? "%s %s\n" : "%s\n", host, ip);
+		if (g_host_count >= BATCH_MAX || body_len + n + head_len + 16 + 32 > PACKET_MAX) {
+			printf("too many batch entries, max %d!\n", BATCH_MAX);
+			ok = false;
+		} else {
+			strcpy(g_hosts[g_host_count++], host);
+			body_len += n;
+		}
+	}
+	if (f != stdin) fclose(f);
+	if (!ok || !g_host_count) {
+		if (ok) printf("batch file %s has no entry!\n", g_conf.batch);
+		return 0;
+	}
+
+	// 签名: 头部及版本标志 + 时间 + 全部条目 + 密钥
+	char buf[PACKET_MAX + KEY_MAX], digest[33], *p = buf;
+	memcpy(p, MAGIC, sizeof(MAGIC) - 1);
+	p += sizeof(MAGIC) - 1;
+	memcpy(p, BATCH_VER, sizeof(BATCH_VER) - 1);
+	p += sizeof(BATCH_VER) - 1;
+	_uint64_to_hex(p, time(NULL));
+	p += 16;
+	memcpy(p, body, body_len);
+	p += body_len;
+	size_t key_len = strlen(g_conf.key);
+	memcpy(p, g_conf.key, key_len);
+	md5_string(digest, buf, p + key_len - buf);
+
+	// 报文: 头部及版本标志 + 时间 + 签名 + 全部条目
+	memcpy(g_buf, buf, head_len + 16);
+	memcpy(g_buf + head_len + 16, digest, 32);
+	memcpy(g_buf + head_len + 16 + 32, body, body_len);
+	return head_len + 16 + 32 + body_len;
+}
+
+/** 显示批量更新的应答, 首行为总体结果, 之后每个条目一行 */
+static void print_batch_reply(char* reply) {
+	char *save = NULL, *line = strtok_r(reply, "\n", &save);
+	if (!line) return;
+	printf("%s\n", line);
+	for (int i = 0; i < g_host_count && (line = strtok_r(NULL, "\n", &save)); ++i)
+		printf("%s %s\n", g_hosts[i], line);
+}
+
 int main(int argc, char **argv) {
 	// 解析命令行参数
 	if (!parse_cmd_line(argc, argv, &g_conf))
@@ -182,7 +260,7 @@ int main(int argc, char **argv) {
 
 	// 如果参数是显示帮助
 	if (g_conf.help || !g_conf.server[0]
-			|| !g_conf.host[0] || !g_conf.key[0]) {
+			|| (!g_conf.host[0] && !g_conf.batch[0]) || !g_conf.key[0]) {
 		usage();
 		return 0;
 	}
@@ -211,7 +289,11 @@ int main(int argc, char **argv) {
 		.sin_port = htons(g_conf.port)};
 	socklen_t addrlen = sizeof(addr);
 
-	int count = mk_dyndns_req();
+	int count = g_conf.batch[0] ? mk_batch_req() : mk_dyndns_req();
+	if (count == 0) {
+		socket_close(fd);
+		return -1;
+	}
 	// 发送数据
 	count = sendto(fd, g_buf, count, 0, (sockaddr_t *) &addr, addrlen);
 	g_buf[count] = 0;
@@ -224,6 +306,10 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 	log_text(LOG_DEBUG, "recv data: ", g_buf, count);
+	if (g_conf.batch[0]) {
+		g_buf[count] = 0;
+		print_batch_reply(g_buf);
+	}
 
 	return 0;
 }
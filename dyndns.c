@@ -7,6 +7,8 @@
 #include <inttypes.h>
 #include "log.h"
 #include "md5.h"
+#include "net.h"
+#include "dnsdb.h"
 #include "dyndns.h"
 
 #define DD_HEAD_LEN 4
@@ -16,8 +18,34 @@
 #define DD_HOST_MAX 63
 #define DD_IP_MAX 15
 #define DD_MAX_LEN (DD_MIN_LEN + DD_HOST_MAX + DD_IP_MAX)
+/** 批量更新协议的版本标志, 紧跟在头部之后, 单条更新的时间只有16进制字符, 不会混淆 */
+#define DD_BATCH_VER "/2"
+#define DD_VER_LEN 2
+#define DD_BATCH_MIN_LEN (DD_HEAD_LEN + DD_VER_LEN + DD_TIME_LEN + DD_MD5_LEN)
+/** 批量更新每个报文最多的条目数量 */
+#define DD_BATCH_MAX 32
+/** 批量更新应答的最大长度, 首行及每个条目一行 */
+#define DD_BATCH_REPLY_MAX (32 + DD_BATCH_MAX * (8 + DD_IP_MAX + 1))
+/** 请求时间允许的误差, 秒为单位 */
+#define DD_TIME_WINDOW 600
+/** 每个来源地址每秒允许的更新报文数量 */
+#define DD_RATE 5
+/** 每个来源地址允许的突发报文数量 */
+#define DD_BURST 20
+/** 进入签名校验的报文全局每秒允许的数量, 伪造来源地址的洪水也不能让md5计算占满处理能力 */
+#define DD_VERIFY_RATE 500
+/** 进入签名校验的报文全局允许的突发数量 */
+#define DD_VERIFY_BURST 1000
+/** 来源地址令牌桶的数量, 必须是2的幂, 哈希冲突时覆盖 */
+#define DD_SOURCE_SLOTS 1024
+/** 最近接受的签名的缓存数量, 必须是2的幂, 哈希冲突时覆盖 */
+#define DD_REPLAY_SLOTS 1024
+/** 统计信息的输出间隔, 毫秒为单位 */
+#define DD_STATS_INTERVAL (60 * 1000)
 
-typedef enum { CHK_OK, TIME_INVALID, SIGN_INVALID } chk_err_t;
+/** 校验结果, 不成功的按原因分别计数 */
+typedef enum { CHK_OK, TIME_INVALID, SIGN_INVALID, REPLAYED, FORMAT_INVALID, RATE_LIMITED, CHK_ERR_MAX } chk_err_t;
+static const char* const g_chk_names[CHK_ERR_MAX] = { "ok", "time", "sign", "replay", "format", "rate" };
 
 typedef struct {
 	char time[DD_TIME_LEN + 1];
@@ -29,10 +57,38 @@ typedef struct {
 	uint64_t time_num;
 } dyndns_request_t;
 
-static const char g_magic[] = "ddyn";
+/** 批量更新的一个条目 */
+typedef struct {
+	char host[DD_HOST_MAX + 1];
+	uint32_t ip;
+	bool ok;
+} dyndns_entry_t;
+
+/** 来源地址的令牌桶 */
+typedef struct {
+	uint32_t ip;				// 来源地址
+	uint32_t last;				// 最后一次使用的时间, 毫秒为单位, 允许回绕
+	int32_t tokens;				// 剩余令牌, 千分之一个报文为单位
+} dyndns_source_t;
+
+/** 最近接受的签名, 同一报文再次出现时视为重放 */
+typedef struct {
+	bool used;
+	char md5[DD_MD5_LEN];
+	int64_t time;				// 报文的请求时间, 超出时间窗口后被覆盖不影响重放检查
+} dyndns_replay_t;
+
+static const char g_magic[] = DYNDNS_MAGIC;
 static const char g_zero_ip[] = "0.0.0.0";
 static dyndns_upd_func g_dyndns_upd_func = NULL;
+static dyndns_commit_func g_dyndns_commit_func = NULL;
 static char *g_key = "Mini DNS Server";
+static dyndns_source_t g_sources[DD_SOURCE_SLOTS];
+static dyndns_source_t g_verify;				// 签名校验的全局令牌桶
+static dyndns_replay_t g_replays[DD_REPLAY_SLOTS];
+static uint64_t g_evicted = 0;					// 覆盖仍在时间窗口内的签名的次数, 这些报文可以被重放
+static uint64_t g_rejects[CHK_ERR_MAX];		// 按原因统计的拒绝数量, 下标0为接受的数量
+static uint64_t g_stats_next = 0;
 
 inline static uint32_t _h2(char c, unsigned shift) {
 	return (uint32_t) (c >= '0' && c <= '9' ? c - 48 : c - 87) << shift;
@@ -64,33 +120,108 @@ inline static bool _dyndns_chk_valid(const char *src, size_t src_len) {
 			&& src[DD_MIN_LEN] != 0);
 }
 
-static chk_err_t _dyndns_chk_sign(const dyndns_request_t* req) {
-	// 时间校验, 正负10分钟内都算有效
+/** 检查是否批量更新报文 */
+inline static bool _dyndns_chk_batch(const char *src, size_t src_len) {
+	return (src_len >= DD_HEAD_LEN + DD_VER_LEN
+			&& src[DD_HEAD_LEN] == DD_BATCH_VER[0] && src[DD_HEAD_LEN + 1] == DD_BATCH_VER[1]);
+}
+
+/** 从令牌桶取一个令牌, reset为真或空闲超过补满时间时桶是满的 */
+static bool _dyndns_take(dyndns_source_t *s, bool reset, uint32_t now, int32_t rate, int32_t burst) {
+	if (reset || now - s->last >= (uint32_t) (burst * 1000 / rate)) {
+		s->tokens = burst * 1000;
+	} else {
+		s->tokens += (int32_t) (now - s->last) * rate;
+		if (s->tokens > burst * 1000) s->tokens = burst * 1000;
+	}
+	s->last = now;
+	if (s->tokens < 1000) return false;
+	s->tokens -= 1000;
+	return true;
+}
+
+/** 按来源地址限速, 在解析报文之前检查, 伪造更新报文的洪水不会耗尽处理能力 */
+static bool _dyndns_chk_rate(uint32_t ip, uint32_t now) {
+	dyndns_source_t *s = g_sources + ((ip * 2654435761u) >> 16 & (DD_SOURCE_SLOTS - 1));
+	bool reset = s->ip != ip;
+	s->ip = ip;
+	return _dyndns_take(s, reset, now, DD_RATE, DD_BURST);
+}
+
+static dyndns_replay_t* _dyndns_replay_slot(const char *md5) {
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < DD_MD5_LEN; ++i)
+		h = (h ^ (uint8_t) md5[i]) * 16777619u;
+	return g_replays + (h & (DD_REPLAY_SLOTS - 1));
+}
+
+/** 记录已接受的签名, 签名包含时间, 超出时间窗口的重放由时间检查拒绝 */
+static void _dyndns_remember(const char *md5, const char *time_hex) {
+	dyndns_replay_t *r = _dyndns_replay_slot(md5);
+	int64_t t = _hex_to_int64(time_hex);
+	if (r->used && r->time >= (int64_t) time(NULL) - DD_TIME_WINDOW) {
+		++g_evicted;
+		log_debug("dyndns replay cache evict a signature in time window");
+	}
+	r->used = true;
+	r->time = t;
+	memcpy(r->md5, md5, DD_MD5_LEN);
+}
+
+/** 签名校验之前的检查, 只做比较, 不格式化也不计算md5: 时间在正负10分钟内, 且不是最近接受过的报文 */
+static chk_err_t _dyndns_chk_pre(const char *time_hex, const char *md5) {
+	for (int i = 0; i < DD_TIME_LEN; ++i)
+		if (!((time_hex[i] >= '0' && time_hex[i] <= '9') || (time_hex[i] >= 'a' && time_hex[i] <= 'f')))
+			return TIME_INVALID;
 	time_t now = time(NULL);
-	time_t cmp = (time_t) req->time_num;
-	if (cmp < now - 600 || cmp > now + 600) {
-		log_warn("dyndns request error: time invalid!");
+	time_t cmp = (time_t) _hex_to_int64(time_hex);
+	if (cmp < now - DD_TIME_WINDOW || cmp > now + DD_TIME_WINDOW)
 		return TIME_INVALID;
-	}
+	const dyndns_replay_t *r = _dyndns_replay_slot(md5);
+	if (r->used && !memcmp(r->md5, md5, DD_MD5_LEN))
+		return REPLAYED;
+	return CHK_OK;
+}
+
+/** 计数并生成拒绝的应答, 限速的报文直接丢弃, 不应答 */
+static int _dyndns_reject(chk_err_t err, char *reply) {
+	++g_rejects[err];
+	if (err == RATE_LIMITED) return 0;
+	strcpy(reply, err == TIME_INVALID ? "error invalid time."
+			: err == REPLAYED ? "error replayed request." : "error invalid sign.");
+	log_debug("dyndns reply: %s", reply);
+	return strlen(reply);
+}
+
+/** 校验md5签名, 签名算法: 头部 + 时间 + 内容 + 密钥 */
+static chk_err_t _dyndns_chk_data(const char *head, size_t head_len, const char *time_hex,
+		const char *md5, const char *data, size_t data_len) {
+	// 全局限速, 来源地址可以伪造, 按来源地址限速挡不住分散的洪水
+	if (!_dyndns_take(&g_verify, false, (uint32_t) net_mstime(), DD_VERIFY_RATE, DD_VERIFY_BURST))
+		return RATE_LIMITED;
 
 	// md5签名校验
 	size_t key_len = strlen(g_key);
-	size_t host_ip_len = strlen(req->host_ip);
-	size_t buf_len = DD_HEAD_LEN + DD_TIME_LEN + host_ip_len + key_len;
+	size_t buf_len = head_len + DD_TIME_LEN + data_len + key_len;
 	char sign[33], buf[buf_len];
-	memcpy(buf, g_magic, DD_HEAD_LEN);
-	memcpy(buf + DD_HEAD_LEN, req->time, DD_TIME_LEN);
-	memcpy(buf + DD_HEAD_LEN + DD_TIME_LEN, req->host_ip, host_ip_len);
-	memcpy(buf + DD_HEAD_LEN + DD_TIME_LEN + host_ip_len , g_key, key_len);
+	memcpy(buf, head, head_len);
+	memcpy(buf + head_len, time_hex, DD_TIME_LEN);
+	memcpy(buf + head_len + DD_TIME_LEN, data, data_len);
+	memcpy(buf + head_len + DD_TIME_LEN + data_len, g_key, key_len);
 	md5_string(sign, buf, buf_len);
-	if (0 != strcmp(req->md5, sign)) {
-		log_warn("dyndns request error: md5 sign invalid!");
+	if (0 != memcmp(md5, sign, DD_MD5_LEN)) {
+		log_debug("dyndns request error: md5 sign invalid!");
 		return SIGN_INVALID;
 	}
 
 	return CHK_OK;
 }
 
+static chk_err_t _dyndns_chk_sign(const dyndns_request_t* req) {
+	return _dyndns_chk_data(g_magic, DD_HEAD_LEN, req->time, req->md5,
+			req->host_ip, strlen(req->host_ip));
+}
+
 /** 解析请求内容, 按协议解析到dst中 */
 inline static void _dyndns_parse_request(const struct in_addr *addr, const char *src,
 		size_t size, dyndns_request_t* dst) {
@@ -141,11 +272,132 @@ inline static void _dyndns_dump(const char* data, size_t size, const dyndns_requ
 }
 
 
+/** 解析批量更新的一个条目, 格式与单条更新相同: 域名 + 可选的空格及ip, 没有ip时取客户端地址,
+ *  域名按记录文件的规则检查, 不接受通配符 */
+static bool _dyndns_parse_entry(const struct in_addr *addr, const char *src, size_t len,
+		dyndns_entry_t* dst) {
+	const char *p = memchr(src, ' ', len);
+	size_t n = p ? (size_t) (p - src) : len;
+	dst->host[0] = '\0';
+	dst->ip = addr->s_addr;
+	if (!n || n > DD_HOST_MAX)
+		return false;
+	memcpy(dst->host, src, n);
+	dst->host[n] = '\0';
+	if (!dnsdb_host_valid(dst->host, false))
+		return false;
+
+	if (p) {
+		char ip[DD_IP_MAX + 1];
+		n = len - n - 1;
+		if (!n || n > DD_IP_MAX)
+			return false;
+		memcpy(ip, p + 1, n);
+		ip[n] = '\0';
+		dst->ip = inet_addr(ip);
+		if (dst->ip == INADDR_NONE)
+			return false;
+	}
+	return true;
+}
+
+/** 批量动态更新, 先校验全部条目, 都有效时才逐个更新, 最后只保存一次 */
+static int _dyndns_batch(const struct in_addr *addr, const char *msg, size_t msg_size,
+		char *reply, size_t reply_size) {
+	if (msg_size <= DD_BATCH_MIN_LEN || reply_size < DD_BATCH_REPLY_MAX) {
+		++g_rejects[FORMAT_INVALID];
+		log_debug("dyndns bad batch request, ignore this request!");
+		return 0;
+	}
+
+	const char *time_hex = msg + DD_HEAD_LEN + DD_VER_LEN, *md5 = time_hex + DD_TIME_LEN;
+	const char *body = md5 + DD_MD5_LEN, *end = msg + msg_size;
+	chk_err_t _chk_err = _dyndns_chk_pre(time_hex, md5);
+	if (CHK_OK == _chk_err)
+		_chk_err = _dyndns_chk_data(msg, DD_HEAD_LEN + DD_VER_LEN, time_hex, md5, body, end - body);
+	if (CHK_OK != _chk_err)
+		return _dyndns_reject(_chk_err, reply);
+	_dyndns_remember(md5, time_hex);
+	++g_rejects[CHK_OK];
+
+	// 条目按行分隔, 忽略空行
+	dyndns_entry_t entries[DD_BATCH_MAX];
+	uint32_t count = 0, invalid = 0, updated = 0;
+	for (const char *p = body; p < end; ) {
+		const char *eol = memchr(p, '\n', end - p);
+		size_t len = (eol ? eol : end) - p, n = len;
+		if (n && p[n - 1] == '\r') --n;
+		if (n) {
+			if (count >= DD_BATCH_MAX) {
+				strcpy(reply, "error too many entries.");
+				log_debug("dyndns reply: %s", reply);
+				return strlen(reply);
+			}
+			dyndns_entry_t *e = entries + count++;
+			e->ok = _dyndns_parse_entry(addr, p, n, e);
+			if (!e->ok) ++invalid;
+			log_debug("dyndns batch entry: %s %s%s", e->host, net_ip_tostring(e->ip), e->ok ? "" : " invalid");
+		}
+		p += len + 1;
+	}
+
+	// 有无效条目时整批都不更新, 无效的条目应答invalid, 其余应答skipped
+	char *w = reply;
+	if (invalid || !count) {
+		w += sprintf(w, count ? "error invalid entry.\n" : "error no entry.\n");
+		for (uint32_t i = 0; i < count; ++i)
+			w += sprintf(w, "%s %s\n", entries[i].ok ? "skipped" : "invalid", g_zero_ip);
+	} else {
+		for (uint32_t i = 0; i < count; ++i) {
+			dyndns_entry_t *e = entries + i;
+			e->ok = g_dyndns_upd_func && g_dyndns_upd_func(e->host, e->ip);
+			if (e->ok) ++updated;
+		}
+		if (updated && g_dyndns_commit_func)
+			g_dyndns_commit_func();
+		w += sprintf(w, "ok %u\n", updated);
+		for (uint32_t i = 0; i < count; ++i)
+			w += sprintf(w, "%s %s\n", entries[i].ok ? "ok" : "failed",
+					entries[i].ok ? net_ip_tostring(entries[i].ip) : g_zero_ip);
+	}
+
+	log_debug("dyndns batch reply: %u entries, %u updated", count, updated);
+	return w - reply;
+}
+
 void dyndns_init(const char *key, dyndns_upd_func func) {
 	if (key) g_key = strdup(key);
 	g_dyndns_upd_func = func;
 }
 
+void dyndns_set_commit(dyndns_commit_func func) {
+	g_dyndns_commit_func = func;
+}
+
+void dyndns_timer(uint64_t now) {
+	if (now < g_stats_next) return;
+	g_stats_next = now + DD_STATS_INTERVAL;
+	uint64_t rejected = 0;
+	for (int i = CHK_OK + 1; i < CHK_ERR_MAX; ++i)
+		rejected += g_rejects[i];
+	if (rejected) {
+		char buf[160];
+		int n = 0;
+		for (int i = CHK_OK + 1; i < CHK_ERR_MAX; ++i)
+			n += snprintf(buf + n, sizeof(buf) - n, ", %s=%" PRIu64, g_chk_names[i], g_rejects[i]);
+		log_info("dyndns stats: accepted=%" PRIu64 ", rejected=%" PRIu64 "%s", g_rejects[CHK_OK], rejected, buf);
+	}
+	// 重放缓存太小时, 时间窗口内的签名会被覆盖而失去重放保护
+	if (g_evicted)
+		log_warn("dyndns replay cache evicted %" PRIu64 " signatures in time window, slots=%d", g_evicted, DD_REPLAY_SLOTS);
+	memset(g_rejects, 0, sizeof(g_rejects));
+	g_evicted = 0;
+}
+
+bool dyndns_check(const char *msg, size_t msg_size) {
+	return _dyndns_chk_magic(msg, msg_size);
+}
+
 /** 动态dns更新协议
  *  协议格式:
  *     请求报文:
@@ -158,6 +410,16 @@ void dyndns_init(const char *key, dyndns_upd_func func) {
  *               例子2: home.kivensoft.cn 180.89.75.42
  *     应答报文:
  *         1.域名 + ip, 动态长度, 空格间隔, 如果更新失败, ip部分返回 0.0.0.0
+ *  批量更新协议格式:
+ *     请求报文:
+ *         1.固定4字节的头部: ddyn, 紧跟2字节的版本标志: /2
+ *         2.固定16字节的时间, 与单条更新相同
+ *         3.固定32字节的md5值16进制表示, 算法: 头部及版本标志 + 时间 + 全部条目 + 密钥
+ *         4.最多32个条目, 用换行分隔, 每个条目的格式与单条更新的域名 + ip相同
+ *     应答报文:
+ *         1.首行: ok + 更新的数量; 有无效条目时整批都不更新, 首行为: error invalid entry.
+ *         2.每个条目一行, 与请求的顺序相同: 状态 + ip, 状态为ok、failed、invalid或skipped,
+ *               不成功时ip为 0.0.0.0
  */
 int dyndns(const struct sockaddr_in *addr, const char *msg, size_t msg_size,
 		char *reply, size_t reply_size) {
@@ -166,35 +428,146 @@ int dyndns(const struct sockaddr_in *addr, const char *msg, size_t msg_size,
 		return -1;
 
 	log_text(LOG_TRACE, "recv dynamic dns update request: ", msg, msg_size);
+	// 先按来源地址限速, 超过的直接丢弃, 不应答
+	if (!_dyndns_chk_rate(addr->sin_addr.s_addr, (uint32_t) net_mstime())) {
+		++g_rejects[RATE_LIMITED];
+		return 0;
+	}
+
+	// 带版本标志的批量更新
+	if (_dyndns_chk_batch(msg, msg_size))
+		return _dyndns_batch(&(addr->sin_addr), msg, msg_size, reply, reply_size);
+
 	// 有效标志头, 但内容无效或参数无效, 返回0, 表示抛弃该消息
 	if (!_dyndns_chk_valid(msg, msg_size)
 			|| reply_size < DD_HOST_MAX + DD_IP_MAX + 2) {
+		++g_rejects[FORMAT_INVALID];
 		log_debug("dyndns bad request, ignore this request!");
 		return 0;
 	}
 
+	// 解析及计算md5之前先检查时间和重放
+	chk_err_t _chk_err = _dyndns_chk_pre(msg + DD_HEAD_LEN, msg + DD_HEAD_LEN + DD_TIME_LEN);
+	if (CHK_OK != _chk_err)
+		return _dyndns_reject(_chk_err, reply);
+
 	dyndns_request_t req;
 	memset(&req, 0, sizeof(req));
 	_dyndns_parse_request(&(addr->sin_addr), msg, msg_size, &req);
-	_dyndns_dump(msg, msg_size, &req);
-
-	// 校验时间和MD5是否正确
-	chk_err_t _chk_err;
-	if (CHK_OK != (_chk_err = _dyndns_chk_sign(&req))) {
-		if (TIME_INVALID == _chk_err)
-			strcpy(reply, "error invalid time.");
-		else
-			strcpy(reply, "error invalid sign.");
-	} else {
-		const char *p;
-		if (g_dyndns_upd_func && g_dyndns_upd_func(req.host, req.ip_num))
-			p = req.ip;
-		else
-			p = g_zero_ip;
+	if (log_is_debug_enabled())
+		_dyndns_dump(msg, msg_size, &req);
 
-		sprintf(reply, "ok %s %s", req.host, p);
-	}
+	// 校验MD5是否正确
+	if (CHK_OK != (_chk_err = _dyndns_chk_sign(&req)))
+		return _dyndns_reject(_chk_err, reply);
+	_dyndns_remember(req.md5, req.time);
+	++g_rejects[CHK_OK];
+
+	const char *p;
+	if (dnsdb_host_valid(req.host, false) && g_dyndns_upd_func && g_dyndns_upd_func(req.host, req.ip_num)) {
+		p = req.ip;
+		if (g_dyndns_commit_func) g_dyndns_commit_func();
+	} else
+		p = g_zero_ip;
+
+	sprintf(reply, "ok %s %s", req.host, p);
 
 	log_debug("dyndns reply: %s", reply);
 	return strlen(reply);
 }
+
+// #define DYNDNS_TEST
+#ifdef DYNDNS_TEST
+#include <assert.h>
+
+static int _upd_count = 0, _commit_count = 0;
+
+static bool test_upd(const char* host, uint32_t ip) {
+	++_upd_count;
+	return true;
+}
+
+static bool test_commit() {
+	++_commit_count;
+	return true;
+}
+
+/** 生成签名的批量更新报文并处理, forged为真时篡改签名, 每次使用不同的来源地址以免触发限速, 返回应答长度 */
+static int test_batch(const char* body, char* reply, bool forged) {
+	static uint32_t src = 0x0A000001;
+	char msg[2048], md5[DD_MD5_LEN + 1];
+	int n = sprintf(msg, "%s%s%016" PRIx64, g_magic, DD_BATCH_VER, (uint64_t) time(NULL));
+	size_t head = n, len = strlen(body);
+	sprintf(msg + head, "%s%s", body, g_key);
+	md5_string(md5, msg, head + len + strlen(g_key));
+	memmove(msg + head + DD_MD5_LEN, body, len);
+	memcpy(msg + head, md5, DD_MD5_LEN);
+	if (forged) msg[head] ^= 1;
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	addr.sin_addr.s_addr = htonl(src++);
+	memset(reply, 0, DD_BATCH_REPLY_MAX);
+	return dyndns(&addr, msg, head + DD_MD5_LEN + len, reply, DD_BATCH_REPLY_MAX);
+}
+
+int main() {
+	char reply[DD_BATCH_REPLY_MAX], body[2048];
+	dyndns_init(NULL, test_upd);
+	dyndns_set_commit(test_commit);
+
+	// CRLF分隔的条目, 没有ip的条目取来源地址
+	int n = test_batch("a.com 1.2.3.4\r\nb.a.com\r\n\r\n", reply, false);
+	assert(n == (int) strlen(reply) && !strcmp(reply, "ok 2\nok 1.2.3.4\nok 10.0.0.1\n"));
+	assert(_upd_count == 2 && _commit_count == 1);
+
+	// 有无效条目时整批都不更新, 通配符、非法字符及错误的ip都是无效条目
+	test_batch("a.com 1.2.3.4\n*.a.com 1.2.3.5\nc.com", reply, false);
+	assert(!strcmp(reply, "error invalid entry.\nskipped 0.0.0.0\ninvalid 0.0.0.0\nskipped 0.0.0.0\n"));
+	test_batch("a b.com\na.com 1.2.3.400\n", reply, false);
+	assert(!strcmp(reply, "error invalid entry.\ninvalid 0.0.0.0\ninvalid 0.0.0.0\n"));
+	test_batch("\n\n", reply, false);
+	assert(!strcmp(reply, "error no entry.\n"));
+	assert(_upd_count == 2 && _commit_count == 1);
+
+	// 最多32个条目
+	char *w = body;
+	for (int i = 0; i < DD_BATCH_MAX; ++i)
+		w += sprintf(w, "h%d.a.com 1.2.3.%d\n", i, i);
+	test_batch(body, reply, false);
+	assert(!strncmp(reply, "ok 32\nok 1.2.3.0\n", 17) && strstr(reply, "ok 1.2.3.31\n"));
+	assert(_upd_count == 34 && _commit_count == 2);
+	sprintf(w, "h32.a.com 1.2.3.32\n");
+	test_batch(body, reply, false);
+	assert(!strcmp(reply, "error too many entries."));
+	assert(_upd_count == 34 && _commit_count == 2);
+
+	assert(g_rejects[CHK_OK] == 6 && g_rejects[SIGN_INVALID] == 0);
+
+	// 重放缓存覆盖时间窗口内的签名时计数, 覆盖已过期的签名不计数, 先清空前面批量更新留下的签名
+	memset(g_replays, 0, sizeof(g_replays));
+	g_evicted = 0;
+	char md5[3][DD_MD5_LEN + 1], now_hex[DD_TIME_LEN + 1];
+	sprintf(now_hex, "%016" PRIx64, (uint64_t) time(NULL));
+	for (int i = 0, j = 0; j < 3; ++i) {
+		sprintf(md5[j], "%032x", i);
+		if (!j || _dyndns_replay_slot(md5[j]) == _dyndns_replay_slot(md5[0])) ++j;
+	}
+	_dyndns_remember(md5[0], "0000000000000000");
+	_dyndns_remember(md5[1], now_hex);
+	assert(g_evicted == 0);
+	_dyndns_remember(md5[2], now_hex);
+	assert(g_evicted == 1 && _dyndns_chk_pre(now_hex, md5[2]) == REPLAYED);
+	assert(_dyndns_chk_pre(now_hex, md5[1]) == CHK_OK);
+
+	// 分散来源的伪造报文洪水由签名校验的全局令牌桶限速, 丢弃的报文不应答并计为rate
+	log_set_level(LOG_INFO);
+	int forged = 0;
+	while (test_batch("a.com 1.2.3.4", reply, true) && forged < DD_VERIFY_BURST * 2) {
+		assert(!strcmp(reply, "error invalid sign."));
+		++forged;
+	}
+	assert(forged >= DD_VERIFY_BURST - 6 && forged < DD_VERIFY_BURST * 2);
+	assert(reply[0] == '\0' && g_rejects[RATE_LIMITED] == 1 && g_rejects[SIGN_INVALID] == (uint64_t) forged);
+	printf("test success\n");
+	return 0;
+}
+#endif // DYNDNS_TEST
@@ -3,6 +3,7 @@
 #define __DYNDNS_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef _WIN32
 #	include <winsock2.h>
@@ -11,11 +12,32 @@
 #	include <unistd.h>
 #endif // _WIN32
 
+/** 动态更新协议报文的头部标志 */
+#define DYNDNS_MAGIC "ddyn"
+
 typedef bool (*dyndns_upd_func) (const char* domain_name, uint32_t ip);
 
+/** 一个更新报文处理完成后调用一次, 用于保存更新结果, 批量更新只保存一次 */
+typedef bool (*dyndns_commit_func) (void);
+
 /** 初始化设置更新域名ip映射的回调函数 */
 extern void dyndns_init(const char *key, dyndns_upd_func func);
 
+/** 设置保存更新结果的回调函数 */
+extern void dyndns_set_commit(dyndns_commit_func func);
+
+/** 服务循环中定时调用, 有报文被拒绝时每分钟按原因输出一次拒绝数量
+ * @param now 当前时间, 毫秒为单位
+ */
+extern void dyndns_timer(uint64_t now);
+
+/** 检查报文是否带有动态更新协议的头部标志, 用于在处理之前对报文分类
+ * @param msg 消息报文地址
+ * @param msg_size 消息报文长度
+ * @return true: 是动态更新报文
+ */
+extern bool dyndns_check(const char *msg, size_t msg_size);
+
 /** dns动态更新处理函数
  * @param addr 客户端连接的socket信息
  * @param msg 消息报文地址
@@ -0,0 +1,964 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "pool.h"
+#include "cache.h"
+#include "upstream.h"
+#include "forward.h"
+
+/** 未完成查询表的槽位数量, 必须是2的幂, 使用事务id的低位定位槽位 */
+#define FORWARD_SLOTS 1024
+/** 分配事务id时的最大尝试次数, 随机id对应的槽位被占用时重新生成 */
+#define FORWARD_ID_TRIES 16
+/** 上游查询的超时时间, 毫秒为单位 */
+#define FORWARD_TIMEOUT 1500
+/** tcp查询的超时时间, 毫秒为单位 */
+#define FORWARD_TCP_TIMEOUT 3000
+/** 单个查询最多发送给上游的次数, 超时后切换到其它上游服务器 */
+#define FORWARD_TRIES 3
+/** 否定应答没有SOA记录时的缓存时间, 秒为单位 */
+#define FORWARD_NEG_TTL 30
+/** 缓存时间的上限, 秒为单位 */
+#define FORWARD_TTL_MAX 86400
+/** 单个问题区域的最大长度, 域名(2+HOST_MAX) type(2) class(2) */
+#define FORWARD_QSEC_MAX (HOST_MAX + 6)
+/** 缓存命中次数达到该值才视为热点条目, 进入预取阈值时发起预取 */
+#define FORWARD_PREFETCH_HITS 2
+/** 使用过期缓存前等待上游应答的时间, 毫秒为单位, 取RFC 8767建议的客户端应答计时 */
+#define FORWARD_STALE_WAIT 1800
+/** 过期缓存应答的生存时间, 秒为单位, 取RFC 8767建议值 */
+#define FORWARD_STALE_TTL 30
+/** 刷新失败后直接使用过期缓存应答、不再查询上游的时间, 秒为单位 */
+#define FORWARD_STALE_RECHECK 30
+/** 单个上游查询允许合并的最大客户端数量, 超出时丢弃新的请求 */
+#define FORWARD_WAITERS_MAX 256
+/** 输出统计信息日志的间隔时间, 毫秒为单位 */
+#define FORWARD_STATS_INTERVAL (300 * 1000)
+/** 定时转储缓存的间隔时间, 毫秒为单位 */
+#define FORWARD_DUMP_INTERVAL (600 * 1000)
+/** OPT伪记录的类型值 */
+#define FORWARD_QT_OPT 41
+/** 不带选项的OPT伪记录长度 */
+#define FORWARD_OPT_LEN 11
+
+/** 等待上游应答的客户端 */
+typedef struct forward_waiter_t {
+	struct forward_waiter_t *next;		// 同一上游查询的下一个等待者
+	bool			edns;				// 客户端是否使用EDNS
+	bool			cookie;				// 客户端带有有效的服务器cookie, 应答不经过过滤
+	uint8_t			opt_len;			// 应答OPT伪记录的选项数据长度
+	uint16_t		client_id;			// 客户端的事务id, 网络字节序
+	uint16_t		max;				// 与客户端协商的应答报文最大长度
+	uint16_t		qlen;				// 客户端问题区域的长度
+	sockaddr_in_t	client;				// 客户端地址
+	uint8_t			qsec[FORWARD_QSEC_MAX];	// 客户端问题区域的原文, 应答时原样返回
+	uint8_t			opt[DNS_OPT_DATA_MAX];	// 应答OPT伪记录的选项数据, 即客户端的cookie选项
+} forward_waiter_t;
+
+/** 未完成的上游查询, 相同(域名, 类型, 类)的并发请求合并到同一个上游查询 */
+typedef struct forward_slot_t {
+	bool			used;				// 槽位是否使用中
+	uint8_t			tries;				// 已发送的次数
+	int8_t			upstream;			// 当前查询的上游服务器序号
+	int8_t			racer;				// 同时发送的另一个上游服务器序号, -1表示没有
+	uint8_t			tried;				// 已发送过的上游服务器序号位图
+	bool			tcp;				// 应答被截断, 已改用tcp连接重新查询
+	bool			stale_served;		// 已使用过期缓存应答过等待者, 之后的请求直接使用过期缓存应答
+	uint16_t		id;					// 发送给上游的事务id
+	uint16_t		type;				// 查询类型
+	uint16_t		class;				// 查询类
+	uint32_t		hash;				// (域名, 类型, 类)的哈希值
+	uint32_t		waiters;			// 等待者数量
+	uint64_t		deadline;			// 超时时间, 毫秒为单位
+	uint64_t		sent_at;			// 最近一次发送的时间, 用于计算往返时间
+	uint64_t		stale_at;			// 使用过期缓存应答等待者的时间, 0表示没有可用的过期缓存
+	uint32_t		stale;				// 域名的过期应答窗口, 秒为单位
+	struct forward_slot_t *pnext;		// 待决查询索引中同一哈希桶的下一项
+	forward_waiter_t *head;				// 等待应答的客户端链表
+	char			host[HOST_MAX];		// 查询的域名
+} forward_slot_t;
+
+static socket_t _server_fd = -1, _fwd_fd = -1;
+static forward_slot_t _slots[FORWARD_SLOTS];
+static forward_slot_t *_pending_index[FORWARD_SLOTS];	// 按(域名, 类型, 类)索引的待决查询
+static pool_t _waiter_pool = NULL;
+static forward_policy_func _policy_func = NULL;
+static forward_filter_func _filter_func = NULL;
+static bool _race = false;
+static unsigned _pending = 0;
+static uint64_t _rand_state = 0;
+static forward_stats_t _stats;
+static uint64_t _stats_next = 0;
+static char *_dump_file = NULL;
+static uint64_t _dump_next = 0;
+
+static inline uint16_t fwd_get16(const uint8_t* p) { return (uint16_t) (p[0] << 8 | p[1]); }
+
+static inline uint32_t fwd_get32(const uint8_t* p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void fwd_put16(uint8_t* p, uint16_t v) { p[0] = (uint8_t) (v >> 8); p[1] = (uint8_t) v; }
+
+static inline void fwd_put32(uint8_t* p, uint32_t v) {
+	fwd_put16(p, (uint16_t) (v >> 16));
+	fwd_put16(p + 2, (uint16_t) v);
+}
+
+/** 生成随机的16位事务id, xorshift64*算法 */
+static uint16_t forward_rand() {
+	_rand_state ^= _rand_state >> 12;
+	_rand_state ^= _rand_state << 25;
+	_rand_state ^= _rand_state >> 27;
+	return (uint16_t) ((_rand_state * 2685821657736338717ULL) >> 48);
+}
+
+/** 计算待决查询键的哈希值, FNV-1a算法, 域名不区分大小写 */
+static uint32_t forward_hash(const char* host, uint16_t type, uint16_t class) {
+	uint32_t h = 2166136261u;
+	for (; *host; ++host)
+		h = (h ^ (uint8_t) tolower((unsigned char) *host)) * 16777619u;
+	h = (h ^ type) * 16777619u;
+	return (h ^ class) * 16777619u;
+}
+
+void forward_set_policy(forward_policy_func policy_func) {
+	_policy_func = policy_func;
+}
+
+void forward_set_filter(forward_filter_func filter_func) {
+	_filter_func = filter_func;
+}
+
+void forward_set_race(bool race) {
+	_race = race;
+}
+
+/** 把缓存转储到文件 */
+static void forward_dump(uint64_t now) {
+	int count = cache_save(_dump_file, (uint32_t) (now / 1000));
+	if (count >= 0)
+		log_info("forward cache dump %d entries to %s", count, _dump_file);
+}
+
+bool forward_start(socket_t server_fd, size_t cache_mem, const char* dump_file) {
+	_fwd_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (_fwd_fd == -1 || !socket_set_nonblock(_fwd_fd)) {
+		log_error("forward can't create upstream socket");
+		if (_fwd_fd != -1) socket_close(_fwd_fd);
+		_fwd_fd = -1;
+		return false;
+	}
+
+	_server_fd = server_fd;
+	_rand_state = net_mstime() ^ ((uint64_t) time(NULL) << 20) ^ (uint64_t) (uintptr_t) &server_fd;
+	if (!_rand_state) _rand_state = 88172645463325252ULL;
+	memset(_slots, 0, sizeof(_slots));
+	memset(_pending_index, 0, sizeof(_pending_index));
+	memset(&_stats, 0, sizeof(_stats));
+	_pending = 0;
+	_stats_next = net_mstime() + FORWARD_STATS_INTERVAL;
+	_waiter_pool = pool_malloc(FORWARD_SLOTS, sizeof(forward_waiter_t));
+	cache_init(cache_mem);
+
+	// 加载上次转储的缓存, 重启后的查询直接命中缓存, 避免集中查询上游
+	free(_dump_file);
+	_dump_file = dump_file && *dump_file ? strdup(dump_file) : NULL;
+	if (_dump_file) {
+		int count = cache_load(_dump_file, (uint32_t) (net_mstime() / 1000));
+		if (count >= 0)
+			log_info("forward cache load %d entries from %s", count, _dump_file);
+		_dump_next = net_mstime() + FORWARD_DUMP_INTERVAL;
+	}
+
+	for (int i = 0; i < upstream_count(); ++i)
+		log_debug("forward upstream %s:%d", net_ip_tostring(upstream_addr(i)->sin_addr.s_addr),
+				ntohs(upstream_addr(i)->sin_port));
+	return true;
+}
+
+void forward_stop() {
+	for (int i = 0; i < FORWARD_SLOTS; ++i) {
+		for (forward_waiter_t *w = _slots[i].head, *next; w; w = next) {
+			next = w->next;
+			pool_put(_waiter_pool, w);
+		}
+	}
+	memset(_slots, 0, sizeof(_slots));
+	memset(_pending_index, 0, sizeof(_pending_index));
+	if (_waiter_pool) pool_free(_waiter_pool);
+	_waiter_pool = NULL;
+	if (_fwd_fd != -1) socket_close(_fwd_fd);
+	_fwd_fd = -1;
+	_pending = 0;
+	upstream_stop();
+	if (_dump_file) forward_dump(net_mstime());
+	free(_dump_file);
+	_dump_file = NULL;
+	cache_free();
+}
+
+void forward_get_stats(forward_stats_t* dst) {
+	*dst = _stats;
+}
+
+unsigned forward_pending() {
+	return _pending;
+}
+
+
+/** 在待决查询索引中查找相同(域名, 类型, 类)的上游查询 */
+static forward_slot_t* forward_pending_find(uint32_t hash, const char* host, uint16_t type, uint16_t class) {
+	for (forward_slot_t *s = _pending_index[hash & (FORWARD_SLOTS - 1)]; s; s = s->pnext)
+		if (s->hash == hash && s->type == type && s->class == class && !strcasecmp(s->host, host))
+			return s;
+	return NULL;
+}
+
+/** 释放槽位的全部等待者 */
+static void forward_waiters_release(forward_slot_t* s) {
+	for (forward_waiter_t *w = s->head, *next; w; w = next) {
+		next = w->next;
+		pool_put(_waiter_pool, w);
+	}
+	s->head = NULL;
+	s->waiters = 0;
+}
+
+/** 释放槽位及全部等待者, 并从待决查询索引中移除 */
+static void forward_slot_release(forward_slot_t* s) {
+	forward_slot_t **pp = _pending_index + (s->hash & (FORWARD_SLOTS - 1));
+	while (*pp && *pp != s) pp = &(*pp)->pnext;
+	if (*pp) *pp = s->pnext;
+
+	forward_waiters_release(s);
+	s->used = false;
+	--_pending;
+}
+
+/** 生成发送给上游的查询报文, 查询带有RD标志和OPT伪记录, 返回报文长度 */
+static uint16_t forward_build_query(const forward_slot_t* s, uint8_t* buf) {
+	memset(buf, 0, DNS_HEAD_LEN);
+	fwd_put16(buf, s->id);
+	buf[2] = 0x01;						// RD
+	fwd_put16(buf + 4, 1);
+	fwd_put16(buf + 10, 1);
+
+	uint16_t pos = DNS_HEAD_LEN;
+	pos += dns_name_to_wire(s->host, buf + pos, HOST_MAX + 2);
+	fwd_put16(buf + pos, s->type);
+	fwd_put16(buf + pos + 2, s->class);
+	pos += 4;
+
+	buf[pos] = 0;
+	fwd_put16(buf + pos + 1, FORWARD_QT_OPT);
+	fwd_put16(buf + pos + 3, DNS_EDNS_MAX);
+	fwd_put32(buf + pos + 5, 0);
+	fwd_put16(buf + pos + 9, 0);
+	pos += FORWARD_OPT_LEN;
+	return pos;
+}
+
+/** 使用udp发送查询给指定的上游服务器 */
+static void forward_send_to(forward_slot_t* s, int idx, const uint8_t* buf, uint16_t len) {
+	const sockaddr_in_t *u = upstream_addr(idx);
+	++_stats.upstream;
+	s->tried |= (uint8_t) (1u << idx);
+	if (sendto(_fwd_fd, (const char*) buf, len, 0, (const sockaddr_t*) u, sizeof(*u)) != len)
+		log_warn("forward send %s to %s failed", s->host, net_ip_tostring(u->sin_addr.s_addr));
+	else
+		log_debug("forward %s [type=%u] to %s, try %d", s->host, s->type,
+				net_ip_tostring(u->sin_addr.s_addr), s->tries + 1);
+}
+
+/** 选择上游服务器发送查询, 优先选择未发送过的最快的健康服务器, 启用竞速时首次查询同时发送给两个服务器 */
+static void forward_send(forward_slot_t* s, uint64_t now) {
+	uint8_t buf[DNS_HEAD_LEN + FORWARD_QSEC_MAX + FORWARD_OPT_LEN];
+	uint16_t len = forward_build_query(s, buf);
+
+	int idx = upstream_select(s->tried);
+	if (idx < 0) idx = upstream_select(0);
+	s->upstream = (int8_t) idx;
+	s->racer = -1;
+	s->tcp = false;
+	forward_send_to(s, idx, buf, len);
+
+	if (_race && !s->tries && (idx = upstream_select(s->tried)) >= 0) {
+		s->racer = (int8_t) idx;
+		++_stats.raced;
+		forward_send_to(s, idx, buf, len);
+	}
+	s->sent_at = now;
+	s->deadline = now + FORWARD_TIMEOUT;
+}
+
+/** 应答被截断时, 通过上游服务器的tcp连接重新查询 */
+static bool forward_send_tcp(forward_slot_t* s, int idx, uint64_t now) {
+	uint8_t buf[DNS_HEAD_LEN + FORWARD_QSEC_MAX + FORWARD_OPT_LEN];
+	uint16_t len = forward_build_query(s, buf);
+	if (!upstream_tcp_send(idx, buf, len, now))
+		return false;
+
+	log_debug("forward %s [type=%u] truncated, retry with tcp", s->host, s->type);
+	++_stats.tcp;
+	s->tcp = true;
+	s->upstream = (int8_t) idx;
+	s->racer = -1;
+	s->sent_at = now;
+	s->deadline = now + FORWARD_TCP_TIMEOUT;
+	return true;
+}
+
+/** 在应答末尾写入客户端的OPT伪记录, 并增加附加区域数量, 调用者已检查长度
+ * @return 写入长度
+ */
+static size_t forward_put_opt(const forward_waiter_t* s, uint8_t* res, size_t pos) {
+	res[pos] = 0;
+	fwd_put16(res + pos + 1, FORWARD_QT_OPT);
+	fwd_put16(res + pos + 3, DNS_EDNS_MAX);
+	fwd_put32(res + pos + 5, 0);
+	fwd_put16(res + pos + 9, s->opt_len);
+	memcpy(res + pos + FORWARD_OPT_LEN, s->opt, s->opt_len);
+	fwd_put16(res + 10, fwd_get16(res + 10) + 1);
+	return FORWARD_OPT_LEN + s->opt_len;
+}
+
+/** 使用缓存的应答报文生成客户端的应答
+ * @param s 客户端信息
+ * @param msg 缓存的应答报文, 已去除OPT伪记录
+ * @param len 应答报文长度
+ * @param age 已缓存的时间, 从每条记录的生存时间中扣除
+ * @param stale_ttl 不为0时是过期缓存应答, 每条记录的生存时间都改为该值
+ * @param res 写入应答报文的地址
+ * @param res_size 应答报文地址的可写长度
+ * @return 写入长度, 0: 缓存报文格式错误
+ */
+static int forward_build_reply(const forward_waiter_t* s, const uint8_t* msg, uint16_t len,
+		uint32_t age, uint32_t stale_ttl, uint8_t* res, size_t res_size) {
+	char host[HOST_MAX];
+	size_t qend = dns_read_name(msg, len, DNS_HEAD_LEN, host);
+	if (!qend || qend + 4 > len) return 0;
+	qend += 4;
+
+	size_t max = s->max < res_size ? s->max : res_size;
+	size_t opt = s->edns ? FORWARD_OPT_LEN + s->opt_len : 0;
+	size_t pos = len;
+	unsigned an = fwd_get16(msg + 6), ns = fwd_get16(msg + 8), ar = fwd_get16(msg + 10);
+	bool truncated = false;
+
+	// 超出客户端报文大小时, 先依次丢弃附加区域和授权区域, 回答区域仍放不下时只返回问题区域并设置TC标志
+	if (pos + opt > max) {
+		size_t off = qend, an_end = 0, ns_end = 0;
+		for (unsigned i = 0; i < an + ns && off; ++i) {
+			off = dns_skip_rr(msg, len, off);
+			if (i + 1 == an) an_end = off;
+			if (i + 1 == an + ns) ns_end = off;
+		}
+		if (!an) an_end = qend;
+		if (!ns) ns_end = an_end;
+		if (ns_end && ns_end + opt <= max) pos = ns_end, ar = 0;
+		else if (an_end && an_end + opt <= max) pos = an_end, ns = ar = 0;
+		else pos = qend, an = ns = ar = 0, truncated = true;
+	}
+	if (pos + opt > max) return 0;
+
+	memcpy(res, msg, pos);
+	memcpy(res, &s->client_id, 2);
+	fwd_put16(res + 6, (uint16_t) an);
+	fwd_put16(res + 8, (uint16_t) ns);
+	fwd_put16(res + 10, (uint16_t) ar);
+	// 问题区域长度一致时使用客户端的原文, 保留客户端域名的大小写
+	if (qend - DNS_HEAD_LEN == s->qlen)
+		memcpy(res + DNS_HEAD_LEN, s->qsec, s->qlen);
+
+	if (truncated) {
+		res[2] |= 0x02;
+	} else if (age || stale_ttl) {
+		unsigned count = fwd_get16(res + 6) + fwd_get16(res + 8) + fwd_get16(res + 10);
+		for (size_t off = qend; count--; ) {
+			size_t name_end = dns_read_name(res, pos, off, host);
+			if (!name_end || name_end + DNS_RR_HEAD_LEN > pos) return 0;
+			uint32_t ttl = fwd_get32(res + name_end + 4);
+			fwd_put32(res + name_end + 4, stale_ttl ? stale_ttl : ttl > age ? ttl - age : 0);
+			off = name_end + DNS_RR_HEAD_LEN + fwd_get16(res + name_end + 8);
+		}
+	}
+
+	if (s->edns) pos += forward_put_opt(s, res, pos);
+	return (int) pos;
+}
+
+/** 生成SERVFAIL应答 */
+static int forward_build_servfail(const forward_waiter_t* s, uint8_t* res, size_t res_size) {
+	size_t pos = DNS_HEAD_LEN + s->qlen;
+	if (pos + (s->edns ? FORWARD_OPT_LEN + s->opt_len : 0) > res_size) return 0;
+
+	memset(res, 0, DNS_HEAD_LEN);
+	memcpy(res, &s->client_id, 2);
+	res[2] = 0x81;						// QR RD
+	res[3] = 0x80 | 2;					// RA SERVFAIL
+	fwd_put16(res + 4, 1);
+	memcpy(res + DNS_HEAD_LEN, s->qsec, s->qlen);
+	if (s->edns) pos += forward_put_opt(s, res, pos);
+	return (int) pos;
+}
+
+/** 发送应答给客户端, 带有效cookie的客户端不经过过滤 */
+static void forward_reply(const forward_waiter_t* s, uint8_t* res, int len) {
+	if (len > 0 && _filter_func && !s->cookie) len = _filter_func(&s->client, res, len);
+	if (len > 0 && sendto(_server_fd, (const char*) res, len, 0, (const sockaddr_t*) &s->client,
+			sizeof(s->client)) != len)
+		log_warn("forward reply to %s failed", net_ip_tostring(s->client.sin_addr.s_addr));
+}
+
+/** 使用过期的缓存应答槽位的全部等待者, 上游查询继续进行, 应答后刷新缓存
+ * @return true: 有可用的过期缓存, false: 没有
+ */
+static bool forward_serve_stale(forward_slot_t* s, uint64_t now) {
+	cache_view_t cv;
+	if (!s->stale || !cache_get(s->host, s->type, s->class, (uint32_t) (now / 1000), s->stale, &cv))
+		return false;
+
+	uint8_t res[DNS_EDNS_MAX];
+	log_debug("forward %s [type=%u] serve stale to %u clients", s->host, s->type, s->waiters);
+	for (forward_waiter_t *w = s->head; w; w = w->next)
+		forward_reply(w, res, forward_build_reply(w, cv.msg, cv.len, 0, FORWARD_STALE_TTL, res, sizeof(res)));
+	_stats.stale_answers += s->waiters;
+	forward_waiters_release(s);
+	return true;
+}
+
+/** 超时或上游应答失败时, 切换到下一个上游服务器重试, 重试次数用完后使用过期缓存应答, 没有过期缓存时应答SERVFAIL */
+static void forward_retry(forward_slot_t* s, uint64_t now) {
+	upstream_failure(s->upstream);
+	if (s->racer >= 0) upstream_failure(s->racer);
+	if (++s->tries >= FORWARD_TRIES) {
+		if (forward_serve_stale(s, now)) {
+			cache_set_failed(s->host, s->type, s->class, (uint32_t) (now / 1000));
+			forward_slot_release(s);
+			return;
+		}
+		uint8_t res[DNS_HEAD_LEN + FORWARD_QSEC_MAX + FORWARD_OPT_LEN + DNS_OPT_DATA_MAX];
+		log_warn("forward %s [type=%u] failed, reply SERVFAIL to %u clients", s->host, s->type, s->waiters);
+		for (forward_waiter_t *w = s->head; w; w = w->next)
+			forward_reply(w, res, forward_build_servfail(w, res, sizeof(res)));
+		_stats.servfail += s->waiters;
+		forward_slot_release(s);
+		return;
+	}
+	forward_send(s, now);
+}
+
+/** 去除上游应答中的OPT伪记录(及其后的附加记录), 计算缓存时间
+ * @param msg 上游应答报文, 问题区域已校验
+ * @param len 应答报文长度
+ * @param qend 问题区域的结束偏移地址
+ * @param dst 回写去除OPT后的报文
+ * @param ttl 回写缓存时间, 肯定应答取回答区域记录的最小生存时间, 否定应答取SOA的否定缓存时间
+ * @return 回写的报文长度, 0: 报文格式错误
+ */
+static uint16_t forward_compact(const uint8_t* msg, size_t len, size_t qend, uint8_t* dst, uint32_t* ttl) {
+	char host[HOST_MAX];
+	unsigned counts[3] = { fwd_get16(msg + 6), fwd_get16(msg + 8), fwd_get16(msg + 10) };
+	uint32_t min_ttl = FORWARD_TTL_MAX, neg_ttl = FORWARD_NEG_TTL;
+	size_t off = qend, keep = qend;
+	unsigned arcount = 0;
+
+	for (int sec = 0; sec < 3; ++sec) {
+		for (unsigned i = 0; i < counts[sec]; ++i) {
+			size_t name_end = dns_read_name(msg, len, off, host);
+			size_t next = dns_skip_rr(msg, len, off);
+			if (!name_end || !next) return 0;
+			uint16_t type = fwd_get16(msg + name_end);
+			uint32_t rr_ttl = fwd_get32(msg + name_end + 4);
+			if (type == FORWARD_QT_OPT) {
+				// OPT之后的附加记录可能引用已移动的偏移地址, 一并丢弃
+				sec = 3;
+				break;
+			}
+			if (sec == 0 && rr_ttl < min_ttl)
+				min_ttl = rr_ttl;
+			if (sec == 1 && type == DNS_QT_SOA && next - 4 >= name_end + DNS_RR_HEAD_LEN) {
+				uint32_t minimum = fwd_get32(msg + next - 4);
+				neg_ttl = rr_ttl < minimum ? rr_ttl : minimum;
+			}
+			if (sec == 2) ++arcount;
+			off = next;
+			keep = next;
+		}
+	}
+
+	memcpy(dst, msg, keep);
+	fwd_put16(dst + 10, (uint16_t) arcount);
+	*ttl = counts[0] ? min_ttl : neg_ttl;
+	if (*ttl > FORWARD_TTL_MAX) *ttl = FORWARD_TTL_MAX;
+	return (uint16_t) keep;
+}
+
+/** 处理一个上游应答报文
+ * @param idx 发送应答的上游服务器序号
+ * @param tcp 应答是否来自tcp连接
+ * @param msg 应答报文
+ * @param len 应答报文长度
+ * @param now 当前时间, 毫秒为单位
+ */
+static void forward_answer(int idx, bool tcp, const uint8_t* msg, size_t len, uint64_t now) {
+	static uint8_t compact[65535];
+	char host[HOST_MAX];
+	uint8_t res[DNS_EDNS_MAX];
+
+	if (len < DNS_HEAD_LEN) return;
+
+	// 应答必须来自查询发送的服务器及传输方式, 改用tcp后迟到的udp应答直接丢弃
+	uint16_t id = fwd_get16(msg);
+	forward_slot_t *s = _slots + (id & (FORWARD_SLOTS - 1));
+	if (!s->used || s->id != id || s->tcp != tcp || (idx != s->upstream && idx != s->racer)
+			|| !(msg[2] & 0x80) || fwd_get16(msg + 4) != 1) {
+		log_debug("forward drop unexpected answer [id=%u]", id);
+		return;
+	}
+
+	size_t qend = dns_read_name(msg, len, DNS_HEAD_LEN, host);
+	if (!qend || qend + 4 > len || strcasecmp(host, s->host)
+			|| fwd_get16(msg + qend) != s->type || fwd_get16(msg + qend + 2) != s->class) {
+		log_debug("forward drop answer with mismatched question [id=%u]", id);
+		return;
+	}
+	qend += 4;
+
+	int rcode = msg[3] & 0x0F;
+	if (rcode == 2 || rcode == 5) {
+		log_debug("forward %s got rcode %d from upstream", s->host, rcode);
+		s->upstream = (int8_t) idx;
+		s->racer = -1;
+		forward_retry(s, now);
+		return;
+	}
+	upstream_success(idx, now - s->sent_at);
+
+	// udp应答被截断时, 改用tcp连接重新查询, tcp不可用时把截断的应答转给客户端
+	if ((msg[2] & 0x02) && !tcp && forward_send_tcp(s, idx, now))
+		return;
+
+	uint32_t ttl;
+	uint16_t clen = forward_compact(msg, len, qend, compact, &ttl);
+	if (!clen) {
+		log_warn("forward answer of %s format error", s->host);
+		forward_retry(s, now);
+		return;
+	}
+
+	// 截断的应答不缓存, 客户端需要改用其它方式重新查询
+	if (!(msg[2] & 0x02) && (rcode == 0 || rcode == 3))
+		cache_put(s->host, s->type, s->class, compact, clen, ttl, (uint32_t) (now / 1000));
+
+	// 同一个上游应答回复全部合并等待的客户端
+	for (forward_waiter_t *w = s->head; w; w = w->next)
+		forward_reply(w, res, forward_build_reply(w, compact, clen, 0, 0, res, sizeof(res)));
+	forward_slot_release(s);
+}
+
+/** tcp连接收到应答的回调函数 */
+static void forward_tcp_answer(int idx, const uint8_t* msg, size_t len, uint64_t now) {
+	log_hex(LOG_TRACE, "forward tcp recived data:", msg, len);
+	forward_answer(idx, true, msg, len, now);
+}
+
+socket_t forward_fdset(fd_set* rfds, fd_set* wfds, socket_t maxfd) {
+	FD_SET(_fwd_fd, rfds);
+	if (_fwd_fd > maxfd) maxfd = _fwd_fd;
+	return upstream_fdset(rfds, wfds, maxfd);
+}
+
+void forward_io(const fd_set* rfds, const fd_set* wfds) {
+	uint8_t buf[DNS_EDNS_MAX];
+	sockaddr_in_t from;
+	socklen_t fromlen;
+
+	while (FD_ISSET(_fwd_fd, rfds)) {
+		fromlen = sizeof(from);
+		int n = recvfrom(_fwd_fd, (char*) buf, sizeof(buf), 0, (sockaddr_t*) &from, &fromlen);
+		if (n <= 0) break;
+		log_hex(LOG_TRACE, "forward recived data:", buf, n);
+		int idx = upstream_find(&from);
+		if (idx < 0)
+			log_debug("forward drop message from %s", net_ip_tostring(from.sin_addr.s_addr));
+		else
+			forward_answer(idx, false, buf, n, net_mstime());
+	}
+	upstream_io(rfds, wfds, forward_tcp_answer);
+}
+
+void forward_timer(uint64_t now) {
+	if (now >= _stats_next) {
+		_stats_next = now + FORWARD_STATS_INTERVAL;
+		size_t count, mem;
+		cache_usage(&count, &mem);
+		log_info("forward stats: queries=%" PRIu64 ", cache_hits=%" PRIu64 ", upstream=%" PRIu64
+				", coalesced=%" PRIu64 ", servfail=%" PRIu64 ", prefetch=%" PRIu64 ", stale_answers=%" PRIu64
+				", raced=%" PRIu64 ", tcp=%" PRIu64 ", pending=%u, cache_entries=%" PRIu64 ", cache_mem=%" PRIu64,
+				_stats.queries, _stats.cache_hits, _stats.upstream, _stats.coalesced, _stats.servfail,
+				_stats.prefetch, _stats.stale_answers, _stats.raced, _stats.tcp, _pending,
+				(uint64_t) count, (uint64_t) mem);
+		upstream_log_stats();
+	}
+	if (_dump_file && now >= _dump_next) {
+		_dump_next = now + FORWARD_DUMP_INTERVAL;
+		forward_dump(now);
+	}
+	upstream_timer(now);
+	if (!_pending) return;
+	for (int i = 0; i < FORWARD_SLOTS; ++i) {
+		forward_slot_t *s = _slots + i;
+		if (s->used && s->stale_at && now >= s->stale_at) {
+			s->stale_at = 0;
+			s->stale_served = forward_serve_stale(s, now);
+		}
+		if (s->used && now >= s->deadline)
+			forward_retry(s, now);
+	}
+}
+
+/** 分配槽位并加入待决查询索引, 没有可用槽位时返回NULL */
+static forward_slot_t* forward_slot_new(const char* host, uint16_t type, uint16_t class, uint32_t hash) {
+	forward_slot_t *s = NULL;
+	uint16_t id = 0;
+	for (int i = 0; i < FORWARD_ID_TRIES && !s; ++i) {
+		id = forward_rand();
+		if (!_slots[id & (FORWARD_SLOTS - 1)].used)
+			s = _slots + (id & (FORWARD_SLOTS - 1));
+	}
+	if (!s) return NULL;
+
+	*s = (forward_slot_t) { .used = true, .id = id, .type = type, .class = class, .hash = hash };
+	strcpy(s->host, host);
+	s->pnext = _pending_index[hash & (FORWARD_SLOTS - 1)];
+	_pending_index[hash & (FORWARD_SLOTS - 1)] = s;
+	++_pending;
+	return s;
+}
+
+int forward_query(const sockaddr_in_t* addr, const dns_fwd_query_t* query, uint8_t* res, size_t res_size) {
+	if (!upstream_count() || _fwd_fd == -1 || query->qend - DNS_HEAD_LEN > FORWARD_QSEC_MAX)
+		return -1;
+
+	forward_waiter_t tmp = { .edns = query->edns, .cookie = query->cookie, .max = query->max,
+		.qlen = query->qend - DNS_HEAD_LEN, .client = *addr };
+	if (query->edns && query->opt_len <= DNS_OPT_DATA_MAX) {
+		tmp.opt_len = (uint8_t) query->opt_len;
+		memcpy(tmp.opt, query->opt, query->opt_len);
+	}
+	memcpy(&tmp.client_id, query->req, 2);
+	memcpy(tmp.qsec, query->req + DNS_HEAD_LEN, tmp.qlen);
+	++_stats.queries;
+
+	uint8_t prefetch = 0;
+	uint32_t stale = 0;
+	if (_policy_func) _policy_func(query->host, &prefetch, &stale);
+
+	uint64_t now = net_mstime();
+	uint32_t now_sec = (uint32_t) (now / 1000);
+	uint32_t hash = forward_hash(query->host, query->type, query->class);
+	forward_slot_t *s = forward_pending_find(hash, query->host, query->type, query->class);
+	bool has_stale = false;
+	cache_view_t cv;
+
+	if (cache_get(query->host, query->type, query->class, now_sec, stale, &cv)) {
+		if (cv.age < cv.ttl) {
+			int n = forward_build_reply(&tmp, cv.msg, cv.len, cv.age, 0, res, res_size);
+			if (n <= 0) return n;
+			log_debug("forward cache hit %s [type=%u], age %u", query->host, query->type, cv.age);
+			++_stats.cache_hits;
+			// 热点条目的剩余生存时间进入预取阈值时, 在后台刷新缓存
+			if (!s && prefetch && cv.hits >= FORWARD_PREFETCH_HITS
+					&& (uint64_t) (cv.ttl - cv.age) * 100 < (uint64_t) cv.ttl * prefetch
+					&& (s = forward_slot_new(query->host, query->type, query->class, hash))) {
+				log_debug("forward prefetch %s [type=%u], ttl left %u", query->host, query->type, cv.ttl - cv.age);
+				++_stats.prefetch;
+				s->stale = stale;
+				forward_send(s, now);
+			}
+			return n;
+		}
+
+		// 过期缓存: 最近刷新失败过, 或正在进行的刷新已超过等待时间, 直接使用过期缓存应答
+		if ((cv.failed && now_sec - cv.failed < FORWARD_STALE_RECHECK) || (s && s->stale_served)) {
+			int n = forward_build_reply(&tmp, cv.msg, cv.len, 0, FORWARD_STALE_TTL, res, res_size);
+			if (n > 0) {
+				log_debug("forward %s [type=%u] serve stale, expired %u", query->host, query->type, cv.age - cv.ttl);
+				++_stats.stale_answers;
+				return n;
+			}
+		}
+		has_stale = true;
+	}
+
+	// 已有相同的上游查询在等待应答时, 合并到该查询, 不再重复发送
+	if (s) {
+		if (s->waiters >= FORWARD_WAITERS_MAX) {
+			log_warn("forward %s has too many waiters, drop request", query->host);
+			return 0;
+		}
+		if (has_stale && !s->stale_at) {
+			s->stale = stale;
+			s->stale_at = now + FORWARD_STALE_WAIT;
+		}
+		forward_waiter_t *w = pool_get(_waiter_pool);
+		*w = tmp;
+		w->next = s->head;
+		s->head = w;
+		++s->waiters;
+		++_stats.coalesced;
+		log_debug("forward coalesce %s [type=%u], waiters %u", query->host, query->type, s->waiters);
+		return 0;
+	}
+
+	// 只允许使用缓存时不发送新的上游查询, 由调用方按本地结果应答
+	if (query->cache_only) return -1;
+
+	if (!(s = forward_slot_new(query->host, query->type, query->class, hash))) {
+		log_warn("forward table is full, reply SERVFAIL for %s", query->host);
+		++_stats.servfail;
+		return forward_build_servfail(&tmp, res, res_size);
+	}
+
+	forward_waiter_t *w = pool_get(_waiter_pool);
+	*w = tmp;
+	w->next = NULL;
+	s->head = w;
+	s->waiters = 1;
+	s->stale = stale;
+	// 有过期缓存时, 上游在等待时间内没有应答则先使用过期缓存应答
+	s->stale_at = has_stale ? now + FORWARD_STALE_WAIT : 0;
+	forward_send(s, now);
+	return 0;
+}
+
+//==========================================================================
+// #define FORWARD_TEST
+#ifdef FORWARD_TEST
+#include <assert.h>
+
+static socket_t test_socket(sockaddr_in_t* addr) {
+	socklen_t len = sizeof(*addr);
+	socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = net_ip_fromstring("127.0.0.1");
+	assert(bind(fd, (sockaddr_t*) addr, sizeof(*addr)) == 0);
+	getsockname(fd, (sockaddr_t*) addr, &len);
+	socket_recv_timeout(fd, 1);
+	return fd;
+}
+
+static uint16_t test_request(uint8_t* req, uint16_t id, const char* host, dns_fwd_query_t* q) {
+	memset(req, 0, DNS_HEAD_LEN);
+	fwd_put16(req, id);
+	req[2] = 0x01;
+	fwd_put16(req + 4, 1);
+	uint16_t pos = DNS_HEAD_LEN + dns_name_to_wire(host, req + DNS_HEAD_LEN, HOST_MAX + 2);
+	fwd_put16(req + pos, DNS_QT_A);
+	fwd_put16(req + pos + 2, 1);
+	pos += 4;
+	*q = (dns_fwd_query_t) { .req = req, .req_size = pos, .qend = pos, .type = DNS_QT_A,
+		.class = 1, .max = DNS_PACKET_MAX, .edns = false, .host = host };
+	return pos;
+}
+
+static void test_policy(const char* host, uint8_t* prefetch, uint32_t* stale) {
+	*prefetch = 10;
+	*stale = 60;
+}
+
+/** 等待并处理转发模块的socket事件, 返回就绪的socket数量 */
+static int test_pump(int ms) {
+	fd_set rfds, wfds;
+	struct timeval tv = { .tv_sec = 0, .tv_usec = ms * 1000 };
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	socket_t maxfd = forward_fdset(&rfds, &wfds, 0);
+	int ready = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+	if (ready > 0) forward_io(&rfds, &wfds);
+	return ready;
+}
+
+static void test_wait_forward() {
+	assert(test_pump(1000) > 0);
+}
+
+/** 上游通过tcp应答截断的查询, 应答一个A记录 */
+static void test_tcp_answer(socket_t conn, uint8_t* buf) {
+	static const uint8_t answer[] = { 0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 5, 6, 7, 8 };
+	uint8_t *msg = buf + 2;
+	assert(recv(conn, (char*) buf, 2, MSG_WAITALL) == 2);
+	int len = fwd_get16(buf);
+	assert(recv(conn, (char*) msg, len, MSG_WAITALL) == len);
+	size_t qend = dns_read_name(msg, len, DNS_HEAD_LEN, (char[HOST_MAX]) {0}) + 4;
+	msg[2] = 0x81; msg[3] = 0x80;
+	fwd_put16(msg + 6, 1);
+	fwd_put16(msg + 10, 0);
+	memcpy(msg + qend, answer, sizeof(answer));
+	fwd_put16(buf, (uint16_t) (qend + sizeof(answer)));
+	assert(send(conn, (char*) buf, 2 + qend + sizeof(answer), 0) > 0);
+}
+
+int main() {
+	uint8_t req[128], buf[DNS_EDNS_MAX], res[DNS_EDNS_MAX];
+	sockaddr_in_t stub_addr, srv_addr, cli_addr, from;
+	socklen_t fromlen = sizeof(from);
+	dns_fwd_query_t q;
+	char upstream[32];
+
+	socket_init();
+	socket_t stub = test_socket(&stub_addr), srv = test_socket(&srv_addr), cli = test_socket(&cli_addr);
+	sprintf(upstream, "127.0.0.1:%d", ntohs(stub_addr.sin_port));
+	assert(upstream_add(upstream));
+	assert(!upstream_add("bad.ip"));
+
+	// 上游的tcp监听端口与udp端口相同
+	socket_t stub_tcp = socket(AF_INET, SOCK_STREAM, 0);
+	assert(bind(stub_tcp, (sockaddr_t*) &stub_addr, sizeof(stub_addr)) == 0 && listen(stub_tcp, 4) == 0);
+	assert(forward_start(srv, 64 * 1024, NULL));
+
+	// 缓存未命中, 转发给上游, 上游应答后异步应答客户端
+	test_request(req, 0x1234, "WWW.Example.com", &q);
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+	int n = recvfrom(stub, (char*) buf, sizeof(buf), 0, (sockaddr_t*) &from, &fromlen);
+	assert(n == q.qend + FORWARD_OPT_LEN && (buf[2] & 0x01) && fwd_get16(buf + 10) == 1);
+
+	static const uint8_t answer[] = { 0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0x01, 0x2c, 0, 4, 1, 2, 3, 4 };
+	buf[2] = 0x81; buf[3] = 0x80;
+	fwd_put16(buf + 6, 1);
+	fwd_put16(buf + 10, 0);
+	memcpy(buf + q.qend, answer, sizeof(answer));
+	n = q.qend + sizeof(answer);
+	sendto(stub, (char*) buf, n, 0, (sockaddr_t*) &from, fromlen);
+	test_wait_forward();
+
+	n = recv(cli, (char*) res, sizeof(res), 0);
+	assert(n == q.qend + (int) sizeof(answer));
+	assert(fwd_get16(res) == 0x1234 && fwd_get16(res + 6) == 1);
+	assert(!memcmp(res + DNS_HEAD_LEN, req + DNS_HEAD_LEN, q.qend - DNS_HEAD_LEN));
+	assert(!memcmp(res + n - 4, answer + 12, 4));
+
+	// 并发的相同查询合并到同一个上游查询, 上游应答后全部应答
+	test_request(req, 0x1111, "pop.example.com", &q);
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+	test_request(req, 0x2222, "POP.example.com", &q);
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+	n = recvfrom(stub, (char*) buf, sizeof(buf), 0, (sockaddr_t*) &from, &fromlen);
+	assert(n > 0);
+	forward_stats_t st;
+	forward_get_stats(&st);
+	assert(st.upstream == 2 && st.coalesced == 1);
+	buf[2] = 0x81; buf[3] = 0x80;
+	fwd_put16(buf + 6, 1);
+	fwd_put16(buf + 10, 0);
+	memcpy(buf + q.qend, answer, sizeof(answer));
+	sendto(stub, (char*) buf, q.qend + sizeof(answer), 0, (sockaddr_t*) &from, fromlen);
+	test_wait_forward();
+	uint16_t ids = 0;
+	for (int i = 0; i < 2; ++i) {
+		n = recv(cli, (char*) res, sizeof(res), 0);
+		assert(n == q.qend + (int) sizeof(answer));
+		ids |= fwd_get16(res) == 0x1111 ? 1 : fwd_get16(res) == 0x2222 ? 2 : 0;
+	}
+	assert(ids == 3 && !memcmp(res + DNS_HEAD_LEN + 1, "POP", 3) == (fwd_get16(res) == 0x2222));
+
+	// 再次查询命中缓存, 直接应答
+	test_request(req, 0x4321, "www.example.com", &q);
+	n = forward_query(&cli_addr, &q, res, sizeof(res));
+	assert(n == q.qend + (int) sizeof(answer) && fwd_get16(res) == 0x4321);
+	assert(fwd_get32(res + n - 10) <= 300);
+
+	// 上游不应答, 重试次数用完后应答SERVFAIL
+	test_request(req, 0x5678, "timeout.example.com", &q);
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+	uint64_t now = net_mstime();
+	for (int i = 1; i <= FORWARD_TRIES; ++i) {
+		assert(recv(stub, (char*) buf, sizeof(buf), 0) > 0);
+		forward_timer(now + i * FORWARD_TIMEOUT);
+	}
+	n = recv(cli, (char*) res, sizeof(res), 0);
+	assert(n == q.qend && fwd_get16(res) == 0x5678 && (res[3] & 0x0F) == 2);
+
+	// 过期缓存在上游无应答时先使用过期缓存应答, 之后的请求直接使用过期缓存应答
+	forward_set_policy(test_policy);
+	test_request(req, 0x6666, "stale.example.com", &q);
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+	n = recvfrom(stub, (char*) buf, sizeof(buf), 0, (sockaddr_t*) &from, &fromlen);
+	buf[2] = 0x81; buf[3] = 0x80;
+	fwd_put16(buf + 6, 1);
+	fwd_put16(buf + 10, 0);
+	memcpy(buf + q.qend, answer, sizeof(answer));
+	fwd_put32(buf + q.qend + 6, 1);
+	sendto(stub, (char*) buf, q.qend + sizeof(answer), 0, (sockaddr_t*) &from, fromlen);
+	test_wait_forward();
+	assert(recv(cli, (char*) res, sizeof(res), 0) > 0);
+#ifdef _WIN32
+	Sleep(2000);
+#else
+	sleep(2);
+#endif
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+	assert(recv(stub, (char*) buf, sizeof(buf), 0) > 0);
+	forward_timer(net_mstime() + FORWARD_STALE_WAIT);
+	n = recv(cli, (char*) res, sizeof(res), 0);
+	assert(n == q.qend + (int) sizeof(answer) && fwd_get32(res + n - 10) == FORWARD_STALE_TTL);
+	assert(forward_query(&cli_addr, &q, res, sizeof(res)) == n);
+	forward_get_stats(&st);
+	assert(st.stale_answers == 2);
+
+	// 截断的udp应答改用tcp重新查询, 后续的截断查询复用同一个tcp连接
+	socket_t conn = -1;
+	for (int k = 0; k < 2; ++k) {
+		test_request(req, 0x7000 + k, k ? "big2.example.com" : "big.example.com", &q);
+		assert(forward_query(&cli_addr, &q, res, sizeof(res)) == 0);
+		// 跳过前面测试遗留在上游socket中的重试查询
+		do {
+			n = recvfrom(stub, (char*) buf, sizeof(buf), 0, (sockaddr_t*) &from, &fromlen);
+		} while (n > 0 && memcmp(buf + DNS_HEAD_LEN, req + DNS_HEAD_LEN, q.qend - DNS_HEAD_LEN));
+		buf[2] = 0x83; buf[3] = 0x80;
+		fwd_put16(buf + 10, 0);
+		sendto(stub, (char*) buf, q.qend, 0, (sockaddr_t*) &from, fromlen);
+		test_wait_forward();
+		if (!k) conn = accept(stub_tcp, NULL, NULL);
+		while (test_pump(50) > 0);
+		test_tcp_answer(conn, buf);
+		test_wait_forward();
+		n = recv(cli, (char*) res, sizeof(res), 0);
+		assert(fwd_get16(res) == 0x7000 + k && !(res[2] & 0x02) && !memcmp(res + n - 4, "\5\6\7\10", 4));
+	}
+	forward_get_stats(&st);
+	assert(st.tcp == 2);
+	socket_close(conn);
+
+	// 缓存转储后重新加载, 保留已缓存时间及命中次数, 跳过已过期的条目
+	uint32_t sec = (uint32_t) (net_mstime() / 1000);
+	cache_view_t cv;
+	assert(cache_get("www.example.com", DNS_QT_A, 1, sec, 0, &cv));
+	uint32_t age = cv.age, hits = cv.hits;
+	assert(cache_save("forward_test.cache", sec) >= 1);
+	cache_free();
+	cache_init(64 * 1024);
+	assert(!cache_get("www.example.com", DNS_QT_A, 1, sec, 0, &cv));
+	assert(cache_load("forward_test.cache", sec) >= 1);
+	assert(cache_get("WWW.example.com", DNS_QT_A, 1, sec, 0, &cv));
+	assert(cv.age >= age && cv.age <= age + 1 && cv.hits == hits + 1);
+	assert(!cache_get("stale.example.com", DNS_QT_A, 1, sec, 3600, &cv));
+	remove("forward_test.cache");
+
+	forward_stop();
+	socket_close(stub_tcp);
+	socket_close(stub);
+	socket_close(srv);
+	socket_close(cli);
+	printf("test success\n");
+	return 0;
+}
+#endif // FORWARD_TEST
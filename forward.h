@@ -0,0 +1,94 @@
+/** dns转发模块, 本地数据库找不到的域名转发给上游服务器查询, 应答结果写入缓存
+ *  上游查询使用非阻塞socket异步发送, 使用未完成查询表匹配上游应答, 超时后切换上游重试
+ */
+#pragma once
+#ifndef __FORWARD_H__
+#define __FORWARD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "net.h"
+#include "dnsproto.h"
+
+/** 默认的缓存内存上限, KB为单位 */
+#define FORWARD_CACHE_DEFAULT 1024
+
+/** 转发统计计数 */
+typedef struct forward_stats_t {
+	uint64_t		queries;			// 转发模块收到的查询数量
+	uint64_t		cache_hits;			// 缓存命中的数量
+	uint64_t		upstream;			// 发送给上游的查询数量, 包含超时重试
+	uint64_t		coalesced;			// 合并到已有上游查询, 未重复发送的数量
+	uint64_t		servfail;			// 应答SERVFAIL的数量
+	uint64_t		prefetch;			// 生存时间即将到期时发起的预取查询数量
+	uint64_t		stale_answers;		// 使用过期缓存应答的数量
+	uint64_t		raced;				// 同时发送给两个上游服务器的查询数量
+	uint64_t		tcp;				// 应答被截断后改用tcp重新查询的数量
+} forward_stats_t;
+
+/** 转发域名的缓存策略回调接口
+ * @param host 域名
+ * @param prefetch 回写预取阈值, 命中的缓存剩余生存时间低于该百分比时后台刷新, 0表示不预取
+ * @param stale 回写过期应答窗口, 秒为单位, 上游无应答时在过期后该时间内使用过期缓存应答, 0表示不使用
+ */
+typedef void (*forward_policy_func) (const char* host, uint8_t* prefetch, uint32_t* stale);
+
+/** 设置转发域名的缓存策略回调接口, 为NULL时不预取, 不使用过期应答 */
+extern void forward_set_policy(forward_policy_func policy_func);
+
+/** 异步应答客户端前的过滤回调接口, 用于应答限速
+ * @param addr 客户端地址
+ * @param res 应答报文, 允许在原地修改
+ * @param len 应答报文长度
+ * @return 需要发送的长度, 0: 丢弃
+ */
+typedef int (*forward_filter_func) (const sockaddr_in_t* addr, uint8_t* res, int len);
+
+/** 设置异步应答客户端前的过滤回调接口, 为NULL时不过滤 */
+extern void forward_set_filter(forward_filter_func filter_func);
+
+/** 设置是否启用竞速查询, 启用时首次查询同时发送给最快的两个上游服务器, 使用先到的应答 */
+extern void forward_set_race(bool race);
+
+/** 启动转发模块, 创建上游查询socket并初始化缓存
+ * @param server_fd 接收客户端请求的服务socket, 异步应答时使用该socket发送
+ * @param cache_mem 缓存允许使用的最大内存, 字节为单位
+ * @param dump_file 缓存转储文件名, 启动时加载, 定时及停止时转储, NULL表示不转储
+ * @return true: 成功, false: 失败
+ */
+extern bool forward_start(socket_t server_fd, size_t cache_mem, const char* dump_file);
+
+/** 停止转发模块, 转储缓存, 关闭socket并释放缓存 */
+extern void forward_stop();
+
+/** 获取转发统计计数, 统计信息也会定时输出到日志 */
+extern void forward_get_stats(forward_stats_t* dst);
+
+/** 获取尚未完成的上游查询数量 */
+extern unsigned forward_pending();
+
+/** 把转发模块的上游udp socket及tcp连接加入select的等待集合
+ * @return 已加入集合及maxfd中的最大值
+ */
+extern socket_t forward_fdset(fd_set* rfds, fd_set* wfds, socket_t maxfd);
+
+/** select返回后调用, 读取全部上游应答, 写入缓存并应答客户端 */
+extern void forward_io(const fd_set* rfds, const fd_set* wfds);
+
+/** 定时调用, 处理超时的上游查询, 切换上游重试, 关闭空闲的tcp连接, 定时转储缓存, 重试次数用完后应答客户端SERVFAIL
+ * @param now 当前时间, net_mstime返回的毫秒值
+ */
+extern void forward_timer(uint64_t now);
+
+/** 转发查询, 符合dns_forward_func接口, 缓存命中时直接写入应答, 否则发送给上游服务器
+ * @param addr 客户端地址
+ * @param query 查询信息
+ * @param res 写入应答报文的地址
+ * @param res_size 应答报文地址的可写长度
+ * @return 大于0: 缓存命中, 已写入res的应答长度, 0: 已发送给上游, 稍后异步应答, 小于0: 不转发
+ */
+extern int forward_query(const sockaddr_in_t* addr, const dns_fwd_query_t* query,
+		uint8_t* res, size_t res_size);
+
+#endif // __FORWARD_H__
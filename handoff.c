@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "handoff.h"
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** 新进程等待旧进程完成收尾的最长时间, 秒为单位 */
+#define HANDOFF_WAIT 10
+/** 随服务socket一起发送的标志字节 */
+#define HANDOFF_TAG 'H'
+
+static socket_t _listen_fd = -1, _conn_fd = -1;
+static char *_path = NULL;
+
+/** 生成unix socket地址, 路径过长时返回false */
+static bool handoff_addr(const char* path, struct sockaddr_un* addr) {
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		log_error("handoff path too long: %s", path);
+		return false;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+socket_t handoff_receive(const char* path) {
+	struct sockaddr_un addr;
+	if (!handoff_addr(path, &addr))
+		return -1;
+	socket_t c = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c == -1) return -1;
+	// 连接失败说明没有运行中的进程, 由调用者自行监听服务端口
+	if (connect(c, (const sockaddr_t*) &addr, sizeof(addr)) != 0) {
+		socket_close(c);
+		return -1;
+	}
+	socket_recv_timeout(c, HANDOFF_WAIT);
+
+	char tag = 0;
+	struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+	union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+			.msg_controllen = sizeof(ctl.buf) };
+	socket_t fd = -1;
+	if (recvmsg(c, &msg, 0) == 1 && tag == HANDOFF_TAG) {
+		struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+		if (h && h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS && h->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(&fd, CMSG_DATA(h), sizeof(int));
+	}
+	if (fd == -1) {
+		log_warn("handoff receive server socket from %s failed", path);
+		socket_close(c);
+		return -1;
+	}
+
+	// 旧进程处理完未完成的查询并转储缓存后关闭连接, 超时则不再等待
+	log_info("handoff receive server socket from %s, wait for old process", path);
+	while (recv(c, &tag, 1, 0) > 0);
+	socket_close(c);
+	return fd;
+}
+
+bool handoff_listen(const char* path) {
+	struct sockaddr_un addr;
+	if (!handoff_addr(path, &addr))
+		return false;
+
+	// 删除旧进程遗留的路径, 交接完成后旧进程不会删除该路径
+	unlink(path);
+	socket_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (const sockaddr_t*) &addr, sizeof(addr)) != 0
+			|| listen(fd, 1) != 0 || !socket_set_nonblock(fd)) {
+		log_error("handoff can't listen %s", path);
+		if (fd != -1) socket_close(fd);
+		return false;
+	}
+
+	_listen_fd = fd;
+	_conn_fd = -1;
+	free(_path);
+	_path = strdup(path);
+	log_debug("handoff listen %s", path);
+	return true;
+}
+
+socket_t handoff_fdset(fd_set* rfds, socket_t maxfd) {
+	if (_listen_fd == -1 || _conn_fd != -1) return maxfd;
+	FD_SET(_listen_fd, rfds);
+	return _listen_fd > maxfd ? _listen_fd : maxfd;
+}
+
+bool handoff_io(const fd_set* rfds, socket_t server_fd) {
+	if (_listen_fd == -1 || _conn_fd != -1 || !FD_ISSET(_listen_fd, rfds))
+		return false;
+	socket_t c = accept(_listen_fd, NULL, NULL);
+	if (c == -1) return false;
+
+	char tag = HANDOFF_TAG;
+	struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+	union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+	memset(&ctl, 0, sizeof(ctl));
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+			.msg_controllen = sizeof(ctl.buf) };
+	struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+	h->cmsg_level = SOL_SOCKET;
+	h->cmsg_type = SCM_RIGHTS;
+	h->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(h), &server_fd, sizeof(int));
+	if (sendmsg(c, &msg, 0) != 1) {
+		log_warn("handoff send server socket failed");
+		socket_close(c);
+		return false;
+	}
+
+	// 连接保持到退出前, 新进程以连接关闭作为旧进程已完成收尾的通知
+	_conn_fd = c;
+	log_info("handoff server socket to new process");
+	return true;
+}
+
+void handoff_stop() {
+	if (_listen_fd == -1) return;
+	socket_close(_listen_fd);
+	// 已交接时监听路径由新进程接管, 不能删除
+	if (_conn_fd == -1) unlink(_path);
+	else socket_close(_conn_fd);
+	free(_path);
+	_path = NULL;
+	_listen_fd = _conn_fd = -1;
+}
+
+#else // _WIN32
+
+socket_t handoff_receive(const char* path) {
+	return -1;
+}
+
+bool handoff_listen(const char* path) {
+	log_warn("handoff is not supported on windows");
+	return false;
+}
+
+socket_t handoff_fdset(fd_set* rfds, socket_t maxfd) {
+	return maxfd;
+}
+
+bool handoff_io(const fd_set* rfds, socket_t server_fd) {
+	return false;
+}
+
+void handoff_stop() {
+}
+
+#endif // _WIN32
@@ -0,0 +1,39 @@
+/** 服务socket交接, 用于不中断服务的重启及升级, 仅支持linux
+ *  运行中的进程监听unix socket, 新进程启动时连接该路径, 旧进程通过SCM_RIGHTS把服务socket传给新进程,
+ *  然后等待未完成的上游查询应答、转储缓存后关闭连接退出, 新进程收到连接关闭后接管监听路径
+ *  交接期间到达的请求保留在共享的服务socket接收缓冲区中, 由新进程继续处理
+ */
+#pragma once
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <stdbool.h>
+#include "net.h"
+
+/** 从运行中的进程接收服务socket, 收到后等待旧进程完成收尾退出
+ * @param path 交接使用的unix socket路径
+ * @return 服务socket, -1: 没有运行中的进程或交接失败
+ */
+extern socket_t handoff_receive(const char* path);
+
+/** 监听交接请求, 路径已存在时先删除
+ * @param path 交接使用的unix socket路径
+ * @return true: 成功, false: 失败
+ */
+extern bool handoff_listen(const char* path);
+
+/** 把交接监听socket加入select的等待集合
+ * @return 已加入集合及maxfd中的最大值
+ */
+extern socket_t handoff_fdset(fd_set* rfds, socket_t maxfd);
+
+/** select返回后调用, 有交接请求时把服务socket发送给新进程
+ * @param server_fd 服务socket
+ * @return true: 已交给新进程, 当前进程应停止读取服务socket并退出, false: 没有交接
+ */
+extern bool handoff_io(const fd_set* rfds, socket_t server_fd);
+
+/** 关闭交接监听socket, 已交接时关闭与新进程的连接, 通知新进程旧进程已完成收尾, 未交接时删除监听路径 */
+extern void handoff_stop();
+
+#endif // __HANDOFF_H__
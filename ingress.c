@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "lpm.h"
+#include "dyndns.h"
+#include "ingress.h"
+
+/** 过载时允许的排队时延, 毫秒为单位 */
+#define INGRESS_TARGET 5
+/** 队列持续非空超过该时间时判定为过载, 毫秒为单位 */
+#define INGRESS_INTERVAL 100
+/** 已知客户端地址表的大小, 必须是2的幂 */
+#define INGRESS_KNOWN_SLOTS 4096
+/** 信任网段的最大数量 */
+#define INGRESS_TRUSTED_MAX 64
+/** 统计信息的输出间隔, 毫秒为单位 */
+#define INGRESS_STATS_INTERVAL (60 * 1000)
+
+/** 环形队列 */
+typedef struct ingress_queue_t {
+	ingress_packet_t	*packets;		// 报文数组
+	uint32_t			capacity;		// 容量
+	uint32_t			head;			// 队首位置
+	uint32_t			count;			// 报文数量
+	uint64_t			received;		// 入队的报文数量
+	uint64_t			full;			// 队列已满丢弃的报文数量
+	uint64_t			shed;			// 过载丢弃的报文数量
+} ingress_queue_t;
+
+static const char* const _class_names[] = { "dyndns", "known", "unknown" };
+/** 各类别队列的容量, 动态更新报文很少, 队列较短 */
+static const uint32_t _capacities[INGRESS_CLASSES] = { 64, 1024, 1024 };
+
+static ingress_queue_t _queues[INGRESS_CLASSES];
+static uint32_t _pending = 0;
+static lpm_t *_trusted = NULL;
+static uint32_t _known[INGRESS_KNOWN_SLOTS];	// 出示过有效cookie的地址, 哈希冲突时覆盖
+static uint64_t _last_empty = 0;	// 队列最近一次为空的时间
+static bool _overload = false;		// 是否处于过载状态
+static uint64_t _overload_shed = 0;	// 本次过载丢弃的报文数量
+static uint64_t _stats_next = 0;
+static ingress_drops_func _drops_func = NULL;
+static uint64_t _kernel_drops = 0;		// 上次输出统计信息时内核丢弃的累计数量
+
+bool ingress_init(const char* trusted) {
+	for (int i = 0; i < INGRESS_CLASSES; ++i) {
+		_queues[i].packets = malloc(_capacities[i] * sizeof(ingress_packet_t));
+		_queues[i].capacity = _capacities[i];
+	}
+	if (!trusted || !*trusted) return true;
+
+	lpm_prefix_t prefixes[INGRESS_TRUSTED_MAX];
+	uint32_t count = 0;
+	char *text = strdup(trusted), *save = NULL;
+	for (char *p = strtok_r(text, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		if (count >= INGRESS_TRUSTED_MAX || !lpm_parse(p, prefixes + count)) {
+			log_error("ingress trusted subnet error: %s", p);
+			free(text);
+			return false;
+		}
+		prefixes[count++].value = 1;
+	}
+	free(text);
+	_trusted = lpm_build(prefixes, count);
+	log_info("ingress trusted subnets: %u", count);
+	return _trusted != NULL;
+}
+
+void ingress_set_kernel_drops(ingress_drops_func drops_func) {
+	_drops_func = drops_func;
+	_kernel_drops = drops_func ? drops_func() : 0;
+}
+
+static inline uint32_t ingress_known_slot(uint32_t ip) {
+	return (ip * 2654435761u) >> 20 & (INGRESS_KNOWN_SLOTS - 1);
+}
+
+void ingress_trust(uint32_t ip) {
+	_known[ingress_known_slot(ip)] = ip;
+}
+
+/** 报文分类, 动态更新报文以固定的头部标志开头 */
+static ingress_class_t ingress_classify(const sockaddr_in_t* addr, const uint8_t* data, size_t len) {
+	if (dyndns_check((const char*) data, len)) return INGRESS_DYNDNS;
+	uint32_t ip = addr->sin_addr.s_addr;
+	if (_known[ingress_known_slot(ip)] == ip || (_trusted && lpm_lookup(_trusted, ntohl(ip))))
+		return INGRESS_KNOWN;
+	return INGRESS_UNKNOWN;
+}
+
+bool ingress_push(const sockaddr_in_t* addr, const uint8_t* data, size_t len, uint64_t now) {
+	ingress_queue_t *q = _queues + ingress_classify(addr, data, len);
+	if (q->count >= q->capacity) {
+		++q->full;
+		return false;
+	}
+	if (!_pending) _last_empty = now;
+	ingress_packet_t *p = q->packets + (q->head + q->count) % q->capacity;
+	p->arrival = now;
+	p->addr = *addr;
+	p->len = (uint16_t) (len < INGRESS_PACKET_MAX ? len : INGRESS_PACKET_MAX);
+	memcpy(p->data, data, p->len);
+	++q->count;
+	++q->received;
+	++_pending;
+	return true;
+}
+
+uint32_t ingress_pending(void) {
+	return _pending;
+}
+
+/** 取出队列的队首报文 */
+static ingress_packet_t* ingress_take(ingress_queue_t* q) {
+	ingress_packet_t *p = q->packets + q->head;
+	q->head = (q->head + 1) % q->capacity;
+	--q->count;
+	--_pending;
+	return p;
+}
+
+/** 定时输出各类别的丢弃计数, 有丢弃时才输出 */
+static void ingress_log_stats(uint64_t now) {
+	if (now < _stats_next) return;
+	_stats_next = now + INGRESS_STATS_INTERVAL;
+	// 内核丢弃的报文包含过滤器丢弃及接收缓冲区满丢弃的
+	uint64_t kernel = _drops_func ? _drops_func() : 0, kernel_dropped = kernel - _kernel_drops, dropped = kernel_dropped;
+	_kernel_drops = kernel;
+	for (int i = 0; i < INGRESS_CLASSES; ++i)
+		dropped += _queues[i].full + _queues[i].shed;
+	if (dropped) {
+		char buf[320];
+		int n = 0;
+		for (int i = 0; i < INGRESS_CLASSES; ++i) {
+			const ingress_queue_t *q = _queues + i;
+			n += snprintf(buf + n, sizeof(buf) - n, "%s: received=%" PRIu64 ", full=%" PRIu64 ", shed=%" PRIu64 "; ",
+					_class_names[i], q->received, q->full, q->shed);
+		}
+		log_info("ingress stats: %skernel: dropped=%" PRIu64, buf, kernel_dropped);
+	}
+	for (int i = 0; i < INGRESS_CLASSES; ++i)
+		_queues[i].received = _queues[i].full = _queues[i].shed = 0;
+}
+
+const ingress_packet_t* ingress_pop(uint64_t now) {
+	ingress_log_stats(now);
+	for (;;) {
+		ingress_queue_t *q = _queues;
+		while (q < _queues + INGRESS_CLASSES && !q->count) ++q;
+		if (q == _queues + INGRESS_CLASSES) {
+			_last_empty = now;
+			if (_overload) {
+				_overload = false;
+				log_info("ingress overload end, shed %" PRIu64 " packets", _overload_shed);
+			}
+			return NULL;
+		}
+
+		// 队列持续非空说明处理速度跟不上, 此时只处理排队时延在目标值以内的报文, 优先级低的报文排队最久, 最先被丢弃
+		if (now - _last_empty <= INGRESS_INTERVAL || now - q->packets[q->head].arrival <= INGRESS_TARGET)
+			return ingress_take(q);
+		if (!_overload) {
+			_overload = true;
+			_overload_shed = 0;
+			log_warn("ingress overload: %s queue delay %" PRIu64 "ms, pending %u, shedding",
+					_class_names[q - _queues], now - q->packets[q->head].arrival, _pending);
+		}
+		ingress_take(q);
+		++q->shed;
+		++_overload_shed;
+	}
+}
+
+// #define INGRESS_TEST
+#ifdef INGRESS_TEST
+#include <assert.h>
+
+int main() {
+	assert(ingress_init("192.168.1.0/24"));
+	sockaddr_in_t trusted = { .sin_family = AF_INET }, unknown = trusted, cookie = trusted;
+	trusted.sin_addr.s_addr = net_ip_fromstring("192.168.1.9");
+	unknown.sin_addr.s_addr = net_ip_fromstring("10.0.0.1");
+	cookie.sin_addr.s_addr = net_ip_fromstring("10.0.0.2");
+	const uint8_t query[DNS_HEAD_LEN] = { 0 }, update[] = "ddyn0000";
+
+	// 优先级高的先取出
+	ingress_push(&unknown, query, sizeof(query), 0);
+	ingress_push(&cookie, query, sizeof(query), 0);
+	ingress_trust(cookie.sin_addr.s_addr);
+	ingress_push(&cookie, query, sizeof(query), 0);
+	ingress_push(&trusted, query, sizeof(query), 0);
+	ingress_push(&unknown, update, sizeof(update), 0);
+	assert(ingress_pending() == 5);
+	assert(ingress_pop(0)->len == sizeof(update));
+	assert(ingress_pop(0)->addr.sin_addr.s_addr == cookie.sin_addr.s_addr);
+	assert(ingress_pop(0)->addr.sin_addr.s_addr == trusted.sin_addr.s_addr);
+	assert(ingress_pop(0)->addr.sin_addr.s_addr == unknown.sin_addr.s_addr);
+	assert(ingress_pop(0)->addr.sin_addr.s_addr == cookie.sin_addr.s_addr);
+	assert(!ingress_pop(0));
+
+	// 队列已满时丢弃
+	for (uint32_t i = 0; i < _capacities[INGRESS_UNKNOWN] + 10; ++i)
+		ingress_push(&unknown, query, sizeof(query), 0);
+	assert(_queues[INGRESS_UNKNOWN].full == 10);
+
+	// 模拟过载: 每毫秒到达4个未知客户端查询和1个已知客户端查询, 只能处理3个, 已知客户端的查询不应被丢弃
+	while (ingress_pop(0)) {}
+	_queues[INGRESS_UNKNOWN].full = _queues[INGRESS_UNKNOWN].shed = 0;
+	uint64_t served[INGRESS_CLASSES] = { 0 };
+	for (uint64_t now = 10000; now < 20000; ++now) {
+		for (int i = 0; i < 4; ++i) ingress_push(&unknown, query, sizeof(query), now);
+		ingress_push(&trusted, query, sizeof(query), now);
+		for (int i = 0; i < 3; ++i) {
+			const ingress_packet_t *p = ingress_pop(now);
+			if (p) ++served[p->addr.sin_addr.s_addr == trusted.sin_addr.s_addr ? INGRESS_KNOWN : INGRESS_UNKNOWN];
+		}
+	}
+	printf("served known=%llu, unknown=%llu, shed known=%llu, unknown=%llu, full unknown=%llu, pending=%u\n",
+			(unsigned long long) served[INGRESS_KNOWN], (unsigned long long) served[INGRESS_UNKNOWN],
+			(unsigned long long) _queues[INGRESS_KNOWN].shed, (unsigned long long) _queues[INGRESS_UNKNOWN].shed,
+			(unsigned long long) _queues[INGRESS_UNKNOWN].full, ingress_pending());
+	fflush(stdout);
+	assert(served[INGRESS_KNOWN] == 10000 && !_queues[INGRESS_KNOWN].shed);
+	assert(!_queues[INGRESS_UNKNOWN].full && _queues[INGRESS_UNKNOWN].count < 100);
+	printf("test success\n");
+	return 0;
+}
+#endif // INGRESS_TEST
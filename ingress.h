@@ -0,0 +1,69 @@
+/** 入口分级队列, 服务循环处理不过来时按优先级主动丢弃请求, 代替内核缓冲区满时的随机丢包
+ *  收到的报文按类别(动态更新、已知客户端、未知客户端)放入各自的有界队列, 处理时总是先取优先级高的队列,
+ *  按CoDel在服务端请求队列上的用法判断过载: 队列持续非空超过一个间隔即为过载, 过载期间排队超过目标时延的报文直接丢弃,
+ *  优先级低的报文排队最久, 最先被丢弃
+ */
+#pragma once
+#ifndef __INGRESS_H__
+#define __INGRESS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "net.h"
+#include "dnsproto.h"
+
+/** 队列中报文的最大长度, 超出的部分被截断 */
+#define INGRESS_PACKET_MAX DNS_EDNS_MAX
+
+/** 报文类别, 值越小优先级越高 */
+typedef enum {
+	INGRESS_DYNDNS,					// 动态更新报文
+	INGRESS_KNOWN,					// 已知客户端的查询: 信任网段, 或出示过有效cookie的地址
+	INGRESS_UNKNOWN,				// 未知客户端的查询
+	INGRESS_CLASSES
+} ingress_class_t;
+
+/** 排队的报文 */
+typedef struct ingress_packet_t {
+	uint64_t		arrival;		// 到达时间, 毫秒为单位
+	sockaddr_in_t	addr;			// 客户端地址
+	uint16_t		len;			// 报文长度
+	uint8_t			data[INGRESS_PACKET_MAX];
+} ingress_packet_t;
+
+/** 获取内核丢弃的报文数量的回调接口, 返回从socket创建时开始的累计值 */
+typedef uint64_t (*ingress_drops_func) (void);
+
+/** 初始化入口队列
+ * @param trusted 信任网段列表, 逗号分隔的"a.b.c.d/len"格式, 例如监控服务器所在网段, 为NULL时没有
+ * @return false: 网段格式错误
+ */
+extern bool ingress_init(const char* trusted);
+
+/** 设置获取内核丢弃数量的回调接口, 统计信息中与入口队列的丢弃数量一起输出 */
+extern void ingress_set_kernel_drops(ingress_drops_func drops_func);
+
+/** 记录出示过有效cookie的客户端地址, 之后的查询按已知客户端排队
+ * @param ip 客户端地址, 网络字节序
+ */
+extern void ingress_trust(uint32_t ip);
+
+/** 对收到的报文分类并放入对应的队列, 队列已满时丢弃
+ * @param addr 客户端地址
+ * @param data 报文
+ * @param len 报文长度
+ * @param now 当前时间, 毫秒为单位
+ * @return true: 已入队, false: 队列已满被丢弃
+ */
+extern bool ingress_push(const sockaddr_in_t* addr, const uint8_t* data, size_t len, uint64_t now);
+
+/** 取出下一个要处理的报文, 过载时先丢弃优先级最低的报文
+ * @param now 当前时间, 毫秒为单位
+ * @return 报文, 在下一次调用ingress_push或ingress_pop之前有效, NULL: 队列为空
+ */
+extern const ingress_packet_t* ingress_pop(uint64_t now);
+
+/** 全部队列中等待处理的报文数量 */
+extern uint32_t ingress_pending(void);
+
+#endif // __INGRESS_H__
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "log.h"
 
@@ -96,6 +97,8 @@ static size_t _log_cur_size = 0;
 static char _log_levels[][9] = {"[TRACE]", "[DEBUG] ", "[INFO ] ", "[WARN ] ", "[ERROR] ", "[OFF  ]"};
 /** 16进制转换常量 */
 static const char _HEX[] = "0123456789abcdef";
+/** 日志写入锁, 后台线程(如数据库重新加载)也会写日志 */
+static pthread_mutex_t _log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static inline bool _check_log_size() {
 	return _log_fp && _log_cur_size >= _log_max_size;
@@ -214,6 +217,7 @@ static inline void _log_write_head(log_level_t level, const char* title) {
 
 void log_format(log_level_t level, const char* fmt, ...) {
 	if (_check_disabled(level)) return;
+	pthread_mutex_lock(&_log_mutex);
 	_log_write_head(level, NULL);
 
 	va_list args;
@@ -238,10 +242,12 @@ void log_format(log_level_t level, const char* fmt, ...) {
 	if (buf != stack_buf) free(buf);
 
 	_log_flush();
+	pthread_mutex_unlock(&_log_mutex);
 }
 
 void log_hex(log_level_t level, const char *title, const void *data, size_t size) {
 	if (_check_disabled(level)) return;
+	pthread_mutex_lock(&_log_mutex);
 	_log_write_head(level, title);
 
 	char buf[LOG_HEX_LINE]; // 一行hex显示格式所需大小
@@ -260,19 +266,23 @@ void log_hex(log_level_t level, const char *title, const void *data, size_t size
 	}
 
 	_log_flush();
+	pthread_mutex_unlock(&_log_mutex);
 }
 
 void log_text(log_level_t level, const char *title, const char *data, size_t size) {
 	if (_check_disabled(level)) return;
+	pthread_mutex_lock(&_log_mutex);
 	_log_write_head(level, title);
 
 	_log_write(data, size);
 	_log_putc('\n');
 	_log_flush();
+	pthread_mutex_unlock(&_log_mutex);
 }
 
 void log_dump(log_level_t level, const char *title, void* arg, LOG_DUMP_FUNC callback) {
 	if (_check_disabled(level)) return;
+	pthread_mutex_lock(&_log_mutex);
 	_log_write_head(level, title);
 
 	char buf[2048];
@@ -282,6 +292,7 @@ void log_dump(log_level_t level, const char *title, void* arg, LOG_DUMP_FUNC cal
 
 	_log_putc('\n');
 	_log_flush();
+	pthread_mutex_unlock(&_log_mutex);
 }
 
 #endif // NLOG
\ No newline at end of file
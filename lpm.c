@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "net.h"
+#include "lpm.h"
+
+/** 每级块的最大数量, 受表项中块序号的位数限制 */
+#define LPM_BLOCKS_MAX (0x10000 - LPM_CHILD)
+
+/** 排序使用的比较函数, 按前缀长度从短到长, 长度相同时保持原有顺序 */
+static int lpm_prefix_cmp(const void* a, const void* b) {
+	const lpm_prefix_t *x = *(const lpm_prefix_t* const*) a, *y = *(const lpm_prefix_t* const*) b;
+	if (x->len != y->len) return x->len - y->len;
+	return x < y ? -1 : x > y;
+}
+
+/** 获取表项对应的下一级块, 表项不是块时新建一个继承表项值的块
+ * @param entry 上一级表项
+ * @param blocks 下一级块数组
+ * @param count 下一级块数量
+ * @return 块的起始地址, NULL: 块数量超过上限
+ */
+static uint16_t* lpm_child(uint16_t* entry, uint16_t** blocks, uint32_t* count) {
+	if (*entry <= LPM_VALUE_MAX) {
+		if (*count >= LPM_BLOCKS_MAX) return NULL;
+		// 块数量为2的幂时扩容, 块数组的地址可能改变, 调用者不能保留之前的块地址
+		if (!(*count & (*count - 1)))
+			*blocks = realloc(*blocks, (*count ? *count * 2 : 1) * 256 * sizeof(uint16_t));
+		uint16_t *b = *blocks + *count * 256;
+		for (int i = 0; i < 256; ++i) b[i] = *entry;
+		*entry = (uint16_t) (LPM_CHILD + *count);
+		++*count;
+	}
+	return *blocks + (uint32_t) (*entry - LPM_CHILD) * 256;
+}
+
+lpm_t* lpm_build(const lpm_prefix_t* prefixes, uint32_t count) {
+	const lpm_prefix_t **sorted = malloc((count ? count : 1) * sizeof(lpm_prefix_t*));
+	for (uint32_t i = 0; i < count; ++i)
+		sorted[i] = prefixes + i;
+	qsort(sorted, count, sizeof(lpm_prefix_t*), lpm_prefix_cmp);
+
+	lpm_t *lpm = calloc(1, sizeof(lpm_t));
+	for (uint32_t i = 0; i < count; ++i) {
+		const lpm_prefix_t *p = sorted[i];
+		uint32_t ip = p->len ? p->ip & (0xFFFFFFFFu << (32 - p->len)) : 0;
+		uint16_t *tab, *l2;
+		uint32_t start, n;
+		if (p->len <= 16) {
+			// 较长的前缀还没有写入, 第一级表项都不是块, 直接写入范围内的表项
+			tab = lpm->l1;
+			start = ip >> 16;
+			n = 1u << (16 - p->len);
+		} else if (!(tab = lpm_child(lpm->l1 + (ip >> 16), &lpm->l2, &lpm->l2_count))) {
+			goto overflow;
+		} else if (p->len <= 24) {
+			start = ip >> 8 & 0xFF;
+			n = 1u << (24 - p->len);
+		} else {
+			l2 = tab;
+			if (!(tab = lpm_child(l2 + (ip >> 8 & 0xFF), &lpm->l3, &lpm->l3_count)))
+				goto overflow;
+			start = ip & 0xFF;
+			n = 1u << (32 - p->len);
+		}
+		for (uint32_t j = 0; j < n; ++j)
+			tab[start + j] = p->value;
+	}
+	free(sorted);
+	log_debug("lpm build: prefixes=%u, l2 blocks=%u, l3 blocks=%u", count, lpm->l2_count, lpm->l3_count);
+	return lpm;
+
+overflow:
+	log_error("lpm build failed: too many prefixes longer than /16");
+	free(sorted);
+	lpm_free(lpm);
+	return NULL;
+}
+
+void lpm_free(lpm_t* lpm) {
+	if (!lpm) return;
+	free(lpm->l2);
+	free(lpm->l3);
+	free(lpm);
+}
+
+bool lpm_parse(const char* text, lpm_prefix_t* dst) {
+	char ip[32];
+	const char *slash = strchr(text, '/');
+	size_t n = slash ? (size_t) (slash - text) : strlen(text);
+	int len = slash ? atoi(slash + 1) : 32;
+	if (!n || n >= sizeof(ip) || len < 0 || len > 32 || (slash && !slash[1]))
+		return false;
+	memcpy(ip, text, n);
+	ip[n] = '\0';
+	uint32_t addr = net_ip_fromstring(ip);
+	if (addr == INADDR_NONE && strcmp(ip, "255.255.255.255"))
+		return false;
+
+	addr = ntohl(addr);
+	dst->ip = len ? addr & (0xFFFFFFFFu << (32 - len)) : 0;
+	dst->len = (uint8_t) len;
+	return true;
+}
+
+// #define LPM_TEST
+#ifdef LPM_TEST
+#include <assert.h>
+
+int main() {
+	const char *texts[] = { "0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "10.1.2.128/25",
+		"10.1.2.200", "192.168.0.0/15", "10.1.3.0/24" };
+	lpm_prefix_t ps[8];
+	for (int i = 0; i < 8; ++i) {
+		assert(lpm_parse(texts[i], ps + i));
+		ps[i].value = (uint16_t) (i + 1);
+	}
+	assert(!lpm_parse("10.0.0.0/33", ps));
+	assert(!lpm_parse("10.0.0/", ps));
+
+	// 乱序加入, 较长的前缀优先
+	lpm_prefix_t shuffled[8] = { ps[5], ps[2], ps[7], ps[0], ps[4], ps[1], ps[6], ps[3] };
+	lpm_t *lpm = lpm_build(shuffled, 8);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("1.2.3.4"))) == 1);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("10.9.9.9"))) == 2);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("10.1.9.9"))) == 3);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("10.1.2.1"))) == 4);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("10.1.2.129"))) == 5);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("10.1.2.200"))) == 6);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("192.169.1.1"))) == 7);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("192.170.1.1"))) == 1);
+	assert(lpm_lookup(lpm, ntohl(net_ip_fromstring("10.1.3.7"))) == 8);
+	lpm_free(lpm);
+
+	// 大量的长前缀, 检查块扩容及查找速度
+	uint32_t n = 60000;
+	lpm_prefix_t *many = malloc(n * sizeof(lpm_prefix_t));
+	for (uint32_t i = 0; i < n; ++i)
+		many[i] = (lpm_prefix_t) { .ip = (i * 2654435761u) & 0xFFFFFF00u, .len = 24 + (i % 5) * 2, .value = 1 + i % LPM_VALUE_MAX };
+	lpm = lpm_build(many, n);
+	assert(lpm);
+	for (uint32_t i = 0; i < n; ++i)
+		assert(lpm_lookup(lpm, many[i].ip) == many[i].value || many[i].len == 24);
+
+	uint64_t start = net_mstime(), sum = 0;
+	for (uint32_t i = 0; i < 100000000; ++i)
+		sum += lpm_lookup(lpm, i * 2654435761u);
+	printf("100M lookups: %llums, sum=%llu\n", (unsigned long long) (net_mstime() - start), (unsigned long long) sum);
+	lpm_free(lpm);
+	free(many);
+	printf("test success\n");
+	return 0;
+}
+#endif // LPM_TEST
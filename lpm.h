@@ -0,0 +1,62 @@
+/** ipv4最长前缀匹配表, DIR-16-8-8结构, 按地址的16位、8位、8位分三级直接索引
+ *  每项为16位, 不大于LPM_VALUE_MAX时是匹配的值, 否则减去LPM_CHILD是下一级256项块的序号, 查找最多访问3次内存
+ *  建表时按前缀长度从短到长写入, 较长的前缀覆盖较短的前缀, 新建的下一级块继承上一级的值
+ */
+#pragma once
+#ifndef __LPM_H__
+#define __LPM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** 允许的最大值, 0表示没有匹配的前缀 */
+#define LPM_VALUE_MAX 0xFF
+/** 表项中下一级块序号的起始值 */
+#define LPM_CHILD (LPM_VALUE_MAX + 1)
+
+/** 前缀 */
+typedef struct lpm_prefix_t {
+	uint32_t		ip;				// 前缀地址, 主机字节序
+	uint8_t			len;			// 前缀长度, 0-32
+	uint16_t		value;			// 匹配时返回的值, 1-LPM_VALUE_MAX
+} lpm_prefix_t;
+
+/** 最长前缀匹配表 */
+typedef struct lpm_t {
+	uint16_t		l1[65536];		// 第一级, 按地址高16位索引
+	uint16_t		*l2;			// 第二级块, 每块256项, 按地址的第3个字节索引
+	uint16_t		*l3;			// 第三级块, 每块256项, 按地址的第4个字节索引
+	uint32_t		l2_count;		// 第二级块数量
+	uint32_t		l3_count;		// 第三级块数量
+} lpm_t;
+
+/** 使用前缀列表生成匹配表, 相同的前缀以后面的为准
+ * @param prefixes 前缀列表
+ * @param count 前缀数量
+ * @return 匹配表, NULL: 下一级块数量超过上限
+ */
+extern lpm_t* lpm_build(const lpm_prefix_t* prefixes, uint32_t count);
+
+/** 释放匹配表 */
+extern void lpm_free(lpm_t* lpm);
+
+/** 解析"a.b.c.d/len"格式的前缀, 省略长度时为32位, 主机位不为0时清零
+ * @return true: 成功, false: 格式错误
+ */
+extern bool lpm_parse(const char* text, lpm_prefix_t* dst);
+
+/** 查找地址匹配的最长前缀
+ * @param ip 地址, 主机字节序
+ * @return 最长前缀的值, 0: 没有匹配
+ */
+static inline uint16_t lpm_lookup(const lpm_t* lpm, uint32_t ip) {
+	uint16_t e = lpm->l1[ip >> 16];
+	if (e > LPM_VALUE_MAX) {
+		e = lpm->l2[(uint32_t) (e - LPM_CHILD) << 8 | (ip >> 8 & 0xFF)];
+		if (e > LPM_VALUE_MAX)
+			e = lpm->l3[(uint32_t) (e - LPM_CHILD) << 8 | (ip & 0xFF)];
+	}
+	return e;
+}
+
+#endif // __LPM_H__
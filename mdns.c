@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <signal.h>
 
 #ifdef _WIN32
 #include "winsvr.h"
@@ -20,12 +21,33 @@
 #include "dnsdb.h"
 #include "dnsproto.h"
 #include "dyndns.h"
+#include "forward.h"
+#include "upstream.h"
+#include "handoff.h"
+#include "blocklist.h"
+#include "rrl.h"
+#include "cookie.h"
+#include "ingress.h"
+#include "sockfilter.h"
+#include "xdp.h"
+#include "rsd.h"
+#include "topk.h"
+#include "tsig.h"
+#include "dnsupdate.h"
 
 #ifndef _MAX_FNAME
 #define _MAX_FNAME 256
 #endif
 
 #define KEY_LEN 33
+/** 交接服务socket后等待未完成的上游查询的最长时间, 毫秒为单位 */
+#define HANDOFF_DRAIN 2000
+/** 每轮从服务socket读取的最大报文数量, 不小于入口队列的总容量, 排队发生在入口队列而不是内核缓冲区 */
+#define RECV_BATCH 2048
+/** 每轮处理入口队列的最长时间, 到时后回到select处理其它事件, 毫秒为单位 */
+#define PROCESS_BUDGET 5
+/** 处理报文期间每处理多少个报文读取一次服务socket, 内核缓冲区只能容纳几百个报文, 不及时读取会被内核随机丢弃 */
+#define RECV_INTERVAL 8
 
 
 #ifdef _WIN32
@@ -45,7 +67,16 @@
 const char DEFAULT_KEY[] = "Mini DNS Server";
 
 /** 收发dns消息的两个变量 */
-static uint8_t g_recv[DNS_PACKET_MAX], g_reply[DNS_PACKET_MAX];
+static uint8_t g_recv[DNS_EDNS_MAX], g_reply[DNS_EDNS_MAX];
+/** 当前报文已由转发模块接管, 稍后由转发模块应答, 不是丢弃 */
+static bool g_forwarded = false;
+
+/** 退出标志, 收到退出信号或服务停止时置位, 服务循环结束后转储缓存再退出 */
+static volatile sig_atomic_t g_quit = 0;
+/** 重新加载标志, 收到SIGHUP时置位, 由服务循环在后台重新加载数据库文件 */
+static volatile sig_atomic_t g_reload = 0;
+/** 热点输出标志, 收到SIGUSR1时置位, 由服务循环输出当前的热点统计 */
+static volatile sig_atomic_t g_dump = 0;
 
 //命令行参数
 typedef struct config {
@@ -57,17 +88,72 @@ typedef struct config {
 	char* dbfile;   // DNS数据库文件名
 	char* logfile;  // LOG文件名
 	char* key;	    // DNS动态域名更新密钥
+	int   cache;    // 转发缓存的内存上限, KB为单位
+	bool  race;     // 转发查询同时发送给两个上游服务器
+	char* dumpfile; // 转发缓存的转储文件名
+	char* handoff;  // 服务socket交接使用的unix socket路径
+	char* blockfile;// 拦截列表文件名
+	bool  blocknx;  // 拦截的域名应答域名不存在
+	int   rrl_rate; // 应答限速, 每个网段每种应答类别每秒的应答数量, 0表示不限速
+	int   rrl_slip; // 每多少个被限速的应答发送一个截断应答
+	int   cookie;   // DNS Cookie密钥的更换间隔, 秒为单位, 0表示不启用
+	char* trusted;  // 信任网段列表, 过载时优先处理
+	bool  filter;   // 在内核中过滤不合格的报文, linux only
+	char* xdp;      // XDP快速应答挂载的网卡名称, linux only
+	int   rsd;      // 随机子域名攻击检测的阈值, 区域每10秒的不同标签数量, 0表示不检测
+	int   top;      // 热点统计每分钟输出的前N项数量, 0表示不统计
+	char* tsig;     // 标准动态更新(RFC 2136)的TSIG密钥列表, 为空时不接受标准动态更新
 } config_t;
 
-config_t g_conf = { .help = 0, .level = LOG_DEBUG, .daemon = 0, .inst = 0, .port = 53, .dbfile = (char*)DEFAULT_CONF, .key = (char*)DEFAULT_KEY };
+config_t g_conf = { .help = 0, .level = LOG_DEBUG, .daemon = 0, .inst = 0, .port = 53, .dbfile = (char*)DEFAULT_CONF, .key = (char*)DEFAULT_KEY, .cache = FORWARD_CACHE_DEFAULT, .rrl_slip = RRL_SLIP_DEFAULT, .cookie = COOKIE_ROTATE_DEFAULT, .rsd = RSD_THRESHOLD_DEFAULT, .top = TOPK_DEFAULT };
 
-/** 提供给dns动态更新协议的回调函数接口 */
+/** 提供给dns动态更新协议的回调函数接口, 更新报文处理完成后再统一保存 */
 static bool dyndns_update(const char* name, uint32_t ip) {
 	bool ret = dnsdb_update(name, ip);
-	if (ret) dnsdb_save();
+	if (ret) topk_dyndns(name);
 	return ret;
 }
 
+/** 判断域名能否由XDP程序应答, 被拦截的域名由用户空间应答拦截结果 */
+static bool xdp_eligible(const char* host, uint32_t* ip, uint32_t* ttl) {
+	return (!g_conf.blockfile || blocklist_check(host) == DNS_BLOCK_NONE) && dnsdb_find_single(host, ip, ttl);
+}
+
+static bool xdp_keep(const char* host) {
+	uint32_t ip, ttl;
+	return xdp_eligible(host, &ip, &ttl);
+}
+
+static bool xdp_sync_each(const char* host, uint32_t ip);
+
+/** 记录改动的回调函数, 同步XDP程序的哈希表, host为NULL时先清理已不满足条件的域名, 再逐个同步全部域名 */
+static void xdp_sync(const char* host) {
+	uint32_t ip, ttl;
+	if (!host) {
+		xdp_prune(xdp_keep);
+		dnsdb_foreach(xdp_sync_each);
+	} else if (xdp_eligible(host, &ip, &ttl)) {
+		xdp_update(host, ip, ttl);
+	} else {
+		xdp_delete(host);
+	}
+}
+
+static bool xdp_sync_each(const char* host, uint32_t ip) {
+	(void) ip;
+	xdp_sync(host);
+	return true;
+}
+
+/** 提供给dns协议的转发回调函数接口, 属于本地已定义区域的域名不转发 */
+static int dns_forward(const sockaddr_in_t* addr, const dns_fwd_query_t* query, uint8_t* res, size_t res_size) {
+	if (dnsdb_zone_exists(query->host))
+		return -1;
+	int n = forward_query(addr, query, res, res_size);
+	g_forwarded = n == 0;
+	return n;
+}
+
 inline static const char* b2s(bool b) {
 	return b ? "true" : "false";
 }
@@ -77,28 +163,68 @@ static void usage() {
 	printf("Usage: mdns [OPTION]...\n");
 	printf("mini dns server, version 1.34, copyleft by kivensoft 2017-2021.\n\n");
 	printf("Options:\n");
+	printf("  -b <blocklist file>   block listed names and their subdomains\n");
+	printf("  -C <seconds>          dns cookie secret rotate interval, 0 disable, default %d\n", g_conf.cookie);
+	printf("  -c <cache size>       forward cache size in KB, default %d\n", g_conf.cache);
 	printf("  -d                    run daemon mode, default %s\n", b2s(g_conf.daemon));
+	printf("  -F                    drop non-dns packets in kernel with a socket filter, linux only\n");
 	printf("  -f <db filename>      dns db file name, default %s\n", DEFAULT_CONF);
 	printf("  -g <log filename>     log file name, default %s\n", DEFAULT_LOG);
+	printf("  -H <socket path>      take over / hand off the dns port via unix socket, linux only\n");
 	printf("  -i                    install service, warning: windows only\n");
+	printf("  -K <[hmac-sha256:]name:secret[,...]>\n");
+	printf("                        accept RFC 2136 updates signed with these TSIG keys\n");
 	printf("  -k <key>              dynamic dns update key, default %s\n", DEFAULT_KEY);
 	printf("  -l <log level>        set log level, default debug\n");
+	printf("  -n                    answer blocked names with NXDOMAIN instead of 0.0.0.0, default %s\n", b2s(g_conf.blocknx));
 	printf("  -p <port>             listen dns port, default %d\n", g_conf.port);
+	printf("  -R <rate[:slip]>      limit responses per /24 and response class per second,\n");
+	printf("                        every slip-th dropped one is sent truncated, default slip %d\n", g_conf.rrl_slip);
+	printf("  -r                    race the two fastest upstream servers, default %s\n", b2s(g_conf.race));
+	printf("  -s <cache filename>   dump forward cache to file, reload it on start\n");
+	printf("  -T <count>            log top names/clients/dyndns hosts every minute, 0 disable, default %d\n", g_conf.top);
+	printf("  -t <subnet[,...]>     trusted subnets, served first when overloaded\n");
+	printf("  -u <ip[:port]>        forward unknown names to upstream server, max %d\n", UPSTREAM_MAX);
+	printf("  -W <distinct labels>  random subdomain attack threshold per zone per 10s, 0 disable, default %d\n", g_conf.rsd);
+	printf("  -X <ifname[:generic]> answer single A record names with XDP on the interface, linux only\n");
 }
 
 /** 解析命令行参数 */
 static bool parse_cmd_line(int argc, char **argv, config_t *dst) {
 	int c;
-	while ((c = getopt(argc, argv, "df:g:ikl:p:?")) != -1) {
+	while ((c = getopt(argc, argv, "b:C:c:dFf:g:H:iK:k:l:np:R:rs:T:t:u:W:X:?")) != -1) {
 		switch (c) {
+			case 'b': dst->blockfile = strdup(optarg); break;
+			case 'C': dst->cookie = atoi(optarg); break;
+			case 'c': dst->cache = atoi(optarg); break;
 			case 'd':
 				dst->daemon = 1; break;
+			case 'F': dst->filter = 1; break;
 			case 'f': dst->dbfile = strdup(optarg); break;
 			case 'g': dst->logfile = strdup(optarg); break;
+			case 'H': dst->handoff = strdup(optarg); break;
 			case 'i': dst->inst = 1; break;
+			case 'K': dst->tsig = strdup(optarg); break;
 			case 'k': dst->key = strdup(optarg); break;
 			case 'l': dst->level = log_get_level(optarg); break;
+			case 'n': dst->blocknx = 1; break;
 			case 'p': dst->port = atoi(optarg); break;
+			case 'R':
+				dst->rrl_rate = atoi(optarg);
+				if (strchr(optarg, ':')) dst->rrl_slip = atoi(strchr(optarg, ':') + 1);
+				break;
+			case 'r': dst->race = 1; break;
+			case 's': dst->dumpfile = strdup(optarg); break;
+			case 'T': dst->top = atoi(optarg); break;
+			case 't': dst->trusted = strdup(optarg); break;
+			case 'u':
+				if (!upstream_add(optarg)) {
+					printf("invalid upstream server: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'W': dst->rsd = atoi(optarg); break;
+			case 'X': dst->xdp = strdup(optarg); break;
 			case '?': dst->help = 1; break;
 			default:
 				puts("Try mdns -? for more informaton.");
@@ -126,10 +252,51 @@ static bool init() {
 	}
 
 	// 初始化dns协议的回调接口配置
-	dns_init(dnsdb_find);
+	dns_init(dnsdb_lookup, dnsdb_soa);
+
+	// 加载拦截列表, 在本地记录查找之前检查
+	if (g_conf.blockfile) {
+		if (!blocklist_load(g_conf.blockfile, g_conf.blocknx))
+			return false;
+		dns_set_block(blocklist_check);
+	}
+
+	// 启用应答限速
+	rrl_init(g_conf.rrl_rate, g_conf.rrl_slip);
+
+	// 启用DNS Cookie, 带有效cookie的客户端不受限速
+	if (g_conf.cookie > 0) {
+		cookie_init((uint32_t) g_conf.cookie);
+		dns_set_cookie(cookie_check);
+	}
+
+	// 启用随机子域名攻击检测, 受到攻击的区域不转发, 直接否定应答
+	if (g_conf.rsd > 0) {
+		rsd_init((uint32_t) g_conf.rsd);
+		dns_set_guard(rsd_query, rsd_miss);
+	}
+
+	// 启用热点统计, 统计查询的域名、客户端地址及动态更新的域名
+	if (g_conf.top > 0) {
+		topk_init((uint32_t) g_conf.top);
+		dns_set_observe(topk_name);
+	}
+
+	// 初始化入口队列, 过载时按优先级丢弃请求
+	if (!ingress_init(g_conf.trusted))
+		return false;
 
 	// 初始化动态dns协议配置, 配置动态更新ip的回调函数
 	dyndns_init(g_conf.key, dyndns_update);
+	dyndns_set_commit(dnsdb_save);
+
+	// 配置TSIG密钥后接受标准动态更新, 一个请求的全部修改只保存一次数据库文件
+	if (g_conf.tsig) {
+		for (char *save = NULL, *k = strtok_r(g_conf.tsig, ",", &save); k; k = strtok_r(NULL, ",", &save))
+			if (!tsig_add_key(k))
+				return false;
+		dns_set_update(dnsupdate_process);
+	}
 
 	return true;
 }
@@ -148,54 +315,215 @@ static socket_t create_udp_server(const char *host, uint16_t port) {
 	return fd;
 }
 
-int run() {
-	// 监听dns服务端口
-	socket_t fd = create_udp_server(NULL, g_conf.port);
-	if (fd == -1) {
-		log_error("mini dns can't listen port %d", g_conf.port);
-		return -1;
+/** 服务socket已交给新进程, 继续处理上游应答, 直到没有未完成的查询或超时 */
+static void drain_forward() {
+	uint64_t deadline = net_mstime() + HANDOFF_DRAIN;
+	while (forward_pending() && net_mstime() < deadline) {
+		fd_set rfds, wfds;
+		struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		socket_t maxfd = forward_fdset(&rfds, &wfds, -1);
+		if (select(maxfd + 1, &rfds, &wfds, NULL, &tv) > 0)
+			forward_io(&rfds, &wfds);
+		forward_timer(net_mstime());
 	}
-	log_debug("mini dns listen port %d", g_conf.port);
+	log_info("handoff drain finished, pending %u", forward_pending());
+}
 
+/** 读取服务socket中已到达的报文, 分类放入入口队列 */
+static void receive_packets(socket_t fd) {
 	sockaddr_in_t addr;
-	socklen_t addrlen = sizeof(addr);
-	int recv_count, reply_count, dump_flag = 0;
+	socklen_t addrlen;
+	uint64_t now = net_mstime();
+	for (int i = 0; i < RECV_BATCH; ++i) {
+		addrlen = sizeof(addr);
+		int recv_count = recvfrom(fd, (char*)g_recv, sizeof(g_recv), 0, (sockaddr_t *) &addr, &addrlen);
+		if (recv_count <= 0) break;
+		log_hex(LOG_TRACE, "dns recived data:", g_recv, recv_count);
+		ingress_push(&addr, g_recv, recv_count, now);
+	}
+}
 
-	// 进入服务处理模式
-	while (1) {
-		recv_count = recvfrom(fd, (char*)g_recv, sizeof(g_recv), 0, (sockaddr_t *) &addr, &addrlen);
-		if (recv_count <= 0) {
-			log_debug("udp recive count is 0, ignore");
-			continue;
-		}
+/** 处理入口队列中的一个报文并发送应答 */
+static void process_packet(socket_t fd, const ingress_packet_t* pkt) {
+	int reply_count, dump_flag = 0;
+	bool cookie_valid = false;
+	topk_client(pkt->addr.sin_addr.s_addr);
+
+	// 先使用动态dns协议判断是否动态dns更新协议
+	reply_count = dyndns(&pkt->addr, (const char*)pkt->data, pkt->len, (char*)g_reply, sizeof(g_reply));
+
+	// 不是动态dns协议报文, 转到正常dns处理
+	if (reply_count == -1) {
+		dump_flag = 1;
+		g_forwarded = false;
+		dnsdb_select_view(pkt->addr.sin_addr.s_addr);
+		reply_count = dns_process(&pkt->addr, pkt->data, pkt->len, g_reply, sizeof(g_reply), &cookie_valid);
+		// 出示过有效cookie的客户端地址不是伪造的, 之后过载时优先处理
+		if (reply_count > 0 && cookie_valid)
+			ingress_trust(pkt->addr.sin_addr.s_addr);
+	}
 
-		log_hex(LOG_TRACE, "dns recived data:", g_recv, recv_count);
+	// 处理结果有应答包, 则进行发送, dns应答按限速结果丢弃或截断, 否则, 可能是外部攻击, 忽略
+	int send_count = reply_count > 0 && dump_flag && !cookie_valid
+		? rrl_filter(&pkt->addr, g_reply, reply_count) : reply_count;
+	if (send_count > 0)
+		sendto(fd, (char*)g_reply, send_count, 0, (const sockaddr_t *)&pkt->addr, sizeof(pkt->addr));
+
+	if (dump_flag) {
+		if (send_count > 0)
+			log_hex(LOG_TRACE, "dns answer data:", g_reply, send_count);
+		else if (reply_count <= 0 && !g_forwarded)
+			log_debug("dns drop this message, no reply!");
+	}
+}
 
-		// 先使用动态dns协议判断是否动态dns更新协议
-		reply_count = dyndns(&addr, (const char*)g_recv, recv_count, (char*)g_reply, sizeof(g_reply));
+int run() {
+	// 指定了交接路径时先从运行中的旧进程接收服务socket, 没有旧进程时监听dns服务端口
+	socket_t fd = g_conf.handoff ? handoff_receive(g_conf.handoff) : -1;
+	if (fd == -1) {
+		fd = create_udp_server(NULL, g_conf.port);
+		if (fd == -1) {
+			log_error("mini dns can't listen port %d", g_conf.port);
+			return -1;
+		}
+	}
+	log_debug("mini dns listen port %d", g_conf.port);
+	bool handoff = g_conf.handoff && handoff_listen(g_conf.handoff), handed = false;
+
+	// 配置了上游服务器时, 启用转发模式
+	bool forwarding = upstream_count() > 0;
+	if (forwarding) {
+		if (!forward_start(fd, (size_t) g_conf.cache * 1024, g_conf.dumpfile))
+			return -1;
+		forward_set_policy(dnsdb_forward_policy);
+		forward_set_race(g_conf.race);
+		forward_set_filter(rrl_filter);
+		dns_set_forward(dns_forward);
+	}
 
-		// 不是动态dns协议报文, 转到正常dns处理
-		if (reply_count == -1) {
-			dump_flag = 1;
-			reply_count = dns_process(g_recv, recv_count, g_reply);
+	// 报文先读入入口队列再逐个处理, 服务socket使用非阻塞模式, 不合格的报文可在内核中提前丢弃
+	socket_set_nonblock(fd);
+	if (!sockfilter_init(fd, g_conf.filter)) {
+		socket_close(fd);
+		return -1;
+	}
+	ingress_set_kernel_drops(sockfilter_drops);
+	const ingress_packet_t *pkt;
+
+	// 启用XDP快速应答, 哈希表先同步全部记录, 之后随记录改动同步
+	if (g_conf.xdp) {
+		if (!xdp_init(g_conf.xdp, (uint16_t) g_conf.port)) {
+			socket_close(fd);
+			return -1;
 		}
+		xdp_sync(NULL);
+		dnsdb_set_change(xdp_sync);
+	}
 
-		// 处理结果有应答包, 则进行发送, 否则, 可能是外部攻击, 忽略
-		if (reply_count > 0)
-			sendto(fd, (char*)g_reply, reply_count, 0, (sockaddr_t *)&addr, addrlen);
+	// 监视数据库文件, 被其它程序改动时自动重新加载
+	dnsdb_watch();
 
-		if (dump_flag) {
-			dump_flag = 0;
-			if (reply_count > 0)
-				log_hex(LOG_TRACE, "dns answer data:", g_reply, reply_count);
-			else
-				log_info("dns drop this message, no reply!");
+	// 进入服务处理模式
+	while (!g_quit) {
+		// 同时等待客户端请求、上游应答、交接请求及数据库文件改动, 定时处理超时的上游查询, 入口队列不为空时不等待
+		fd_set rfds, wfds;
+		struct timeval tv = { .tv_sec = 0, .tv_usec = ingress_pending() ? 0 : 100 * 1000 };
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(fd, &rfds);
+		socket_t maxfd = handoff_fdset(&rfds, fd);
+		maxfd = dnsdb_watch_fdset(&rfds, maxfd);
+		if (forwarding) maxfd = forward_fdset(&rfds, &wfds, maxfd);
+		int ready = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+		if (forwarding) {
+			if (ready > 0)
+				forward_io(&rfds, &wfds);
+			forward_timer(net_mstime());
+		}
+		xdp_timer(net_mstime());
+		topk_timer(net_mstime());
+		dyndns_timer(net_mstime());
+		if (g_dump) {
+			g_dump = 0;
+			topk_dump();
+		}
+		// 服务socket交给新进程后不再读取客户端请求
+		if (ready > 0 && handoff_io(&rfds, fd)) {
+			handed = true;
+			// 新进程需要在同一网卡上挂载自己的XDP程序
+			xdp_stop();
+			while ((pkt = ingress_pop(net_mstime())))
+				process_packet(fd, pkt);
+			break;
+		}
+
+		// 数据库在后台线程重新加载, 完成后在两次请求之间替换
+		if (g_reload) {
+			g_reload = 0;
+			dnsdb_reload();
+		}
+		if (ready > 0) dnsdb_watch_io(&rfds);
+		dnsdb_publish();
+		if (ready > 0 && FD_ISSET(fd, &rfds))
+			receive_packets(fd);
+
+		// 按优先级处理入口队列, 期间定时读取新到达的报文, 处理时间用完后回到select, 剩余的报文下一轮继续处理
+		uint64_t start = net_mstime(), now = start;
+		for (unsigned n = 1; now - start < PROCESS_BUDGET && (pkt = ingress_pop(now)); ++n) {
+			process_packet(fd, pkt);
+			if (n % RECV_INTERVAL == 0) receive_packets(fd);
+			now = net_mstime();
 		}
 	}
 
+	if (handed && forwarding) drain_forward();
+	if (forwarding) forward_stop();
+	xdp_stop();
+	socket_close(fd);
+	if (handoff) handoff_stop();
+	log_info("mini dns stopped");
 	return 0;
 }
 
+void stop() {
+	g_quit = 1;
+}
+
+static void on_signal(int sig) {
+#ifdef SIGHUP
+	if (sig == SIGHUP) {
+		g_reload = 1;
+		return;
+	}
+#endif
+#ifdef SIGUSR1
+	if (sig == SIGUSR1) {
+		g_dump = 1;
+		return;
+	}
+#endif
+	stop();
+}
+
+/** 注册退出、重新加载及输出热点统计的信号, linux下不自动重启被中断的系统调用, 使阻塞的select返回后立即检查标志 */
+static void set_signals() {
+#ifdef _WIN32
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+#else
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+#endif
+}
+
 #ifdef _WIN32
 static int _svc_inst() {
 	char buf[1024], *p = buf;
@@ -232,5 +560,6 @@ int main(int argc, char **argv) {
 	// linux平台, 切换成守护模式, windows平台, 启动服务
 	_DAEMON(g_conf.daemon);
 
+	set_signals();
 	return run();
 }
@@ -11,6 +11,9 @@
 #else // no _WIN32
 #  include <arpa/inet.h>
 #  include <unistd.h>
+#  include <fcntl.h>
+#  include <errno.h>
+#  include <time.h>
 #endif // _WIN32
 
 typedef struct sockaddr_in sockaddr_in_t;
@@ -66,6 +69,41 @@ static inline bool socket_send_timeout(socket_t socket, uint32_t seconds) {
 	return !setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (char*)(&t), sizeof(t));
 }
 
+/** 设置socket为非阻塞模式
+ * 
+ * @param socket 
+ * @return true: 成功, false: 失败
+ */
+static inline bool socket_set_nonblock(socket_t socket) {
+#ifdef _WIN32
+	u_long mode = 1;
+	return !ioctlsocket(socket, FIONBIO, &mode);
+#else
+	int flags = fcntl(socket, F_GETFL, 0);
+	return flags != -1 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+/** 判断最近一次非阻塞socket操作是否因为需要等待而未完成, 例如无数据可读或连接正在建立 */
+static inline bool socket_would_block() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS;
+#endif
+}
+
+/** 获取单调递增的时钟值, 毫秒为单位, 不受系统时间调整的影响 */
+static inline uint64_t net_mstime() {
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 /** 32位整型ip转换为字符串样式 */
 static inline const char* net_ip_tostring(uint32_t ip) {
 	struct in_addr a = {.s_addr = ip};
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "dnsproto.h"
+#include "rrl.h"
+
+/** 哈希表的组数量, 必须是2的幂, 每组RRL_WAYS项 */
+#define RRL_SETS 16384
+/** 每组的项数 */
+#define RRL_WAYS 4
+/** 客户端网段的前缀长度 */
+#define RRL_PREFIX_BITS 24
+/** 允许的最大速率, 令牌以千分之一个应答为单位, 保证不溢出 */
+#define RRL_RATE_MAX 100000
+/** 统计信息的输出间隔, 毫秒为单位 */
+#define RRL_STATS_INTERVAL (60 * 1000)
+
+// 应答类别, 不同类别分别限速
+enum rrl_class_t { RRL_ANSWER, RRL_NODATA, RRL_NXDOMAIN, RRL_ERROR };
+static const char* const _class_names[] = { "answer", "nodata", "nxdomain", "error" };
+
+// 令牌桶, 同时记录该网段该类别的计数
+typedef struct rrl_entry_t {
+	uint32_t key;				// 网段与应答类别, 0表示空项
+	uint32_t last;				// 最后一次使用的时间, 毫秒为单位, 允许回绕
+	int32_t tokens;				// 剩余令牌, 千分之一个应答为单位
+	uint32_t responses;			// 发送的应答数量
+	uint32_t dropped;			// 丢弃的应答数量, 包含改为截断应答的
+	uint32_t slipped;			// 改为截断应答的数量
+} rrl_entry_t;
+
+static rrl_entry_t *_table = NULL;
+static uint32_t _rate = 0, _slip = 0;
+static uint64_t _stats_next = 0;
+// 全部网段的计数, 统计信息输出后清零
+static uint64_t _responses = 0, _dropped = 0, _slipped = 0, _evicted = 0;
+
+void rrl_init(uint32_t rate, uint32_t slip) {
+	_rate = rate > RRL_RATE_MAX ? RRL_RATE_MAX : rate;
+	_slip = slip;
+	if (!_rate) return;
+	if (!_table) _table = calloc(RRL_SETS * RRL_WAYS, sizeof(rrl_entry_t));
+	log_info("rrl enabled: rate=%u/s per /%d, slip=%u, memory=%u KB", _rate, RRL_PREFIX_BITS, _slip,
+			(unsigned) (RRL_SETS * RRL_WAYS * sizeof(rrl_entry_t) / 1024));
+}
+
+/** 按应答的返回码及回答数量确定应答类别 */
+static inline unsigned rrl_classify(const uint8_t* res) {
+	unsigned rcode = res[3] & 0xF;
+	if (rcode == 3) return RRL_NXDOMAIN;
+	if (rcode) return RRL_ERROR;
+	return res[6] || res[7] ? RRL_ANSWER : RRL_NODATA;
+}
+
+/** 查找键对应的令牌桶, 不存在时替换组内最久未使用的项, 新项的令牌是满的 */
+static rrl_entry_t* rrl_entry(uint32_t key, uint32_t now) {
+	rrl_entry_t *set = _table + ((key * 2654435761u) >> 18) % RRL_SETS * RRL_WAYS, *victim = set;
+	for (int i = 0; i < RRL_WAYS; ++i) {
+		if (set[i].key == key) return set + i;
+		if (now - set[i].last > now - victim->last || !set[i].key) victim = set + i;
+		if (!set[i].key) break;
+	}
+	if (victim->key) ++_evicted;
+	memset(victim, 0, sizeof(*victim));
+	victim->key = key;
+	victim->last = now;
+	victim->tokens = (int32_t) _rate * 1000;
+	return victim;
+}
+
+/** 把应答改为截断应答, 只保留头部及第一个问题, 客户端收到后改用tcp重新查询 */
+static int rrl_truncate(uint8_t* res, int len) {
+	size_t pos = DNS_HEAD_LEN;
+	char host[HOST_MAX];
+	if (res[4] || res[5]) {
+		pos = dns_read_name(res, len, pos, host);
+		if (!pos || pos + 4 > (size_t) len) return 0;
+		pos += 4;
+		// 多个问题的请求也只保留第一个问题, 问题数量与保留的内容一致
+		res[4] = 0, res[5] = 1;
+	}
+	res[2] |= 0x02;
+	memset(res + 6, 0, 6);
+	return (int) pos;
+}
+
+/** 定时输出统计信息, 有应答被限速时才输出 */
+static void rrl_log_stats(uint64_t now) {
+	if (now < _stats_next) return;
+	_stats_next = now + RRL_STATS_INTERVAL;
+	if (_dropped)
+		log_info("rrl stats: responses=%" PRIu64 ", dropped=%" PRIu64 ", slipped=%" PRIu64 ", evicted=%" PRIu64,
+				_responses, _dropped, _slipped, _evicted);
+	_responses = _dropped = _slipped = _evicted = 0;
+}
+
+/** 按指定的时间限速, ms为毫秒为单位的当前时间 */
+static int rrl_check(const sockaddr_in_t* addr, uint8_t* res, int len, uint64_t ms) {
+	uint32_t now = (uint32_t) ms, net = ntohl(addr->sin_addr.s_addr) >> (32 - RRL_PREFIX_BITS);
+	unsigned cls = rrl_classify(res);
+	rrl_entry_t *e = rrl_entry(net << 2 | cls | 0x80000000u, now);
+	rrl_log_stats(ms);
+
+	// 按经过的时间补充令牌, 最多补满一秒的应答数量
+	int32_t max = (int32_t) _rate * 1000;
+	uint32_t elapsed = now - e->last;
+	e->last = now;
+	e->tokens = elapsed >= 1000 || e->tokens + (int64_t) elapsed * _rate >= max ? max
+		: e->tokens + (int32_t) (elapsed * _rate);
+
+	if (e->tokens >= 1000) {
+		// 令牌补满说明限速已结束, 输出该网段被限速期间的计数
+		if (e->dropped && e->tokens == max) {
+			log_info("rrl release %s/%d %s: dropped=%u, slipped=%u, responses=%u",
+					net_ip_tostring(htonl(net << (32 - RRL_PREFIX_BITS))), RRL_PREFIX_BITS, _class_names[cls],
+					e->dropped, e->slipped, e->responses);
+			e->dropped = e->slipped = e->responses = 0;
+		}
+		e->tokens -= 1000;
+		++e->responses;
+		++_responses;
+		return len;
+	}
+
+	if (!e->dropped)
+		log_info("rrl limit %s/%d %s", net_ip_tostring(htonl(net << (32 - RRL_PREFIX_BITS))),
+				RRL_PREFIX_BITS, _class_names[cls]);
+	++e->dropped;
+	++_dropped;
+	if (_slip && e->dropped % _slip == 0) {
+		++e->slipped;
+		++_slipped;
+		return rrl_truncate(res, len);
+	}
+	return 0;
+}
+
+int rrl_filter(const sockaddr_in_t* addr, uint8_t* res, int len) {
+	if (!_rate || len < DNS_HEAD_LEN) return len;
+	return rrl_check(addr, res, len, net_mstime());
+}
+
+// #define RRL_TEST
+#ifdef RRL_TEST
+#include <assert.h>
+
+/** 两个问题、一条回答的应答报文 */
+static const uint8_t _res[] = {
+	0x12, 0x34, 0x84, 0x00, 0, 2, 0, 1, 0, 0, 0, 0,
+	1, 'a', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+	1, 'b', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+	0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 1, 2, 3, 4 };
+
+/** 按指定时间限速一个应答, 返回发送长度, 截断应答写入out */
+static int test_check(uint32_t ip, uint64_t ms, uint8_t* out) {
+	sockaddr_in_t addr = { .sin_family = AF_INET };
+	addr.sin_addr.s_addr = htonl(ip);
+	memcpy(out, _res, sizeof(_res));
+	return rrl_check(&addr, out, sizeof(_res), ms);
+}
+
+/** 网段的令牌桶是否在表中 */
+static bool test_cached(uint32_t net) {
+	uint32_t key = net << 2 | RRL_ANSWER | 0x80000000u;
+	const rrl_entry_t *set = _table + ((key * 2654435761u) >> 18) % RRL_SETS * RRL_WAYS;
+	for (int i = 0; i < RRL_WAYS; ++i)
+		if (set[i].key == key) return true;
+	return false;
+}
+
+int main() {
+	uint8_t out[sizeof(_res)];
+	uint32_t ip = 0x0A000001;
+	uint64_t t = 1000000;
+	rrl_init(10, 3);
+
+	// 每秒10个应答, 之后丢弃, 每3个丢弃的应答改为截断应答
+	for (int i = 0; i < 10; ++i)
+		assert(test_check(ip, t, out) == sizeof(_res));
+	for (int i = 1; i <= 9; ++i) {
+		int n = test_check(ip, t, out);
+		assert(i % 3 ? n == 0 : n == 23);
+	}
+	assert(_dropped == 9 && _slipped == 3);
+
+	// 截断应答只保留第一个问题, 问题数量为1, 其它区域为0, 设置TC标志, 可以完整解析
+	assert(test_check(ip, t, out) == 0 && test_check(ip, t, out) == 0 && test_check(ip, t, out) == 23);
+	char host[HOST_MAX];
+	assert(out[2] & 0x02);
+	assert(out[4] == 0 && out[5] == 1 && !out[6] && !out[7] && !out[8] && !out[9] && !out[10] && !out[11]);
+	assert(dns_read_name(out, 23, DNS_HEAD_LEN, host) == 19 && !strcmp(host, "a.com"));
+	assert(!memcmp(out + 19, _res + 19, 4));
+
+	// 同一网段的其它地址共用令牌桶, 其它网段不受影响
+	assert(test_check(ip + 200, t, out) == 0);
+	assert(test_check(ip + 0x100, t, out) == sizeof(_res));
+
+	// 令牌按经过的时间补充: 100毫秒补充1个, 超过1秒补满, 被限速的应答丢弃或截断
+	assert(test_check(ip, t + 100, out) == sizeof(_res));
+	assert(test_check(ip, t + 100, out) < (int) sizeof(_res));
+	assert(test_check(ip, t + 150, out) < (int) sizeof(_res));
+	assert(test_check(ip, t + 250, out) == sizeof(_res));
+	t += 2000;
+	for (int i = 0; i < 10; ++i)
+		assert(test_check(ip, t, out) == sizeof(_res));
+	assert(test_check(ip, t, out) < (int) sizeof(_res));
+
+	// 同一组的项数超过RRL_WAYS时替换最久未使用的项, 最近使用过的项保留
+	uint32_t nets[RRL_WAYS + 1], count = 0, first = (0x0A000001 >> 8) + 1;
+	uint32_t target = ((first << 2 | 0x80000000u) * 2654435761u >> 18) % RRL_SETS;
+	for (uint32_t net = first; count <= RRL_WAYS; ++net)
+		if (((net << 2 | 0x80000000u) * 2654435761u >> 18) % RRL_SETS == target)
+			nets[count++] = net;
+	uint64_t evicted = _evicted;
+	for (int i = 0; i < RRL_WAYS; ++i)
+		test_check(nets[i] << 8, t + 10 + i, out);
+	test_check(nets[0] << 8, t + 20, out);
+	test_check(nets[RRL_WAYS] << 8, t + 30, out);
+	assert(_evicted == evicted + 1);
+	assert(test_cached(nets[0]) && !test_cached(nets[1]) && test_cached(nets[RRL_WAYS]));
+	for (int i = 2; i < RRL_WAYS; ++i)
+		assert(test_cached(nets[i]));
+
+	printf("test success\n");
+	return 0;
+}
+#endif // RRL_TEST
@@ -0,0 +1,29 @@
+/** 应答限速(Response Rate Limiting), 防止被伪造源地址的查询利用为反射放大攻击的工具
+ *  按(客户端/24网段, 应答类别)使用令牌桶限速, 超过速率的应答丢弃, 每slip个丢弃的应答改为发送截断应答,
+ *  令牌桶存放在固定大小的4路组相联哈希表中, 组满时替换最久未使用的项, 源地址再多内存占用也不变
+ */
+#pragma once
+#ifndef __RRL_H__
+#define __RRL_H__
+
+#include <stdint.h>
+#include "net.h"
+
+/** 默认的截断应答间隔 */
+#define RRL_SLIP_DEFAULT 2
+
+/** 启用应答限速
+ * @param rate 每个网段每种应答类别每秒允许的应答数量, 0表示不限速
+ * @param slip 每slip个丢弃的应答改为发送一个截断应答, 0表示全部丢弃
+ */
+extern void rrl_init(uint32_t rate, uint32_t slip);
+
+/** 发送应答前调用, 超过速率时丢弃应答或改为截断应答
+ * @param addr 客户端地址
+ * @param res 应答报文, 改为截断应答时在原地修改
+ * @param len 应答报文长度
+ * @return 需要发送的长度, 0: 丢弃
+ */
+extern int rrl_filter(const sockaddr_in_t* addr, uint8_t* res, int len);
+
+#endif // __RRL_H__
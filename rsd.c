@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "net.h"
+#include "dnsproto.h"
+#include "rsd.h"
+
+/** 哈希表的组数量, 必须是2的幂, 每组RSD_WAYS项 */
+#define RSD_SETS 256
+/** 每组的项数 */
+#define RSD_WAYS 4
+/** HyperLogLog寄存器序号的位数, 256个寄存器, 标准误差约6.5% */
+#define RSD_REG_BITS 8
+#define RSD_REGS (1 << RSD_REG_BITS)
+/** 统计窗口的长度, 毫秒为单位 */
+#define RSD_WINDOW (10 * 1000)
+/** 窗口内每多少个查询估计一次不同标签数量, 攻击开始后不必等到窗口结束就能标记 */
+#define RSD_CHECK_INTERVAL 256
+/** 不同标签数量超过平时数量的倍数时视为突增 */
+#define RSD_SPIKE 8
+/** 未命中率的阈值, 百分比 */
+#define RSD_MISS_PERCENT 50
+/** 统计信息的输出间隔, 毫秒为单位 */
+#define RSD_STATS_INTERVAL (60 * 1000)
+/** 统计信息中输出的区域数量, 按不同标签数量从大到小 */
+#define RSD_STATS_TOP 3
+
+// 区域的统计信息
+typedef struct rsd_zone_t {
+	uint64_t key;				// 区域名的哈希值, 0表示空项
+	uint64_t window;			// 当前窗口的开始时间, 毫秒为单位
+	uint64_t last;				// 最后一次使用的时间, 毫秒为单位
+	uint32_t queries;			// 当前窗口的查询数量
+	uint32_t misses;			// 当前窗口的未命中数量
+	uint32_t prev_queries;		// 上一个窗口的查询数量
+	uint32_t prev_misses;		// 上一个窗口的未命中数量
+	float estimate;				// 当前窗口最近一次估计的不同标签数量
+	float prev_estimate;		// 上一个窗口的不同标签数量
+	float baseline;				// 平时的不同标签数量, 未标记窗口的指数移动平均
+	bool flagged;				// 是否已标记
+	uint64_t suppressed;		// 本次标记期间直接否定应答的查询数量
+	char name[HOST_MAX];		// 区域名
+	uint8_t regs[RSD_REGS];		// HyperLogLog寄存器, 当前窗口首个标签的哈希值的最大前导0数量加1
+} rsd_zone_t;
+
+static rsd_zone_t *_table = NULL;
+static uint32_t _threshold = 0;
+static uint64_t _seed = 0;			// 标签哈希的随机种子, 防止构造标签操纵估计值
+static uint64_t _stats_next = 0;
+static double _pow2[66];			// 2的负整数次幂, 寄存器的值最大为65
+
+/** FNV-1a哈希后再做一次64位混合, 使高位分布均匀 */
+static uint64_t rsd_hash(uint64_t seed, const char* data, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t) data[i]) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void rsd_init(uint32_t threshold) {
+	_threshold = threshold;
+	if (!_threshold) return;
+	if (!_table) _table = calloc(RSD_SETS * RSD_WAYS, sizeof(rsd_zone_t));
+	for (int i = 0; i < 66; ++i)
+		_pow2[i] = ldexp(1.0, -i);
+	_seed = rsd_hash(net_mstime(), (const char*) &_table, sizeof(_table));
+	log_info("random subdomain detection enabled: threshold=%u per %ds, memory=%u KB", _threshold,
+			RSD_WINDOW / 1000, (unsigned) (RSD_SETS * RSD_WAYS * sizeof(rsd_zone_t) / 1024));
+}
+
+/** HyperLogLog估计值, 较小时使用线性计数修正 */
+static float rsd_estimate(const rsd_zone_t* z) {
+	double sum = 0;
+	uint32_t zeros = 0;
+	for (int i = 0; i < RSD_REGS; ++i) {
+		sum += _pow2[z->regs[i]];
+		zeros += !z->regs[i];
+	}
+	double m = RSD_REGS, e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (e <= 2.5 * m && zeros) e = m * log(m / zeros);
+	return (float) e;
+}
+
+/** 按滑动窗口计算未命中率, 上一个窗口按当前窗口已过去的比例折算 */
+static uint32_t rsd_miss_percent(const rsd_zone_t* z, uint64_t now) {
+	double f = (double) (now - z->window) / RSD_WINDOW, w = f < 1 ? 1 - f : 0;
+	double queries = z->prev_queries * w + z->queries, misses = z->prev_misses * w + z->misses;
+	return queries > 0 ? (uint32_t) (misses * 100 / queries) : 0;
+}
+
+/** 不同标签数量超过阈值、远高于平时且大部分查询未命中 */
+static bool rsd_spike(const rsd_zone_t* z, float estimate, uint64_t now) {
+	return estimate >= _threshold && estimate >= z->baseline * RSD_SPIKE
+		&& rsd_miss_percent(z, now) >= RSD_MISS_PERCENT;
+}
+
+static void rsd_flag(rsd_zone_t* z, float estimate, uint64_t now) {
+	z->flagged = true;
+	z->suppressed = 0;
+	log_warn("random subdomain attack on %s: distinct labels %.0f (baseline %.0f), miss %u%%, negative answers without forwarding",
+			z->name, estimate, z->baseline, rsd_miss_percent(z, now));
+}
+
+/** 窗口结束时按整个窗口的数据判断标记状态, 标记期间不更新平时的数量, 降到阈值一半以下时取消标记 */
+static void rsd_roll(rsd_zone_t* z, uint64_t now) {
+	if (now - z->window < RSD_WINDOW) return;
+	float estimate = rsd_estimate(z);
+	if (z->flagged) {
+		if (estimate < _threshold / 2.0f || rsd_miss_percent(z, z->window + RSD_WINDOW) < RSD_MISS_PERCENT / 2) {
+			z->flagged = false;
+			log_info("random subdomain attack on %s end, distinct labels %.0f, suppressed %" PRIu64 " queries",
+					z->name, estimate, z->suppressed);
+		}
+	} else if (z->queries && rsd_spike(z, estimate, z->window + RSD_WINDOW)) {
+		rsd_flag(z, estimate, now);
+	} else {
+		z->baseline += (estimate - z->baseline) / 8;
+	}
+
+	// 空闲超过一个窗口时上一个窗口的数据已过时
+	bool adjacent = now - z->window < 2 * RSD_WINDOW;
+	z->prev_queries = adjacent ? z->queries : 0;
+	z->prev_misses = adjacent ? z->misses : 0;
+	z->prev_estimate = adjacent ? estimate : 0;
+	z->queries = z->misses = 0;
+	z->estimate = 0;
+	z->window = now;
+	memset(z->regs, 0, sizeof(z->regs));
+}
+
+/** 查找区域, 不存在且add为true时替换组内最久未使用的项 */
+static rsd_zone_t* rsd_zone(const char* zone, size_t len, uint64_t now, bool add) {
+	uint64_t key = rsd_hash(0, zone, len) | 1;
+	rsd_zone_t *set = _table + (key >> 32) % RSD_SETS * RSD_WAYS, *victim = set;
+	for (int i = 0; i < RSD_WAYS; ++i) {
+		if (set[i].key == key) return set + i;
+		if (!set[i].key || (victim->key && set[i].last < victim->last)) victim = set + i;
+	}
+	if (!add) return NULL;
+	if (victim->flagged)
+		log_info("random subdomain attack on %s no longer tracked, suppressed %" PRIu64 " queries",
+				victim->name, victim->suppressed);
+	memset(victim, 0, sizeof(*victim));
+	victim->key = key;
+	victim->window = now;
+	memcpy(victim->name, zone, len < HOST_MAX ? len : HOST_MAX - 1);
+	return victim;
+}
+
+/** 定时输出不同标签数量最多的几个区域的估计值 */
+static void rsd_log_stats(uint64_t now) {
+	if (now < _stats_next) return;
+	_stats_next = now + RSD_STATS_INTERVAL;
+	const rsd_zone_t *top[RSD_STATS_TOP] = { NULL };
+	uint32_t zones = 0, flagged = 0;
+	for (const rsd_zone_t *z = _table, *end = _table + RSD_SETS * RSD_WAYS; z < end; ++z) {
+		if (!z->key) continue;
+		++zones;
+		if (z->flagged) ++flagged;
+		for (int i = 0; i < RSD_STATS_TOP; ++i) {
+			if (!top[i] || z->prev_estimate > top[i]->prev_estimate) {
+				memmove(top + i + 1, top + i, (RSD_STATS_TOP - i - 1) * sizeof(top[0]));
+				top[i] = z;
+				break;
+			}
+		}
+	}
+	if (!zones) return;
+	char buf[RSD_STATS_TOP * (HOST_MAX + 64)];
+	int n = 0;
+	for (int i = 0; i < RSD_STATS_TOP && top[i]; ++i)
+		n += snprintf(buf + n, sizeof(buf) - n, "; %s: distinct=%.0f, baseline=%.0f, miss=%u%%%s", top[i]->name,
+				top[i]->prev_estimate, top[i]->baseline, rsd_miss_percent(top[i], now), top[i]->flagged ? ", flagged" : "");
+	log_info("rsd stats: zones=%u, flagged=%u%s", zones, flagged, buf);
+}
+
+bool rsd_query(const char* host) {
+	if (!_threshold) return false;
+	const char *dot = strchr(host, '.');
+	if (!dot || !dot[1]) return false;
+	uint64_t now = net_mstime();
+	rsd_log_stats(now);
+	rsd_zone_t *z = rsd_zone(dot + 1, strlen(dot + 1), now, true);
+	rsd_roll(z, now);
+	z->last = now;
+	++z->queries;
+
+	// 哈希值的高位选择寄存器, 其余位的前导0数量加1作为寄存器的候选值
+	uint64_t h = rsd_hash(_seed, host, (size_t) (dot - host)), w = h << RSD_REG_BITS;
+	uint8_t rho = w ? (uint8_t) (__builtin_clzll(w) + 1) : 64 - RSD_REG_BITS + 1;
+	uint8_t *reg = z->regs + (h >> (64 - RSD_REG_BITS));
+	if (rho > *reg) *reg = rho;
+
+	if (z->queries % RSD_CHECK_INTERVAL == 0) {
+		z->estimate = rsd_estimate(z);
+		if (!z->flagged && rsd_spike(z, z->estimate, now)) rsd_flag(z, z->estimate, now);
+	}
+	return z->flagged;
+}
+
+void rsd_miss(const char* host) {
+	if (!_threshold) return;
+	const char *dot = strchr(host, '.');
+	if (!dot || !dot[1]) return;
+	rsd_zone_t *z = rsd_zone(dot + 1, strlen(dot + 1), 0, false);
+	if (!z) return;
+	++z->misses;
+	if (z->flagged) ++z->suppressed;
+}
+
+// #define RSD_TEST
+#ifdef RSD_TEST
+#include <assert.h>
+
+int main() {
+	rsd_init(RSD_THRESHOLD_DEFAULT);
+	_seed = 1;
+	char host[HOST_MAX];
+
+	// HyperLogLog估计值的误差
+	const uint32_t counts[] = { 10, 100, 1000, 10000, 100000 };
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+		rsd_zone_t z = { 0 };
+		for (uint32_t i = 0; i < counts[c]; ++i) {
+			int n = snprintf(host, sizeof(host), "x%u", i);
+			uint64_t h = rsd_hash(_seed, host, n), w = h << RSD_REG_BITS;
+			uint8_t rho = w ? (uint8_t) (__builtin_clzll(w) + 1) : 64 - RSD_REG_BITS + 1;
+			if (rho > z.regs[h >> (64 - RSD_REG_BITS)]) z.regs[h >> (64 - RSD_REG_BITS)] = rho;
+		}
+		float e = rsd_estimate(&z);
+		printf("distinct %u, estimate %.0f, error %.1f%%\n", counts[c], e, (e - counts[c]) * 100.0 / counts[c]);
+		assert(e > counts[c] * 0.8 && e < counts[c] * 1.2);
+	}
+
+	// 正常流量: 少量域名反复查询, 不标记
+	for (int i = 0; i < 100000; ++i) {
+		snprintf(host, sizeof(host), "h%d.normal.com", i % 50);
+		assert(!rsd_query(host));
+	}
+	// 大量存在的不同域名, 都能命中, 不标记
+	for (int i = 0; i < 20000; ++i) {
+		snprintf(host, sizeof(host), "cdn%d.hits.com", i);
+		assert(!rsd_query(host));
+	}
+	// 随机子域名且都未命中, 标记后该区域直接否定应答, 其它区域不受影响
+	bool flagged = false;
+	int i;
+	for (i = 0; i < 20000 && !flagged; ++i) {
+		snprintf(host, sizeof(host), "r%08x.victim.com", (unsigned) (i * 2654435761u));
+		if (!(flagged = rsd_query(host))) rsd_miss(host);
+	}
+	printf("victim.com flagged after %d queries\n", i);
+	assert(flagged && i <= 2 * RSD_THRESHOLD_DEFAULT);
+	assert(rsd_query("www.victim.com") && !rsd_query("www.normal.com"));
+
+	uint64_t start = net_mstime();
+	for (i = 0; i < 1000000; ++i) {
+		snprintf(host, sizeof(host), "r%08x.zone%d.com", (unsigned) (i * 2654435761u), i & 1023);
+		rsd_query(host);
+	}
+	printf("1M queries: %llums\n", (unsigned long long) (net_mstime() - start));
+	printf("test success\n");
+	return 0;
+}
+#endif // RSD_TEST
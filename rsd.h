@@ -0,0 +1,33 @@
+/** 随机子域名攻击(水刑攻击)检测, 攻击者大量查询"随机串.example.com"这类不存在的域名, 每个查询都不命中缓存,
+ *  都会转发到上游并输出日志. 按父区域(去掉首个标签后的域名)统计首个标签的不同值数量及查询未命中率,
+ *  不同值数量用HyperLogLog估计, 每个区域的内存固定, 数量突增且大部分查询未命中时标记该区域,
+ *  标记期间区域内本地记录及转发缓存中都没有的域名直接否定应答, 不转发、不输出日志.
+ *  区域存放在固定大小的4路组相联哈希表中, 组满时替换最久未使用的项
+ */
+#pragma once
+#ifndef __RSD_H__
+#define __RSD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** 默认的检测阈值, 区域在一个统计窗口内的不同标签数量 */
+#define RSD_THRESHOLD_DEFAULT 1000
+
+/** 启用随机子域名攻击检测
+ * @param threshold 区域在一个统计窗口(10秒)内不同标签数量的阈值, 超过阈值且远高于平时的数量时才标记, 0表示不检测
+ */
+extern void rsd_init(uint32_t threshold);
+
+/** 每个查询的问题调用一次, 记录域名的首个标签, 与dns_guard_func接口一致
+ * @param host 域名
+ * @return true: 域名的父区域已被标记
+ */
+extern bool rsd_query(const char* host);
+
+/** 查询在本地及转发缓存中都没有找到时调用, 用于统计未命中率, 与dns_miss_func接口一致
+ * @param host 域名
+ */
+extern void rsd_miss(const char* host);
+
+#endif // __RSD_H__
@@ -0,0 +1,219 @@
+#include <string.h>
+#include "sha256.h"
+
+/** 64个轮常量, 前64个质数立方根小数部分的前32bits, 算法本身规定的 */
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/** 用于bits填充的缓冲区, 第一个字节为0x80, 其余为0 */
+static const uint8_t PADDING[SHA256_BLOCK] = { 0x80 };
+
+/* ROTATE_RIGHT rotates x right n bits. */
+#define ROTATE_RIGHT(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+/* sha256算法规定的逻辑函数 */
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x) (ROTATE_RIGHT(x, 2) ^ ROTATE_RIGHT(x, 13) ^ ROTATE_RIGHT(x, 22))
+#define EP1(x) (ROTATE_RIGHT(x, 6) ^ ROTATE_RIGHT(x, 11) ^ ROTATE_RIGHT(x, 25))
+#define SIG0(x) (ROTATE_RIGHT(x, 7) ^ ROTATE_RIGHT(x, 18) ^ ((x) >> 3))
+#define SIG1(x) (ROTATE_RIGHT(x, 17) ^ ROTATE_RIGHT(x, 19) ^ ((x) >> 10))
+
+/** 将4字节的整数按大端字节序写入缓冲区
+ * @param output：用于输出的字符缓冲区
+ * @param input：欲转换的四字节的整数形式的数组
+ * @param len：output缓冲区的长度，要求是4的整数倍
+ */
+static void _encode(uint8_t *output, const uint32_t *input, size_t len) {
+	for (size_t i = 0, j = 0; j < len; i++, j += 4) {
+		output[j    ] = (uint8_t)(input[i] >> 24);
+		output[j + 1] = (uint8_t)(input[i] >> 16);
+		output[j + 2] = (uint8_t)(input[i] >> 8);
+		output[j + 3] = (uint8_t)(input[i]);
+	}
+}
+
+/** 对一个512bits的分组做一次转换, 结果累加到state中 */
+static void _sha256_transform(uint32_t state[8], const uint8_t block[SHA256_BLOCK]) {
+	uint32_t w[64], a = state[0], b = state[1], c = state[2], d = state[3],
+		e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (int i = 0; i < 16; ++i)
+		w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16
+			| (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (int i = 16; i < 64; ++i)
+		w[i] = SIG1(w[i - 2]) + w[i - 7] + SIG0(w[i - 15]) + w[i - 16];
+
+	for (int i = 0; i < 64; ++i) {
+		uint32_t t1 = h + EP1(e) + CH(e, f, g) + K[i] + w[i];
+		uint32_t t2 = EP0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+
+	/* Zeroize sensitive information. */
+	memset(w, 0, sizeof(w));
+}
+
+void sha256_init(sha256_ctx_t* sha) {
+	memset(sha, 0, sizeof(*sha));
+	// 初始哈希值, 前8个质数平方根小数部分的前32bits
+	uint32_t *state = sha->state;
+	state[0] = 0x6a09e667;
+	state[1] = 0xbb67ae85;
+	state[2] = 0x3c6ef372;
+	state[3] = 0xa54ff53a;
+	state[4] = 0x510e527f;
+	state[5] = 0x9b05688c;
+	state[6] = 0x1f83d9ab;
+	state[7] = 0x5be0cd19;
+}
+
+void sha256_update(sha256_ctx_t* sha, const void *input, size_t len) {
+	const uint8_t *p = input;
+	size_t index = (size_t) (sha->count & (SHA256_BLOCK - 1));
+	sha->count += len;
+
+	// 先用输入内容补足缓冲区中未满的分组
+	if (index) {
+		size_t part_len = SHA256_BLOCK - index;
+		if (len < part_len) {
+			memcpy(sha->buffer + index, p, len);
+			return;
+		}
+		memcpy(sha->buffer + index, p, part_len);
+		_sha256_transform(sha->state, sha->buffer);
+		p += part_len;
+		len -= part_len;
+	}
+
+	// 完整的分组直接转换, 剩余的内容留在缓冲区中待以后处理
+	for (; len >= SHA256_BLOCK; p += SHA256_BLOCK, len -= SHA256_BLOCK)
+		_sha256_transform(sha->state, p);
+	memcpy(sha->buffer, p, len);
+}
+
+void sha256_final(sha256_ctx_t* sha, uint8_t digest[SHA256_LEN]) {
+	// 原始信息的bits长度, 大端字节序
+	uint8_t bits[8];
+	uint64_t count = sha->count << 3;
+	for (int i = 0; i < 8; ++i)
+		bits[i] = (uint8_t) (count >> (56 - i * 8));
+
+	// 填充到模64余56, 再补上原始信息的bits长度, 恰好凑够一个分组
+	size_t index = (size_t) (sha->count & (SHA256_BLOCK - 1));
+	sha256_update(sha, PADDING, index < 56 ? 56 - index : 120 - index);
+	sha256_update(sha, bits, 8);
+	_encode(digest, sha->state, SHA256_LEN);
+
+	// Zeroize sensitive information.
+	memset(sha, 0, sizeof(*sha));
+}
+
+uint8_t* sha256_bin(uint8_t dst[SHA256_LEN], const void *input, size_t len) {
+	sha256_ctx_t sha;
+	sha256_init(&sha);
+	sha256_update(&sha, input, len);
+	sha256_final(&sha, dst);
+	return dst;
+}
+
+void hmac_sha256_init(hmac_sha256_ctx_t* hmac, const void *key, size_t key_len) {
+	uint8_t k[SHA256_BLOCK] = { 0 }, pad[SHA256_BLOCK];
+	if (key_len > SHA256_BLOCK) sha256_bin(k, key, key_len);
+	else memcpy(k, key, key_len);
+
+	for (int i = 0; i < SHA256_BLOCK; ++i) pad[i] = k[i] ^ 0x36;
+	sha256_init(&hmac->inner);
+	sha256_update(&hmac->inner, pad, SHA256_BLOCK);
+	for (int i = 0; i < SHA256_BLOCK; ++i) pad[i] = k[i] ^ 0x5c;
+	sha256_init(&hmac->outer);
+	sha256_update(&hmac->outer, pad, SHA256_BLOCK);
+
+	memset(k, 0, sizeof(k));
+	memset(pad, 0, sizeof(pad));
+}
+
+void hmac_sha256_update(hmac_sha256_ctx_t* hmac, const void *input, size_t len) {
+	sha256_update(&hmac->inner, input, len);
+}
+
+void hmac_sha256_final(hmac_sha256_ctx_t* hmac, uint8_t mac[SHA256_LEN]) {
+	uint8_t digest[SHA256_LEN];
+	sha256_final(&hmac->inner, digest);
+	sha256_update(&hmac->outer, digest, SHA256_LEN);
+	sha256_final(&hmac->outer, mac);
+	memset(digest, 0, sizeof(digest));
+}
+
+// #define SHA256_TEST
+#ifdef SHA256_TEST
+#include <assert.h>
+#include <stdlib.h>
+
+static void hex(const char* text, uint8_t* dst) {
+	for (; *text; text += 2)
+		*dst++ = (uint8_t) strtoul((char[]) { text[0], text[1], 0 }, NULL, 16);
+}
+
+int main() {
+	uint8_t out[SHA256_LEN], expect[SHA256_LEN];
+
+	// FIPS 180-2附录B的测试向量
+	hex("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", expect);
+	assert(!memcmp(sha256_bin(out, "abc", 3), expect, SHA256_LEN));
+	hex("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", expect);
+	const char* two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	assert(!memcmp(sha256_bin(out, two, strlen(two)), expect, SHA256_LEN));
+
+	// 分段输入与一次输入结果相同
+	sha256_ctx_t sha;
+	sha256_init(&sha);
+	for (const char* p = two; *p; ++p) sha256_update(&sha, p, 1);
+	sha256_final(&sha, out);
+	assert(!memcmp(out, expect, SHA256_LEN));
+
+	// RFC 4231的测试用例2和6, 分别是短密钥与超过分组长度的密钥
+	hmac_sha256_ctx_t hmac;
+	hex("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843", expect);
+	hmac_sha256_init(&hmac, "Jefe", 4);
+	hmac_sha256_update(&hmac, "what do ya want ", 16);
+	hmac_sha256_update(&hmac, "for nothing?", 12);
+	hmac_sha256_final(&hmac, out);
+	assert(!memcmp(out, expect, SHA256_LEN));
+
+	uint8_t key[131];
+	memset(key, 0xaa, sizeof(key));
+	const char* msg = "Test Using Larger Than Block-Size Key - Hash Key First";
+	hex("60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54", expect);
+	hmac_sha256_init(&hmac, key, sizeof(key));
+	hmac_sha256_update(&hmac, msg, strlen(msg));
+	hmac_sha256_final(&hmac, out);
+	assert(!memcmp(out, expect, SHA256_LEN));
+
+	return 0;
+}
+#endif // SHA256_TEST
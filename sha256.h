@@ -0,0 +1,90 @@
+/** sha256编码单元头文件, 包含HMAC-SHA256, 用于TSIG签名
+ * @file sha256.h
+*/
+
+#pragma once
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** sha256结果的字节数 */
+#define SHA256_LEN 32
+/** sha256的分组字节数, 也是HMAC密钥填充的长度 */
+#define SHA256_BLOCK 64
+
+typedef struct {
+    /** 8个32bits的中间结果, 最终即为消息摘要 */
+    uint32_t state[8];
+
+    /** 已输入信息的字节数 */
+    uint64_t count;
+
+    /** 未满一个分组的输入缓冲区, 512bits */
+    uint8_t buffer[SHA256_BLOCK];
+} sha256_ctx_t;
+
+typedef struct {
+    /** 内层哈希, 已输入密钥与ipad异或的分组 */
+    sha256_ctx_t inner;
+
+    /** 外层哈希, 已输入密钥与opad异或的分组 */
+    sha256_ctx_t outer;
+} hmac_sha256_ctx_t;
+
+/** 初始化sha256结构
+ * @param sha           sha256结构
+*/
+void sha256_init(sha256_ctx_t* sha);
+
+/** 计算sha256值，可多次调用进行分段计算
+ * @param sha           sha256结构
+ * @param input         输入内容
+ * @param len           输入内容长度
+*/
+void sha256_update(sha256_ctx_t* sha, const void *input, size_t len);
+
+/** 输出sha256结果，完成计算
+ * @param sha           sha256结构
+ * @param digest        输出结果的地址
+*/
+void sha256_final(sha256_ctx_t* sha, uint8_t digest[SHA256_LEN]);
+
+/** 计算sha256值的快捷函数
+ * @param dst           写入sha256结果的地址
+ * @param input         要计算的内容地址
+ * @param len           要计算的长度(字节为单位)
+ * @return              返回dst
+ */
+uint8_t* sha256_bin(uint8_t dst[SHA256_LEN], const void *input, size_t len);
+
+/** 初始化HMAC-SHA256结构
+ * @param hmac          hmac结构
+ * @param key           密钥
+ * @param key_len       密钥长度, 超过分组长度时先计算sha256
+*/
+void hmac_sha256_init(hmac_sha256_ctx_t* hmac, const void *key, size_t key_len);
+
+/** 计算HMAC-SHA256值，可多次调用进行分段计算
+ * @param hmac          hmac结构
+ * @param input         输入内容
+ * @param len           输入内容长度
+*/
+void hmac_sha256_update(hmac_sha256_ctx_t* hmac, const void *input, size_t len);
+
+/** 输出HMAC-SHA256结果，完成计算
+ * @param hmac          hmac结构
+ * @param mac           输出结果的地址
+*/
+void hmac_sha256_final(hmac_sha256_ctx_t* hmac, uint8_t mac[SHA256_LEN]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHA256_H__ */
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "dnsproto.h"
+#include "dyndns.h"
+#include "sockfilter.h"
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
+
+/** udp socket的过滤器从udp头部开始读取, 报文内容的偏移地址 */
+#define SOCKFILTER_UDP_HEAD 8
+
+static socket_t _fd = -1;
+
+bool sockfilter_init(socket_t fd, bool attach) {
+	_fd = fd;
+	if (!attach) {
+		// 交接得到的socket可能带有旧进程挂载的过滤器, 没有挂载时失败, 忽略,
+		// 内核对全部选项先检查长度不小于int, 参数不能为空
+		int unused = 0;
+		setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+		return true;
+	}
+
+	const uint8_t *m = (const uint8_t*) DYNDNS_MAGIC;
+	uint32_t magic = (uint32_t) m[0] << 24 | (uint32_t) m[1] << 16 | (uint32_t) m[2] << 8 | m[3];
+	struct sock_filter code[] = {
+		// 读取报文前4个字节, 不足4个字节时程序中止, 报文被丢弃
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SOCKFILTER_UDP_HEAD),
+		// 动态更新报文
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, magic, 7, 0),
+		// dns报文长度必须大于头部长度
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, SOCKFILTER_UDP_HEAD + DNS_HEAD_LEN, 0, 6),
+		// QR标志必须为0, 即查询报文
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SOCKFILTER_UDP_HEAD + 2),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 4, 0),
+		// 操作码不能超过支持的最大值, 动态更新(RFC 2136)除外
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x78),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, DNS_OPCODE_MAX << 3, 0, 1),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, DNS_OPCODE_UPDATE << 3, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+		log_error("attach socket filter failed: %s", strerror(errno));
+		return false;
+	}
+	log_info("socket filter attached, %u instructions", (unsigned) prog.len);
+	return true;
+}
+
+uint64_t sockfilter_drops(void) {
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+	if (_fd == -1 || getsockopt(_fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) || len <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+		return 0;
+	return meminfo[SK_MEMINFO_DROPS];
+}
+
+#else // __linux__
+
+bool sockfilter_init(socket_t fd, bool attach) {
+	(void) fd;
+	if (attach) log_error("socket filter is only supported on linux");
+	return !attach;
+}
+
+uint64_t sockfilter_drops(void) {
+	return 0;
+}
+
+#endif // __linux__
+
+// #define SOCKFILTER_TEST
+#if defined(SOCKFILTER_TEST) && defined(__linux__)
+#include <assert.h>
+#include <unistd.h>
+
+/** 测试报文, 第二个字节作为编号, 接收后据此判断哪些报文通过了过滤器 */
+typedef struct test_packet_t {
+	const char	*name;
+	bool		pass;
+	uint16_t	len;
+	uint8_t		data[32];
+} test_packet_t;
+
+int main() {
+	static const test_packet_t packets[] = {
+		{ "query", true, 23, { 0, 1, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0, 1, 'a', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1 } },
+		{ "inverse query", true, 13, { 0, 2, 0x08, 0 } },
+		{ "update", true, 17, { 0, 3, DNS_OPCODE_UPDATE << 3, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 6, 0, 1 } },
+		{ "dyndns", true, 10, { 'd', 'd', 'y', 'n', '/', '2', 0, 0, 0, 0 } },
+		{ "response", false, 23, { 0, 5, 0x81, 0x80, 0, 1, 0, 0, 0, 0, 0, 0, 1, 'a', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1 } },
+		{ "status opcode", false, 13, { 0, 6, 2 << 3, 0 } },
+		{ "notify opcode", false, 13, { 0, 7, 4 << 3, 0 } },
+		{ "header only", false, 12, { 0, 8, 0x01, 0 } },
+		{ "short", false, 8, { 0, 9, 0x01, 0 } },
+		{ "tiny", false, 3, { 0, 10, 0x01 } },
+		{ "last query", true, 13, { 0, 11, 0x01, 0 } },
+	};
+	const int count = sizeof(packets) / sizeof(packets[0]);
+
+	// 本机的一对udp socket, 接收端挂载过滤器
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	int rfd = socket(AF_INET, SOCK_DGRAM, 0), sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(rfd != -1 && sfd != -1);
+	assert(!bind(rfd, (struct sockaddr*) &addr, sizeof(addr)));
+	assert(!getsockname(rfd, (struct sockaddr*) &addr, &addrlen));
+	assert(sockfilter_init(rfd, true));
+	uint64_t drops = sockfilter_drops();
+
+	for (int i = 0; i < count; ++i)
+		assert(sendto(sfd, packets[i].data, packets[i].len, 0, (struct sockaddr*) &addr, sizeof(addr)) == packets[i].len);
+
+	// 最后一个报文是应通过的查询, 收到它时之前的报文都已处理
+	uint8_t buf[64];
+	int expect = 0, dropped = 0;
+	struct timeval tv = { .tv_sec = 2 };
+	setsockopt(rfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	for (int i = 0; i < count; ++i) {
+		if (!packets[i].pass) {
+			++dropped;
+			continue;
+		}
+		ssize_t n = recv(rfd, buf, sizeof(buf), 0);
+		assert(n == packets[i].len && !memcmp(buf, packets[i].data, n));
+		printf("%-14s pass\n", packets[i].name);
+		++expect;
+	}
+	tv.tv_sec = 0, tv.tv_usec = 100000;
+	setsockopt(rfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	assert(recv(rfd, buf, sizeof(buf), 0) == -1);
+	assert(sockfilter_drops() - drops == (uint64_t) dropped);
+	printf("passed=%d, dropped=%d\n", expect, dropped);
+
+	// 卸载后全部报文都能收到
+	assert(sockfilter_init(rfd, false));
+	assert(sendto(sfd, packets[4].data, packets[4].len, 0, (struct sockaddr*) &addr, sizeof(addr)) == packets[4].len);
+	assert(recv(rfd, buf, sizeof(buf), 0) == packets[4].len);
+
+	close(sfd);
+	close(rfd);
+	printf("test success\n");
+	return 0;
+}
+#endif // SOCKFILTER_TEST
@@ -0,0 +1,25 @@
+/** 服务socket的内核过滤器, 使用SO_ATTACH_FILTER挂载经典BPF程序, 不合格的报文在内核中直接丢弃, 不再进入用户空间
+ *  过滤规则与协议解析的检查一致: 动态更新报文以头部标志开头, dns报文必须长于头部、是查询报文且操作码受支持
+ *  仅linux支持, 其它平台上挂载失败
+ */
+#pragma once
+#ifndef __SOCKFILTER_H__
+#define __SOCKFILTER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "net.h"
+
+/** 初始化服务socket的内核过滤器
+ * @param fd 服务socket
+ * @param attach true: 挂载过滤器, false: 卸载之前(例如交接前的旧进程)挂载的过滤器
+ * @return false: 挂载失败
+ */
+extern bool sockfilter_init(socket_t fd, bool attach);
+
+/** 获取内核丢弃的报文数量, 包含过滤器丢弃及接收缓冲区满丢弃的报文, 从socket创建时开始累计
+ * @return 丢弃数量, 不支持时返回0
+ */
+extern uint64_t sockfilter_drops(void);
+
+#endif // __SOCKFILTER_H__
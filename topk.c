@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "net.h"
+#include "topk.h"
+
+/** 统计周期, 毫秒为单位, 周期结束时输出前N项并重新统计 */
+#define TOPK_INTERVAL (60 * 1000)
+/** 日志中每类最多输出的项数 */
+#define TOPK_LOG_MAX 32
+
+/** 计数器, 按计数值分组挂在桶的双向链表上, 计数值存放在桶中 */
+typedef struct topk_counter_t {
+	uint64_t	error;			// 替换时继承的最小计数值
+	int32_t		bucket;			// 所属的桶
+	int32_t		prev, next;		// 桶内链表
+	int32_t		chain;			// 哈希冲突链
+	uint32_t	hash;			// 键的哈希值
+	uint8_t		len;			// 键的长度
+	char		key[HOST_MAX];	// 键, 域名或4字节的ip地址
+} topk_counter_t;
+
+/** 桶, 计数值相同的计数器在同一个桶中, 桶按计数值从小到大链接 */
+typedef struct topk_bucket_t {
+	uint64_t	count;			// 计数值
+	int32_t		head;			// 桶内链表头
+	int32_t		prev, next;		// 按计数值排序的链表, 空闲桶用next链接
+} topk_bucket_t;
+
+/** Space-Saving统计结构, 计数器与桶都是预分配的数组, 用下标链接 */
+typedef struct topk_summary_t {
+	const char		*title;		// 日志中的名称
+	uint32_t		capacity;	// 计数器数量
+	uint32_t		used;		// 已使用的计数器数量
+	uint32_t		mask;		// 哈希索引的掩码
+	int32_t			min, max;	// 计数值最小及最大的桶
+	int32_t			free;		// 空闲桶链表
+	uint64_t		total;		// 本周期的总次数
+	topk_counter_t	*counters;
+	topk_bucket_t	*buckets;
+	int32_t			*index;		// 哈希索引, 链表头
+} topk_summary_t;
+
+/** 各类别的计数器数量, 动态更新的域名很少 */
+static const uint32_t _capacities[TOPK_KINDS] = { 1024, 1024, 256 };
+static const char* const _titles[TOPK_KINDS] = { "names", "clients", "dyndns" };
+
+static topk_summary_t _summaries[TOPK_KINDS];
+static uint32_t _top = 0;
+static uint64_t _next = 0;
+
+static void topk_reset(topk_summary_t* s) {
+	s->used = 0;
+	s->total = 0;
+	s->min = s->max = -1;
+	for (uint32_t i = 0; i < s->capacity; ++i)
+		s->buckets[i].next = i + 1 < s->capacity ? (int32_t) i + 1 : -1;
+	s->free = 0;
+	memset(s->index, 0xff, (s->mask + 1) * sizeof(int32_t));
+}
+
+static void topk_summary_init(topk_summary_t* s, uint32_t capacity, const char* title) {
+	uint32_t slots = 1;
+	while (slots < capacity * 2) slots <<= 1;
+	s->title = title;
+	s->capacity = capacity;
+	s->mask = slots - 1;
+	s->counters = malloc(capacity * sizeof(topk_counter_t));
+	s->buckets = malloc(capacity * sizeof(topk_bucket_t));
+	s->index = malloc(slots * sizeof(int32_t));
+	topk_reset(s);
+}
+
+void topk_init(uint32_t top) {
+	_top = top;
+	if (!_top) return;
+	for (int i = 0; i < TOPK_KINDS; ++i)
+		if (!_summaries[i].counters) topk_summary_init(_summaries + i, _capacities[i], _titles[i]);
+	_next = net_mstime() + TOPK_INTERVAL;
+	log_info("heavy hitter tracking enabled: top %u per %ds", _top, TOPK_INTERVAL / 1000);
+}
+
+static uint32_t topk_hash(const char* key, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t) key[i]) * 16777619u;
+	return h ^ h >> 16;
+}
+
+/** 在桶after之后插入计数值为count的新桶, after为-1时插入到最前面 */
+static int32_t topk_bucket_insert(topk_summary_t* s, int32_t after, uint64_t count) {
+	int32_t b = s->free;
+	topk_bucket_t *p = s->buckets + b;
+	s->free = p->next;
+	p->count = count;
+	p->head = -1;
+	p->prev = after;
+	p->next = after == -1 ? s->min : s->buckets[after].next;
+	if (p->next == -1) s->max = b;
+	else s->buckets[p->next].prev = b;
+	if (after == -1) s->min = b;
+	else s->buckets[after].next = b;
+	return b;
+}
+
+/** 从所在的桶中摘下计数器, 桶变空时释放 */
+static void topk_detach(topk_summary_t* s, int32_t c) {
+	topk_counter_t *p = s->counters + c;
+	topk_bucket_t *b = s->buckets + p->bucket;
+	if (p->prev == -1) b->head = p->next;
+	else s->counters[p->prev].next = p->next;
+	if (p->next != -1) s->counters[p->next].prev = p->prev;
+	if (b->head != -1) return;
+
+	if (b->prev == -1) s->min = b->next;
+	else s->buckets[b->prev].next = b->next;
+	if (b->next == -1) s->max = b->prev;
+	else s->buckets[b->next].prev = b->prev;
+	b->next = s->free;
+	s->free = p->bucket;
+}
+
+static void topk_attach(topk_summary_t* s, int32_t c, int32_t b) {
+	topk_counter_t *p = s->counters + c;
+	p->bucket = b;
+	p->prev = -1;
+	p->next = s->buckets[b].head;
+	if (p->next != -1) s->counters[p->next].prev = c;
+	s->buckets[b].head = c;
+}
+
+/** 计数值加1, 移到下一个桶, 下一个桶的计数值不连续时新建 */
+static void topk_increment(topk_summary_t* s, int32_t c) {
+	int32_t b = s->counters[c].bucket, next = s->buckets[b].next;
+	uint64_t count = s->buckets[b].count + 1;
+	bool alone = s->buckets[b].head == c && s->counters[c].next == -1;
+	if (next == -1 || s->buckets[next].count != count) {
+		if (alone) {
+			s->buckets[b].count = count;
+			return;
+		}
+		next = topk_bucket_insert(s, b, count);
+	}
+	topk_detach(s, c);
+	topk_attach(s, c, next);
+}
+
+static void topk_add(topk_summary_t* s, const void* key, size_t len) {
+	if (len >= HOST_MAX) len = HOST_MAX - 1;
+	uint32_t h = topk_hash(key, len);
+	int32_t *slot = s->index + (h & s->mask);
+	++s->total;
+	for (int32_t c = *slot; c != -1; c = s->counters[c].chain) {
+		const topk_counter_t *p = s->counters + c;
+		if (p->hash == h && p->len == len && !memcmp(p->key, key, len)) {
+			topk_increment(s, c);
+			return;
+		}
+	}
+
+	int32_t c;
+	topk_counter_t *p;
+	if (s->used < s->capacity) {
+		// 还有空闲计数器, 放入计数值为1的桶
+		c = (int32_t) s->used++;
+		p = s->counters + c;
+		p->error = 0;
+		int32_t b = s->min != -1 && s->buckets[s->min].count == 1 ? s->min : topk_bucket_insert(s, -1, 1);
+		topk_attach(s, c, b);
+	} else {
+		// 替换计数值最小的计数器, 继承它的计数值作为误差
+		c = s->buckets[s->min].head;
+		p = s->counters + c;
+		int32_t *pc = s->index + (p->hash & s->mask);
+		while (*pc != c) pc = &s->counters[*pc].chain;
+		*pc = p->chain;
+		p->error = s->buckets[s->min].count;
+		topk_increment(s, c);
+	}
+	p->hash = h;
+	p->len = (uint8_t) len;
+	memcpy(p->key, key, len);
+	p->chain = *slot;
+	*slot = c;
+}
+
+void topk_name(const char* host) {
+	if (_top) topk_add(_summaries + TOPK_NAME, host, strlen(host));
+}
+
+void topk_client(uint32_t ip) {
+	if (_top) topk_add(_summaries + TOPK_CLIENT, &ip, sizeof(ip));
+}
+
+void topk_dyndns(const char* host) {
+	if (_top) topk_add(_summaries + TOPK_DYNDNS, host, strlen(host));
+}
+
+uint32_t topk_top(topk_kind_t kind, topk_item_t* dst, uint32_t n) {
+	if (!_top || kind >= TOPK_KINDS) return 0;
+	const topk_summary_t *s = _summaries + kind;
+	uint32_t count = 0;
+	for (int32_t b = s->max; b != -1 && count < n; b = s->buckets[b].prev) {
+		for (int32_t c = s->buckets[b].head; c != -1 && count < n; c = s->counters[c].next) {
+			const topk_counter_t *p = s->counters + c;
+			topk_item_t *item = dst + count++;
+			if (kind == TOPK_CLIENT) {
+				uint32_t ip;
+				memcpy(&ip, p->key, sizeof(ip));
+				strcpy(item->name, net_ip_tostring(ip));
+			} else {
+				memcpy(item->name, p->key, p->len);
+				item->name[p->len] = '\0';
+			}
+			item->count = s->buckets[b].count;
+			item->error = p->error;
+		}
+	}
+	return count;
+}
+
+void topk_dump(void) {
+	if (!_top) return;
+	uint32_t top = _top < TOPK_LOG_MAX ? _top : TOPK_LOG_MAX;
+	topk_item_t items[TOPK_LOG_MAX];
+	char buf[TOPK_LOG_MAX * (HOST_MAX + 48)];
+	for (int k = 0; k < TOPK_KINDS; ++k) {
+		const topk_summary_t *s = _summaries + k;
+		if (!s->total) continue;
+		uint32_t count = topk_top((topk_kind_t) k, items, top);
+		int n = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			n += snprintf(buf + n, sizeof(buf) - n, "; %s=%" PRIu64, items[i].name, items[i].count);
+			if (items[i].error)
+				n += snprintf(buf + n, sizeof(buf) - n, "(err=%" PRIu64 ")", items[i].error);
+		}
+		log_info("top %s: total=%" PRIu64 "%s", s->title, s->total, buf);
+	}
+}
+
+void topk_timer(uint64_t now) {
+	if (!_top || now < _next) return;
+	_next = now + TOPK_INTERVAL;
+	topk_dump();
+	for (int i = 0; i < TOPK_KINDS; ++i)
+		topk_reset(_summaries + i);
+}
+
+// #define TOPK_TEST
+#ifdef TOPK_TEST
+#include <assert.h>
+
+/** 检查桶按计数值严格递增, 计数器都在正确的桶中 */
+static void test_check(const topk_summary_t* s) {
+	uint32_t counters = 0;
+	uint64_t last = 0;
+	for (int32_t b = s->min, prev = -1; b != -1; prev = b, b = s->buckets[b].next) {
+		assert(s->buckets[b].prev == prev && s->buckets[b].count > last && s->buckets[b].head != -1);
+		last = s->buckets[b].count;
+		for (int32_t c = s->buckets[b].head; c != -1; c = s->counters[c].next, ++counters)
+			assert(s->counters[c].bucket == b);
+		if (s->buckets[b].next == -1) assert(s->max == b);
+	}
+	assert(counters == s->used);
+}
+
+int main() {
+	topk_init(TOPK_DEFAULT);
+	topk_summary_t *s = _summaries + TOPK_NAME;
+	char host[HOST_MAX];
+
+	// 精确计数: 不同键的数量不超过计数器数量时没有误差
+	for (int i = 0; i < 100; ++i)
+		for (int j = 0; j <= i; ++j) {
+			snprintf(host, sizeof(host), "h%d.com", j);
+			topk_name(host);
+		}
+	test_check(s);
+	topk_item_t items[TOPK_DEFAULT];
+	assert(topk_top(TOPK_NAME, items, TOPK_DEFAULT) == TOPK_DEFAULT);
+	for (int i = 0; i < TOPK_DEFAULT; ++i)
+		assert(items[i].count == 100u - i && !items[i].error);
+	assert(!strcmp(items[0].name, "h0.com"));
+
+	// 长尾流量中的热点: 10个热点各占1%, 其余为从不重复的随机域名, 热点都在前10项中
+	topk_reset(s);
+	uint32_t seed = 1;
+	for (int i = 0; i < 1000000; ++i) {
+		seed = seed * 1103515245u + 12345u;
+		uint32_t r = seed >> 16;
+		if (r % 10 == 0) snprintf(host, sizeof(host), "hot%u.com", r / 10 % 10);
+		else snprintf(host, sizeof(host), "r%d.tail.com", i);
+		topk_name(host);
+	}
+	test_check(s);
+	uint32_t n = topk_top(TOPK_NAME, items, TOPK_DEFAULT);
+	for (uint32_t i = 0; i < n; ++i)
+		printf("%s=%" PRIu64 "(err=%" PRIu64 ")\n", items[i].name, items[i].count, items[i].error);
+	for (uint32_t i = 0; i < n; ++i)
+		assert(!strncmp(items[i].name, "hot", 3) && items[i].count - items[i].error > s->total / 200);
+
+	// 客户端地址
+	topk_client(net_ip_fromstring("10.0.0.1"));
+	topk_client(net_ip_fromstring("10.0.0.1"));
+	topk_client(net_ip_fromstring("10.0.0.2"));
+	assert(topk_top(TOPK_CLIENT, items, TOPK_DEFAULT) == 2 && !strcmp(items[0].name, "10.0.0.1") && items[0].count == 2);
+	topk_dyndns("home.example.com");
+	topk_dump();
+
+	uint64_t start = net_mstime();
+	for (int i = 0; i < 1000000; ++i)
+		topk_client((uint32_t) i * 2654435761u % 5000);
+	printf("1M updates: %llums\n", (unsigned long long) (net_mstime() - start));
+	test_check(_summaries + TOPK_CLIENT);
+	printf("test success\n");
+	return 0;
+}
+#endif // TOPK_TEST
@@ -0,0 +1,69 @@
+/** 热点统计, 负载突增时找出查询最多的域名、客户端地址及动态更新最多的域名
+ *  使用Space-Saving算法, 每类只保留固定数量的计数器, 每次更新O(1), 内存固定,
+ *  出现次数超过总数/计数器数量的项一定在统计结果中, 计数值是上限, 减去误差是下限,
+ *  每分钟输出一次前N项后重新统计, 统计结果只反映最近一分钟
+ */
+#pragma once
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dnsproto.h"
+
+/** 默认输出的前N项数量 */
+#define TOPK_DEFAULT 10
+
+/** 统计类别 */
+typedef enum topk_kind_t {
+	TOPK_NAME,		// 查询的域名
+	TOPK_CLIENT,	// 客户端地址
+	TOPK_DYNDNS,	// 动态更新的域名
+	TOPK_KINDS
+} topk_kind_t;
+
+/** 统计结果的一项 */
+typedef struct topk_item_t {
+	char		name[HOST_MAX];	// 域名或点分格式的客户端地址
+	uint64_t	count;			// 计数值, 真实次数的上限
+	uint64_t	error;			// 最大误差, 真实次数不少于count - error
+} topk_item_t;
+
+/** 启用热点统计
+ * @param top 输出的前N项数量, 0表示不统计
+ */
+extern void topk_init(uint32_t top);
+
+/** 每个查询的问题调用一次, 与dns_observe_func接口一致
+ * @param host 域名
+ */
+extern void topk_name(const char* host);
+
+/** 每个收到的报文调用一次
+ * @param ip 客户端地址, 网络字节序
+ */
+extern void topk_client(uint32_t ip);
+
+/** 每次成功的动态更新调用一次
+ * @param host 域名
+ */
+extern void topk_dyndns(const char* host);
+
+/** 查询当前统计周期的前N项, 按计数值从大到小
+ * @param kind 统计类别
+ * @param dst 回写统计结果
+ * @param n dst的容量
+ * @return 回写的数量
+ */
+extern uint32_t topk_top(topk_kind_t kind, topk_item_t* dst, uint32_t n);
+
+/** 输出当前统计周期的前N项到日志, 不重新统计 */
+extern void topk_dump(void);
+
+/** 服务循环中定时调用, 每分钟输出一次前N项后重新统计
+ * @param now 当前时间, 毫秒为单位
+ */
+extern void topk_timer(uint64_t now);
+
+#endif // __TOPK_H__
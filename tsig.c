@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "net.h"
+#include "tsig.h"
+
+/** TSIG记录的类型值 */
+#define TSIG_TYPE 250
+/** TSIG记录的类, 固定为ANY */
+#define TSIG_CLASS 255
+/** 唯一支持的算法名 */
+#define TSIG_ALG "hmac-sha256"
+/** TSIG记录rdata中签名之前的固定长度, time signed(6) fudge(2) mac size(2) */
+#define TSIG_FIXED_LEN 10
+/** TSIG记录rdata中签名之后的固定长度, original id(2) error(2) other len(2) */
+#define TSIG_TAIL_LEN 6
+/** 时间错误应答的other data长度, 服务器当前时间 */
+#define TSIG_OTHER_LEN 6
+
+/** 密钥 */
+typedef struct tsig_key_t {
+	char		name[HOST_MAX];			// 密钥名, 已转为小写
+	uint16_t	len;					// 密钥长度
+	uint8_t		secret[TSIG_SECRET_MAX];	// 密钥
+} tsig_key_t;
+
+static tsig_key_t _keys[TSIG_KEY_MAX];
+static uint32_t _key_count = 0;
+
+/** 解码base64字符串, 忽略末尾的填充字符
+ * @return 解码后的长度, -1: 格式错误或超出可写长度
+ */
+static int tsig_base64_decode(const char* src, uint8_t* dst, size_t dst_size) {
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t len = 0;
+	for (; *src && *src != '='; ++src) {
+		const char *p = strchr(table, *src);
+		if (!p) return -1;
+		acc = acc << 6 | (uint32_t)(p - table);
+		if ((bits += 6) >= 8) {
+			if (len >= dst_size) return -1;
+			bits -= 8;
+			dst[len++] = (uint8_t)(acc >> bits);
+		}
+	}
+	return (int) len;
+}
+
+/** 复制域名并转为小写, 去掉末尾的点 */
+static void tsig_lower(char dst[HOST_MAX], const char* src, size_t len) {
+	if (len && src[len - 1] == '.') --len;
+	for (size_t i = 0; i < len; ++i)
+		dst[i] = (char) tolower((unsigned char) src[i]);
+	dst[len] = '\0';
+}
+
+bool tsig_add_key(const char* spec) {
+	if (_key_count >= TSIG_KEY_MAX) {
+		log_error("tsig key count exceeds %d", TSIG_KEY_MAX);
+		return false;
+	}
+	// 三段时第一段是算法名, 只支持hmac-sha256
+	const char *name = spec, *secret = strrchr(spec, ':'), *colon = strchr(spec, ':');
+	if (colon && colon != secret) {
+		if ((size_t)(colon - spec) != strlen(TSIG_ALG) || strncasecmp(spec, TSIG_ALG, colon - spec)) {
+			log_error("tsig key algorithm[%.*s] unsupport, only %s", (int)(colon - spec), spec, TSIG_ALG);
+			return false;
+		}
+		name = colon + 1;
+	}
+	if (!secret || secret == name || (size_t)(secret - name) >= HOST_MAX) {
+		log_error("tsig key[%s] format error, must be [%s:]name:secret", spec, TSIG_ALG);
+		return false;
+	}
+
+	tsig_key_t *k = _keys + _key_count;
+	int n = tsig_base64_decode(secret + 1, k->secret, sizeof(k->secret));
+	if (n <= 0) {
+		log_error("tsig key[%.*s] secret is not valid base64", (int)(secret - name), name);
+		return false;
+	}
+	k->len = (uint16_t) n;
+	tsig_lower(k->name, name, secret - name);
+	++_key_count;
+	log_info("tsig key[%s] added, %u bytes secret", k->name, (unsigned) k->len);
+	return true;
+}
+
+uint32_t tsig_key_count(void) {
+	return _key_count;
+}
+
+/** 查找密钥, 返回序号, -1表示找不到 */
+static int tsig_key_find(const char* name) {
+	for (uint32_t i = 0; i < _key_count; ++i)
+		if (!strcmp(_keys[i].name, name))
+			return (int) i;
+	return -1;
+}
+
+/** 写入48位的签名时间 */
+static void tsig_put_time(uint8_t dst[6], uint64_t t) {
+	for (int i = 0; i < 6; ++i)
+		dst[i] = (uint8_t)(t >> (40 - i * 8));
+}
+
+/** 计算签名中TSIG变量部分(RFC 8945 4.3.3), 密钥名及算法名使用小写的无压缩格式 */
+static void tsig_mac_vars(hmac_sha256_ctx_t* hmac, const tsig_t* t, uint64_t signed_time, uint16_t error,
+		const uint8_t* other, uint16_t other_len) {
+	uint8_t buf[(HOST_MAX + 1) * 2 + 32], *p = buf;
+	p += dns_name_to_wire(t->name, p, HOST_MAX + 1);
+	*(uint16_t*) p = htons(TSIG_CLASS);
+	*(uint32_t*)(p + 2) = 0;
+	p += 6;
+	p += dns_name_to_wire(t->alg, p, HOST_MAX + 1);
+	tsig_put_time(p, signed_time);
+	*(uint16_t*)(p + 6) = htons(t->fudge);
+	*(uint16_t*)(p + 8) = htons(error);
+	*(uint16_t*)(p + 10) = htons(other_len);
+	p += 12;
+	hmac_sha256_update(hmac, buf, p - buf);
+	hmac_sha256_update(hmac, other, other_len);
+}
+
+tsig_result_t tsig_verify(const uint8_t* msg, size_t len, size_t* end, tsig_t* dst) {
+	memset(dst, 0, sizeof(*dst));
+	dst->key = -1;
+	if (len <= DNS_HEAD_LEN) return TSIG_MALFORMED;
+
+	// 跳过问题区域及附加区域最后一条之前的全部记录
+	unsigned qdcount = ntohs(*(const uint16_t*)(msg + 4)), arcount = ntohs(*(const uint16_t*)(msg + 10));
+	unsigned rrs = ntohs(*(const uint16_t*)(msg + 6)) + ntohs(*(const uint16_t*)(msg + 8)) + arcount;
+	size_t off = DNS_HEAD_LEN;
+	char host[HOST_MAX];
+	for (unsigned i = 0; i < qdcount; ++i)
+		if (!(off = dns_read_name(msg, len, off, host)) || (off += 4) > len)
+			return TSIG_MALFORMED;
+	if (!arcount) return TSIG_UNSIGNED;
+	for (unsigned i = 1; i < rrs; ++i)
+		if (!(off = dns_skip_rr(msg, len, off)))
+			return TSIG_MALFORMED;
+
+	// 最后一条记录不是TSIG记录时, 请求没有签名
+	*end = off;
+	size_t p = dns_read_name(msg, len, off, host);
+	if (!p || p + DNS_RR_HEAD_LEN > len) return TSIG_MALFORMED;
+	if (ntohs(*(const uint16_t*)(msg + p)) != TSIG_TYPE) return TSIG_UNSIGNED;
+	size_t rdend = p + DNS_RR_HEAD_LEN + ntohs(*(const uint16_t*)(msg + p + 8));
+	if (ntohs(*(const uint16_t*)(msg + p + 2)) != TSIG_CLASS || *(const uint32_t*)(msg + p + 4) || rdend != len) {
+		log_warn("tsig record format error!");
+		return TSIG_MALFORMED;
+	}
+	tsig_lower(dst->name, host, strlen(host));
+
+	// 解析rdata: 算法名 签名时间 时间误差 签名长度 签名 原始id 错误码 other长度 other
+	p += DNS_RR_HEAD_LEN;
+	if (!(p = dns_read_name(msg, len, p, host)) || p + TSIG_FIXED_LEN > rdend)
+		return TSIG_MALFORMED;
+	tsig_lower(dst->alg, host, strlen(host));
+	for (int i = 0; i < 6; ++i)
+		dst->time = dst->time << 8 | msg[p + i];
+	dst->fudge = ntohs(*(const uint16_t*)(msg + p + 6));
+	uint16_t mac_len = ntohs(*(const uint16_t*)(msg + p + 8));
+	p += TSIG_FIXED_LEN;
+	if (p + mac_len + TSIG_TAIL_LEN > rdend) return TSIG_MALFORMED;
+	const uint8_t *mac = msg + p;
+	p += mac_len;
+	dst->id = ntohs(*(const uint16_t*)(msg + p));
+	uint16_t error = ntohs(*(const uint16_t*)(msg + p + 2)), other_len = ntohs(*(const uint16_t*)(msg + p + 4));
+	p += TSIG_TAIL_LEN;
+	if (p + other_len != rdend) return TSIG_MALFORMED;
+
+	// 依次校验密钥、签名、时间(RFC 8945 5.2)
+	dst->key = strcmp(dst->alg, TSIG_ALG) ? -1 : tsig_key_find(dst->name);
+	if (dst->key < 0) {
+		log_warn("tsig key[%s] algorithm[%s] unknown!", dst->name, dst->alg);
+		dst->error = TSIG_BADKEY;
+		return TSIG_FAILED;
+	}
+
+	// 签名覆盖不含TSIG记录的报文, 头部的附加区域数量减1, 事务id使用原始id
+	const tsig_key_t *k = _keys + dst->key;
+	uint8_t head[DNS_HEAD_LEN], digest[SHA256_LEN];
+	memcpy(head, msg, DNS_HEAD_LEN);
+	*(uint16_t*) head = htons(dst->id);
+	*(uint16_t*)(head + 10) = htons(arcount - 1);
+	hmac_sha256_ctx_t hmac;
+	hmac_sha256_init(&hmac, k->secret, k->len);
+	hmac_sha256_update(&hmac, head, DNS_HEAD_LEN);
+	hmac_sha256_update(&hmac, msg + DNS_HEAD_LEN, *end - DNS_HEAD_LEN);
+	tsig_mac_vars(&hmac, dst, dst->time, error, msg + rdend - other_len, other_len);
+	hmac_sha256_final(&hmac, digest);
+
+	// 不支持截断的签名, 比较时不提前结束, 避免通过耗时猜测签名
+	uint8_t diff = mac_len != SHA256_LEN;
+	for (int i = 0; i < SHA256_LEN && mac_len == SHA256_LEN; ++i)
+		diff |= digest[i] ^ mac[i];
+	if (diff) {
+		log_warn("tsig key[%s] signature invalid!", dst->name);
+		dst->error = TSIG_BADSIG;
+		return TSIG_FAILED;
+	}
+	dst->mac_len = SHA256_LEN;
+	memcpy(dst->mac, mac, SHA256_LEN);
+
+	uint64_t now = (uint64_t) time(NULL);
+	if (now + dst->fudge < dst->time || dst->time + dst->fudge < now) {
+		log_warn("tsig key[%s] time[%" PRIu64 "] out of fudge[%u], now[%" PRIu64 "]!",
+				dst->name, dst->time, dst->fudge, now);
+		dst->error = TSIG_BADTIME;
+		return TSIG_FAILED;
+	}
+	return TSIG_VALID;
+}
+
+size_t tsig_sign(uint8_t* msg, size_t len, size_t size, const tsig_t* req) {
+	uint8_t name[HOST_MAX + 1], alg[HOST_MAX + 1], mac[SHA256_LEN], other[TSIG_OTHER_LEN];
+	uint16_t nlen = dns_name_to_wire(req->name, name, sizeof(name));
+	uint16_t alen = dns_name_to_wire(req->alg, alg, sizeof(alg));
+	uint64_t now = (uint64_t) time(NULL);
+
+	// 时间错误时签名时间沿用请求的时间, other data为服务器的当前时间, 供客户端校正
+	uint64_t t = req->error == TSIG_BADTIME ? req->time : now;
+	uint16_t other_len = req->error == TSIG_BADTIME ? TSIG_OTHER_LEN : 0;
+	tsig_put_time(other, now);
+
+	// 密钥或签名错误时无法签名, 签名长度为0
+	uint16_t mac_len = req->key >= 0 && req->mac_len ? SHA256_LEN : 0;
+	if (mac_len) {
+		uint8_t prefix[2];
+		*(uint16_t*) prefix = htons(req->mac_len);
+		hmac_sha256_ctx_t hmac;
+		hmac_sha256_init(&hmac, _keys[req->key].secret, _keys[req->key].len);
+		hmac_sha256_update(&hmac, prefix, 2);
+		hmac_sha256_update(&hmac, req->mac, req->mac_len);
+		hmac_sha256_update(&hmac, msg, len);
+		tsig_mac_vars(&hmac, req, t, req->error, other, other_len);
+		hmac_sha256_final(&hmac, mac);
+	}
+
+	uint16_t rdlen = alen + TSIG_FIXED_LEN + mac_len + TSIG_TAIL_LEN + other_len;
+	if (!nlen || !alen || len + nlen + DNS_RR_HEAD_LEN + rdlen > size) {
+		log_warn("tsig sign fail: response memory no enough");
+		return 0;
+	}
+	uint8_t *p = msg + len;
+	memcpy(p, name, nlen);
+	p += nlen;
+	*(uint16_t*) p = htons(TSIG_TYPE);
+	*(uint16_t*)(p + 2) = htons(TSIG_CLASS);
+	*(uint32_t*)(p + 4) = 0;
+	*(uint16_t*)(p + 8) = htons(rdlen);
+	p += DNS_RR_HEAD_LEN;
+	memcpy(p, alg, alen);
+	p += alen;
+	tsig_put_time(p, t);
+	*(uint16_t*)(p + 6) = htons(req->fudge);
+	*(uint16_t*)(p + 8) = htons(mac_len);
+	p += TSIG_FIXED_LEN;
+	memcpy(p, mac, mac_len);
+	p += mac_len;
+	*(uint16_t*) p = htons(req->id);
+	*(uint16_t*)(p + 2) = htons(req->error);
+	*(uint16_t*)(p + 4) = htons(other_len);
+	p += TSIG_TAIL_LEN;
+	memcpy(p, other, other_len);
+	p += other_len;
+
+	uint16_t arcount = ntohs(*(uint16_t*)(msg + 10));
+	*(uint16_t*)(msg + 10) = htons(arcount + 1);
+	return p - msg;
+}
+
+// #define TSIG_TEST
+#ifdef TSIG_TEST
+#include <assert.h>
+
+/** dnspython生成的签名更新请求: 区域a.com, 添加www.a.com 300 A 1.2.3.4,
+ *  密钥k1, 密钥内容secretsecretsecretsecret, 签名时间1700000000, 误差300 */
+static const uint8_t _req[] = {
+	0x12, 0x34, 0x28, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x01, 0x61, 0x03, 0x63,
+	0x6f, 0x6d, 0x00, 0x00, 0x06, 0x00, 0x01, 0x03, 0x77, 0x77, 0x77, 0xc0, 0x0c, 0x00, 0x01, 0x00,
+	0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0x01, 0x02, 0x03, 0x04, 0x02, 0x6b, 0x31, 0x00, 0x00,
+	0xfa, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3d, 0x0b, 0x68, 0x6d, 0x61, 0x63, 0x2d, 0x73,
+	0x68, 0x61, 0x32, 0x35, 0x36, 0x00, 0x00, 0x00, 0x65, 0x53, 0xf1, 0x00, 0x01, 0x2c, 0x00, 0x20,
+	0xc5, 0x21, 0xbe, 0xf7, 0x0a, 0x30, 0x30, 0x7b, 0x32, 0xf2, 0x8e, 0xb5, 0x0d, 0x84, 0xd3, 0x95,
+	0xbe, 0xb3, 0xf6, 0x15, 0x68, 0x20, 0x8f, 0x25, 0x48, 0xc9, 0x41, 0xff, 0xab, 0xa0, 0xf0, 0xbd,
+	0x12, 0x34, 0x00, 0x00, 0x00, 0x00 };
+/** 请求中TSIG记录的偏移地址及签名的偏移地址 */
+#define REQ_TSIG_OFF 43
+#define REQ_MAC_OFF 80
+/** 请求的头部及区域部分长度 */
+#define REQ_ZONE_END 23
+
+static uint64_t test_time(const uint8_t* p) {
+	uint64_t t = 0;
+	for (int i = 0; i < 6; ++i) t = t << 8 | p[i];
+	return t;
+}
+
+int main() {
+	uint8_t msg[sizeof(_req)];
+	size_t end;
+	tsig_t t;
+
+	// 密钥未配置时是BADKEY, 配置后签名正确但时间早已超出误差, 是BADTIME, 说明签名校验已通过
+	assert(tsig_verify(_req, sizeof(_req), &end, &t) == TSIG_FAILED && t.error == TSIG_BADKEY && t.key < 0);
+	assert(!tsig_add_key("hmac-md5:k1:c2VjcmV0") && !tsig_add_key("k1:") && !tsig_add_key("k1:#"));
+	assert(tsig_add_key("hmac-sha256:K1.:c2VjcmV0c2VjcmV0c2VjcmV0c2VjcmV0") && tsig_key_count() == 1);
+	assert(tsig_verify(_req, sizeof(_req), &end, &t) == TSIG_FAILED && t.error == TSIG_BADTIME);
+	assert(end == REQ_TSIG_OFF && t.key == 0 && t.time == 1700000000 && t.fudge == 300 && t.id == 0x1234);
+	assert(!strcmp(t.name, "k1") && !strcmp(t.alg, "hmac-sha256"));
+	assert(t.mac_len == SHA256_LEN && !memcmp(t.mac, _req + REQ_MAC_OFF, SHA256_LEN));
+
+	// 篡改任意一个字节(更新记录的ip)都是BADSIG, 签名错误的请求不保存签名
+	memcpy(msg, _req, sizeof(_req));
+	msg[42] ^= 1;
+	assert(tsig_verify(msg, sizeof(msg), &end, &t) == TSIG_FAILED && t.error == TSIG_BADSIG && !t.mac_len);
+	memcpy(msg, _req, sizeof(_req));
+	msg[REQ_MAC_OFF + SHA256_LEN - 1] ^= 1;
+	assert(tsig_verify(msg, sizeof(msg), &end, &t) == TSIG_FAILED && t.error == TSIG_BADSIG);
+
+	// 没有附加记录时是未签名, 签名记录长度与报文不符时是格式错误
+	memcpy(msg, _req, sizeof(_req));
+	msg[11] = 0;
+	assert(tsig_verify(msg, REQ_TSIG_OFF, &end, &t) == TSIG_UNSIGNED);
+	assert(tsig_verify(_req, sizeof(_req) - 1, &end, &t) == TSIG_MALFORMED);
+
+	// BADTIME的应答要签名, 签名时间沿用请求的时间, other data是服务器时间
+	assert(tsig_verify(_req, sizeof(_req), &end, &t) == TSIG_FAILED && t.error == TSIG_BADTIME);
+	uint8_t res[512], plain[REQ_ZONE_END];
+	memcpy(res, _req, REQ_ZONE_END);
+	res[2] = 0xA8, res[3] = 9;
+	res[8] = res[9] = 0, res[10] = res[11] = 0;
+	memcpy(plain, res, REQ_ZONE_END);
+	assert(!tsig_sign(res, REQ_ZONE_END, REQ_ZONE_END + 40, &t));
+	uint64_t now = (uint64_t) time(NULL);
+	size_t n = tsig_sign(res, REQ_ZONE_END, sizeof(res), &t);
+	const uint8_t *r = res + REQ_ZONE_END;
+	static const uint8_t owner[] = { 2, 'k', '1', 0, 0, 250, 0, 255, 0, 0, 0, 0 };
+	static const uint8_t alg[] = { 11, 'h', 'm', 'a', 'c', '-', 's', 'h', 'a', '2', '5', '6', 0 };
+	assert(res[11] == 1 && !memcmp(r, owner, sizeof(owner)) && !memcmp(r + 14, alg, sizeof(alg)));
+	r += 14 + sizeof(alg);
+	assert(test_time(r) == 1700000000 && r[6] == 1 && r[7] == 44 && r[8] == 0 && r[9] == SHA256_LEN);
+	const uint8_t *mac = r + 10, *tail = mac + SHA256_LEN;
+	assert(tail[0] == 0x12 && tail[1] == 0x34 && tail[2] == 0 && tail[3] == TSIG_BADTIME);
+	assert(tail[4] == 0 && tail[5] == 6 && test_time(tail + 6) - now <= 1 && tail + 12 == res + n);
+	assert(r[-15] == 0 && r[-14] == n - REQ_ZONE_END - 14);
+
+	// 按RFC 8945 4.3计算应答签名: 请求签名长度及签名 + 不含TSIG记录的应答 + TSIG变量
+	uint8_t prefix[2] = { 0, SHA256_LEN }, digest[SHA256_LEN];
+	hmac_sha256_ctx_t hmac;
+	hmac_sha256_init(&hmac, "secretsecretsecretsecret", 24);
+	hmac_sha256_update(&hmac, prefix, 2);
+	hmac_sha256_update(&hmac, _req + REQ_MAC_OFF, SHA256_LEN);
+	hmac_sha256_update(&hmac, plain, REQ_ZONE_END);
+	hmac_sha256_update(&hmac, owner, 4);
+	hmac_sha256_update(&hmac, owner + 6, 6);
+	hmac_sha256_update(&hmac, alg, sizeof(alg));
+	hmac_sha256_update(&hmac, r, 8);
+	hmac_sha256_update(&hmac, tail + 2, 10);
+	hmac_sha256_final(&hmac, digest);
+	assert(!memcmp(mac, digest, SHA256_LEN));
+
+	// 密钥或签名错误时应答不签名
+	t.mac_len = 0, t.error = TSIG_BADSIG;
+	n = tsig_sign(res, REQ_ZONE_END, sizeof(res), &t);
+	assert(res[REQ_ZONE_END + 14 + sizeof(alg) + 9] == 0 && n == REQ_ZONE_END + 14 + sizeof(alg) + 10 + 6);
+
+	printf("test success\n");
+	return 0;
+}
+#endif // TSIG_TEST
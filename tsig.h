@@ -0,0 +1,78 @@
+/** 事务签名(RFC 8945 TSIG), 使用HMAC-SHA256校验动态更新请求并对应答签名
+ *  密钥格式与nsupdate -y参数相同: [hmac-sha256:]密钥名:base64编码的密钥
+ */
+#pragma once
+#ifndef __TSIG_H__
+#define __TSIG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dnsproto.h"
+#include "sha256.h"
+
+/** 允许配置的最大密钥数量 */
+#define TSIG_KEY_MAX 8
+/** 密钥的最大字节数 */
+#define TSIG_SECRET_MAX 128
+/** 默认允许的时间误差, 秒为单位 */
+#define TSIG_FUDGE 300
+
+/** TSIG记录中的错误码, 应答的返回码为NOTAUTH */
+enum tsig_error_t {
+	TSIG_NOERROR = 0,
+	TSIG_BADSIG = 16,				// 签名错误
+	TSIG_BADKEY = 17,				// 密钥或算法不认识
+	TSIG_BADTIME = 18				// 签名时间超出允许的误差
+};
+
+/** 请求校验结果 */
+typedef enum {
+	TSIG_VALID,						// 签名有效
+	TSIG_UNSIGNED,					// 请求没有TSIG记录
+	TSIG_MALFORMED,					// TSIG记录格式错误, 应答FORMERR
+	TSIG_FAILED						// 校验失败, 应答NOTAUTH并附带TSIG错误码
+} tsig_result_t;
+
+/** 请求中TSIG记录的内容, 用于生成应答的签名 */
+typedef struct tsig_t {
+	int			key;				// 使用的密钥序号, -1表示密钥不认识
+	char		name[HOST_MAX];		// 密钥名, 已转为小写
+	char		alg[HOST_MAX];		// 算法名, 已转为小写
+	uint64_t	time;				// 请求的签名时间, 秒为单位
+	uint16_t	fudge;				// 允许的时间误差
+	uint16_t	id;					// 签名时的原始事务id
+	uint16_t	error;				// 校验的错误码, TSIG_NOERROR表示有效
+	uint16_t	mac_len;			// 请求的签名长度
+	uint8_t		mac[SHA256_LEN];	// 请求的签名, 应答签名时要包含
+} tsig_t;
+
+/** 添加密钥
+ * @param spec 密钥, 格式为 [hmac-sha256:]密钥名:base64编码的密钥
+ * @return true: 成功, false: 格式错误或密钥数量超出上限
+ */
+extern bool tsig_add_key(const char* spec);
+
+/** 获取已配置的密钥数量 */
+extern uint32_t tsig_key_count(void);
+
+/** 校验请求的TSIG记录, TSIG记录必须是附加区域的最后一条记录
+ * @param msg 请求报文
+ * @param len 请求报文长度
+ * @param end 回写TSIG记录的起始偏移地址, 即不含签名的报文长度
+ * @param dst 回写TSIG记录的内容
+ * @return 校验结果
+ */
+extern tsig_result_t tsig_verify(const uint8_t* msg, size_t len, size_t* end, tsig_t* dst);
+
+/** 在应答报文末尾追加TSIG记录, 附加区域数量加1, 请求校验通过或时间错误时签名, 密钥或签名错误时不签名
+ * @param msg 应答报文, 头部的事务id应与请求的原始id相同
+ * @param len 应答报文长度
+ * @param size 应答报文地址的可写长度
+ * @param req 请求的TSIG记录内容
+ * @return 追加后的报文长度, 0: 可写长度不足
+ */
+extern size_t tsig_sign(uint8_t* msg, size_t len, size_t size, const tsig_t* req);
+
+#endif // __TSIG_H__
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "upstream.h"
+
+/** 失败率超过该千分比的上游服务器视为不健康 */
+#define UPSTREAM_UNHEALTHY 500
+/** 失败率的衰减间隔, 毫秒为单位, 使不健康的服务器在一段时间后重新被选择 */
+#define UPSTREAM_DECAY_INTERVAL 5000
+/** tcp连接的空闲关闭时间, 毫秒为单位 */
+#define UPSTREAM_TCP_IDLE 30000
+/** tcp连接有未完成查询时, 超过该时间没有任何数据则认为连接已失效, 毫秒为单位 */
+#define UPSTREAM_TCP_STALL 10000
+/** tcp连接发送缓冲区的大小 */
+#define UPSTREAM_TCP_WBUF 4096
+/** tcp连接接收缓冲区的大小, 可容纳一个最大的dns报文及长度前缀 */
+#define UPSTREAM_TCP_RBUF (2 + 65535)
+
+/** 到上游服务器的tcp连接 */
+typedef struct upstream_tcp_t {
+	socket_t		fd;					// 连接socket, -1表示未连接
+	bool			connecting;			// 非阻塞连接正在建立
+	uint32_t		inflight;			// 已发送未收到应答的查询数量
+	uint64_t		active;				// 最后一次收发数据的时间
+	uint32_t		wlen;				// 发送缓冲区中待发送的数据长度
+	uint32_t		rlen;				// 接收缓冲区中已接收的数据长度
+	uint8_t			*rbuf;				// 接收缓冲区, 连接时分配
+	uint8_t			wbuf[UPSTREAM_TCP_WBUF];	// 发送缓冲区
+} upstream_tcp_t;
+
+/** 上游服务器 */
+typedef struct upstream_t {
+	sockaddr_in_t	addr;				// 服务器地址
+	uint32_t		srtt;				// 平滑往返时间, 微秒为单位, 0表示尚未测量
+	uint32_t		fail_rate;			// 指数加权的失败率, 千分比
+	uint64_t		queries;			// 成功的查询数量
+	uint64_t		failures;			// 失败的查询数量
+	upstream_tcp_t	tcp;				// tcp连接
+} upstream_t;
+
+static upstream_t _ups[UPSTREAM_MAX];
+static int _count = 0;
+static uint64_t _decay_next = 0;
+
+bool upstream_add(const char* text) {
+	char ip[32];
+	const char *colon = strchr(text, ':');
+	size_t n = colon ? (size_t) (colon - text) : strlen(text);
+	int port = colon ? atoi(colon + 1) : 53;
+	if (_count >= UPSTREAM_MAX || n >= sizeof(ip) || port <= 0 || port > 65535)
+		return false;
+
+	memcpy(ip, text, n);
+	ip[n] = '\0';
+	uint32_t addr = net_ip_fromstring(ip);
+	if (addr == INADDR_NONE) return false;
+
+	upstream_t *u = _ups + _count++;
+	memset(u, 0, sizeof(*u));
+	u->addr.sin_family = AF_INET;
+	u->addr.sin_addr.s_addr = addr;
+	u->addr.sin_port = htons((uint16_t) port);
+	u->tcp.fd = -1;
+	return true;
+}
+
+int upstream_count() {
+	return _count;
+}
+
+const sockaddr_in_t* upstream_addr(int idx) {
+	return &_ups[idx].addr;
+}
+
+int upstream_find(const sockaddr_in_t* addr) {
+	for (int i = 0; i < _count; ++i)
+		if (_ups[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && _ups[i].addr.sin_port == addr->sin_port)
+			return i;
+	return -1;
+}
+
+int upstream_select(unsigned exclude) {
+	int best = -1;
+	bool best_healthy = false;
+	for (int i = 0; i < _count; ++i) {
+		if (exclude & (1u << i)) continue;
+		const upstream_t *u = _ups + i;
+		bool healthy = u->fail_rate < UPSTREAM_UNHEALTHY;
+		if (best < 0 || (healthy && !best_healthy)
+				|| (healthy && u->srtt < _ups[best].srtt)
+				|| (!healthy && !best_healthy && u->fail_rate < _ups[best].fail_rate)) {
+			best = i;
+			best_healthy = healthy;
+		}
+	}
+
+	// 未被选中的服务器往返时间缓慢衰减, 使较慢的服务器过一段时间后重新被测量
+	for (int i = 0; i < _count; ++i)
+		if (i != best) _ups[i].srtt -= _ups[i].srtt >> 6;
+	return best;
+}
+
+void upstream_success(int idx, uint64_t rtt) {
+	upstream_t *u = _ups + idx;
+	uint32_t us = rtt > 60000 ? 60000000 : (uint32_t) rtt * 1000;
+	u->srtt = u->srtt ? u->srtt - (u->srtt >> 3) + (us >> 3) : us + 1;
+	u->fail_rate -= u->fail_rate >> 3;
+	++u->queries;
+}
+
+void upstream_failure(int idx) {
+	upstream_t *u = _ups + idx;
+	u->fail_rate = u->fail_rate - (u->fail_rate >> 3) + 1000 / 8;
+	++u->failures;
+}
+
+/** 关闭tcp连接, 未完成的查询由转发模块超时后重试 */
+static void upstream_tcp_close(upstream_t* u) {
+	upstream_tcp_t *t = &u->tcp;
+	if (t->fd != -1) {
+		log_debug("upstream %s close tcp connection, inflight %u", net_ip_tostring(u->addr.sin_addr.s_addr),
+				t->inflight);
+		socket_close(t->fd);
+	}
+	free(t->rbuf);
+	t->rbuf = NULL;
+	t->fd = -1;
+	t->connecting = false;
+	t->inflight = t->wlen = t->rlen = 0;
+}
+
+/** 发起非阻塞的tcp连接 */
+static bool upstream_tcp_connect(upstream_t* u, uint64_t now) {
+	upstream_tcp_t *t = &u->tcp;
+	t->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (t->fd == -1 || !socket_set_nonblock(t->fd)) {
+		upstream_tcp_close(u);
+		return false;
+	}
+	if (connect(t->fd, (const sockaddr_t*) &u->addr, sizeof(u->addr)) != 0) {
+		if (!socket_would_block()) {
+			log_warn("upstream %s tcp connect failed", net_ip_tostring(u->addr.sin_addr.s_addr));
+			upstream_tcp_close(u);
+			return false;
+		}
+		t->connecting = true;
+	}
+	t->rbuf = malloc(UPSTREAM_TCP_RBUF);
+	t->active = now;
+	log_debug("upstream %s open tcp connection", net_ip_tostring(u->addr.sin_addr.s_addr));
+	return true;
+}
+
+/** 发送缓冲区中的数据, 出错时关闭连接 */
+static void upstream_tcp_flush(upstream_t* u) {
+	upstream_tcp_t *t = &u->tcp;
+	while (t->wlen) {
+		int n = send(t->fd, (const char*) t->wbuf, t->wlen, 0);
+		if (n <= 0) {
+			if (n < 0 && socket_would_block()) return;
+			upstream_tcp_close(u);
+			return;
+		}
+		memmove(t->wbuf, t->wbuf + n, t->wlen - n);
+		t->wlen -= n;
+	}
+}
+
+bool upstream_tcp_send(int idx, const uint8_t* msg, uint16_t len, uint64_t now) {
+	upstream_t *u = _ups + idx;
+	upstream_tcp_t *t = &u->tcp;
+	if (t->fd == -1 && !upstream_tcp_connect(u, now))
+		return false;
+	if (t->wlen + 2 + len > UPSTREAM_TCP_WBUF)
+		return false;
+
+	t->wbuf[t->wlen] = (uint8_t) (len >> 8);
+	t->wbuf[t->wlen + 1] = (uint8_t) len;
+	memcpy(t->wbuf + t->wlen + 2, msg, len);
+	t->wlen += 2 + len;
+	++t->inflight;
+	if (!t->connecting) upstream_tcp_flush(u);
+	return true;
+}
+
+socket_t upstream_fdset(fd_set* rfds, fd_set* wfds, socket_t maxfd) {
+	for (int i = 0; i < _count; ++i) {
+		upstream_tcp_t *t = &_ups[i].tcp;
+		if (t->fd == -1) continue;
+		FD_SET(t->fd, rfds);
+		if (t->connecting || t->wlen) FD_SET(t->fd, wfds);
+		if (t->fd > maxfd) maxfd = t->fd;
+	}
+	return maxfd;
+}
+
+void upstream_io(const fd_set* rfds, const fd_set* wfds, upstream_answer_func answer_func) {
+	uint64_t now = net_mstime();
+	for (int i = 0; i < _count; ++i) {
+		upstream_t *u = _ups + i;
+		upstream_tcp_t *t = &u->tcp;
+		if (t->fd == -1) continue;
+
+		if (FD_ISSET(t->fd, wfds)) {
+			if (t->connecting) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(t->fd, SOL_SOCKET, SO_ERROR, (char*) &err, &len);
+				if (err) {
+					log_warn("upstream %s tcp connect failed", net_ip_tostring(u->addr.sin_addr.s_addr));
+					upstream_tcp_close(u);
+					continue;
+				}
+				t->connecting = false;
+			}
+			t->active = now;
+			upstream_tcp_flush(u);
+			if (t->fd == -1) continue;
+		}
+
+		if (FD_ISSET(t->fd, rfds)) {
+			int n = recv(t->fd, (char*) t->rbuf + t->rlen, UPSTREAM_TCP_RBUF - t->rlen, 0);
+			if (n <= 0) {
+				if (n < 0 && socket_would_block()) continue;
+				upstream_tcp_close(u);
+				continue;
+			}
+			t->rlen += n;
+			t->active = now;
+
+			// 按2字节长度前缀拆分出完整的应答报文, 同一连接上的应答可能乱序到达, 由事务id匹配
+			while (t->rlen >= 2) {
+				uint32_t mlen = (uint32_t) t->rbuf[0] << 8 | t->rbuf[1];
+				if (t->rlen < 2 + mlen) break;
+				if (t->inflight) --t->inflight;
+				answer_func(i, t->rbuf + 2, mlen, now);
+				if (t->fd == -1) break;
+				memmove(t->rbuf, t->rbuf + 2 + mlen, t->rlen - 2 - mlen);
+				t->rlen -= 2 + mlen;
+			}
+		}
+	}
+}
+
+void upstream_timer(uint64_t now) {
+	bool decay = now >= _decay_next;
+	if (decay) _decay_next = now + UPSTREAM_DECAY_INTERVAL;
+
+	for (int i = 0; i < _count; ++i) {
+		upstream_t *u = _ups + i;
+		upstream_tcp_t *t = &u->tcp;
+		if (decay) u->fail_rate -= u->fail_rate >> 3;
+		if (t->fd != -1 && now - t->active > (t->inflight ? UPSTREAM_TCP_STALL : UPSTREAM_TCP_IDLE))
+			upstream_tcp_close(u);
+	}
+}
+
+void upstream_log_stats() {
+	for (int i = 0; i < _count; ++i) {
+		const upstream_t *u = _ups + i;
+		log_info("upstream %s:%d srtt=%u.%03ums, fail_rate=%u/1000, queries=%" PRIu64 ", failures=%" PRIu64 ", tcp=%s",
+				net_ip_tostring(u->addr.sin_addr.s_addr), ntohs(u->addr.sin_port), u->srtt / 1000,
+				u->srtt % 1000, u->fail_rate, u->queries, u->failures, u->tcp.fd != -1 ? "open" : "closed");
+	}
+}
+
+void upstream_stop() {
+	for (int i = 0; i < _count; ++i)
+		upstream_tcp_close(_ups + i);
+}
@@ -0,0 +1,77 @@
+/** 上游服务器管理, 记录每个上游服务器的平滑往返时间及失败率, 按测量结果选择最快的健康服务器,
+ *  并为每个上游服务器维护可复用的tcp连接, 用于重新查询被截断的应答, 同一连接上可同时发送多个查询
+ */
+#pragma once
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "net.h"
+
+/** 允许配置的最大上游服务器数量 */
+#define UPSTREAM_MAX 4
+
+/** tcp连接收到完整应答报文时的回调接口
+ * @param idx 上游服务器序号
+ * @param msg 应答报文, 不包含tcp的2字节长度前缀
+ * @param len 应答报文长度
+ * @param now 当前时间, 毫秒为单位
+ */
+typedef void (*upstream_answer_func) (int idx, const uint8_t* msg, size_t len, uint64_t now);
+
+/** 添加上游服务器
+ * @param text 上游服务器地址, 格式为 ip[:port], 端口默认53
+ * @return true: 成功, false: 地址格式错误或超出最大数量
+ */
+extern bool upstream_add(const char* text);
+
+/** 获取已配置的上游服务器数量 */
+extern int upstream_count();
+
+/** 获取上游服务器地址 */
+extern const sockaddr_in_t* upstream_addr(int idx);
+
+/** 根据地址查找上游服务器序号, 找不到时返回-1 */
+extern int upstream_find(const sockaddr_in_t* addr);
+
+/** 选择上游服务器, 优先选择平滑往返时间最小的健康服务器, 没有健康服务器时选择失败率最低的服务器
+ * @param exclude 排除的服务器序号位图, 第n位为1表示排除序号为n的服务器
+ * @return 服务器序号, -1: 全部被排除
+ */
+extern int upstream_select(unsigned exclude);
+
+/** 记录一次成功的查询及其往返时间, 毫秒为单位 */
+extern void upstream_success(int idx, uint64_t rtt);
+
+/** 记录一次失败的查询(超时或服务器错误) */
+extern void upstream_failure(int idx);
+
+/** 通过上游服务器的tcp连接发送查询, 连接不存在时发起非阻塞连接, 连接建立前查询在发送缓冲区中等待
+ * @param idx 上游服务器序号
+ * @param msg 查询报文, 不包含tcp的2字节长度前缀
+ * @param len 查询报文长度
+ * @param now 当前时间, 毫秒为单位
+ * @return true: 已发送或已进入发送缓冲区, false: 连接失败或发送缓冲区已满
+ */
+extern bool upstream_tcp_send(int idx, const uint8_t* msg, uint16_t len, uint64_t now);
+
+/** 把tcp连接加入select的等待集合
+ * @return 已加入集合及maxfd中的最大值
+ */
+extern socket_t upstream_fdset(fd_set* rfds, fd_set* wfds, socket_t maxfd);
+
+/** 处理select返回后可读写的tcp连接, 收到的完整应答报文通过回调接口处理 */
+extern void upstream_io(const fd_set* rfds, const fd_set* wfds, upstream_answer_func answer_func);
+
+/** 定时调用, 关闭空闲或无响应的tcp连接, 使失败率随时间衰减 */
+extern void upstream_timer(uint64_t now);
+
+/** 把每个上游服务器的统计信息输出到日志 */
+extern void upstream_log_stats();
+
+/** 关闭全部tcp连接 */
+extern void upstream_stop();
+
+#endif // __UPSTREAM_H__
@@ -18,15 +18,17 @@ static SERVICE_STATUS          gSvcStatus;
 static SERVICE_STATUS_HANDLE   gSvcStatusHandle;
 
 extern int run();
+extern void stop();
 
 void WINAPI SvcCtrlHandler(DWORD dwCtrl) {
 	// Handle the requested control code. 
 	switch (dwCtrl) {
 		case SERVICE_CONTROL_STOP:
 		case SERVICE_CONTROL_SHUTDOWN:
+			// 通知服务循环退出, 循环结束并转储缓存后由SvcMain设置为已停止
+			stop();
 			gSvcStatus.dwWin32ExitCode = 0;
-			gSvcStatus.dwCurrentState = SERVICE_STOPPED;
-			log_debug("stop service success");
+			gSvcStatus.dwCurrentState = SERVICE_STOP_PENDING;
 			break;
 		default:
 			gSvcStatus.dwCurrentState = SERVICE_RUNNING;
@@ -53,6 +55,10 @@ void WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv) {
 
 	log_debug("start service success");
 	run();
+
+	gSvcStatus.dwCurrentState = SERVICE_STOPPED;
+	SetServiceStatus(gSvcStatusHandle, &gSvcStatus);
+	log_debug("stop service success");
 }
 
 void svc_start() {
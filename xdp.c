@@ -0,0 +1,641 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "net.h"
+#include "dnsproto.h"
+#include "xdp.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_ether.h>
+
+/** 报文中各头部的偏移地址, 只处理不带vlan标签的以太网帧及不带选项的ipv4头部 */
+#define XDP_IP_OFF 14
+#define XDP_UDP_OFF (XDP_IP_OFF + 20)
+#define XDP_DNS_OFF (XDP_UDP_OFF + 8)
+#define XDP_QNAME_OFF (XDP_DNS_OFF + DNS_HEAD_LEN)
+/** 应答记录的长度: 压缩指针(2) type(2) class(2) ttl(4) rdlength(2) ip(4) */
+#define XDP_ANSWER_LEN (2 + DNS_RR_HEAD_LEN + 4)
+/** 生成的XDP程序的最大指令数 */
+#define XDP_INSNS_MAX 1024
+/** 栈上变量的偏移地址: 哈希表的键, 查找到的记录, 统计表的键 */
+#define XDP_STACK_KEY (-XDP_NAME_MAX)
+#define XDP_STACK_VALUE (XDP_STACK_KEY - 8)
+#define XDP_STACK_STATS (XDP_STACK_VALUE - 4)
+/** 服务socket交接时旧进程的XDP程序卸载前挂载会失败, 重试的次数及间隔, 毫秒为单位 */
+#define XDP_ATTACH_RETRY 20
+#define XDP_ATTACH_INTERVAL 50
+/** 统计信息的输出间隔, 毫秒为单位 */
+#define XDP_STATS_INTERVAL (60 * 1000)
+
+/** 指令的构造宏, 与内核源码中的同名宏含义相同 */
+#define INSN(c, d, s, o, i) ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV_REG(d, s) INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i) INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ALU_REG(op, d, s) INSN(BPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+#define ALU_IMM(op, d, i) INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define TO_BE16(d) INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define LDX(sz, d, s, o) INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define STX(sz, d, s, o) INSN(BPF_STX | (sz) | BPF_MEM, d, s, o, 0)
+#define ST(sz, d, o, i) INSN(BPF_ST | (sz) | BPF_MEM, d, 0, o, i)
+#define JMP_REG(op, d, s) INSN(BPF_JMP | (op) | BPF_X, d, s, 0, 0)
+#define JMP_IMM(op, d, i) INSN(BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+#define JMP32_IMM(op, d, i) INSN(BPF_JMP32 | (op) | BPF_K, d, 0, 0, i)
+#define JMP_ALWAYS() INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+#define CALL(f) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/** 跳转目标 */
+typedef enum { XDP_L_NAME, XDP_L_TX, XDP_L_PASS, XDP_L_DROP, XDP_LABELS } xdp_label_t;
+
+/** 生成程序时的指令缓冲区, 跳转指令先记录目标, 生成结束后回填偏移量 */
+typedef struct xdp_asm_t {
+	struct bpf_insn	insns[XDP_INSNS_MAX];
+	uint32_t		len;
+	uint32_t		labels[XDP_LABELS];
+	uint32_t		fixups[XDP_INSNS_MAX];	// 每条跳转指令的目标, 加1存放, 0表示不需要回填
+} xdp_asm_t;
+
+/** BPF哈希表的值, 都是网络字节序, 可以直接写入应答 */
+typedef struct xdp_value_t {
+	uint32_t ip;
+	uint32_t ttl;
+} xdp_value_t;
+
+static int _names_fd = -1, _stats_fd = -1, _prog_fd = -1, _link_fd = -1;
+static uint32_t _cpus = 1;
+static uint64_t _answered = 0;		// 上次输出统计信息时XDP程序应答的累计数量
+static uint64_t _stats_next = 0;
+static bool _full_logged = false;
+
+static inline int xdp_bpf(int cmd, union bpf_attr* attr) {
+	return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static inline void xdp_emit(xdp_asm_t* a, struct bpf_insn insn) {
+	if (a->len < XDP_INSNS_MAX) a->insns[a->len++] = insn;
+}
+
+static inline void xdp_jump(xdp_asm_t* a, struct bpf_insn insn, xdp_label_t label) {
+	if (a->len < XDP_INSNS_MAX) a->fixups[a->len] = label + 1;
+	xdp_emit(a, insn);
+}
+
+static inline void xdp_label(xdp_asm_t* a, xdp_label_t label) {
+	a->labels[label] = a->len;
+}
+
+/** 加载BPF表描述符的64位立即数指令, 占两条指令的位置 */
+static inline void xdp_ld_map(xdp_asm_t* a, uint8_t reg, int fd) {
+	xdp_emit(a, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, fd));
+	xdp_emit(a, INSN(0, 0, 0, 0, 0));
+}
+
+/** 生成XDP程序, 寄存器用途: r6 上下文, r7 报文开始, r8 报文结束, r9 问题区域结束的偏移地址
+ *  报文的读取都使用常量偏移, 域名逐字节展开读取, 每个字节前检查一次报文边界, 使校验器能确认访问都在报文范围内
+ */
+static void xdp_build(xdp_asm_t* a, uint16_t port) {
+	memset(a, 0, sizeof(*a));
+	xdp_emit(a, MOV_REG(6, 1));
+	xdp_emit(a, LDX(BPF_W, 7, 6, offsetof(struct xdp_md, data)));
+	xdp_emit(a, LDX(BPF_W, 8, 6, offsetof(struct xdp_md, data_end)));
+
+	// 以太网、ip、udp及dns头部必须完整, ipv4不带选项、不是分片, 发往服务端口
+	xdp_emit(a, MOV_REG(1, 7));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 1, XDP_QNAME_OFF));
+	xdp_jump(a, JMP_REG(BPF_JGT, 1, 8), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_H, 0, 7, 12));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, htons(ETH_P_IP)), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_B, 0, 7, XDP_IP_OFF));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, 0x45), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_B, 0, 7, XDP_IP_OFF + 9));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, IPPROTO_UDP), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_H, 0, 7, XDP_IP_OFF + 6));
+	xdp_emit(a, ALU_IMM(BPF_AND, 0, htons(0x3FFF)));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, 0), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_H, 0, 7, XDP_UDP_OFF + 2));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, htons(port)), XDP_L_PASS);
+
+	// 标准查询: QR、操作码、TC标志都为0, 只有一个问题, 没有其它记录, 带EDNS的查询由用户空间处理cookie及OPT记录
+	xdp_emit(a, LDX(BPF_B, 0, 7, XDP_DNS_OFF + 2));
+	xdp_emit(a, ALU_IMM(BPF_AND, 0, 0xFA));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, 0), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_H, 0, 7, XDP_DNS_OFF + 4));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, htons(1)), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_W, 0, 7, XDP_DNS_OFF + 6));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, 0), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_H, 0, 7, XDP_DNS_OFF + 10));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, 0), XDP_L_PASS);
+
+	// 线路格式的域名复制到栈上作为哈希表的键, 不足部分填0, 遇到结尾的0字节时记录问题区域的结束位置
+	for (int i = 0; i < XDP_NAME_MAX; i += 8)
+		xdp_emit(a, ST(BPF_DW, 10, XDP_STACK_KEY + i, 0));
+	for (int i = 0; i < XDP_NAME_MAX; ++i) {
+		xdp_emit(a, MOV_REG(1, 7));
+		xdp_emit(a, ALU_IMM(BPF_ADD, 1, XDP_QNAME_OFF + i + 1));
+		xdp_jump(a, JMP_REG(BPF_JGT, 1, 8), XDP_L_PASS);
+		xdp_emit(a, LDX(BPF_B, 0, 7, XDP_QNAME_OFF + i));
+		xdp_emit(a, STX(BPF_B, 10, 0, XDP_STACK_KEY + i));
+		xdp_emit(a, MOV_IMM(9, XDP_QNAME_OFF + i + 1 + 4));
+		xdp_jump(a, JMP_IMM(BPF_JEQ, 0, 0), XDP_L_NAME);
+	}
+	xdp_jump(a, JMP_ALWAYS(), XDP_L_PASS);
+
+	// 查询类型及类必须是A、IN
+	xdp_label(a, XDP_L_NAME);
+	xdp_emit(a, MOV_REG(1, 7));
+	xdp_emit(a, ALU_REG(BPF_ADD, 1, 9));
+	xdp_jump(a, JMP_REG(BPF_JGT, 1, 8), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_W, 0, 1, -4));
+	xdp_jump(a, JMP32_IMM(BPF_JNE, 0, htonl(DNS_QT_A << 16 | 1)), XDP_L_PASS);
+	xdp_ld_map(a, 1, _names_fd);
+	xdp_emit(a, MOV_REG(2, 10));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 2, XDP_STACK_KEY));
+	xdp_emit(a, CALL(BPF_FUNC_map_lookup_elem));
+	xdp_jump(a, JMP_IMM(BPF_JEQ, 0, 0), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_DW, 1, 0, 0));
+	xdp_emit(a, STX(BPF_DW, 10, 1, XDP_STACK_VALUE));
+
+	// 去掉问题区域之后的内容, 在报文尾部扩展出应答记录的空间, 之后报文指针需要重新读取
+	xdp_emit(a, MOV_REG(2, 9));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 2, XDP_ANSWER_LEN));
+	xdp_emit(a, MOV_REG(1, 8));
+	xdp_emit(a, ALU_REG(BPF_SUB, 1, 7));
+	xdp_emit(a, ALU_REG(BPF_SUB, 2, 1));
+	xdp_emit(a, MOV_REG(1, 6));
+	xdp_emit(a, CALL(BPF_FUNC_xdp_adjust_tail));
+	xdp_jump(a, JMP_IMM(BPF_JNE, 0, 0), XDP_L_PASS);
+	xdp_emit(a, LDX(BPF_W, 7, 6, offsetof(struct xdp_md, data)));
+	xdp_emit(a, LDX(BPF_W, 8, 6, offsetof(struct xdp_md, data_end)));
+	xdp_emit(a, MOV_REG(1, 7));
+	xdp_emit(a, ALU_REG(BPF_ADD, 1, 9));
+	xdp_emit(a, MOV_REG(2, 1));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 2, XDP_ANSWER_LEN));
+	xdp_jump(a, JMP_REG(BPF_JGT, 2, 8), XDP_L_DROP);
+
+	// 应答记录: 压缩指针指向问题中的域名, 与用户空间的应答一致
+	xdp_emit(a, ST(BPF_H, 1, 0, htons(0xC000 | DNS_HEAD_LEN)));
+	xdp_emit(a, ST(BPF_H, 1, 2, htons(DNS_QT_A)));
+	xdp_emit(a, ST(BPF_H, 1, 4, htons(1)));
+	xdp_emit(a, LDX(BPF_W, 2, 10, XDP_STACK_VALUE + (int) offsetof(xdp_value_t, ttl)));
+	xdp_emit(a, STX(BPF_W, 1, 2, 6));
+	xdp_emit(a, ST(BPF_H, 1, 10, htons(4)));
+	xdp_emit(a, LDX(BPF_W, 2, 10, XDP_STACK_VALUE + (int) offsetof(xdp_value_t, ip)));
+	xdp_emit(a, STX(BPF_W, 1, 2, 12));
+
+	// dns头部: 授权应答, 一个回答记录
+	xdp_emit(a, ST(BPF_B, 7, XDP_DNS_OFF + 2, 0x84));
+	xdp_emit(a, ST(BPF_B, 7, XDP_DNS_OFF + 3, 0));
+	xdp_emit(a, ST(BPF_H, 7, XDP_DNS_OFF + 6, htons(1)));
+
+	// udp头部: 交换端口, 更新长度, 不计算校验和
+	xdp_emit(a, LDX(BPF_H, 2, 7, XDP_UDP_OFF));
+	xdp_emit(a, LDX(BPF_H, 3, 7, XDP_UDP_OFF + 2));
+	xdp_emit(a, STX(BPF_H, 7, 3, XDP_UDP_OFF));
+	xdp_emit(a, STX(BPF_H, 7, 2, XDP_UDP_OFF + 2));
+	xdp_emit(a, MOV_REG(2, 9));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 2, XDP_ANSWER_LEN - XDP_UDP_OFF));
+	xdp_emit(a, TO_BE16(2));
+	xdp_emit(a, STX(BPF_H, 7, 2, XDP_UDP_OFF + 4));
+	xdp_emit(a, ST(BPF_H, 7, XDP_UDP_OFF + 6, 0));
+
+	// ip头部: 交换地址, 更新长度及生存时间, 重新计算校验和, 反码求和与字节序无关, 按主机字节序读写即可
+	xdp_emit(a, LDX(BPF_W, 2, 7, XDP_IP_OFF + 12));
+	xdp_emit(a, LDX(BPF_W, 3, 7, XDP_IP_OFF + 16));
+	xdp_emit(a, STX(BPF_W, 7, 3, XDP_IP_OFF + 12));
+	xdp_emit(a, STX(BPF_W, 7, 2, XDP_IP_OFF + 16));
+	xdp_emit(a, MOV_REG(2, 9));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 2, XDP_ANSWER_LEN - XDP_IP_OFF));
+	xdp_emit(a, TO_BE16(2));
+	xdp_emit(a, STX(BPF_H, 7, 2, XDP_IP_OFF + 2));
+	xdp_emit(a, ST(BPF_B, 7, XDP_IP_OFF + 8, 64));
+	xdp_emit(a, ST(BPF_H, 7, XDP_IP_OFF + 10, 0));
+	xdp_emit(a, MOV_IMM(2, 0));
+	for (int i = 0; i < 20; i += 2) {
+		xdp_emit(a, LDX(BPF_H, 3, 7, XDP_IP_OFF + i));
+		xdp_emit(a, ALU_REG(BPF_ADD, 2, 3));
+	}
+	for (int i = 0; i < 2; ++i) {
+		xdp_emit(a, MOV_REG(3, 2));
+		xdp_emit(a, ALU_IMM(BPF_RSH, 3, 16));
+		xdp_emit(a, ALU_IMM(BPF_AND, 2, 0xFFFF));
+		xdp_emit(a, ALU_REG(BPF_ADD, 2, 3));
+	}
+	xdp_emit(a, ALU_IMM(BPF_XOR, 2, 0xFFFF));
+	xdp_emit(a, STX(BPF_H, 7, 2, XDP_IP_OFF + 10));
+
+	// 以太网头部: 交换地址
+	xdp_emit(a, LDX(BPF_W, 2, 7, 0));
+	xdp_emit(a, LDX(BPF_H, 3, 7, 4));
+	xdp_emit(a, LDX(BPF_W, 4, 7, 6));
+	xdp_emit(a, LDX(BPF_H, 5, 7, 10));
+	xdp_emit(a, STX(BPF_W, 7, 4, 0));
+	xdp_emit(a, STX(BPF_H, 7, 5, 4));
+	xdp_emit(a, STX(BPF_W, 7, 2, 6));
+	xdp_emit(a, STX(BPF_H, 7, 3, 10));
+
+	// 每个cpu各自累计应答数量, 不需要原子操作
+	xdp_emit(a, ST(BPF_W, 10, XDP_STACK_STATS, 0));
+	xdp_ld_map(a, 1, _stats_fd);
+	xdp_emit(a, MOV_REG(2, 10));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 2, XDP_STACK_STATS));
+	xdp_emit(a, CALL(BPF_FUNC_map_lookup_elem));
+	xdp_jump(a, JMP_IMM(BPF_JEQ, 0, 0), XDP_L_TX);
+	xdp_emit(a, LDX(BPF_DW, 1, 0, 0));
+	xdp_emit(a, ALU_IMM(BPF_ADD, 1, 1));
+	xdp_emit(a, STX(BPF_DW, 0, 1, 0));
+
+	xdp_label(a, XDP_L_TX);
+	xdp_emit(a, MOV_IMM(0, XDP_TX));
+	xdp_emit(a, EXIT());
+	xdp_label(a, XDP_L_PASS);
+	xdp_emit(a, MOV_IMM(0, XDP_PASS));
+	xdp_emit(a, EXIT());
+	xdp_label(a, XDP_L_DROP);
+	xdp_emit(a, MOV_IMM(0, XDP_DROP));
+	xdp_emit(a, EXIT());
+
+	for (uint32_t i = 0; i < a->len; ++i)
+		if (a->fixups[i]) a->insns[i].off = (int16_t) (a->labels[a->fixups[i] - 1] - i - 1);
+}
+
+/** 获取内核可能的cpu数量, 每cpu表的读取结果按该数量返回, 文件格式例如"0-3,5" */
+static uint32_t xdp_possible_cpus(void) {
+	char buf[128];
+	uint32_t n = 0;
+	FILE *fp = fopen("/sys/devices/system/cpu/possible", "r");
+	if (fp) {
+		if (fgets(buf, sizeof(buf), fp)) {
+			for (char *p = buf; *p >= '0' && *p <= '9'; ) {
+				uint32_t end = (uint32_t) strtoul(p, &p, 10);
+				if (*p == '-') end = (uint32_t) strtoul(p + 1, &p, 10);
+				if (end + 1 > n) n = end + 1;
+				if (*p == ',') ++p;
+			}
+		}
+		fclose(fp);
+	}
+	return n ? n : 1;
+}
+
+static int xdp_map_create(uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries, const char* name) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+	strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+	return xdp_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/** 加载程序, 校验失败时输出校验器日志 */
+static int xdp_prog_load(const xdp_asm_t* a) {
+	static char verifier_log[64 * 1024];
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t) (uintptr_t) a->insns;
+	attr.insn_cnt = a->len;
+	attr.license = (uint64_t) (uintptr_t) "GPL";
+	strncpy(attr.prog_name, "mdns_fastpath", sizeof(attr.prog_name) - 1);
+	int fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (fd >= 0) return fd;
+
+	attr.log_buf = (uint64_t) (uintptr_t) verifier_log;
+	attr.log_size = sizeof(verifier_log);
+	attr.log_level = 1;
+	fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0) {
+		size_t len = strlen(verifier_log);
+		log_error("xdp program load failed: %s, verifier: %s", strerror(errno),
+				len > 1024 ? verifier_log + len - 1024 : verifier_log);
+	}
+	return fd;
+}
+
+/** 按网卡挂载程序, 使用bpf link, 进程退出时内核自动卸载 */
+static int xdp_attach(const char* ifname) {
+	char name[IF_NAMESIZE];
+	const char *colon = strchr(ifname, ':');
+	size_t len = colon ? (size_t) (colon - ifname) : strlen(ifname);
+	if (len >= sizeof(name)) {
+		log_error("xdp interface name too long: %s", ifname);
+		return -1;
+	}
+	memcpy(name, ifname, len);
+	name[len] = '\0';
+	unsigned ifindex = if_nametoindex(name);
+	if (!ifindex) {
+		log_error("xdp interface %s not found", name);
+		return -1;
+	}
+
+	bool generic = colon && !strcmp(colon + 1, "generic");
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = (uint32_t) _prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = generic ? XDP_FLAGS_SKB_MODE : 0;
+	for (int i = 0; i < XDP_ATTACH_RETRY; ++i) {
+		int fd = xdp_bpf(BPF_LINK_CREATE, &attr);
+		if (fd >= 0) {
+			log_info("xdp fast path attached to %s%s", name, generic ? " (generic mode)" : "");
+			return fd;
+		}
+		if (errno != EBUSY) break;
+		usleep(XDP_ATTACH_INTERVAL * 1000);
+	}
+	log_error("xdp attach to %s failed: %s", name, strerror(errno));
+	return -1;
+}
+
+bool xdp_init(const char* ifname, uint16_t port) {
+	_cpus = xdp_possible_cpus();
+	_names_fd = xdp_map_create(BPF_MAP_TYPE_HASH, XDP_NAME_MAX, sizeof(xdp_value_t), XDP_ENTRIES_MAX, "mdns_names");
+	_stats_fd = xdp_map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 1, "mdns_stats");
+	if (_names_fd < 0 || _stats_fd < 0) {
+		log_error("xdp map create failed: %s", strerror(errno));
+		xdp_stop();
+		return false;
+	}
+
+	xdp_asm_t *a = malloc(sizeof(xdp_asm_t));
+	xdp_build(a, port);
+	_prog_fd = xdp_prog_load(a);
+	log_debug("xdp program: %u instructions", a->len);
+	free(a);
+	if (_prog_fd < 0 || (_link_fd = xdp_attach(ifname)) < 0) {
+		xdp_stop();
+		return false;
+	}
+	_answered = 0;
+	_full_logged = false;
+	return true;
+}
+
+void xdp_stop(void) {
+	if (_link_fd >= 0) log_info("xdp fast path detached");
+	int *fds[] = { &_link_fd, &_prog_fd, &_stats_fd, &_names_fd };
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+		if (*fds[i] >= 0) close(*fds[i]);
+		*fds[i] = -1;
+	}
+}
+
+bool xdp_enabled(void) {
+	return _names_fd >= 0;
+}
+
+/** 生成哈希表的键, 线路格式的域名, 不足部分填0 */
+static bool xdp_key(const char* host, uint8_t key[XDP_NAME_MAX]) {
+	memset(key, 0, XDP_NAME_MAX);
+	return dns_name_to_wire(host, key, XDP_NAME_MAX) > 1;
+}
+
+bool xdp_update(const char* host, uint32_t ip, uint32_t ttl) {
+	uint8_t key[XDP_NAME_MAX];
+	if (_names_fd < 0 || !xdp_key(host, key)) return false;
+	xdp_value_t value = { .ip = ip, .ttl = htonl(ttl) };
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t) _names_fd;
+	attr.key = (uint64_t) (uintptr_t) key;
+	attr.value = (uint64_t) (uintptr_t) &value;
+	attr.flags = BPF_ANY;
+	if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+		// 哈希表已满时只输出一次, 之后的域名由用户空间应答
+		if (errno != E2BIG || !_full_logged)
+			log_warn("xdp update %s failed: %s", host, strerror(errno));
+		_full_logged = _full_logged || errno == E2BIG;
+		return false;
+	}
+	log_trace("xdp update host[%s], ip[%s]", host, net_ip_tostring(ip));
+	return true;
+}
+
+/** 按键删除哈希表中的记录 */
+static void xdp_delete_key(const uint8_t key[XDP_NAME_MAX]) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t) _names_fd;
+	attr.key = (uint64_t) (uintptr_t) key;
+	xdp_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+void xdp_delete(const char* host) {
+	uint8_t key[XDP_NAME_MAX];
+	if (_names_fd >= 0 && xdp_key(host, key))
+		xdp_delete_key(key);
+}
+
+void xdp_prune(bool (*keep) (const char* host)) {
+	if (_names_fd < 0) return;
+	uint8_t prev[XDP_NAME_MAX], next[XDP_NAME_MAX];
+	char host[HOST_MAX];
+	uint32_t removed = 0;
+	bool first = true;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t) _names_fd;
+	attr.next_key = (uint64_t) (uintptr_t) next;
+	// 删除的是刚取到的键, 前一个键仍在表中, 可以继续从前一个键遍历
+	for (;;) {
+		attr.key = first ? 0 : (uint64_t) (uintptr_t) prev;
+		if (xdp_bpf(BPF_MAP_GET_NEXT_KEY, &attr)) break;
+		if (!dns_name_from_wire(next, XDP_NAME_MAX, host) || !keep(host)) {
+			xdp_delete_key(next);
+			++removed;
+		} else {
+			memcpy(prev, next, XDP_NAME_MAX);
+			first = false;
+		}
+	}
+	if (removed) log_debug("xdp prune %u names", removed);
+}
+
+void xdp_timer(uint64_t now) {
+	if (_stats_fd < 0 || now < _stats_next) return;
+	_stats_next = now + XDP_STATS_INTERVAL;
+	// 每cpu表一次读出全部cpu的值
+	uint64_t *values = calloc(_cpus, sizeof(uint64_t)), total = 0;
+	uint32_t key = 0;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t) _stats_fd;
+	attr.key = (uint64_t) (uintptr_t) &key;
+	attr.value = (uint64_t) (uintptr_t) values;
+	if (!xdp_bpf(BPF_MAP_LOOKUP_ELEM, &attr)) {
+		for (uint32_t i = 0; i < _cpus; ++i)
+			total += values[i];
+		if (total != _answered)
+			log_info("xdp stats: answered=%" PRIu64, total - _answered);
+		_answered = total;
+	}
+	free(values);
+}
+
+#else // __linux__
+
+bool xdp_init(const char* ifname, uint16_t port) {
+	(void) ifname, (void) port;
+	log_error("xdp fast path is only supported on linux");
+	return false;
+}
+
+void xdp_stop(void) {}
+
+bool xdp_enabled(void) {
+	return false;
+}
+
+bool xdp_update(const char* host, uint32_t ip, uint32_t ttl) {
+	(void) host, (void) ip, (void) ttl;
+	return false;
+}
+
+void xdp_delete(const char* host) {
+	(void) host;
+}
+
+void xdp_prune(bool (*keep) (const char* host)) {
+	(void) keep;
+}
+
+void xdp_timer(uint64_t now) {
+	(void) now;
+}
+
+#endif // __linux__
+
+// #define XDP_TEST
+#if defined(XDP_TEST) && defined(__linux__)
+#include <assert.h>
+
+static const uint8_t _test_rdata[DNS_RR_HEAD_LEN + 4] = { 0, DNS_QT_A, 0, 1, 0, 0, 0x02, 0x58, 0, 4, 10, 0, 0, 1 };
+
+static dns_lookup_t test_lookup(const char* host, uint16_t type, dns_rrset_view_t* dst) {
+	if (strcmp(host, "www.local.lan") || type != DNS_QT_A) return DNS_LOOKUP_NXDOMAIN;
+	*dst = (dns_rrset_view_t) { .data = _test_rdata, .len = sizeof(_test_rdata), .count = 1, .type = DNS_QT_A };
+	return DNS_LOOKUP_FOUND;
+}
+
+static bool test_keep(const char* host) {
+	return !strcmp(host, "www.local.lan");
+}
+
+/** 构造以太网帧格式的查询报文, 返回报文长度 */
+static uint32_t test_frame(uint8_t* frame, const char* host, uint16_t type, bool edns) {
+	static const uint8_t head[XDP_QNAME_OFF] = {
+		0x02, 0, 0, 0, 0, 0x09, 0x02, 0, 0, 0, 0, 0x02, 0x08, 0x00,
+		0x45, 0, 0, 0, 0, 0, 0x40, 0, 64, IPPROTO_UDP, 0, 0, 10, 0, 0, 2, 10, 0, 0, 9,
+		0x30, 0x39, 0, 53, 0, 0, 0, 0,
+		0x12, 0x34, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+	memcpy(frame, head, sizeof(head));
+	uint32_t len = XDP_QNAME_OFF + dns_name_to_wire(host, frame + XDP_QNAME_OFF, HOST_MAX);
+	frame[len++] = (uint8_t) (type >> 8), frame[len++] = (uint8_t) type, frame[len++] = 0, frame[len++] = 1;
+	if (edns) {
+		static const uint8_t opt[] = { 0, 0, 41, 0x04, 0xD0, 0, 0, 0, 0, 0, 0 };
+		memcpy(frame + len, opt, sizeof(opt));
+		len += sizeof(opt);
+		frame[XDP_DNS_OFF + 11] = 1;
+	}
+	*(uint16_t*)(frame + XDP_IP_OFF + 2) = htons((uint16_t) (len - XDP_IP_OFF));
+	*(uint16_t*)(frame + XDP_UDP_OFF + 4) = htons((uint16_t) (len - XDP_UDP_OFF));
+	return len;
+}
+
+/** 运行一次XDP程序, 回写输出报文及程序执行时间 */
+static uint32_t test_run(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t* out_len, uint32_t* duration) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.test.prog_fd = (uint32_t) _prog_fd;
+	attr.test.data_in = (uint64_t) (uintptr_t) in;
+	attr.test.data_size_in = in_len;
+	attr.test.data_out = (uint64_t) (uintptr_t) out;
+	attr.test.data_size_out = 1500;
+	attr.test.repeat = 1;
+	assert(!xdp_bpf(BPF_PROG_TEST_RUN, &attr));
+	*out_len = attr.test.data_size_out;
+	if (duration) *duration = attr.test.duration;
+	return attr.test.retval;
+}
+
+int main() {
+	_cpus = xdp_possible_cpus();
+	_names_fd = xdp_map_create(BPF_MAP_TYPE_HASH, XDP_NAME_MAX, sizeof(xdp_value_t), XDP_ENTRIES_MAX, "mdns_names");
+	_stats_fd = xdp_map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 1, "mdns_stats");
+	assert(_names_fd >= 0 && _stats_fd >= 0);
+	static xdp_asm_t a;
+	xdp_build(&a, 53);
+	_prog_fd = xdp_prog_load(&a);
+	assert(_prog_fd >= 0);
+	printf("xdp program: %u instructions\n", a.len);
+	assert(xdp_update("www.local.lan", net_ip_fromstring("10.0.0.1"), 600));
+	assert(xdp_update("other.local.lan", net_ip_fromstring("10.0.0.2"), 600));
+	assert(!xdp_update("a-very-long-label-that-does-not-fit.in-the-xdp-map-key.local.lan", 0, 600));
+
+	// 应答与用户空间的应答逐字节一致, 地址及端口交换, ip校验和正确
+	uint8_t in[1500], out[1500], res[DNS_EDNS_MAX];
+	uint32_t in_len = test_frame(in, "www.local.lan", DNS_QT_A, false), out_len, duration;
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_TX);
+	assert(out_len == in_len + XDP_ANSWER_LEN);
+	dns_init(test_lookup, NULL);
+	uint16_t n = dns_process(NULL, in + XDP_DNS_OFF, in_len - XDP_DNS_OFF, res, sizeof(res), NULL);
+	assert(n == out_len - XDP_DNS_OFF && !memcmp(res, out + XDP_DNS_OFF, n));
+	assert(!memcmp(out, in + 6, 6) && !memcmp(out + 6, in, 6));
+	assert(!memcmp(out + XDP_IP_OFF + 12, in + XDP_IP_OFF + 16, 4) && !memcmp(out + XDP_UDP_OFF, in + XDP_UDP_OFF + 2, 2));
+	assert(ntohs(*(uint16_t*)(out + XDP_UDP_OFF + 4)) == out_len - XDP_UDP_OFF);
+	uint32_t sum = 0;
+	for (int i = 0; i < 20; i += 2)
+		sum += (uint32_t) out[XDP_IP_OFF + i] << 8 | out[XDP_IP_OFF + i + 1];
+	assert((sum & 0xFFFF) + (sum >> 16) == 0xFFFF);
+
+	// 不在表中、其它类型、带EDNS的查询交给用户空间
+	in_len = test_frame(in, "none.local.lan", DNS_QT_A, false);
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_PASS);
+	in_len = test_frame(in, "www.local.lan", DNS_QT_AAAA, false);
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_PASS);
+	in_len = test_frame(in, "www.local.lan", DNS_QT_A, true);
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_PASS);
+	in_len = test_frame(in, "www.local.lan", DNS_QT_A, false);
+	assert(test_run(in, in_len - 1, out, &out_len, NULL) == XDP_PASS);
+	xdp_delete("www.local.lan");
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_PASS);
+	assert(xdp_update("www.local.lan", net_ip_fromstring("10.0.0.1"), 600));
+
+	// 清理表中回调函数不保留的域名
+	xdp_prune(test_keep);
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_TX);
+	in_len = test_frame(in, "other.local.lan", DNS_QT_A, false);
+	assert(test_run(in, in_len, out, &out_len, NULL) == XDP_PASS);
+
+	// XDP程序与用户空间协议处理的单次耗时, 不含用户空间的收发及协议栈的开销
+	log_set_level(LOG_INFO);
+	const int count = 100000;
+	uint64_t total = 0;
+	in_len = test_frame(in, "www.local.lan", DNS_QT_A, false);
+	for (int i = 0; i < count; ++i) {
+		test_run(in, in_len, out, &out_len, &duration);
+		total += duration;
+	}
+	printf("xdp program: %.1fns per query\n", (double) total / count);
+	uint64_t start = net_mstime();
+	for (int i = 0; i < count * 10; ++i)
+		dns_process(NULL, in + XDP_DNS_OFF, in_len - XDP_DNS_OFF, res, sizeof(res), NULL);
+	printf("dns_process: %.1fns per query\n", (net_mstime() - start) * 1e6 / (count * 10));
+	printf("test success\n");
+	return 0;
+}
+#endif // XDP_TEST
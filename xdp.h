@@ -0,0 +1,55 @@
+/** XDP快速应答, 在网卡驱动收包处直接应答热点域名的A记录查询, 报文不进入网络协议栈
+ *  XDP程序在运行时按指令逐条生成, 通过bpf系统调用加载, 不依赖clang及libbpf,
+ *  只处理不带附加记录(EDNS)的单个A记录查询, 在BPF哈希表中按线路格式的域名查找, 找到时原地改写成应答报文并从收到的网卡发回,
+ *  其它报文(包括查找失败的)原样交给协议栈, 由用户空间正常处理, 哈希表的内容由用户空间与记录数据库保持同步
+ *  仅linux支持, 其它平台上启用失败
+ */
+#pragma once
+#ifndef __XDP_H__
+#define __XDP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** 域名按线路格式编码后的最大长度, 即BPF哈希表键的长度, 更长的域名交给用户空间 */
+#define XDP_NAME_MAX 64
+/** BPF哈希表的最大记录数量 */
+#define XDP_ENTRIES_MAX 65536
+
+/** 在网卡上挂载XDP快速应答程序
+ * @param ifname 网卡名称, 以":generic"结尾时使用通用模式(skb模式), 用于不支持原生XDP的网卡及veth测试
+ * @param port dns服务端口, 只应答发往该端口的查询
+ * @return false: 失败
+ */
+extern bool xdp_init(const char* ifname, uint16_t port);
+
+/** 卸载XDP程序, 释放哈希表 */
+extern void xdp_stop(void);
+
+/** 是否已启用XDP快速应答 */
+extern bool xdp_enabled(void);
+
+/** 添加或更新域名的A记录
+ * @param host 域名
+ * @param ip ip地址, 网络字节序
+ * @param ttl 生存时间
+ * @return false: 域名过长或哈希表已满
+ */
+extern bool xdp_update(const char* host, uint32_t ip, uint32_t ttl);
+
+/** 删除域名的A记录, 之后该域名的查询交给用户空间
+ * @param host 域名
+ */
+extern void xdp_delete(const char* host);
+
+/** 遍历哈希表, 删除回调函数返回false的域名, 用于重新加载记录后清理已不存在的域名
+ * @param keep 回调函数, 返回true表示保留
+ */
+extern void xdp_prune(bool (*keep) (const char* host));
+
+/** 服务循环中定时调用, 定时输出XDP程序应答的查询数量
+ * @param now 当前时间, 毫秒为单位
+ */
+extern void xdp_timer(uint64_t now);
+
+#endif // __XDP_H__